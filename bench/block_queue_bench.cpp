@@ -0,0 +1,294 @@
+/************************************************************
+*阻塞队列基准测试：原来的block_queue（拷贝入队、每次push都broadcast、满了返回false由调用者重试）
+*vs 现在的block_queue（移动入队、只在有人等待时signal、满了阻塞）以及pop_bulk批量出队
+*多个生产者和消费者传递string，输出吞吐，并检查每个元素恰好被取出一次
+*
+*编译：g++ -O2 -std=c++11 -I.. block_queue_bench.cpp -lpthread -o block_queue_bench
+*运行：./block_queue_bench [producers] [consumers] [items_per_producer] [queue_size]
+************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "block_queue.h"
+
+using namespace std;
+
+/************************************************************
+*原来的实现，只保留基准测试用到的push/pop
+*（原来的size()/back()把成员变量m_size当函数调用，无法编译）
+************************************************************/
+template <class T>
+class old_block_queue
+{
+public:
+    old_block_queue(int max_size = 1000)
+    {
+        m_max_size = max_size;
+        m_array = new T[max_size];
+        m_size = 0;
+        m_front = -1;
+        m_back = -1;
+    }
+
+    ~old_block_queue()
+    {
+        delete [] m_array;
+    }
+
+    bool push(const T &item)
+    {
+        m_mutex.lock();
+        if (m_size >= m_max_size)
+        {
+            m_cond.broadcast();
+            m_mutex.unlock();
+            return false;
+        }
+        m_back = (m_back + 1) % m_max_size;
+        m_array[m_back] = item;
+        m_size++;
+        m_cond.broadcast();
+        m_mutex.unlock();
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        m_mutex.lock();
+        while (m_size <= 0)
+        {
+            if (!m_cond.wait(m_mutex.get()))
+            {
+                m_mutex.unlock();
+                return false;
+            }
+        }
+        m_front = (m_front + 1) % m_max_size;
+        item = m_array[m_front];
+        m_size--;
+        m_mutex.unlock();
+        return true;
+    }
+
+private:
+    locker m_mutex;
+    cond m_cond;
+    T *m_array;
+    int m_size;
+    int m_max_size;
+    int m_front;
+    int m_back;
+};
+
+static const int MODE_OLD = 0;
+static const int MODE_NEW = 1;
+static const int MODE_BULK = 2;
+static const int BULK = 32;
+
+struct bench_ctx
+{
+    int mode;
+    int items;
+    old_block_queue<string> *old_q;
+    block_queue<string> *new_q;
+    vector<atomic<int> > *seen;
+    atomic<long long> consumed;
+    atomic<int> alive;          // 还没退出的消费者数
+};
+
+struct bench_arg
+{
+    bench_ctx *ctx;
+    int id;
+};
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 元素内容为"生产者编号:序号"，再补到64字节，避开短字符串优化，让拷贝真正分配内存
+static string make_item(int id, int i)
+{
+    char buf[80];
+    int n = snprintf(buf, sizeof(buf), "%d:%d:", id, i);
+    memset(buf + n, 'x', 64 - n);
+    buf[64] = '\0';
+    return string(buf, 64);
+}
+
+static void check_item(bench_ctx *ctx, const string &s)
+{
+    int id = atoi(s.c_str());
+    int i = atoi(strchr(s.c_str(), ':') + 1);
+    (*ctx->seen)[(long)id * ctx->items + i]++;
+}
+
+static void *producer(void *p)
+{
+    bench_arg *arg = (bench_arg *)p;
+    bench_ctx *ctx = arg->ctx;
+    for (int i = 0; i < ctx->items; i++)
+    {
+        string s = make_item(arg->id, i);
+        if (ctx->mode == MODE_OLD)
+        {
+            // 原来的push满了直接失败，只能让出CPU重试
+            while (!ctx->old_q->push(s))
+            {
+                sched_yield();
+            }
+        }
+        else
+        {
+            ctx->new_q->push(std::move(s));
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *p)
+{
+    bench_arg *arg = (bench_arg *)p;
+    bench_ctx *ctx = arg->ctx;
+    long long cnt = 0;
+    if (ctx->mode == MODE_BULK)
+    {
+        vector<string> out(BULK);
+        while (true)
+        {
+            int n = ctx->new_q->pop_bulk(&out[0], BULK);
+            bool stop = false;
+            for (int i = 0; i < n; i++)
+            {
+                if (out[i].empty())
+                {
+                    stop = true;
+                    continue;
+                }
+                check_item(ctx, out[i]);
+                cnt++;
+            }
+            if (stop)
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        string s;
+        while (true)
+        {
+            if (ctx->mode == MODE_OLD)
+            {
+                ctx->old_q->pop(s);
+            }
+            else
+            {
+                ctx->new_q->pop(s);
+            }
+            if (s.empty())
+            {
+                break;
+            }
+            check_item(ctx, s);
+            cnt++;
+        }
+    }
+    ctx->consumed += cnt;
+    ctx->alive--;
+    return NULL;
+}
+
+static void run(const char *name, int mode, int producers, int consumers, int items, int qsize)
+{
+    old_block_queue<string> old_q(qsize);
+    block_queue<string> new_q(qsize);
+    vector<atomic<int> > seen((size_t)producers * items);
+    for (size_t i = 0; i < seen.size(); i++)
+    {
+        seen[i] = 0;
+    }
+
+    bench_ctx ctx;
+    ctx.mode = mode;
+    ctx.items = items;
+    ctx.old_q = &old_q;
+    ctx.new_q = &new_q;
+    ctx.seen = &seen;
+    ctx.consumed = 0;
+    ctx.alive = consumers;
+
+    vector<bench_arg> pargs(producers), cargs(consumers);
+    vector<pthread_t> ptids(producers), ctids(consumers);
+    long long t0 = now_ns();
+    for (int i = 0; i < consumers; i++)
+    {
+        cargs[i].ctx = &ctx;
+        cargs[i].id = i;
+        pthread_create(&ctids[i], NULL, consumer, &cargs[i]);
+    }
+    for (int i = 0; i < producers; i++)
+    {
+        pargs[i].ctx = &ctx;
+        pargs[i].id = i;
+        pthread_create(&ptids[i], NULL, producer, &pargs[i]);
+    }
+    for (int i = 0; i < producers; i++)
+    {
+        pthread_join(ptids[i], NULL);
+    }
+    // 生产者都结束后发结束标记（空串），消费者收到后退出
+    // 批量模式下一个消费者可能一次拿走多个标记，所以一直发到消费者全部退出
+    while (ctx.alive > 0)
+    {
+        bool ok = mode == MODE_OLD ? old_q.push(string()) : new_q.try_push(string());
+        if (!ok)
+        {
+            sched_yield();
+        }
+    }
+    for (int i = 0; i < consumers; i++)
+    {
+        pthread_join(ctids[i], NULL);
+    }
+    long long elapsed = now_ns() - t0;
+
+    long long total = (long long)producers * items;
+    long long bad = 0;
+    for (size_t i = 0; i < seen.size(); i++)
+    {
+        if (seen[i] != 1)
+        {
+            bad++;
+        }
+    }
+    printf("%-28s %10lld items  %8.1f ms  %10.0f items/s%s\n", name, (long long)ctx.consumed,
+           elapsed / 1e6, total * 1e9 / elapsed, bad ? "  LOST/DUPLICATED" : "");
+}
+
+int main(int argc, char *argv[])
+{
+    int producers = argc > 1 ? atoi(argv[1]) : 4;
+    int consumers = argc > 2 ? atoi(argv[2]) : 4;
+    int items = argc > 3 ? atoi(argv[3]) : 200000;
+    int qsize = argc > 4 ? atoi(argv[4]) : 1000;
+
+    printf("producers=%d consumers=%d items/producer=%d queue=%d\n", producers, consumers, items, qsize);
+    run("old (copy, broadcast)", MODE_OLD, producers, consumers, items, qsize);
+    run("new (move, signal)", MODE_NEW, producers, consumers, items, qsize);
+    run("new + pop_bulk(32)", MODE_BULK, producers, consumers, items, qsize);
+    return 0;
+}
@@ -0,0 +1,602 @@
+/************************************************************
+*HTTP压测工具：多线程，每个线程一个epoll管理若干非阻塞连接，对本机的服务器持续发请求
+*输出吞吐和p50/p90/p99/p999/max延迟，用来在同一台机器上通过回环地址检验http_conn、threadpool的改动
+*
+*模式(-m)：
+*   get         长连接GET，收到响应后立即发下一个
+*   close       短连接GET，每个请求新建连接（延迟包括建连）
+*   pipeline    长连接上一次发-P个GET，全部收到后再发下一批（每个请求的延迟从这一批发出时算起）
+*   login       长连接POST /2CGISQL.cgi登录，开始前先注册一次该用户
+*   register    长连接POST /3CGISQL.cgi注册，每次用不同的用户名
+*   mix         登录和注册混合：按-R的百分比注册新用户，其余从预置的-N个用户（user0..userN-1，
+*               密码pass0..passN-1，见tools/e2e.sh）中随机选一个登录；每个连接的随机种子固定，可重复
+*
+*编译：g++ -O2 -std=c++11 loadgen.cpp -lpthread -o loadgen
+*运行：./loadgen [-h 127.0.0.1] [-p 9006] [-t 线程数] [-c 总连接数] [-d 秒数] [-m 模式] [-u 路径] [-P 管道深度]
+*          [-U 用户名] [-W 密码] [-T 超时毫秒] [-N 预置用户数] [-R 注册百分比]
+*例如：./loadgen -p 9006 -t 4 -c 64 -d 10 -m get -u /judge.html
+************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+enum MODE {MODE_GET = 0, MODE_CLOSE, MODE_PIPELINE, MODE_LOGIN, MODE_REGISTER, MODE_MIX};
+
+struct options
+{
+    const char *host;
+    int port;
+    int threads;
+    int conns;
+    int duration;
+    MODE mode;
+    const char *path;
+    int depth;
+    const char *user;
+    const char *passwd;
+    int timeout_ms;
+    int users;          // mix模式：预置的用户数
+    int register_pct;   // mix模式：注册请求的百分比
+};
+
+static options opt = {"127.0.0.1", 9006, 2, 32, 10, MODE_GET, "/judge.html", 8, "loadgen", "loadgen", 5000, 0, 10};
+static struct sockaddr_in server_addr;
+static volatile bool stopping = false;
+
+static const int READ_BUF = 64 * 1024;
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 一个连接的状态
+struct client
+{
+    int fd;
+    int id;                 // 全局编号，注册模式下用来区分用户名
+    bool connecting;
+    string out;             // 待发送的请求
+    size_t out_off;
+    int inflight;           // 已发出还没收到响应的请求数
+    long long sent_ns;      // 这一批请求发出的时间
+    long long seq;          // 已发出的请求数，注册模式下用来生成用户名
+    unsigned int rng;       // mix模式选择请求的随机状态，以id为种子
+
+    // 响应解析
+    string hdr;             // 还没收完的响应头
+    long long body_left;    // 当前响应还差多少字节的消息体，-1表示在读响应头
+    int status;
+};
+
+struct worker
+{
+    int id;
+    int epfd;
+    vector<client> clients;
+    // 统计
+    vector<long long> lat;  // 每个请求的延迟(ns)
+    long long ok;
+    long long non2xx;
+    long long errors;       // 连接出错或被对方提前关闭
+    long long timeouts;
+    long long bytes;
+    pthread_t tid;
+};
+
+static string build_request(client &c)
+{
+    char buf[512];
+    char body[256];
+    const char *conn_hdr = opt.mode == MODE_CLOSE ? "close" : "keep-alive";
+    switch (opt.mode)
+    {
+    case MODE_LOGIN:
+    case MODE_REGISTER:
+    case MODE_MIX:
+    {
+        int n;
+        bool login = opt.mode == MODE_LOGIN;
+        if (opt.mode == MODE_MIX)
+        {
+            login = (int)(rand_r(&c.rng) % 100) >= opt.register_pct;
+        }
+        if (login && opt.mode == MODE_MIX)
+        {
+            int u = rand_r(&c.rng) % opt.users;
+            n = snprintf(body, sizeof(body), "user=user%d&password=pass%d", u, u);
+        }
+        else if (login)
+        {
+            n = snprintf(body, sizeof(body), "user=%s&password=%s", opt.user, opt.passwd);
+        }
+        else
+        {
+            n = snprintf(body, sizeof(body), "user=lg%d_%lld_%ld&password=%s", c.id, c.seq, (long)getpid(), opt.passwd);
+        }
+        snprintf(buf, sizeof(buf),
+                 "POST /%cCGISQL.cgi HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n"
+                 "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %d\r\n\r\n%s",
+                 login ? '2' : '3', opt.host, conn_hdr, n, body);
+        break;
+    }
+    default:
+        snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", opt.path, opt.host, conn_hdr);
+        break;
+    }
+    c.seq++;
+    return buf;
+}
+
+static void close_client(worker &w, client &c)
+{
+    if (c.fd >= 0)
+    {
+        epoll_ctl(w.epfd, EPOLL_CTL_DEL, c.fd, NULL);
+        close(c.fd);
+        c.fd = -1;
+    }
+}
+
+// 发起非阻塞连接，完成后在EPOLLOUT上发出第一批请求
+static bool open_client(worker &w, client &c)
+{
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd < 0)
+    {
+        return false;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c.connecting = true;
+    c.out.clear();
+    c.out_off = 0;
+    c.inflight = 0;
+    c.hdr.clear();
+    c.body_left = -1;
+    // 短连接模式下延迟包括建连
+    c.sent_ns = now_ns();
+    int ret = connect(c.fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0 && errno != EINPROGRESS)
+    {
+        close(c.fd);
+        c.fd = -1;
+        return false;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = &c;
+    epoll_ctl(w.epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    return true;
+}
+
+// 准备下一批请求，发送由flush_out完成
+static void queue_requests(client &c)
+{
+    int n = opt.mode == MODE_PIPELINE ? opt.depth : 1;
+    c.out.clear();
+    c.out_off = 0;
+    for (int i = 0; i < n; i++)
+    {
+        c.out += build_request(c);
+    }
+    c.inflight = n;
+    if (!(c.connecting && opt.mode == MODE_CLOSE))
+    {
+        c.sent_ns = now_ns();
+    }
+}
+
+static bool flush_out(worker &w, client &c)
+{
+    while (c.out_off < c.out.size())
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return false;
+        }
+        c.out_off += n;
+    }
+    struct epoll_event ev;
+    ev.events = c.out_off < c.out.size() ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = &c;
+    epoll_ctl(w.epfd, EPOLL_CTL_MOD, c.fd, &ev);
+    return true;
+}
+
+// 一个响应收完
+static void on_response(worker &w, client &c)
+{
+    if (!stopping)
+    {
+        w.lat.push_back(now_ns() - c.sent_ns);
+        if (c.status >= 200 && c.status < 300)
+        {
+            w.ok++;
+        }
+        else
+        {
+            w.non2xx++;
+        }
+    }
+    c.inflight--;
+}
+
+// 解析收到的数据，可能包含多个响应（管道模式）或某个响应的一部分
+static void parse_input(worker &w, client &c, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        if (c.body_left < 0)
+        {
+            size_t old = c.hdr.size();
+            c.hdr.append(data, len);
+            size_t end = c.hdr.find("\r\n\r\n");
+            if (end == string::npos)
+            {
+                return;
+            }
+            size_t used = end + 4 - old;
+            data += used;
+            len -= used;
+            c.status = 0;
+            sscanf(c.hdr.c_str(), "HTTP/%*d.%*d %d", &c.status);
+            c.body_left = 0;
+            // 只在响应头范围内找Content-Length
+            string head = c.hdr.substr(0, end);
+            for (size_t i = 0; i < head.size(); i++)
+            {
+                head[i] = tolower(head[i]);
+            }
+            size_t p = head.find("content-length:");
+            if (p != string::npos)
+            {
+                c.body_left = atoll(head.c_str() + p + 15);
+            }
+            c.hdr.clear();
+            if (c.body_left == 0)
+            {
+                c.body_left = -1;
+                on_response(w, c);
+                continue;
+            }
+        }
+        size_t take = (size_t)c.body_left < len ? (size_t)c.body_left : len;
+        c.body_left -= take;
+        data += take;
+        len -= take;
+        if (c.body_left == 0)
+        {
+            c.body_left = -1;
+            on_response(w, c);
+        }
+    }
+}
+
+// 连接出错或者响应完成后需要新建连接
+static void restart_client(worker &w, client &c)
+{
+    close_client(w, c);
+    if (!stopping)
+    {
+        open_client(w, c);
+    }
+}
+
+static void handle_event(worker &w, client &c, unsigned int events, char *buf)
+{
+    if (c.connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || (events & (EPOLLERR | EPOLLHUP)))
+        {
+            w.errors++;
+            restart_client(w, c);
+            return;
+        }
+        queue_requests(c);
+        c.connecting = false;
+        if (!flush_out(w, c))
+        {
+            w.errors++;
+            restart_client(w, c);
+        }
+        return;
+    }
+    if (events & EPOLLOUT)
+    {
+        if (!flush_out(w, c))
+        {
+            w.errors++;
+            restart_client(w, c);
+            return;
+        }
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        bool closed = false;
+        while (true)
+        {
+            ssize_t n = recv(c.fd, buf, READ_BUF, 0);
+            if (n > 0)
+            {
+                w.bytes += n;
+                parse_input(w, c, buf, n);
+                continue;
+            }
+            if (n == 0)
+            {
+                closed = true;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                closed = true;
+            }
+            break;
+        }
+        if (c.inflight == 0)
+        {
+            // 这一批都收到了，短连接重新建连，长连接直接发下一批
+            if (opt.mode == MODE_CLOSE || closed)
+            {
+                restart_client(w, c);
+            }
+            else
+            {
+                queue_requests(c);
+                if (!flush_out(w, c))
+                {
+                    w.errors++;
+                    restart_client(w, c);
+                }
+            }
+        }
+        else if (closed)
+        {
+            // 还有请求没收到响应连接就断了
+            w.errors += c.inflight;
+            restart_client(w, c);
+        }
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    worker &w = *(worker *)arg;
+    vector<char> buf(READ_BUF);
+    for (size_t i = 0; i < w.clients.size(); i++)
+    {
+        if (!open_client(w, w.clients[i]))
+        {
+            w.errors++;
+        }
+    }
+    struct epoll_event events[256];
+    long long last_check = now_ns();
+    while (!stopping)
+    {
+        int n = epoll_wait(w.epfd, events, 256, 100);
+        for (int i = 0; i < n; i++)
+        {
+            handle_event(w, *(client *)events[i].data.ptr, events[i].events, &buf[0]);
+        }
+        // 每100ms检查一次超时的请求，也顺便重试建连失败的连接
+        long long now = now_ns();
+        if (now - last_check >= 100000000LL)
+        {
+            last_check = now;
+            for (size_t i = 0; i < w.clients.size(); i++)
+            {
+                client &c = w.clients[i];
+                if (c.fd < 0)
+                {
+                    open_client(w, c);
+                }
+                else if ((c.inflight > 0 || c.connecting) && now - c.sent_ns > opt.timeout_ms * 1000000LL)
+                {
+                    w.timeouts += c.inflight > 0 ? c.inflight : 1;
+                    restart_client(w, c);
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < w.clients.size(); i++)
+    {
+        close_client(w, w.clients[i]);
+    }
+    close(w.epfd);
+    return NULL;
+}
+
+// 登录模式开始前用一个阻塞连接注册一次用户，已存在时服务器返回注册失败页面，不影响后面的登录
+static void register_login_user()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        fprintf(stderr, "cannot connect to %s:%d\n", opt.host, opt.port);
+        exit(1);
+    }
+    char body[256], req[512];
+    int n = snprintf(body, sizeof(body), "user=%s&password=%s", opt.user, opt.passwd);
+    int len = snprintf(req, sizeof(req),
+                       "POST /3CGISQL.cgi HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n"
+                       "Content-Length: %d\r\n\r\n%s", opt.host, n, body);
+    send(fd, req, len, MSG_NOSIGNAL);
+    struct timeval tv = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char buf[4096];
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+    {
+    }
+    close(fd);
+}
+
+static double percentile(const vector<long long> &v, double q)
+{
+    if (v.empty())
+    {
+        return 0;
+    }
+    size_t idx = (size_t)(q * (v.size() - 1) + 0.5);
+    return v[idx] / 1e3;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-t threads] [-c conns] [-d seconds] "
+            "[-m get|close|pipeline|login|register|mix] [-u path] [-P depth] [-U user] [-W passwd] [-T timeout_ms] "
+            "[-N users] [-R register_pct]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "h:p:t:c:d:m:u:P:U:W:T:N:R:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'h': opt.host = optarg; break;
+        case 'p': opt.port = atoi(optarg); break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'c': opt.conns = atoi(optarg); break;
+        case 'd': opt.duration = atoi(optarg); break;
+        case 'u': opt.path = optarg; break;
+        case 'P': opt.depth = atoi(optarg); break;
+        case 'U': opt.user = optarg; break;
+        case 'W': opt.passwd = optarg; break;
+        case 'T': opt.timeout_ms = atoi(optarg); break;
+        case 'N': opt.users = atoi(optarg); break;
+        case 'R': opt.register_pct = atoi(optarg); break;
+        case 'm':
+            if (strcmp(optarg, "get") == 0) opt.mode = MODE_GET;
+            else if (strcmp(optarg, "close") == 0) opt.mode = MODE_CLOSE;
+            else if (strcmp(optarg, "pipeline") == 0) opt.mode = MODE_PIPELINE;
+            else if (strcmp(optarg, "login") == 0) opt.mode = MODE_LOGIN;
+            else if (strcmp(optarg, "register") == 0) opt.mode = MODE_REGISTER;
+            else if (strcmp(optarg, "mix") == 0) opt.mode = MODE_MIX;
+            else usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (opt.threads <= 0 || opt.conns < opt.threads || opt.duration <= 0 || opt.depth <= 0
+        || (opt.mode == MODE_MIX && (opt.users <= 0 || opt.register_pct < 0 || opt.register_pct > 100)))
+    {
+        usage(argv[0]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host, &server_addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address %s\n", opt.host);
+        return 1;
+    }
+    if (opt.mode == MODE_LOGIN)
+    {
+        register_login_user();
+    }
+
+    static const char *MODE_NAMES[] = {"get", "close", "pipeline", "login", "register", "mix"};
+    printf("%s:%d mode=%s threads=%d conns=%d duration=%ds", opt.host, opt.port, MODE_NAMES[opt.mode],
+           opt.threads, opt.conns, opt.duration);
+    if (opt.mode == MODE_PIPELINE)
+    {
+        printf(" depth=%d", opt.depth);
+    }
+    if (opt.mode == MODE_MIX)
+    {
+        printf(" users=%d register=%d%%", opt.users, opt.register_pct);
+    }
+    printf("\n");
+
+    vector<worker> workers(opt.threads);
+    for (int i = 0; i < opt.threads; i++)
+    {
+        worker &w = workers[i];
+        w.id = i;
+        w.epfd = epoll_create1(EPOLL_CLOEXEC);
+        w.ok = w.non2xx = w.errors = w.timeouts = w.bytes = 0;
+        // 连接平均分给各线程
+        int n = opt.conns / opt.threads + (i < opt.conns % opt.threads ? 1 : 0);
+        w.clients.resize(n);
+        for (int j = 0; j < n; j++)
+        {
+            w.clients[j].fd = -1;
+            w.clients[j].id = i * (opt.conns / opt.threads + 1) + j;
+            w.clients[j].seq = 0;
+            w.clients[j].rng = w.clients[j].id + 1;
+            w.clients[j].connecting = false;
+            w.clients[j].inflight = 0;
+            w.clients[j].body_left = -1;
+            w.clients[j].status = 0;
+        }
+    }
+
+    long long start = now_ns();
+    for (int i = 0; i < opt.threads; i++)
+    {
+        pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+    sleep(opt.duration);
+    stopping = true;
+    long long elapsed = now_ns() - start;
+    for (int i = 0; i < opt.threads; i++)
+    {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    vector<long long> lat;
+    long long ok = 0, non2xx = 0, errors = 0, timeouts = 0, bytes = 0;
+    for (int i = 0; i < opt.threads; i++)
+    {
+        worker &w = workers[i];
+        lat.insert(lat.end(), w.lat.begin(), w.lat.end());
+        ok += w.ok;
+        non2xx += w.non2xx;
+        errors += w.errors;
+        timeouts += w.timeouts;
+        bytes += w.bytes;
+    }
+    sort(lat.begin(), lat.end());
+    double secs = elapsed / 1e9;
+    printf("requests   %lld ok, %lld non-2xx, %lld errors, %lld timeouts\n", ok, non2xx, errors, timeouts);
+    printf("throughput %.0f req/s, %.2f MB/s\n", lat.size() / secs, bytes / secs / 1e6);
+    printf("latency us p50 %.0f  p90 %.0f  p99 %.0f  p999 %.0f  max %.0f\n",
+           percentile(lat, 0.5), percentile(lat, 0.9), percentile(lat, 0.99), percentile(lat, 0.999),
+           lat.empty() ? 0.0 : lat.back() / 1e3);
+    return 0;
+}
@@ -0,0 +1,617 @@
+/************************************************************
+*核心数据结构的微基准测试：时间轮、线程池append、阻塞队列、日志（同步/异步）、HTTP请求解析
+*每项用固定的随机种子和固定的次数重复运行若干轮，取中位数，每项输出一行JSON：
+*   {"name":"timer_wheel.add_del","iters":1000000,"ns_per_op":35.20,"min_ns_per_op":34.10}
+*保存一次输出作为基线，之后用 -b 对比：每行多出基线值和变化百分比，
+*任何一项比基线慢超过阈值（-r，默认10%）时在标准错误输出中标出，并以退出码2结束
+*
+*编译：g++ -O2 -std=c++11 -I.. microbench.cpp ../http_conn.cpp ../log.cpp ../clock_cache.cpp ../metrics.cpp
+*      ../sql_connection_pool.cpp ../redis_pool.cpp ../redis_async.cpp ../user_cache.cpp ../capture.cpp ../rate_limit.cpp ../tls.cpp ../h2_conn.cpp ../hpack.cpp
+*      -lmysqlclient -lhiredis -lssl -lcrypto -lpthread -o microbench
+*运行：./microbench [-f 名字子串] [-n 轮数] [-s 次数倍率] [-b 基线文件] [-r 阈值百分比] [-o 日志目录]
+*例如：./microbench > base.jsonl；改动之后 ./microbench -b base.jsonl
+*
+*日志单例只能初始化一次，所以日志的几项各自在fork出的子进程中运行，并且排在创建任何线程之前
+************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "http_conn.h"
+#include "timer_wheel.h"
+#include "threadpool.h"
+#include "block_queue.h"
+#include "log.h"
+
+using namespace std;
+
+// http_conn.cpp用到，服务器里由main.cpp定义
+timer_wheel http_conn::m_twheel;
+
+static const unsigned int SEED = 20240601;
+static const char *log_dir = "/tmp";
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/************************************************************
+*时间轮
+************************************************************/
+
+static void noop_cb(http_conn *)
+{
+}
+
+// 保持LIVE个定时器，每次随机删掉一个再加一个，超时时间1~300秒
+static long long bench_timer_add_del(long long iters)
+{
+    static const int LIVE = 10000;
+    timer_wheel wheel;
+    unsigned int seed = SEED;
+    vector<tw_timer *> live(LIVE);
+    for (int i = 0; i < LIVE; i++)
+    {
+        live[i] = wheel.add_timer(1 + rand_r(&seed) % 300);
+    }
+    long long t0 = now_ns();
+    for (long long i = 0; i < iters; i++)
+    {
+        int k = rand_r(&seed) % LIVE;
+        wheel.del_timer(live[k]);
+        live[k] = wheel.add_timer(1 + rand_r(&seed) % 300);
+    }
+    long long elapsed = now_ns() - t0;
+    for (int i = 0; i < LIVE; i++)
+    {
+        wheel.del_timer(live[i]);
+    }
+    return elapsed;
+}
+
+// 时间轮上有10万个定时器，一次操作是一次tick()，到期的定时器回调后重新加回去，保持总数不变
+static long long bench_timer_tick(long long iters)
+{
+    static const int LIVE = 100000;
+    timer_wheel wheel;
+    unsigned int seed = SEED;
+    for (int i = 0; i < LIVE; i++)
+    {
+        tw_timer *t = wheel.add_timer(1 + rand_r(&seed) % 300);
+        t->cb_func = noop_cb;
+        t->user_data = NULL;
+    }
+    long long elapsed = 0;
+    for (long long i = 0; i < iters; i++)
+    {
+        long long t0 = now_ns();
+        wheel.tick();
+        elapsed += now_ns() - t0;
+        // 大约补回这一格到期的数量（不计时）
+        for (int j = 0; j < LIVE / 300; j++)
+        {
+            tw_timer *t = wheel.add_timer(1 + rand_r(&seed) % 300);
+            t->cb_func = noop_cb;
+            t->user_data = NULL;
+        }
+    }
+    return elapsed;
+}
+
+/************************************************************
+*线程池：多个线程同时append，工作线程只做计数
+************************************************************/
+
+struct noop_task
+{
+    static atomic<long long> done;
+    void process()
+    {
+        done.fetch_add(1, memory_order_relaxed);
+    }
+};
+atomic<long long> noop_task::done(0);
+
+static threadpool<noop_task> *task_pool = NULL;
+static noop_task the_task;
+
+struct append_arg
+{
+    long long n;
+    long long rejected;
+};
+
+static void *append_worker(void *p)
+{
+    append_arg *arg = (append_arg *)p;
+    for (long long i = 0; i < arg->n; i++)
+    {
+        // 队列满时重试，计入耗时
+        while (!task_pool->append(&the_task))
+        {
+            arg->rejected++;
+        }
+    }
+    return NULL;
+}
+
+static long long run_appenders(long long iters, int threads)
+{
+    if (task_pool == NULL)
+    {
+        // 工作线程不会退出，线程池一直保留到进程结束
+        task_pool = new threadpool<noop_task>(4, 1 << 20);
+    }
+    vector<append_arg> args(threads);
+    vector<pthread_t> tids(threads);
+    long long t0 = now_ns();
+    for (int i = 0; i < threads; i++)
+    {
+        args[i].n = iters / threads;
+        args[i].rejected = 0;
+        pthread_create(&tids[i], NULL, append_worker, &args[i]);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    long long elapsed = now_ns() - t0;
+    // 等工作线程取空队列，不影响下一轮
+    while (task_pool->queue_size() > 0)
+    {
+        usleep(1000);
+    }
+    return elapsed;
+}
+
+static long long bench_pool_append_1(long long iters)
+{
+    return run_appenders(iters, 1);
+}
+
+static long long bench_pool_append_4(long long iters)
+{
+    return run_appenders(iters, 4);
+}
+
+/************************************************************
+*阻塞队列
+************************************************************/
+
+// 单线程交替push/pop，衡量不争用时的加锁和移动开销
+static long long bench_queue_push_pop(long long iters)
+{
+    block_queue<string> q(1024);
+    string item(64, 'x');
+    string out;
+    long long t0 = now_ns();
+    for (long long i = 0; i < iters; i++)
+    {
+        string s = item;
+        q.push(std::move(s));
+        q.pop(out);
+    }
+    return now_ns() - t0;
+}
+
+struct queue_arg
+{
+    block_queue<string> *q;
+    long long n;                    // 每个生产者的个数
+    atomic<long long> *left;        // 还没被取走的总数
+};
+
+static void *queue_producer(void *p)
+{
+    queue_arg *arg = (queue_arg *)p;
+    string item(64, 'x');
+    for (long long i = 0; i < arg->n; i++)
+    {
+        string s = item;
+        arg->q->push(std::move(s));
+    }
+    return NULL;
+}
+
+static void *queue_consumer(void *p)
+{
+    queue_arg *arg = (queue_arg *)p;
+    string out[32];
+    // 各消费者取到的个数不均匀，取完总数后都退出；带超时避免最后卡在空队列上
+    while (arg->left->load() > 0)
+    {
+        int n = arg->q->pop_bulk(out, 32, 10);
+        arg->left->fetch_sub(n);
+    }
+    return NULL;
+}
+
+// 4个生产者、4个消费者（pop_bulk）争用一个容量1000的队列
+static long long bench_queue_mpmc(long long iters)
+{
+    static const int P = 4;
+    block_queue<string> q(1000);
+    atomic<long long> left(iters / P * P);
+    queue_arg arg = {&q, iters / P, &left};
+    pthread_t pt[P], ct[P];
+    long long t0 = now_ns();
+    for (int i = 0; i < P; i++)
+    {
+        pthread_create(&ct[i], NULL, queue_consumer, &arg);
+        pthread_create(&pt[i], NULL, queue_producer, &arg);
+    }
+    for (int i = 0; i < P; i++)
+    {
+        pthread_join(pt[i], NULL);
+    }
+    for (int i = 0; i < P; i++)
+    {
+        pthread_join(ct[i], NULL);
+    }
+    return now_ns() - t0;
+}
+
+/************************************************************
+*日志：在子进程中初始化，操作是调用线程上的一次写日志（异步模式不含日志线程写盘）
+************************************************************/
+
+static void init_log(bool async)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/microbench_%d_Log", log_dir, (int)getpid());
+    Log::get_instance()->init(path, 0, 2000, 800000000, async ? 800 : 0, false, LOG_LEVEL_INFO);
+}
+
+static long long bench_log_sync(long long iters)
+{
+    init_log(false);
+    long long t0 = now_ns();
+    for (long long i = 0; i < iters; i++)
+    {
+        Log::get_instance()->write_log(LOG_LEVEL_INFO, "request %lld from %s took %d us\n", i, "127.0.0.1", 42);
+    }
+    return now_ns() - t0;
+}
+
+static long long bench_log_async(long long iters)
+{
+    init_log(true);
+    long long t0 = now_ns();
+    for (long long i = 0; i < iters; i++)
+    {
+        Log::get_instance()->write_log(LOG_LEVEL_INFO, "request %lld from %s took %d us\n", i, "127.0.0.1", 42);
+    }
+    return now_ns() - t0;
+}
+
+// LOG_*宏只记录格式编号和参数
+static long long bench_log_macro_async(long long iters)
+{
+    init_log(true);
+    long long t0 = now_ns();
+    for (long long i = 0; i < iters; i++)
+    {
+        LOG_INFO("request %lld from %s took %d us\n", i, "127.0.0.1", 42);
+    }
+    return now_ns() - t0;
+}
+
+/************************************************************
+*HTTP解析：直接调用http_conn的私有函数
+************************************************************/
+
+static const char *REQ_CURL =
+    "GET /judge.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const char *REQ_BROWSER =
+    "GET /picture.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Referer: http://127.0.0.1:9006/welcome.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "\r\n";
+
+static const char *REQ_LOGIN =
+    "POST /2CGISQL.cgi HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 29\r\n"
+    "User-Agent: Mozilla/5.0\r\n"
+    "\r\n"
+    "user=alice&password=secret123";
+
+// 404的请求让process_read()走完do_request()但不打开文件
+static const char *REQ_MISSING =
+    "GET /microbench_missing.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+class http_conn_bench
+{
+public:
+    // 模拟read()读入一个完整请求
+    static void load(http_conn *c, const char *req, size_t len)
+    {
+        c->init();
+        memcpy(c->m_read_buf, req, len);
+        c->m_read_idx = len;
+    }
+
+    // process_read()中的状态机，得到完整请求时停下，不调用do_request()
+    static http_conn::HTTP_CODE parse(http_conn *c)
+    {
+        http_conn::LINE_STATE line_status = http_conn::LINE_OK;
+        while ((line_status == http_conn::LINE_OK && c->m_check_state == http_conn::CHECK_STATE_CONTENT)
+               || (line_status = c->parse_line()) == http_conn::LINE_OK)
+        {
+            char *text = c->get_line();
+            c->m_start_line = c->m_checked_idx;
+            http_conn::HTTP_CODE ret;
+            switch (c->m_check_state)
+            {
+            case http_conn::CHECK_STATE_REQUESTLINE:
+                if (c->parse_request_line(text) == http_conn::BAD_REQUEST)
+                {
+                    return http_conn::BAD_REQUEST;
+                }
+                break;
+            case http_conn::CHECK_STATE_HEADER:
+                ret = c->parse_header(text);
+                if (ret != http_conn::NO_REQUEST)
+                {
+                    return ret;
+                }
+                break;
+            case http_conn::CHECK_STATE_CONTENT:
+                if (c->pares_content(text) == http_conn::GET_REQUEST)
+                {
+                    return http_conn::GET_REQUEST;
+                }
+                line_status = http_conn::LINE_OPEN;
+                break;
+            }
+        }
+        return http_conn::NO_REQUEST;
+    }
+
+    static http_conn::HTTP_CODE process_read(http_conn *c)
+    {
+        return c->process_read();
+    }
+};
+
+// 一次操作包括init()（每个请求都要做的清空）和解析
+static long long run_parse(long long iters, const char *req)
+{
+    http_conn *c = new http_conn;
+    size_t len = strlen(req);
+    long long t0 = now_ns();
+    for (long long i = 0; i < iters; i++)
+    {
+        http_conn_bench::load(c, req, len);
+        if (http_conn_bench::parse(c) != http_conn::GET_REQUEST)
+        {
+            fprintf(stderr, "parse failed\n");
+            exit(1);
+        }
+    }
+    long long elapsed = now_ns() - t0;
+    delete c;
+    return elapsed;
+}
+
+static long long bench_parse_curl(long long iters)
+{
+    return run_parse(iters, REQ_CURL);
+}
+
+static long long bench_parse_browser(long long iters)
+{
+    return run_parse(iters, REQ_BROWSER);
+}
+
+static long long bench_parse_post(long long iters)
+{
+    return run_parse(iters, REQ_LOGIN);
+}
+
+static long long bench_process_read_404(long long iters)
+{
+    http_conn *c = new http_conn;
+    size_t len = strlen(REQ_MISSING);
+    long long t0 = now_ns();
+    for (long long i = 0; i < iters; i++)
+    {
+        http_conn_bench::load(c, REQ_MISSING, len);
+        http_conn_bench::process_read(c);
+    }
+    long long elapsed = now_ns() - t0;
+    delete c;
+    return elapsed;
+}
+
+/************************************************************
+*运行和对比
+************************************************************/
+
+struct bench_def
+{
+    const char *name;
+    long long (*fn)(long long iters);   // 运行iters次操作，返回计时部分的纳秒数
+    long long iters;
+    bool fork;                          // 在子进程中运行
+};
+
+// 日志的几项用fork，必须排在会创建线程的项之前
+static const bench_def BENCHES[] = {
+    {"log.write_log_sync", bench_log_sync, 200000, true},
+    {"log.write_log_async", bench_log_async, 200000, true},
+    {"log.macro_async", bench_log_macro_async, 200000, true},
+    {"timer_wheel.add_del", bench_timer_add_del, 1000000, false},
+    {"timer_wheel.tick", bench_timer_tick, 3000, false},
+    {"block_queue.push_pop", bench_queue_push_pop, 1000000, false},
+    {"block_queue.mpmc_4x4", bench_queue_mpmc, 400000, false},
+    {"threadpool.append_1t", bench_pool_append_1, 400000, false},
+    {"threadpool.append_4t", bench_pool_append_4, 400000, false},
+    {"http_conn.parse_curl", bench_parse_curl, 1000000, false},
+    {"http_conn.parse_browser", bench_parse_browser, 500000, false},
+    {"http_conn.parse_post", bench_parse_post, 1000000, false},
+    {"http_conn.process_read_404", bench_process_read_404, 200000, false},
+};
+
+// 在子进程中跑一轮，通过管道取回耗时
+static long long run_forked(const bench_def &b, long long iters)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        long long ns = b.fn(iters);
+        write(fds[1], &ns, sizeof(ns));
+        _exit(0);
+    }
+    close(fds[1]);
+    long long ns = -1;
+    if (read(fds[0], &ns, sizeof(ns)) != sizeof(ns))
+    {
+        ns = -1;
+    }
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return ns;
+}
+
+// 读基线文件：每行一个本程序输出的JSON
+static map<string, double> load_baseline(const char *path)
+{
+    map<string, double> base;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "cannot open baseline %s\n", path);
+        exit(1);
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), fp))
+    {
+        char name[128];
+        long long iters;
+        double ns;
+        if (sscanf(line, "{\"name\":\"%127[^\"]\",\"iters\":%lld,\"ns_per_op\":%lf", name, &iters, &ns) == 3)
+        {
+            base[name] = ns;
+        }
+    }
+    fclose(fp);
+    return base;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = NULL;
+    const char *baseline = NULL;
+    int rounds = 5;
+    double scale = 1.0;
+    double threshold = 10.0;
+    int ch;
+    while ((ch = getopt(argc, argv, "f:n:s:b:r:o:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'f': filter = optarg; break;
+        case 'n': rounds = atoi(optarg); break;
+        case 's': scale = atof(optarg); break;
+        case 'b': baseline = optarg; break;
+        case 'r': threshold = atof(optarg); break;
+        case 'o': log_dir = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-f filter] [-n rounds] [-s scale] [-b baseline.jsonl] [-r threshold_pct] [-o log_dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (rounds <= 0 || scale <= 0)
+    {
+        return 1;
+    }
+    map<string, double> base;
+    if (baseline)
+    {
+        base = load_baseline(baseline);
+    }
+    // 父进程不写日志，解析未知请求头时的LOG_ERROR不计入解析耗时
+    Log::get_instance()->set_level(LOG_LEVEL_OFF);
+
+    int regressions = 0;
+    for (size_t i = 0; i < sizeof(BENCHES) / sizeof(BENCHES[0]); i++)
+    {
+        const bench_def &b = BENCHES[i];
+        if (filter && strstr(b.name, filter) == NULL)
+        {
+            continue;
+        }
+        long long iters = (long long)(b.iters * scale);
+        if (iters < 1)
+        {
+            iters = 1;
+        }
+        vector<double> per_op;
+        for (int r = 0; r < rounds; r++)
+        {
+            long long ns = b.fork ? run_forked(b, iters) : b.fn(iters);
+            if (ns < 0)
+            {
+                fprintf(stderr, "%s: run failed\n", b.name);
+                return 1;
+            }
+            per_op.push_back((double)ns / iters);
+        }
+        sort(per_op.begin(), per_op.end());
+        double median = per_op[per_op.size() / 2];
+
+        printf("{\"name\":\"%s\",\"iters\":%lld,\"ns_per_op\":%.2f,\"min_ns_per_op\":%.2f", b.name, iters, median, per_op[0]);
+        map<string, double>::iterator it = base.find(b.name);
+        if (it != base.end() && it->second > 0)
+        {
+            double delta = (median - it->second) / it->second * 100;
+            printf(",\"baseline_ns_per_op\":%.2f,\"delta_pct\":%.1f", it->second, delta);
+            if (delta > threshold)
+            {
+                fprintf(stderr, "REGRESSION %s: %.2f -> %.2f ns/op (%+.1f%%)\n", b.name, it->second, median, delta);
+                regressions++;
+            }
+        }
+        printf("}\n");
+        fflush(stdout);
+    }
+    return regressions ? 2 : 0;
+}
@@ -0,0 +1,109 @@
+/************************************************************
+*Redis批处理基准测试：每次取一个连接发一条命令 vs 管道线程合并pipeline
+*多个线程并发GET同一批key，输出吞吐和平均/p99延迟
+*
+*编译：g++ -O2 -std=c++11 -I.. redis_batch_bench.cpp ../redis_pool.cpp ../log.cpp ../clock_cache.cpp ../metrics.cpp -lhiredis -lpthread -o redis_batch_bench
+*运行：先启动本地redis-server，然后 ./redis_batch_bench [threads] [ops_per_thread] [port]
+************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "redis_pool.h"
+
+using namespace std;
+
+static const int KEYS = 1000;
+
+struct bench_arg
+{
+    RedisPool* pool;
+    int ops;
+    int seed;
+    vector<long long> lat;
+};
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void* bench_thread(void* p)
+{
+    bench_arg* arg = (bench_arg*)p;
+    unsigned int seed = arg->seed;
+    char key[32];
+    for (int i = 0; i < arg->ops; i++)
+    {
+        snprintf(key, sizeof(key), "bench_user%d", rand_r(&seed) % KEYS);
+        long long t0 = now_ns();
+        string v = arg->pool->getString(key);
+        arg->lat.push_back(now_ns() - t0);
+        if (v == "error")
+        {
+            fprintf(stderr, "GET %s failed\n", key);
+        }
+    }
+    return NULL;
+}
+
+static void run(const char* name, RedisPool* pool, int threads, int ops)
+{
+    vector<bench_arg> args(threads);
+    vector<pthread_t> tids(threads);
+    long long t0 = now_ns();
+    for (int i = 0; i < threads; i++)
+    {
+        args[i].pool = pool;
+        args[i].ops = ops;
+        args[i].seed = i + 1;
+        pthread_create(&tids[i], NULL, bench_thread, &args[i]);
+    }
+    vector<long long> all;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+        all.insert(all.end(), args[i].lat.begin(), args[i].lat.end());
+    }
+    double secs = (now_ns() - t0) / 1e9;
+    sort(all.begin(), all.end());
+    long long sum = 0;
+    for (size_t i = 0; i < all.size(); i++) sum += all[i];
+    printf("%-10s threads=%-4d ops/s=%-10.0f avg_us=%-8.1f p50_us=%-8.1f p99_us=%-8.1f\n", name, threads,
+           all.size() / secs, sum / 1000.0 / all.size(), all[all.size() / 2] / 1000.0,
+           all[all.size() * 99 / 100] / 1000.0);
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 32;
+    int ops = argc > 2 ? atoi(argv[2]) : 20000;
+    const char* port = argc > 3 ? argv[3] : "6379";
+
+    Log::get_instance()->init("./redis_batch_bench_log", 0, 2000, 800000, 0);
+
+    // 连接数和服务器默认配置一致：8个连接，批处理模式另加2个管道线程
+    RedisPool single;
+    single.init("127.0.0.1", port, 8);
+    RedisPool batched;
+    batched.init("127.0.0.1", port, 8, 2);
+
+    char key[32], value[32];
+    for (int i = 0; i < KEYS; i++)
+    {
+        snprintf(key, sizeof(key), "bench_user%d", i);
+        snprintf(value, sizeof(value), "pw%d", i);
+        single.setString(key, value);
+    }
+
+    run("per_conn", &single, threads, ops);
+    run("pipelined", &batched, threads, ops);
+    return 0;
+}
@@ -0,0 +1,668 @@
+/************************************************************
+*流量回放工具：读取服务器录制的trace（设置WEBSERVER_CAPTURE时生成，格式见trace_record.h），
+*按记录的到达时间把请求重新发给服务器，复现线上的长连接/短连接分布、慢客户端和突发
+*
+*   同一个录制连接上的请求走同一个连接，前一个响应没收完时后面的请求排队（计入发送延迟）
+*   录制时请求头花了较长时间才收完的（慢客户端），回放时分几次在同样的时间内发完
+*   消息体没有录制，按原长度填充占位内容（登录/注册为user=rp<连接号>&password=xxx...）
+*   -s 2表示以两倍速回放，所有时间间隔减半
+*
+*编译：g++ -O2 -std=c++11 -I.. replay.cpp -lpthread -o replay
+*运行：./replay [-h 127.0.0.1] [-p 9006] [-s 倍速] [-t 线程数] [-T 超时毫秒] trace文件
+*      ./replay -l trace文件      列出trace中的记录
+*输出吞吐、响应延迟，以及实际发出时间比计划晚了多少（回放是否跟上了录制的节奏）
+************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+
+#include "trace_record.h"
+
+using namespace std;
+
+static const char *host = "127.0.0.1";
+static int port = 9006;
+static double speed = 1.0;
+static int timeout_ms = 5000;
+static struct sockaddr_in server_addr;
+static long long start_ns;
+
+static const int READ_BUF = 64 * 1024;
+static const long long SLOW_SEND_NS = 2000000;     // 请求头超过2ms才收完的按慢客户端回放
+static const int SLOW_PIECES = 8;
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct trace_event
+{
+    long long at_ns;        // 按倍速换算后的计划发送时间，相对于回放开始
+    long long send_ns;      // 按倍速换算后的请求头发送时长
+    unsigned int conn_id;
+    uint16_t flags;
+    size_t head_len;
+    string req;             // 请求头 + 占位消息体
+};
+
+// 一个录制连接对应的回放连接
+struct rclient
+{
+    int fd;
+    bool connecting;
+    int remaining;                          // 还没完成的请求数，为0时关闭连接
+    deque<const trace_event *> pending;     // 到了时间但前一个请求还没完成
+    const trace_event *cur;                 // 正在发送或等待响应的请求
+    string out;
+    size_t out_off;
+    size_t allowed;                         // 慢客户端：目前允许发出的字节数
+    int pieces_sent;
+    long long next_piece_ns;
+    long long piece_gap_ns;
+    long long sent_ns;
+    bool opened;                            // 建过连接，之后再建连算作重连
+
+    // 响应解析
+    string hdr;
+    long long body_left;
+    int status;
+    bool server_close;
+
+    rclient()
+        : fd(-1), connecting(false), remaining(0), cur(NULL), out_off(0), allowed(0), pieces_sent(0),
+          next_piece_ns(0), piece_gap_ns(0), sent_ns(0), opened(false), body_left(-1), status(0), server_close(false)
+    {
+    }
+};
+
+struct worker
+{
+    int epfd;
+    vector<trace_event *> events;
+    unordered_map<unsigned int, rclient> clients;
+    vector<rclient *> slow;                 // 正在分段发送的连接
+    vector<long long> lat;
+    vector<long long> lag;
+    long long ok;
+    long long non2xx;
+    long long errors;
+    long long timeouts;
+    long long reconnects;
+    long long bytes;
+    pthread_t tid;
+};
+
+static bool load_trace(const char *path, vector<trace_event> &events, long long &realtime_ns)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    char magic[sizeof(TRACE_MAGIC)];
+    trace_file_hdr fh;
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0
+        || fread(&fh, sizeof(fh), 1, fp) != 1)
+    {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        fclose(fp);
+        return false;
+    }
+    realtime_ns = fh.start_realtime_ns;
+    trace_rec_hdr h;
+    while (fread(&h, sizeof(h), 1, fp) == 1)
+    {
+        trace_event e;
+        e.at_ns = h.offset_ns;
+        e.send_ns = h.send_us * 1000LL;
+        e.conn_id = h.conn_id;
+        e.flags = h.flags;
+        e.head_len = h.head_len;
+        e.req.resize(h.head_len);
+        if (h.head_len && fread(&e.req[0], h.head_len, 1, fp) != 1)
+        {
+            break;  // 录制中途被杀掉时最后一条可能不完整
+        }
+        if (h.body_len > 0)
+        {
+            char prefix[64];
+            int n = snprintf(prefix, sizeof(prefix), "user=rp%u&password=", h.conn_id);
+            string body(h.body_len, 'x');
+            if ((uint32_t)n <= h.body_len)
+            {
+                memcpy(&body[0], prefix, n);
+            }
+            e.req += body;
+        }
+        events.push_back(e);
+    }
+    fclose(fp);
+    return true;
+}
+
+static void list_trace(const vector<trace_event> &events)
+{
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const trace_event &e = events[i];
+        size_t eol = e.req.find("\r\n");
+        printf("%12.3f ms  conn %-6u %s send %6lld us  body %-5zu %s\n", e.at_ns / 1e6, e.conn_id,
+               (e.flags & TRACE_NEW_CONN) ? "new " : "    ", e.send_ns / 1000, e.req.size() - e.head_len,
+               e.req.substr(0, eol).c_str());
+    }
+}
+
+static void close_client(worker &w, rclient &c)
+{
+    if (c.fd >= 0)
+    {
+        epoll_ctl(w.epfd, EPOLL_CTL_DEL, c.fd, NULL);
+        close(c.fd);
+        c.fd = -1;
+    }
+    c.connecting = false;
+    c.hdr.clear();
+    c.body_left = -1;
+    c.server_close = false;
+}
+
+static bool open_client(worker &w, rclient &c)
+{
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd < 0)
+    {
+        return false;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c.fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(c.fd);
+        c.fd = -1;
+        return false;
+    }
+    if (c.opened)
+    {
+        w.reconnects++;
+    }
+    c.opened = true;
+    c.connecting = true;
+    c.sent_ns = now_ns();
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = &c;
+    epoll_ctl(w.epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    return true;
+}
+
+static bool flush_out(worker &w, rclient &c)
+{
+    while (c.out_off < c.allowed)
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.allowed - c.out_off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return false;
+        }
+        c.out_off += n;
+    }
+    struct epoll_event ev;
+    ev.events = c.out_off < c.allowed ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = &c;
+    epoll_ctl(w.epfd, EPOLL_CTL_MOD, c.fd, &ev);
+    return true;
+}
+
+static void fail_current(worker &w, rclient &c);
+
+// 连接空闲时发出排队的下一个请求；没有连接时先建连，连上之后再发
+static void try_start(worker &w, rclient &c)
+{
+    if (c.cur != NULL || c.connecting)
+    {
+        return;
+    }
+    if (c.pending.empty())
+    {
+        if (c.remaining == 0)
+        {
+            close_client(w, c);
+        }
+        return;
+    }
+    if (c.fd < 0)
+    {
+        if (!open_client(w, c))
+        {
+            fail_current(w, c);
+        }
+        return;
+    }
+    const trace_event *e = c.pending.front();
+    c.pending.pop_front();
+    c.cur = e;
+    c.out = e->req;
+    c.out_off = 0;
+    long long now = now_ns();
+    c.sent_ns = now;
+    w.lag.push_back(now - start_ns - e->at_ns);
+    if (e->send_ns >= SLOW_SEND_NS && e->head_len >= (size_t)SLOW_PIECES)
+    {
+        // 请求头分SLOW_PIECES段在send_ns内发完，最后一段带上消息体
+        c.pieces_sent = 1;
+        c.allowed = e->head_len / SLOW_PIECES;
+        c.piece_gap_ns = e->send_ns / (SLOW_PIECES - 1);
+        c.next_piece_ns = now + c.piece_gap_ns;
+        w.slow.push_back(&c);
+    }
+    else
+    {
+        c.pieces_sent = SLOW_PIECES;
+        c.allowed = c.out.size();
+    }
+    if (!flush_out(w, c))
+    {
+        fail_current(w, c);
+    }
+}
+
+// 当前请求出错：计数，关掉连接，后面排队的请求重新建连再发
+static void fail_current(worker &w, rclient &c)
+{
+    close_client(w, c);
+    if (c.cur)
+    {
+        c.cur = NULL;
+    }
+    else if (!c.pending.empty())
+    {
+        c.pending.pop_front();
+    }
+    else
+    {
+        return;
+    }
+    w.errors++;
+    c.remaining--;
+    try_start(w, c);
+}
+
+static void on_response(worker &w, rclient &c)
+{
+    w.lat.push_back(now_ns() - c.sent_ns);
+    if (c.status >= 200 && c.status < 300)
+    {
+        w.ok++;
+    }
+    else
+    {
+        w.non2xx++;
+    }
+    c.cur = NULL;
+    c.remaining--;
+}
+
+static void parse_input(worker &w, rclient &c, const char *data, size_t len)
+{
+    while (len > 0 && c.cur)
+    {
+        if (c.body_left < 0)
+        {
+            size_t old = c.hdr.size();
+            c.hdr.append(data, len);
+            size_t end = c.hdr.find("\r\n\r\n");
+            if (end == string::npos)
+            {
+                return;
+            }
+            size_t used = end + 4 - old;
+            data += used;
+            len -= used;
+            c.status = 0;
+            sscanf(c.hdr.c_str(), "HTTP/%*d.%*d %d", &c.status);
+            string head = c.hdr.substr(0, end);
+            for (size_t i = 0; i < head.size(); i++)
+            {
+                head[i] = tolower(head[i]);
+            }
+            c.body_left = 0;
+            size_t p = head.find("content-length:");
+            if (p != string::npos)
+            {
+                c.body_left = atoll(head.c_str() + p + 15);
+            }
+            c.server_close = head.find("connection: close") != string::npos;
+            c.hdr.clear();
+        }
+        size_t take = (size_t)c.body_left < len ? (size_t)c.body_left : len;
+        c.body_left -= take;
+        data += take;
+        len -= take;
+        if (c.body_left == 0)
+        {
+            c.body_left = -1;
+            on_response(w, c);
+        }
+    }
+}
+
+static void handle_event(worker &w, rclient &c, unsigned int events, char *buf)
+{
+    if (c.connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || (events & (EPOLLERR | EPOLLHUP)))
+        {
+            fail_current(w, c);
+            return;
+        }
+        c.connecting = false;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &c;
+        epoll_ctl(w.epfd, EPOLL_CTL_MOD, c.fd, &ev);
+        try_start(w, c);
+        return;
+    }
+    if ((events & EPOLLOUT) && c.cur && !flush_out(w, c))
+    {
+        fail_current(w, c);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        bool closed = false;
+        while (true)
+        {
+            ssize_t n = recv(c.fd, buf, READ_BUF, 0);
+            if (n > 0)
+            {
+                w.bytes += n;
+                parse_input(w, c, buf, n);
+                continue;
+            }
+            closed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+        if (c.cur && closed)
+        {
+            fail_current(w, c);
+        }
+        else if (c.cur == NULL)
+        {
+            // 服务器声明或已经关闭了连接，下一个请求重新建连
+            if (closed || c.server_close)
+            {
+                close_client(w, c);
+            }
+            try_start(w, c);
+        }
+    }
+}
+
+// 慢客户端的下一段到时间了
+static void advance_slow(worker &w, long long now)
+{
+    for (size_t i = 0; i < w.slow.size(); )
+    {
+        rclient &c = *w.slow[i];
+        if (c.cur == NULL || c.pieces_sent >= SLOW_PIECES)
+        {
+            w.slow[i] = w.slow.back();
+            w.slow.pop_back();
+            continue;
+        }
+        if (now >= c.next_piece_ns)
+        {
+            c.pieces_sent++;
+            c.allowed = c.pieces_sent >= SLOW_PIECES ? c.out.size() : c.cur->head_len * c.pieces_sent / SLOW_PIECES;
+            c.next_piece_ns += c.piece_gap_ns;
+            if (!flush_out(w, c))
+            {
+                fail_current(w, c);
+            }
+        }
+        i++;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    worker &w = *(worker *)arg;
+    vector<char> buf(READ_BUF);
+    struct epoll_event events[256];
+    size_t next = 0;
+    long long last_check = now_ns();
+    while (true)
+    {
+        long long now = now_ns();
+        while (next < w.events.size() && start_ns + w.events[next]->at_ns <= now)
+        {
+            trace_event *e = w.events[next++];
+            rclient &c = w.clients[e->conn_id];
+            c.pending.push_back(e);
+            try_start(w, c);
+        }
+
+        bool busy = false;
+        for (unordered_map<unsigned int, rclient>::iterator it = w.clients.begin(); it != w.clients.end() && !busy; ++it)
+        {
+            busy = it->second.cur != NULL || !it->second.pending.empty() || it->second.connecting;
+        }
+        if (next >= w.events.size() && !busy)
+        {
+            break;
+        }
+
+        // 等到下一个请求的计划时间，最多10ms（慢客户端分段和超时检查）
+        int wait_ms = 10;
+        if (next < w.events.size())
+        {
+            long long until = start_ns + w.events[next]->at_ns - now;
+            wait_ms = until <= 0 ? 0 : (int)min(10LL, (until + 999999) / 1000000);
+        }
+        if (!w.slow.empty())
+        {
+            wait_ms = min(wait_ms, 1);
+        }
+        int n = epoll_wait(w.epfd, events, 256, wait_ms);
+        for (int i = 0; i < n; i++)
+        {
+            handle_event(w, *(rclient *)events[i].data.ptr, events[i].events, &buf[0]);
+        }
+        now = now_ns();
+        advance_slow(w, now);
+        if (now - last_check >= 100000000LL)
+        {
+            last_check = now;
+            for (unordered_map<unsigned int, rclient>::iterator it = w.clients.begin(); it != w.clients.end(); ++it)
+            {
+                rclient &c = it->second;
+                if ((c.cur || c.connecting) && now - c.sent_ns > timeout_ms * 1000000LL)
+                {
+                    w.timeouts++;
+                    w.errors--;     // fail_current会计一次错误
+                    fail_current(w, c);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static double percentile(const vector<long long> &v, double q)
+{
+    if (v.empty())
+    {
+        return 0;
+    }
+    size_t idx = (size_t)(q * (v.size() - 1) + 0.5);
+    return v[idx] / 1e3;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-s speed] [-t threads] [-T timeout_ms] [-l] trace\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 2;
+    bool list = false;
+    int ch;
+    while ((ch = getopt(argc, argv, "h:p:s:t:T:l")) != -1)
+    {
+        switch (ch)
+        {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 's': speed = atof(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'T': timeout_ms = atoi(optarg); break;
+        case 'l': list = true; break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || speed <= 0 || threads <= 0)
+    {
+        usage(argv[0]);
+    }
+
+    vector<trace_event> events;
+    long long realtime_ns;
+    if (!load_trace(argv[optind], events, realtime_ns))
+    {
+        return 1;
+    }
+    if (events.empty())
+    {
+        fprintf(stderr, "empty trace\n");
+        return 1;
+    }
+    // 从第一个请求开始回放，时间按倍速缩放
+    long long first = events[0].at_ns;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        first = min(first, events[i].at_ns);
+    }
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        events[i].at_ns = (long long)((events[i].at_ns - first) / speed);
+        events[i].send_ns = (long long)(events[i].send_ns / speed);
+    }
+    if (list)
+    {
+        list_trace(events);
+        return 0;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address %s\n", host);
+        return 1;
+    }
+
+    // 按录制连接分给各线程，同一个连接上的请求由同一个线程按顺序发
+    vector<worker> workers(threads);
+    for (int i = 0; i < threads; i++)
+    {
+        worker &w = workers[i];
+        w.epfd = epoll_create1(EPOLL_CLOEXEC);
+        w.ok = w.non2xx = w.errors = w.timeouts = w.reconnects = w.bytes = 0;
+    }
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        worker &w = workers[events[i].conn_id % threads];
+        w.events.push_back(&events[i]);
+        w.clients[events[i].conn_id].remaining++;
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        worker &w = workers[i];
+        stable_sort(w.events.begin(), w.events.end(),
+                    [](const trace_event *a, const trace_event *b) { return a->at_ns < b->at_ns; });
+    }
+
+    size_t conns = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        conns += workers[i].clients.size();
+    }
+    time_t rec_start = realtime_ns / 1000000000LL;
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&rec_start));
+    printf("trace recorded %s: %zu requests on %zu connections over %.1fs, replaying at %gx to %s:%d\n",
+           when, events.size(), conns, events.back().at_ns * speed / 1e9, speed, host, port);
+
+    start_ns = now_ns();
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].tid, NULL);
+    }
+    long long elapsed = now_ns() - start_ns;
+
+    vector<long long> lat, lag;
+    long long ok = 0, non2xx = 0, errors = 0, timeouts = 0, reconnects = 0, bytes = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        worker &w = workers[i];
+        lat.insert(lat.end(), w.lat.begin(), w.lat.end());
+        lag.insert(lag.end(), w.lag.begin(), w.lag.end());
+        ok += w.ok;
+        non2xx += w.non2xx;
+        errors += w.errors;
+        timeouts += w.timeouts;
+        reconnects += w.reconnects;
+        bytes += w.bytes;
+    }
+    sort(lat.begin(), lat.end());
+    sort(lag.begin(), lag.end());
+    double secs = elapsed / 1e9;
+    printf("requests   %lld ok, %lld non-2xx, %lld errors, %lld timeouts, %lld reconnects\n",
+           ok, non2xx, errors, timeouts, reconnects);
+    printf("throughput %.0f req/s, %.2f MB/s over %.1fs\n", lat.size() / secs, bytes / secs / 1e6, secs);
+    printf("latency us p50 %.0f  p90 %.0f  p99 %.0f  p999 %.0f  max %.0f\n",
+           percentile(lat, 0.5), percentile(lat, 0.9), percentile(lat, 0.99), percentile(lat, 0.999),
+           lat.empty() ? 0.0 : lat.back() / 1e3);
+    printf("send lag us p50 %.0f  p99 %.0f  max %.0f\n",
+           percentile(lag, 0.5), percentile(lag, 0.99), lag.empty() ? 0.0 : lag.back() / 1e3);
+    return 0;
+}
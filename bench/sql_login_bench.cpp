@@ -0,0 +1,179 @@
+/************************************************************
+*登录查询基准测试：全表扫描 vs 预编译语句索引点查
+*按不同的表大小各测一轮，输出每次登录查询的平均/p99延迟
+*
+*编译：g++ -O2 -std=c++11 -I.. sql_login_bench.cpp ../sql_connection_pool.cpp ../log.cpp ../clock_cache.cpp ../metrics.cpp -lmysqlclient -lpthread -o sql_login_bench
+*运行：./sql_login_bench [host] [user] [passwd] [port]
+*会在名为web_bench的库中重建user表，不会碰线上的web库
+************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <mysql/mysql.h>
+
+#include "sql_connection_pool.h"
+
+using namespace std;
+
+static const char *BENCH_DB = "web_bench";
+static const int LOOKUPS = 2000;
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void must_query(MYSQL *mysql, const char *sql)
+{
+    if (mysql_query(mysql, sql))
+    {
+        fprintf(stderr, "query failed: %s: %s\n", sql, mysql_error(mysql));
+        exit(1);
+    }
+}
+
+// 重建user表并写入n个用户，username上建唯一索引
+static void seed(MYSQL *mysql, int n)
+{
+    must_query(mysql, "DROP TABLE IF EXISTS user");
+    must_query(mysql, "CREATE TABLE user(username VARCHAR(50) NOT NULL, passwd VARCHAR(50) NOT NULL, "
+                      "UNIQUE KEY idx_username(username)) ENGINE=InnoDB");
+    string sql;
+    char row[128];
+    for (int i = 0; i < n; i++)
+    {
+        if (sql.empty())
+        {
+            sql = "INSERT INTO user(username, passwd) VALUES";
+        }
+        else
+        {
+            sql += ",";
+        }
+        snprintf(row, sizeof(row), "('user%d','pw%d')", i, i);
+        sql += row;
+        if ((i + 1) % 1000 == 0 || i == n - 1)
+        {
+            must_query(mysql, sql.c_str());
+            sql.clear();
+        }
+    }
+}
+
+// 旧的登录路径：取回整张表，在C++里逐行比对
+static bool scan_login(MYSQL *mysql, const char *name, const char *password)
+{
+    if (mysql_query(mysql, "SELECT username,passwd FROM user"))
+    {
+        return false;
+    }
+    MYSQL_RES *result = mysql_store_result(mysql);
+    bool ok = false;
+    while (MYSQL_ROW row = mysql_fetch_row(result))
+    {
+        if (strcmp(row[0], name) == 0 && strcmp(row[1], password) == 0)
+        {
+            ok = true;
+            break;
+        }
+    }
+    mysql_free_result(result);
+    return ok;
+}
+
+static void report(const char *name, int table_size, vector<long long> &lat)
+{
+    sort(lat.begin(), lat.end());
+    long long sum = 0;
+    for (size_t i = 0; i < lat.size(); i++) sum += lat[i];
+    printf("%-10s rows=%-8d avg_us=%-10.1f p50_us=%-10.1f p99_us=%-10.1f\n", name, table_size,
+           sum / 1000.0 / lat.size(), lat[lat.size() / 2] / 1000.0, lat[lat.size() * 99 / 100] / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    const char *user = argc > 2 ? argv[2] : "root";
+    const char *passwd = argc > 3 ? argv[3] : "123456";
+    int port = argc > 4 ? atoi(argv[4]) : 3306;
+
+    Log::get_instance()->init("./sql_login_bench_log", 0, 2000, 800000, 0);
+
+    MYSQL *admin = mysql_init(NULL);
+    if (!mysql_real_connect(admin, host, user, passwd, NULL, port, NULL, 0))
+    {
+        fprintf(stderr, "connect failed: %s\n", mysql_error(admin));
+        return 1;
+    }
+    char sql[128];
+    snprintf(sql, sizeof(sql), "CREATE DATABASE IF NOT EXISTS %s", BENCH_DB);
+    must_query(admin, sql);
+    mysql_close(admin);
+
+    int sizes[] = {100, 1000, 10000, 100000};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int n = sizes[s];
+        MYSQL *mysql = mysql_init(NULL);
+        if (!mysql_real_connect(mysql, host, user, passwd, BENCH_DB, port, NULL, 0))
+        {
+            fprintf(stderr, "connect failed: %s\n", mysql_error(mysql));
+            return 1;
+        }
+        seed(mysql, n);
+
+        // 和连接池一样：连接建立后prepare一次
+        sql_conn_params params;
+        params.url = host;
+        params.user = user;
+        params.passwd = passwd;
+        params.db = BENCH_DB;
+        params.port = port;
+        sql_conn conn(&params);
+        if (!conn.connect())
+        {
+            return 1;
+        }
+
+        srand(n);
+        vector<long long> scan_lat, stmt_lat;
+        char name[64], password[64], stored[100];
+        // 全表扫描太慢，大表只取少量样本
+        int scan_lookups = n >= 100000 ? 50 : (n >= 10000 ? 200 : LOOKUPS);
+        for (int i = 0; i < scan_lookups; i++)
+        {
+            int id = rand() % n;
+            snprintf(name, sizeof(name), "user%d", id);
+            snprintf(password, sizeof(password), "pw%d", id);
+            long long t0 = now_ns();
+            if (!scan_login(mysql, name, password))
+            {
+                fprintf(stderr, "scan lookup missed %s\n", name);
+            }
+            scan_lat.push_back(now_ns() - t0);
+        }
+        for (int i = 0; i < LOOKUPS; i++)
+        {
+            int id = rand() % n;
+            snprintf(name, sizeof(name), "user%d", id);
+            snprintf(password, sizeof(password), "pw%d", id);
+            long long t0 = now_ns();
+            if (conn.find_user(name, stored, sizeof(stored)) != 1 || strcmp(stored, password) != 0)
+            {
+                fprintf(stderr, "stmt lookup missed %s\n", name);
+            }
+            stmt_lat.push_back(now_ns() - t0);
+        }
+        report("full_scan", n, scan_lat);
+        report("prepared", n, stmt_lat);
+        mysql_close(mysql);
+    }
+    return 0;
+}
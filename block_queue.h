@@ -1,6 +1,8 @@
 /************************************************************
-*循环数组实现的阻塞队列，m_back = (m_back + 1) % m_max_size
+*循环数组实现的有界阻塞队列，m_front为队首下标，队尾为(m_front + m_size) % m_max_size
 *线程安全，每个操作前都要先加互斥锁，操作完，再解锁
+*元素移动进出队列，不拷贝；pop_bulk一次加锁取出多个元素
+*生产者和消费者分别在两个条件变量上等待，只有确实有线程在等时才signal，每次只唤醒需要的数量
 ************************************************************/
 
 #ifndef BLOCK_QUEUE_H
@@ -9,7 +11,8 @@
 #include <iostream>
 #include <stdlib.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <time.h>
+#include <utility>
 #include "locker.h"
 
 using namespace std;
@@ -27,8 +30,9 @@ public:
         m_max_size = max_size;
         m_array = new T[max_size];
         m_size = 0;
-        m_front = -1;
-        m_back = -1;
+        m_front = 0;
+        m_push_waiters = 0;
+        m_pop_waiters = 0;
     }
 
     ~block_queue()
@@ -44,9 +48,13 @@ public:
     void clear()
     {
         m_mutex.lock();
+        for (int i = 0; i < m_size; i++)
+        {
+            m_array[(m_front + i) % m_max_size] = T();
+        }
         m_size = 0;
-        m_front = -1;
-        m_back = -1;
+        m_front = 0;
+        wake_pushers(m_push_waiters);
         m_mutex.unlock();
     }
 
@@ -54,29 +62,21 @@ public:
     bool full()
     {
         m_mutex.lock();
-        if (m_size >= m_max_size)
-        {
-            m_mutex.unlock();
-            return true;
-        }
+        bool ret = m_size >= m_max_size;
         m_mutex.unlock();
-        return false;
+        return ret;
     }
 
     // 判断队列为空
     bool empty()
     {
         m_mutex.lock();
-        if (m_size == 0)
-        {
-            m_mutex.unlock();
-            return true;
-        }
+        bool ret = m_size == 0;
         m_mutex.unlock();
-        return false;
+        return ret;
     }
 
-    // 返回队列首元素
+    // 返回队列首元素（拷贝，元素仍留在队列中）
     bool front(T &value)
     {
         m_mutex.lock();
@@ -90,60 +90,75 @@ public:
         return true;
     }
 
-    // 返回队尾元素
+    // 返回队尾元素（拷贝，元素仍留在队列中）
     bool back(T &value)
     {
         m_mutex.lock();
-        if (m_size() == 0)
+        if (m_size == 0)
         {
             m_mutex.unlock();
             return false;
         }
-        value = m_array[m_back];
+        value = m_array[(m_front + m_size - 1) % m_max_size];
+        m_mutex.unlock();
         return true;
     }
 
     int size()
     {
-        int tmp = 0;
-
         m_mutex.lock();
-        tmp = m_size();
-        
+        int tmp = m_size;
         m_mutex.unlock();
         return tmp;
     }
 
     int max_size()
     {
-        int tmp = 0;
+        return m_max_size;
+    }
 
-        m_mutex.lock();
-        tmp = m_max_size;
+    // 队列满时等待空位
+    bool push(const T &item)
+    {
+        T tmp(item);
+        return push(std::move(tmp));
+    }
 
+    bool push(T &&item)
+    {
+        m_mutex.lock();
+        while (m_size >= m_max_size)
+        {
+            m_push_waiters++;
+            bool ok = m_not_full.wait(m_mutex.get());
+            m_push_waiters--;
+            if (!ok)
+            {
+                m_mutex.unlock();
+                return false;
+            }
+        }
+        put(std::move(item));
         m_mutex.unlock();
-        return tmp;
+        return true;
+    }
+
+    // 队列满时立即返回false，item保持不变
+    bool try_push(const T &item)
+    {
+        T tmp(item);
+        return try_push(std::move(tmp));
     }
 
-    // 往队列添加元素，需要将所有使用队列的线程先唤醒
-    // 当有元素push进队列，相当于生产者生产了一个元素
-    // 若当前没有线程等待条件变量，则唤醒无意义
-    bool push (const T &item)
+    bool try_push(T &&item)
     {
         m_mutex.lock();
         if (m_size >= m_max_size)
         {
-            m_cond.broadcast();
             m_mutex.unlock();
             return false;
         }
-
-        m_back = (m_back + 1) % m_max_size;
-        m_array[m_back] = item;
-
-        m_size++;
-
-        m_cond.broadcast();
+        put(std::move(item));
         m_mutex.unlock();
         return true;
     }
@@ -151,61 +166,92 @@ public:
     // pop时，如果当前队列没有元素，将会等待条件变量
     bool pop(T &item)
     {
+        return pop_bulk(&item, 1, -1) == 1;
+    }
+
+    // 增加了超时处理，超时返回false
+    bool pop(T &item, int ms_timeout)
+    {
+        return pop_bulk(&item, 1, ms_timeout) == 1;
+    }
+
+    // 一次取出最多n个元素放到out[0..n)，返回取出的个数
+    // 队列为空时等待，ms_timeout < 0表示一直等，超时返回0
+    int pop_bulk(T *out, int n, int ms_timeout = -1)
+    {
+        struct timespec t = {0, 0};
+        if (ms_timeout >= 0)
+        {
+            // pthread_cond_timedwait用的是绝对时间（CLOCK_REALTIME）
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_sec += ms_timeout / 1000;
+            t.tv_nsec += (long)(ms_timeout % 1000) * 1000000;
+            if (t.tv_nsec >= 1000000000)
+            {
+                t.tv_sec++;
+                t.tv_nsec -= 1000000000;
+            }
+        }
+
         m_mutex.lock();
         while (m_size <= 0)
         {
-            if (!m_cond.wait(m_mutex.get()))    // 如果是多个消费者，需要使用while
+            // 如果是多个消费者，需要使用while；超时后再检查一次
+            m_pop_waiters++;
+            bool ok = ms_timeout >= 0 ? m_not_empty.timewait(m_mutex.get(), t) : m_not_empty.wait(m_mutex.get());
+            m_pop_waiters--;
+            if (!ok && m_size <= 0)
             {
                 m_mutex.unlock();
-                return false;
+                return 0;
             }
         }
 
-        m_front = (m_front + 1) % m_max_size;
-        item = m_array[m_front];
-        m_size--;
+        int cnt = n < m_size ? n : m_size;
+        for (int i = 0; i < cnt; i++)
+        {
+            out[i] = std::move(m_array[m_front]);
+            m_front = (m_front + 1) % m_max_size;
+        }
+        m_size -= cnt;
+        wake_pushers(cnt);
         m_mutex.unlock();
-        return true;
+        return cnt;
     }
 
-    // 增加了超时处理
-    bool pop(T &item, int ms_timeout)
+private:
+    // 以下调用时都已持有m_mutex
+    void put(T &&item)
     {
-        struct timespec t = {0, 0};
-        struct timeval now = {0, 0};
-        gettimeofday(&now, NULL);
-        m_mutex.lock();
-        if (m_size <= 0)
+        m_array[(m_front + m_size) % m_max_size] = std::move(item);
+        m_size++;
+        // 一个元素只需要一个消费者，没人等就不进内核
+        if (m_pop_waiters > 0)
         {
-            t.tv_sec = now.tv_sec + ms_timeout / 1000;
-            t.tv_nsec = (ms_timeout % 1000) * 1000;
-            if (!m_cond.timewait(m_mutex.get(), t))     //  线程等待一定的时间，如果超时或有信号触发，线程唤醒
-            {
-                m_mutex.unlock();
-                return false;
-            }
+            m_not_empty.signal();
         }
+    }
 
-        if (m_size <= 0)
+    // 腾出了cnt个空位，最多唤醒cnt个生产者
+    void wake_pushers(int cnt)
+    {
+        int wake = cnt < m_push_waiters ? cnt : m_push_waiters;
+        for (int i = 0; i < wake; i++)
         {
-            m_mutex.unlock();
-            return false;
+            m_not_full.signal();
         }
-        m_front = (m_front + 1) % m_max_size;
-        item = m_array[m_front];
-        m_size--;
-        m_mutex.unlock();
-        return true;
     }
 
 private:
     locker m_mutex;
-    cond m_cond;
+    cond m_not_empty;   // 消费者在这里等
+    cond m_not_full;    // 生产者在这里等
     T *m_array;         // 循环数组
     int m_size;         // 当前数目
     int m_max_size;     // 允许的最大数目
-    int m_front;
-    int m_back;
+    int m_front;        // 队首下标
+    int m_push_waiters; // 正在等待的生产者数
+    int m_pop_waiters;  // 正在等待的消费者数
 };
 
-#endif
\ No newline at end of file
+#endif
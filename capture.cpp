@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "capture.h"
+#include "trace_record.h"
+#include "metrics.h"
+#include "log.h"
+
+traffic_capture::traffic_capture()
+    : m_enabled(false), m_next_conn(0), m_fd(-1), m_base_ns(0), m_chunk_records(0), m_max_bytes(0),
+      m_queued_bytes(0), m_queue(NULL), m_recorded(0), m_dropped(0)
+{
+}
+
+traffic_capture *traffic_capture::GetInstance()
+{
+    static traffic_capture instance;
+    return &instance;
+}
+
+bool traffic_capture::init(const char *path, int max_mb)
+{
+    m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+    {
+        LOG_ERROR("capture: cannot open %s, errno %d\n", path, errno);
+        return false;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    trace_file_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.start_realtime_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    hdr.version = 1;
+    if (write(m_fd, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != sizeof(TRACE_MAGIC)
+        || write(m_fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+    {
+        LOG_ERROR("capture: cannot write %s, errno %d\n", path, errno);
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    // 最多积压64块（4MB），写盘跟不上时丢弃
+    m_queue = new block_queue<string>(64);
+    if (pthread_create(&m_tid, NULL, worker, this) != 0)
+    {
+        delete m_queue;
+        m_queue = NULL;
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    m_max_bytes = (size_t)max_mb * 1024 * 1024;
+    m_chunk.reserve(CHUNK_SIZE + 4096);
+    m_base_ns = metrics::now_ns();
+    m_enabled = true;
+    LOG_INFO("capture: recording request headers to %s, up to %d MB\n", path, max_mb);
+    return true;
+}
+
+// 凭据类的请求头：值不录制
+static bool sensitive_header(const char *name, int len)
+{
+    static const char *NAMES[] = {"authorization", "proxy-authorization", "cookie"};
+    for (size_t i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); i++)
+    {
+        if ((int)strlen(NAMES[i]) == len && strncasecmp(name, NAMES[i], len) == 0)
+        {
+            return true;
+        }
+    }
+    // X-Auth-Token、X-Api-Secret之类的自定义头
+    string lower(name, len);
+    for (size_t i = 0; i < lower.size(); i++)
+    {
+        lower[i] = tolower(lower[i]);
+    }
+    return lower.find("token") != string::npos || lower.find("secret") != string::npos;
+}
+
+// 逐行拷贝请求头到m_head，顺便取出Content-Length
+void traffic_capture::redact(const char *buf, int len, long &body_len)
+{
+    m_head.clear();
+    body_len = 0;
+    const char *end = buf + len;
+    const char *line = buf;
+    bool request_line = true;
+    while (line < end)
+    {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        const char *next = eol ? eol + 1 : end;
+        if (request_line)
+        {
+            // 请求行：查询串可能带着口令，整体替换
+            const char *q = (const char *)memchr(line, '?', next - line);
+            if (q)
+            {
+                const char *sp = (const char *)memchr(q, ' ', next - q);
+                m_head.append(line, q + 1 - line);
+                m_head += "REDACTED";
+                if (sp)
+                {
+                    m_head.append(sp, next - sp);
+                }
+            }
+            else
+            {
+                m_head.append(line, next - line);
+            }
+            request_line = false;
+        }
+        else
+        {
+            const char *colon = (const char *)memchr(line, ':', next - line);
+            if (colon && sensitive_header(line, colon - line))
+            {
+                m_head.append(line, colon + 1 - line);
+                m_head += " REDACTED\r\n";
+            }
+            else
+            {
+                if (colon && colon - line == 14 && strncasecmp(line, "Content-Length", 14) == 0)
+                {
+                    body_len = atol(colon + 1);
+                }
+                m_head.append(line, next - line);
+            }
+        }
+        line = next;
+    }
+}
+
+void traffic_capture::record(unsigned int conn_id, bool new_conn, int64_t start_ns, int64_t done_ns, const char *buf, int len)
+{
+    if (!m_enabled)
+    {
+        return;
+    }
+    long body_len;
+    redact(buf, len, body_len);
+    if (m_head.size() > 0xFFFF)
+    {
+        return;
+    }
+    trace_rec_hdr hdr;
+    hdr.offset_ns = start_ns > m_base_ns ? start_ns - m_base_ns : 0;
+    hdr.conn_id = conn_id;
+    hdr.send_us = done_ns > start_ns ? (done_ns - start_ns) / 1000 : 0;
+    hdr.body_len = body_len > 0 ? body_len : 0;
+    hdr.head_len = m_head.size();
+    hdr.flags = new_conn ? TRACE_NEW_CONN : 0;
+    m_chunk.append((const char *)&hdr, sizeof(hdr));
+    m_chunk += m_head;
+    m_chunk_records++;
+    if (m_chunk.size() >= CHUNK_SIZE)
+    {
+        flush();
+    }
+}
+
+void traffic_capture::flush()
+{
+    if (m_chunk.empty())
+    {
+        return;
+    }
+    int records = m_chunk_records;
+    size_t bytes = m_chunk.size();
+    if (m_queued_bytes + bytes > m_max_bytes)
+    {
+        LOG_WARN("capture: file limit reached, stop recording after %llu requests\n",
+                 (unsigned long long)m_recorded.load());
+        m_enabled = false;
+        m_dropped += records;
+    }
+    else if (m_queue->try_push(std::move(m_chunk)))
+    {
+        m_queued_bytes += bytes;
+        m_recorded += records;
+    }
+    else
+    {
+        m_dropped += records;
+        LOG_WARN("capture: writer is behind, dropped %d requests (%llu in total)\n",
+                 records, (unsigned long long)m_dropped.load());
+    }
+    m_chunk.clear();
+    m_chunk.reserve(CHUNK_SIZE + 4096);
+    m_chunk_records = 0;
+}
+
+void traffic_capture::stop()
+{
+    if (m_queue == NULL)
+    {
+        return;
+    }
+    // 这时不再有新的请求，可以阻塞地等队列空出位置
+    if (m_enabled && !m_chunk.empty() && m_queued_bytes + m_chunk.size() <= m_max_bytes)
+    {
+        m_queued_bytes += m_chunk.size();
+        m_recorded += m_chunk_records;
+        m_queue->push(std::move(m_chunk));
+    }
+    m_enabled = false;
+    m_chunk.clear();
+    m_chunk_records = 0;
+    // 空块表示结束，写线程写完前面的块之后退出
+    m_queue->push(string());
+    pthread_join(m_tid, NULL);
+    delete m_queue;
+    m_queue = NULL;
+    fsync(m_fd);
+    close(m_fd);
+    m_fd = -1;
+    LOG_INFO("capture: stopped, %llu requests recorded, %llu dropped\n",
+             (unsigned long long)m_recorded.load(), (unsigned long long)m_dropped.load());
+}
+
+void *traffic_capture::worker(void *arg)
+{
+    traffic_capture *capture = (traffic_capture *)arg;
+    capture->write_loop();
+    return capture;
+}
+
+void traffic_capture::write_loop()
+{
+    string chunk;
+    while (m_queue->pop(chunk) && !chunk.empty())
+    {
+        size_t off = 0;
+        while (off < chunk.size())
+        {
+            ssize_t n = write(m_fd, chunk.data() + off, chunk.size() - off);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                LOG_ERROR("capture: write failed, errno %d\n", errno);
+                break;
+            }
+            off += n;
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <pthread.h>
+#include "block_queue.h"
+
+using namespace std;
+
+/************************************************************
+*流量录制：记录每个请求的到达时间、所在连接和请求头原文，写成trace_record.h格式的文件，
+*用bench/replay按原来的节奏（或加速）重放，在本机复现线上的负载形状
+*主线程在http_conn::read()收完请求头时调用record()，只做脱敏和追加到内存块；
+*攒满一块或每次定时器tick时交给写线程落盘，写线程跟不上时整块丢弃并计数，不阻塞主线程
+*退出时stop()把最后一块交给写线程，等它写完队列里的所有块并fsync
+*消息体不录制（登录/注册的密码在消息体里），Cookie、Authorization等头和URL查询串替换成REDACTED
+************************************************************/
+
+class traffic_capture
+{
+public:
+    static traffic_capture *GetInstance();
+
+    // 开始录制到path，文件写到max_mb兆后停止录制
+    bool init(const char *path, int max_mb);
+
+    bool enabled()
+    {
+        return m_enabled;
+    }
+
+    // 给新连接分配编号，同一个连接上的请求在回放时走同一个连接
+    unsigned int next_conn_id()
+    {
+        return ++m_next_conn;
+    }
+
+    // 一个请求头收完时由主线程调用；buf为从请求行到空行（含）的原文
+    void record(unsigned int conn_id, bool new_conn, int64_t start_ns, int64_t done_ns, const char *buf, int len);
+
+    // 把攒着的记录交给写线程，主线程在定时器tick时调用
+    void flush();
+    // 停止录制：最后一块不丢弃，等写线程把已经交出去的块都写完再关闭文件，主线程退出前调用
+    void stop();
+
+private:
+    traffic_capture();
+
+    static void *worker(void *arg);
+    void write_loop();
+    void redact(const char *buf, int len, long &body_len);
+
+private:
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    bool m_enabled;
+    unsigned int m_next_conn;
+    int m_fd;
+    pthread_t m_tid;                // 写线程，stop()时join
+    int64_t m_base_ns;              // 开始录制时的单调时间
+
+    // 以下只由主线程访问
+    string m_chunk;                 // 攒着还没交给写线程的记录
+    int m_chunk_records;
+    string m_head;                  // 脱敏后的请求头，复用内存
+    size_t m_max_bytes;
+    size_t m_queued_bytes;          // 已经交给写线程的字节数
+
+    block_queue<string> *m_queue;
+    atomic<uint64_t> m_recorded;
+    atomic<uint64_t> m_dropped;
+};
+
+#endif
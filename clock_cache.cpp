@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "clock_cache.h"
+
+static const char *WEEKDAYS[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+static int64_t real_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+clock_cache::clock_cache()
+{
+    m_running = false;
+    m_interval_us = 1000;
+    m_usec = 0;
+    m_seq = 0;
+    m_stamp[0] = '\0';
+    m_date[0] = '\0';
+    m_mday = 0;
+    m_sec = 0;
+}
+
+clock_cache *clock_cache::GetInstance()
+{
+    static clock_cache instance;
+    return &instance;
+}
+
+void clock_cache::start(int interval_us)
+{
+    if (m_running.exchange(true))
+    {
+        return;
+    }
+    m_interval_us = interval_us;
+    refresh();
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, worker, this) != 0)
+    {
+        m_running = false;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+void *clock_cache::worker(void *arg)
+{
+    clock_cache *clock = (clock_cache *)arg;
+    while (true)
+    {
+        usleep(clock->m_interval_us);
+        clock->refresh();
+    }
+    return clock;
+}
+
+// 按int的最大宽度准备的临时缓冲区，格式化结果不会截断；实际的时间总是正好LOG_STAMP_LEN/HTTP_DATE_LEN个字符
+static void copy_fixed(char *dst, const char *src, int n, int len)
+{
+    n = n < len ? n : len;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+void clock_cache::format(int64_t usec, char *stamp, char *date, int *mday)
+{
+    time_t sec = usec / 1000000;
+    struct tm my_tm;
+    char buf[96];
+    if (stamp)
+    {
+        localtime_r(&sec, &my_tm);
+        int n = snprintf(buf, sizeof(buf), "%04d-%02d-%02d %02d:%02d:%02d.%06d",
+                         my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
+                         my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, (int)(usec % 1000000));
+        copy_fixed(stamp, buf, n, LOG_STAMP_LEN);
+        if (mday)
+        {
+            *mday = my_tm.tm_mday;
+        }
+    }
+    if (date)
+    {
+        gmtime_r(&sec, &my_tm);
+        int n = snprintf(buf, sizeof(buf), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                         WEEKDAYS[my_tm.tm_wday], my_tm.tm_mday, MONTHS[my_tm.tm_mon],
+                         my_tm.tm_year + 1900, my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec);
+        copy_fixed(date, buf, n, HTTP_DATE_LEN);
+    }
+}
+
+// 只有刷新线程（和start）调用，写者只有一个
+void clock_cache::refresh()
+{
+    int64_t usec = real_usec();
+    time_t sec = usec / 1000000;
+
+    m_seq.fetch_add(1, memory_order_acq_rel);
+    if (sec != m_sec)
+    {
+        format(usec, m_stamp, m_date, &m_mday);
+        m_sec = sec;
+    }
+    else
+    {
+        // 同一秒内只有微秒部分变化
+        char frac[8];
+        snprintf(frac, sizeof(frac), "%06ld", (long)(usec % 1000000));
+        memcpy(m_stamp + LOG_STAMP_LEN - 6, frac, 6);
+    }
+    m_usec.store(usec, memory_order_relaxed);
+    m_seq.fetch_add(1, memory_order_release);
+}
+
+int64_t clock_cache::now_usec()
+{
+    if (!m_running.load(memory_order_relaxed))
+    {
+        return real_usec();
+    }
+    return m_usec.load(memory_order_relaxed);
+}
+
+void clock_cache::log_stamp(char *buf, int *mday)
+{
+    if (!m_running.load(memory_order_relaxed))
+    {
+        format(real_usec(), buf, NULL, mday);
+        return;
+    }
+    unsigned int seq;
+    do
+    {
+        seq = m_seq.load(memory_order_acquire);
+        memcpy(buf, m_stamp, LOG_STAMP_LEN + 1);
+        if (mday)
+        {
+            *mday = m_mday;
+        }
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != m_seq.load(memory_order_relaxed));
+}
+
+void clock_cache::http_date(char *buf)
+{
+    if (!m_running.load(memory_order_relaxed))
+    {
+        format(real_usec(), NULL, buf, NULL);
+        return;
+    }
+    unsigned int seq;
+    do
+    {
+        seq = m_seq.load(memory_order_acquire);
+        memcpy(buf, m_date, HTTP_DATE_LEN + 1);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != m_seq.load(memory_order_relaxed));
+}
@@ -0,0 +1,59 @@
+#ifndef CLOCK_CACHE_H
+#define CLOCK_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+using namespace std;
+
+/************************************************************
+*粗粒度时钟：后台线程大约每毫秒刷新一次当前时间，并预先格式化好
+*日志用的"年-月-日 时:分:秒.微秒"和HTTP响应的Date头
+*读者不再调用gettimeofday/localtime（localtime内部有glibc的锁，还可能读TZ），
+*直接拷贝现成的字节；格式化好的字符串用顺序锁(seqlock)保护，读者不加锁
+*时钟线程没启动时（例如离线工具），读者当场计算
+************************************************************/
+
+class clock_cache
+{
+public:
+    static const int LOG_STAMP_LEN = 26;    // 2024-01-01 12:00:00.000000
+    static const int HTTP_DATE_LEN = 29;    // Mon, 01 Jan 2024 12:00:00 GMT
+
+    static clock_cache *GetInstance();
+
+    // 启动刷新线程，interval_us为刷新间隔，重复调用无副作用
+    void start(int interval_us = 1000);
+
+    // 当前时间（微秒），精度为刷新间隔
+    int64_t now_usec();
+    // 日志时间戳，写入buf（至少LOG_STAMP_LEN + 1字节），mday返回当天是几号
+    void log_stamp(char *buf, int *mday);
+    // HTTP Date头的值，写入buf（至少HTTP_DATE_LEN + 1字节）
+    void http_date(char *buf);
+
+private:
+    clock_cache();
+
+    static void *worker(void *arg);
+    void refresh();
+
+    // 不经缓存直接计算一次
+    static void format(int64_t usec, char *stamp, char *date, int *mday);
+
+private:
+    atomic<bool> m_running;
+    int m_interval_us;
+
+    atomic<int64_t> m_usec;
+    atomic<unsigned int> m_seq;         // 奇数表示正在更新
+    char m_stamp[LOG_STAMP_LEN + 1];
+    char m_date[HTTP_DATE_LEN + 1];
+    int m_mday;
+
+    // 以下只由刷新线程使用，秒数不变时只改写微秒部分
+    time_t m_sec;
+};
+
+#endif
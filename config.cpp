@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "config.h"
+#include "log.h"
+
+enum OPTION_KIND
+{
+    OPT_INT = 0,
+    OPT_STR,
+    OPT_RATE,       // "每秒次数:突发次数"
+    OPT_LEVEL,      // 日志级别
+    OPT_OVERFLOW    // 日志缓冲区满时的策略
+};
+
+struct option_def
+{
+    const char *key;
+    const char *def;
+    int kind;
+    bool reloadable;    // SIGHUP时重新应用
+    int min;            // OPT_INT的取值范围，超出范围的值和格式不对的值一样拒绝
+    int max;
+};
+
+// 所有配置项；改默认值只改这里
+static const option_def OPTIONS[] = {
+    // 网站和连接
+    {"root",                    "./root/",      OPT_STR,   false, 0, 0},            // 网站根目录，末尾带'/'
+    {"threads",                 "8",            OPT_INT,   false, 1, 1024},         // 工作线程数
+    {"max_fd",                  "65535",        OPT_INT,   false, 16, 1 << 24},     // 连接fd的上限，超过的连接回503
+    {"max_events",              "10000",        OPT_INT,   false, 1, 1 << 20},      // 一次epoll_wait最多取出的事件数
+    {"backlog",                 "5",            OPT_INT,   false, 1, 65535},        // listen的backlog
+    {"read_buffer",             "2048",         OPT_INT,   false, 1024, 1 << 24},   // 每个连接的读缓冲区，限制了请求头加消息体的长度
+    {"write_buffer",            "1024",         OPT_INT,   false, 1024, 1 << 20},   // 每个连接的写缓冲区，只放响应头和错误页
+    {"conn_timeout",            "100",          OPT_INT,   true,  1, 86400},        // 新连接的空闲超时（秒）
+    {"drain_ms",                "10000",        OPT_INT,   true,  0, 3600000},      // 停机时最多等待正在处理的请求多久
+    {"upgrade_sock",            "",             OPT_STR,   false, 0, 0},            // 热升级用的UNIX域socket路径
+    // HTTPS
+    {"tls_port",                "0",            OPT_INT,   false, 0, 65535},        // 0表示不开HTTPS
+    {"tls_cert",                "",             OPT_STR,   true,  0, 0},            // PEM证书链，SIGHUP时重新加载
+    {"tls_key",                 "",             OPT_STR,   true,  0, 0},
+    {"tls_ticket_key",          "",             OPT_STR,   true,  0, 0},            // 80字节的票据密钥文件，多个进程共用时会话可以跨进程恢复
+    // HTTP/2
+    {"http2",                   "1",            OPT_INT,   true,  0, 1},            // 0表示只说HTTP/1.1：不认连接前言，ALPN不选h2
+    {"h2_max_streams",          "100",          OPT_INT,   true,  1, 1024},         // 每个HTTP/2连接上同时处理的请求数
+    // 日志
+    {"log_async",               "1",            OPT_INT,   false, 0, 1},
+    {"log_queue",               "800",          OPT_INT,   false, 1, 1 << 20},      // 异步日志每个线程的环形缓冲区大小
+    {"log_level",               "info",         OPT_LEVEL, true,  0, 0},
+    {"log_binary",              "0",            OPT_INT,   false, 0, 1},            // 1表示异步日志写二进制格式，用tools/log_decode解码
+    {"log_flush_ms",            "10",           OPT_INT,   false, 0, 10000},        // 日志线程攒批写出的间隔，0表示有日志就写
+    {"log_fsync_ms",            "1000",         OPT_INT,   false, 0, 3600000},      // 距上次fdatasync超过这么多毫秒时同步，0表示不按时间同步
+    {"log_fsync_kb",            "0",            OPT_INT,   false, 0, 1 << 20},      // 距上次fdatasync写了这么多KB时同步，0表示不按大小同步
+    {"log_overflow",            "spill",        OPT_OVERFLOW, false, 0, 0},         // 缓冲区满时：write/drop/sample/block/spill
+    {"log_spill_mb",            "64",           OPT_INT,   false, 1, 4096},         // spill：溢出文件的大小
+    {"log_sample",              "10",           OPT_INT,   false, 1, 1000000},      // sample：每这么多条保留一条
+    {"log_block_ms",            "5",            OPT_INT,   false, 1, 10000},        // block：最多等待日志线程腾出空间的毫秒数
+    // 过载保护和限速
+    {"max_queue",               "10000",        OPT_INT,   true,  1, 1 << 24},
+    {"queue_target_ms",         "5",            OPT_INT,   true,  1, 60000},
+    {"queue_interval_ms",       "100",          OPT_INT,   true,  1, 60000},
+    {"rate_conn",               "50:100",       OPT_RATE,  true,  0, 0},
+    {"rate_static",             "500:1000",     OPT_RATE,  true,  0, 0},
+    {"rate_backend",            "20:40",        OPT_RATE,  true,  0, 0},
+    {"rate_loopback",           "0",            OPT_INT,   true,  0, 1},            // 1表示本机地址也限速
+    {"rate_max_clients",        "65536",        OPT_INT,   true,  1, 1 << 24},
+    // MySQL
+    {"mysql_host",              "localhost",    OPT_STR,   false, 0, 0},
+    {"mysql_port",              "3306",         OPT_INT,   false, 1, 65535},
+    {"mysql_user",              "root",         OPT_STR,   false, 0, 0},
+    {"mysql_password",          "123456",       OPT_STR,   false, 0, 0},
+    {"mysql_db",                "web",          OPT_STR,   false, 0, 0},
+    {"sql_max_conn",            "8",            OPT_INT,   true,  1, 1024},
+    {"sql_min_conn",            "2",            OPT_INT,   true,  0, 1024},
+    {"sql_checkout_ms",         "500",          OPT_INT,   true,  0, 60000},
+    // Redis
+    {"redis_host",              "127.0.0.1",    OPT_STR,   false, 0, 0},
+    {"redis_port",              "6379",         OPT_INT,   false, 1, 65535},
+    {"redis_max_conn",          "8",            OPT_INT,   true,  1, 1024},
+    {"redis_min_conn",          "2",            OPT_INT,   true,  0, 1024},
+    {"redis_checkout_ms",       "200",          OPT_INT,   true,  0, 60000},
+    {"redis_batch",             "2",            OPT_INT,   false, 0, 64},           // 管道线程数，0表示不合并成pipeline
+    {"redis_async",             "1",            OPT_INT,   false, 0, 1},            // 登录时的缓存查询走主线程的异步连接
+    {"pool_idle_timeout",       "60",           OPT_INT,   true,  1, 86400},        // 两个连接池回收空闲连接的秒数
+    {"pool_health_interval",    "5",            OPT_INT,   true,  1, 3600},
+    // 缓存
+    {"user_cache_mb",           "64",           OPT_INT,   true,  1, 65536},
+    {"user_cache_ttl",          "600",          OPT_INT,   true,  1, 2592000},
+    {"near_cache_size",         "100000",       OPT_INT,   false, 0, 1 << 24},
+    {"near_cache_ttl",          "300",          OPT_INT,   false, 1, 86400},
+    {"near_cache_negative_ttl", "30",           OPT_INT,   false, 1, 86400},
+    // 流量录制
+    {"capture",                 "",             OPT_STR,   false, 0, 0},
+    {"capture_mb",              "1024",         OPT_INT,   false, 1, 1 << 20},
+};
+
+static const int OPTION_NUM = sizeof(OPTIONS) / sizeof(OPTIONS[0]);
+
+static const char *LEVEL_NAMES[] = {"debug", "info", "warn", "error", "off"};
+// 和Log::OVERFLOW_POLICY的顺序相同
+static const char *OVERFLOW_NAMES[] = {"write", "drop", "sample", "block", "spill"};
+
+static const option_def *find_option(const string &key)
+{
+    for (int i = 0; i < OPTION_NUM; i++)
+    {
+        if (key == OPTIONS[i].key)
+        {
+            return &OPTIONS[i];
+        }
+    }
+    return NULL;
+}
+
+static bool parse_long(const char *s, long &out, char **end)
+{
+    errno = 0;
+    out = strtol(s, end, 10);
+    return errno == 0 && *end != s;
+}
+
+static int parse_level(const char *s)
+{
+    for (int i = 0; i <= LOG_LEVEL_OFF; i++)
+    {
+        if (strcasecmp(s, LEVEL_NAMES[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int parse_overflow(const char *s)
+{
+    for (int i = 0; i <= Log::OVERFLOW_SPILL; i++)
+    {
+        if (strcasecmp(s, OVERFLOW_NAMES[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool valid_value(const option_def *opt, const string &value)
+{
+    const char *s = value.c_str();
+    char *end;
+    long n;
+    switch (opt->kind)
+    {
+    case OPT_INT:
+        return parse_long(s, n, &end) && *end == '\0' && n >= opt->min && n <= opt->max;
+    case OPT_RATE:
+    {
+        strtod(s, &end);
+        if (end == s)
+        {
+            return false;
+        }
+        if (*end == ':')
+        {
+            return parse_long(end + 1, n, &end) && *end == '\0';
+        }
+        return *end == '\0';
+    }
+    case OPT_LEVEL:
+        return parse_level(s) >= 0;
+    case OPT_OVERFLOW:
+        return parse_overflow(s) >= 0;
+    default:
+        return true;
+    }
+}
+
+// name为配置文件中的key或者对应的环境变量名
+static string bad_value(const option_def *opt, const string &name, const string &value)
+{
+    string err = "bad value for " + name + ": " + value;
+    if (opt->kind == OPT_INT)
+    {
+        err += " (expected " + to_string(opt->min) + ".." + to_string(opt->max) + ")";
+    }
+    return err;
+}
+
+static string trim(const string &s)
+{
+    size_t b = 0;
+    size_t e = s.size();
+    while (b < e && isspace((unsigned char)s[b]))
+    {
+        b++;
+    }
+    while (e > b && isspace((unsigned char)s[e - 1]))
+    {
+        e--;
+    }
+    return s.substr(b, e - b);
+}
+
+static string env_name(const char *key)
+{
+    string name = "WEBSERVER_";
+    for (const char *p = key; *p; p++)
+    {
+        name += (char)toupper((unsigned char)*p);
+    }
+    return name;
+}
+
+config *config::GetInstance()
+{
+    static config instance;
+    return &instance;
+}
+
+bool config::set_override(const char *kv, string &err)
+{
+    const char *eq = strchr(kv, '=');
+    if (eq == NULL)
+    {
+        err = string("expected key=value: ") + kv;
+        return false;
+    }
+    string key = trim(string(kv, eq - kv));
+    string value = trim(eq + 1);
+    const option_def *opt = find_option(key);
+    if (opt == NULL)
+    {
+        err = "unknown option: " + key;
+        return false;
+    }
+    if (!valid_value(opt, value))
+    {
+        err = bad_value(opt, key, value);
+        return false;
+    }
+    m_overrides[key] = value;
+    return true;
+}
+
+// 整个文件都检查通过才返回true
+bool config::parse_file(const char *path, map<string, string> &values, string &err)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        err = string("cannot open ") + path + ": " + strerror(errno);
+        return false;
+    }
+    char line[1024];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp))
+    {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash)
+        {
+            *hash = '\0';
+        }
+        string text = trim(line);
+        if (text.empty())
+        {
+            continue;
+        }
+        size_t eq = text.find('=');
+        string key = trim(text.substr(0, eq));
+        const option_def *opt = eq == string::npos ? NULL : find_option(key);
+        string value = eq == string::npos ? "" : trim(text.substr(eq + 1));
+        if (eq == string::npos)
+        {
+            err = "expected key = value";
+        }
+        else if (opt == NULL)
+        {
+            err = "unknown option " + key;
+        }
+        else if (!valid_value(opt, value))
+        {
+            err = bad_value(opt, key, value);
+        }
+        else
+        {
+            values[key] = value;
+            continue;
+        }
+        err = string(path) + ":" + to_string(lineno) + ": " + err;
+        ok = false;
+    }
+    fclose(fp);
+    return ok;
+}
+
+// 默认值 < 配置文件 < 环境变量 < 命令行
+void config::resolve(const map<string, string> &file_values, map<string, string> &values)
+{
+    for (int i = 0; i < OPTION_NUM; i++)
+    {
+        const char *key = OPTIONS[i].key;
+        values[key] = OPTIONS[i].def;
+        map<string, string>::const_iterator it = file_values.find(key);
+        if (it != file_values.end())
+        {
+            values[key] = it->second;
+        }
+        const char *env = getenv(env_name(key).c_str());
+        if (env && *env)
+        {
+            values[key] = env;
+        }
+        it = m_overrides.find(key);
+        if (it != m_overrides.end())
+        {
+            values[key] = it->second;
+        }
+    }
+}
+
+bool config::load(const char *path, string &err)
+{
+    map<string, string> file_values;
+    if (path && !parse_file(path, file_values, err))
+    {
+        return false;
+    }
+    m_path = path ? path : "";
+    map<string, string> values;
+    resolve(file_values, values);
+    // 环境变量沿用原来的宽松写法，这里也要检查
+    for (int i = 0; i < OPTION_NUM; i++)
+    {
+        if (!valid_value(&OPTIONS[i], values[OPTIONS[i].key]))
+        {
+            err = bad_value(&OPTIONS[i], env_name(OPTIONS[i].key), values[OPTIONS[i].key]);
+            return false;
+        }
+    }
+    m_values.swap(values);
+    m_changed.clear();
+    return true;
+}
+
+bool config::reload(string &err)
+{
+    if (m_path.empty())
+    {
+        err = "no config file";
+        return false;
+    }
+    map<string, string> file_values;
+    if (!parse_file(m_path.c_str(), file_values, err))
+    {
+        return false;
+    }
+    map<string, string> values;
+    resolve(file_values, values);
+    m_changed.clear();
+    for (int i = 0; i < OPTION_NUM; i++)
+    {
+        const option_def &opt = OPTIONS[i];
+        const string &now = values[opt.key];
+        if (now == m_values[opt.key])
+        {
+            map<string, string>::const_iterator it = file_values.find(opt.key);
+            if (it != file_values.end() && it->second != now)
+            {
+                LOG_WARN("config: %s is set by %s or -o, the value in %s is ignored\n",
+                         opt.key, env_name(opt.key).c_str(), m_path.c_str());
+            }
+            continue;
+        }
+        if (opt.reloadable)
+        {
+            LOG_INFO("config: %s = %s\n", opt.key, now.c_str());
+            m_changed[opt.key] = true;
+        }
+        else
+        {
+            // 不能热加载的项保持原值，和正在运行的状态一致
+            LOG_WARN("config: %s changed to %s, takes effect after restart\n", opt.key, now.c_str());
+            values[opt.key] = m_values[opt.key];
+        }
+    }
+    m_values.swap(values);
+    return true;
+}
+
+const char *config::get(const char *key)
+{
+    map<string, string>::iterator it = m_values.find(key);
+    if (it == m_values.end())
+    {
+        // 用了表里没有的key是代码的问题
+        fprintf(stderr, "config: unknown option %s\n", key);
+        abort();
+    }
+    return it->second.c_str();
+}
+
+int config::get_int(const char *key)
+{
+    return atoi(get(key));
+}
+
+int config::get_level(const char *key)
+{
+    return parse_level(get(key));
+}
+
+int config::get_overflow(const char *key)
+{
+    return parse_overflow(get(key));
+}
+
+bool config::changed(const char *key)
+{
+    return m_changed.count(key) > 0;
+}
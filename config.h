@@ -0,0 +1,59 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <map>
+#include <string>
+
+using namespace std;
+
+/************************************************************
+*运行配置：每一项先取默认值，再依次被配置文件、环境变量、命令行覆盖
+*配置文件每行一个"key = value"，#之后为注释；key对应的环境变量是WEBSERVER_加大写的key，
+*例如max_queue对应WEBSERVER_MAX_QUEUE；命令行用-o key=value指定
+*所有项都登记在config.cpp的表里，拼错的key、格式不对或超出取值范围的值让整个文件加载失败，不会只生效一半
+*
+*收到SIGHUP时重读配置文件：标记为可热加载的项（连接池大小、超时、日志级别、限速、缓存大小等）
+*由主线程重新应用，其余的项改了只记一条日志，重启后生效
+*只在主线程中读写，不加锁；get返回的指针在下一次reload之前有效
+************************************************************/
+
+class config
+{
+public:
+    static config *GetInstance();
+
+    // 读入配置文件（path为NULL时只用默认值、环境变量和命令行），失败时err中为原因
+    bool load(const char *path, string &err);
+    // 命令行上的一项"key=value"，在load之前调用
+    bool set_override(const char *kv, string &err);
+    // 重读配置文件，失败时保留原来的配置；成功后changed()反映这次变化的项
+    bool reload(string &err);
+
+    const char *get(const char *key);
+    int get_int(const char *key);
+    // 日志级别：debug/info/warn/error/off
+    int get_level(const char *key);
+    // 日志缓冲区满时的策略：write/drop/sample/block/spill，返回Log::OVERFLOW_POLICY
+    int get_overflow(const char *key);
+    // 上一次reload中值发生了变化
+    bool changed(const char *key);
+
+    const string &path()
+    {
+        return m_path;
+    }
+
+private:
+    config() {}
+
+    bool parse_file(const char *path, map<string, string> &values, string &err);
+    void resolve(const map<string, string> &file_values, map<string, string> &values);
+
+private:
+    string m_path;
+    map<string, string> m_overrides;    // 命令行
+    map<string, string> m_values;       // 生效的值
+    map<string, bool> m_changed;
+};
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef CONN_CACHE_H
+#define CONN_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <list>
+
+#include "locker.h"
+
+/************************************************************
+*连接池中存放空闲连接的地方，取/还连接的常见路径不加锁、不分配内存、不进内核
+*每个线程有一个本地槽位：归还的连接优先放进本线程的槽位，下次直接取回（连接亲和）
+*槽位已被占用或者有线程在等待时，放进全局的无锁栈（Treiber栈）
+*本地和全局都取不到时去偷其他线程槽位里的连接，仍然取不到才加锁限时等待
+*健康检查每次从全局栈取一个连接，检查完放进另一个栈（同样可以被取走），全部检查完再挪回全局栈，
+*检查期间最多只有一个连接不可用
+*
+*T需要有 T* next 成员。放进来过的对象不能delete：无锁栈出栈时别的线程可能还在读它的next，
+*不再使用的对象放进spare栈，建新连接时回收复用
+************************************************************/
+
+using namespace std;
+
+template <class T>
+class conn_cache
+{
+public:
+    static const int MAX_THREADS = 64;     // 超出的线程没有本地槽位，只用全局栈
+
+    conn_cache() : m_idle(0), m_checked(0), m_spare(0), m_count(0), m_waiters(0)
+    {
+        for (int i = 0; i < MAX_THREADS; i++)
+        {
+            m_local[i].conn.store(NULL, memory_order_relaxed);
+        }
+    }
+
+    // 取一个空闲连接，没有则返回NULL，不会阻塞
+    T *get()
+    {
+        int id = thread_slot();
+        if (id >= 0)
+        {
+            T *conn = m_local[id].conn.exchange(NULL, memory_order_acquire);
+            if (conn)
+            {
+                m_count--;
+                return conn;
+            }
+        }
+        T *conn = pop_idle();
+        if (conn)
+        {
+            return conn;
+        }
+        conn = pop_counted(m_checked);
+        if (conn)
+        {
+            return conn;
+        }
+        return steal();
+    }
+
+    // 归还空闲连接
+    void put(T *conn)
+    {
+        int id = thread_slot();
+        if (id >= 0 && m_waiters.load() == 0)
+        {
+            T *expected = NULL;
+            // 先计数再放进去，取走的一方减的时候计数不会是负数
+            m_count++;
+            if (m_local[id].conn.compare_exchange_strong(expected, conn))
+            {
+                // 放进槽位之后再看一次m_waiters：上面检查之后才登记的等待者可能已经扫过空槽位睡下了
+                notify();
+                return;
+            }
+            m_count--;
+        }
+        put_shared(conn);
+    }
+
+    // 归还到全局栈，不占用本线程的槽位（后台线程归还时使用）
+    void put_shared(T *conn)
+    {
+        m_count++;
+        push(m_idle, conn);
+        notify();
+    }
+
+    // 唤醒一个等待者：有连接归还，或者有名额空出来可以新建连接
+    void notify()
+    {
+        if (m_waiters.load() > 0)
+        {
+            m_lock.lock();
+            m_cond.signal();
+            m_lock.unlock();
+        }
+    }
+
+    // 限时等待空闲连接。返回NULL时：timed_out为true表示超时，
+    // 否则表示total已低于max，调用者可以去新建连接
+    T *wait(const struct timespec &deadline, const atomic<int> &total, int max, bool &timed_out)
+    {
+        T *conn = NULL;
+        timed_out = false;
+        m_lock.lock();
+        // 先登记为等待者再检查：归还方先放连接再看m_waiters，两边至少有一方能看到对方
+        m_waiters++;
+        while (true)
+        {
+            conn = get();
+            if (conn || total.load() < max)
+            {
+                break;
+            }
+            if (!m_cond.timewait(m_lock.get(), deadline))
+            {
+                conn = get();
+                timed_out = (conn == NULL && total.load() >= max);
+                break;
+            }
+        }
+        m_waiters--;
+        m_lock.unlock();
+        return conn;
+    }
+
+    // 健康检查：从全局栈取一个还没检查的连接，检查完用put_checked放回，最后调用end_check。
+    // 各线程槽位里的连接不动，保留连接亲和
+    T *take_unchecked()
+    {
+        return pop_idle();
+    }
+
+    void put_checked(T *conn)
+    {
+        m_count++;
+        push(m_checked, conn);
+        notify();
+    }
+
+    // 检查过的连接挪回全局栈
+    void end_check()
+    {
+        T *conn;
+        while ((conn = pop(m_checked)) != NULL)
+        {
+            push(m_idle, conn);
+            notify();
+        }
+    }
+
+    // 取出所有空闲连接（销毁连接池时使用）
+    void drain(list<T *> &out)
+    {
+        T *conn;
+        while ((conn = pop_idle()) != NULL || (conn = pop_counted(m_checked)) != NULL)
+        {
+            out.push_back(conn);
+        }
+        for (int i = 0; i < MAX_THREADS; i++)
+        {
+            conn = m_local[i].conn.exchange(NULL);
+            if (conn)
+            {
+                m_count--;
+                out.push_back(conn);
+            }
+        }
+    }
+
+    // 空闲连接数，取放的同时在变，只是一个近似值
+    int idle_count()
+    {
+        return m_count.load(memory_order_relaxed);
+    }
+
+    T *take_spare() { return pop(m_spare); }
+    void put_spare(T *conn) { push(m_spare, conn); }
+
+private:
+    // 头指针 = 低48位指针 + 高16位版本号，每次修改版本号加一，避免ABA
+    static const uint64_t PTR_MASK = (1ULL << 48) - 1;
+
+    static uint64_t pack(T *p, uint64_t tag) { return ((uint64_t)(uintptr_t)p & PTR_MASK) | (tag << 48); }
+    static T *unpack(uint64_t v) { return (T *)(uintptr_t)(v & PTR_MASK); }
+
+    static void push(atomic<uint64_t> &head, T *node)
+    {
+        uint64_t old = head.load();
+        do
+        {
+            node->next = unpack(old);
+        } while (!head.compare_exchange_weak(old, pack(node, (old >> 48) + 1)));
+    }
+
+    static T *pop(atomic<uint64_t> &head)
+    {
+        uint64_t old = head.load();
+        while (true)
+        {
+            T *node = unpack(old);
+            if (!node)
+            {
+                return NULL;
+            }
+            // 节点不会被释放，这里读到的next即使已经过时，CAS也会因为版本号变化而失败
+            T *next = node->next;
+            if (head.compare_exchange_weak(old, pack(next, (old >> 48) + 1)))
+            {
+                return node;
+            }
+        }
+    }
+
+    T *pop_counted(atomic<uint64_t> &head)
+    {
+        T *conn = pop(head);
+        if (conn)
+        {
+            m_count--;
+        }
+        return conn;
+    }
+
+    T *pop_idle()
+    {
+        return pop_counted(m_idle);
+    }
+
+    T *steal()
+    {
+        for (int i = 0; i < MAX_THREADS; i++)
+        {
+            if (m_local[i].conn.load(memory_order_relaxed))
+            {
+                T *conn = m_local[i].conn.exchange(NULL, memory_order_acquire);
+                if (conn)
+                {
+                    m_count--;
+                    return conn;
+                }
+            }
+        }
+        return NULL;
+    }
+
+    // 线程第一次使用时分配槽位编号
+    static int thread_slot()
+    {
+        static atomic<int> next_id(0);
+        static thread_local int id = next_id.fetch_add(1);
+        return id < MAX_THREADS ? id : -1;
+    }
+
+    // 每个槽位独占一个缓存行，避免不同线程的槽位之间伪共享
+    struct alignas(64) local_slot
+    {
+        atomic<T *> conn;
+    };
+
+    local_slot m_local[MAX_THREADS];
+    atomic<uint64_t> m_idle;        // 全局空闲栈
+    atomic<uint64_t> m_checked;     // 本轮健康检查已经检查过的空闲连接
+    atomic<uint64_t> m_spare;       // 可复用的已关闭对象
+    atomic<int> m_count;            // 空闲连接数（槽位 + 全局栈），取放时增减
+    atomic<int> m_waiters;
+    locker m_lock;
+    cond m_cond;
+};
+
+#endif
@@ -0,0 +1,1022 @@
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+#include "h2_conn.h"
+#include "http_conn.h"
+#include "threadpool.h"
+#include "clock_cache.h"
+#include "rate_limit.h"
+#include "metrics.h"
+#include "log.h"
+
+// 定义在http_conn.cpp
+void modfd(int epollfd, int fd, int ev);
+extern const char* error_429_form;
+extern const char* error_503_form;
+
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const int PREFACE_LEN = 24;
+static const int FRAME_HEADER_LEN = 9;
+static const int FRAME_MAX = 16384;             // SETTINGS_MAX_FRAME_SIZE的默认值，收发的帧都不超过它
+static const size_t MAX_HEADER_LIST = 16384;    // SETTINGS_MAX_HEADER_LIST_SIZE
+static const size_t MAX_HEADER_BLOCK = 65536;   // HEADERS加CONTINUATION的总长度
+static const size_t OUT_HIGH = 65536;           // 发送队列超过这么多字节时先不编新的DATA帧
+static const size_t OUT_MAX = OUT_HIGH * 8;     // 收帧时发送队列超过这么多字节就断开：对端只发不收时，PING/SETTINGS的ACK和WINDOW_UPDATE会一直堆积
+static const size_t SPARE_MAX = 8;              // 每个连接最多留几个用完的http_conn
+static const size_t RESET_MEMORY = 1024;        // 记住最近多少个本端重置的流
+static const int IOV_NUM = 64;
+static const int64_t WINDOW_MAX = 0x7fffffff;
+static const int64_t WINDOW_DEFAULT = 65535;
+
+enum H2_FRAME_TYPE
+{
+    H2_DATA = 0,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION
+};
+
+enum H2_FLAG
+{
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20
+};
+
+enum H2_ERROR
+{
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM
+};
+
+enum H2_SETTING
+{
+    SETTINGS_HEADER_TABLE_SIZE = 1,
+    SETTINGS_ENABLE_PUSH,
+    SETTINGS_MAX_CONCURRENT_STREAMS,
+    SETTINGS_INITIAL_WINDOW_SIZE,
+    SETTINGS_MAX_FRAME_SIZE,
+    SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+bool h2_conn::m_enabled = true;
+int h2_conn::m_max_streams = 100;
+
+static uint32_t get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put_setting(char *p, int key, uint32_t value)
+{
+    p[0] = key >> 8;
+    p[1] = key;
+    put32(p + 2, value);
+}
+
+static void frame_header(char *h, int len, int type, int flags, int id)
+{
+    h[0] = len >> 16;
+    h[1] = len >> 8;
+    h[2] = len;
+    h[3] = type;
+    h[4] = flags;
+    put32(h + 5, id);
+}
+
+// 去掉PADDED帧的填充，填充比帧还长时返回false
+static bool strip_padding(int flags, const unsigned char *&p, int &len)
+{
+    if (!(flags & FLAG_PADDED))
+    {
+        return true;
+    }
+    if (len < 1 || p[0] > len - 1)
+    {
+        return false;
+    }
+    len -= 1 + p[0];
+    p++;
+    return true;
+}
+
+static bool bad_header_name(const string &name)
+{
+    for (size_t i = 0; i < name.size(); i++)
+    {
+        if (name[i] >= 'A' && name[i] <= 'Z')
+        {
+            return true;
+        }
+    }
+    // 连接级的头在HTTP/2中不允许
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+           name == "transfer-encoding" || name == "upgrade";
+}
+
+bool h2_conn::preface(const char *data, int len)
+{
+    return len >= 3 && memcmp(data, PREFACE, len < PREFACE_LEN ? len : PREFACE_LEN) == 0;
+}
+
+h2_conn::h2_conn(http_conn *conn)
+    : m_conn(conn), m_fd(conn->m_sockfd), m_in_flight(0), m_detached(false), m_in_len(0),
+      m_preface(false), m_settings(false), m_cont_id(0), m_cont_end_stream(false), m_last_id(0),
+      m_send_window(WINDOW_DEFAULT), m_initial_window(WINDOW_DEFAULT), m_out_off(0), m_out_bytes(0),
+      m_goaway_sent(false), m_goaway_recv(false)
+{
+    // 切换时读缓冲区里已经有的数据要能整个放进来
+    m_in_cap = std::max(FRAME_HEADER_LEN + FRAME_MAX, http_conn::m_read_buffer_size);
+    m_in = new char[m_in_cap];
+}
+
+h2_conn::~h2_conn()
+{
+    for (map<int, h2_stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        if (it->second->req)
+        {
+            it->second->req->unmap();
+            delete it->second->req;
+        }
+        delete it->second;
+    }
+    for (size_t i = 0; i < m_spare.size(); i++)
+    {
+        delete m_spare[i];
+    }
+    delete [] m_in;
+}
+
+void h2_conn::start(const char *data, int len)
+{
+    if (len > 0)
+    {
+        memcpy(m_in, data, len);
+        m_in_len = len;
+    }
+    // 服务端的连接前言：不用等客户端，直接发SETTINGS
+    char settings[12];
+    put_setting(settings, SETTINGS_MAX_CONCURRENT_STREAMS, m_max_streams);
+    put_setting(settings + 6, SETTINGS_MAX_HEADER_LIST_SIZE, MAX_HEADER_LIST);
+    queue_frame(H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    metrics::GetInstance()->add(COUNTER_H2_CONNS);
+}
+
+bool h2_conn::handle()
+{
+    if (!parse())
+    {
+        return false;
+    }
+    while (true)
+    {
+        int n = m_conn->recv_raw(m_in + m_in_len, m_in_cap - m_in_len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        m_in_len += n;
+        m_conn->m_timer->rotation = 10;
+        if (!parse())
+        {
+            return false;
+        }
+    }
+
+    vector<h2_stream *> done;
+    m_lock.lock();
+    done.swap(m_done);
+    m_lock.unlock();
+    for (size_t i = 0; i < done.size(); i++)
+    {
+        respond(done[i]);
+    }
+
+    // 发送队列发空了就接着编DATA帧，直到socket写不进去或者窗口用完
+    while (true)
+    {
+        produce();
+        int ret = flush();
+        if (ret < 0)
+        {
+            return false;
+        }
+        if (ret == 0 || m_sending.empty() || m_send_window <= 0)
+        {
+            break;
+        }
+    }
+    // 对端发了GOAWAY：已经收到的流处理完就关闭
+    if (m_goaway_recv && m_streams.empty() && m_out.empty())
+    {
+        return false;
+    }
+    rearm();
+    return true;
+}
+
+bool h2_conn::idle()
+{
+    if (!m_goaway_sent)
+    {
+        // 告诉客户端不要再在这个连接上发新请求，已经发来的照常处理
+        char payload[8];
+        put32(payload, m_last_id);
+        put32(payload + 4, H2_NO_ERROR);
+        queue_frame(H2_GOAWAY, 0, 0, payload, sizeof(payload));
+        m_goaway_sent = true;
+    }
+    if (!m_out.empty())
+    {
+        if (flush() < 0)
+        {
+            return true;
+        }
+        rearm();
+    }
+    return m_streams.empty() && m_out.empty();
+}
+
+void h2_conn::detach()
+{
+    m_lock.lock();
+    m_detached = true;
+    m_conn = NULL;
+    bool last = m_in_flight == 0;
+    m_lock.unlock();
+    if (last)
+    {
+        delete this;
+    }
+}
+
+void h2_conn::stream_done(h2_stream *s, bool ok)
+{
+    m_lock.lock();
+    s->ok = ok;
+    m_done.push_back(s);
+    m_in_flight--;
+    bool last = m_detached && m_in_flight == 0;
+    if (!m_detached)
+    {
+        // 主线程重新注册事件时也在锁里看m_done，不会用EPOLLIN覆盖掉这次通知
+        modfd(http_conn::m_epollfd, m_fd, EPOLLIN | EPOLLOUT);
+    }
+    m_lock.unlock();
+    if (last)
+    {
+        delete this;
+    }
+}
+
+void h2_conn::rearm()
+{
+    m_lock.lock();
+    int ev = EPOLLIN;
+    if (!m_done.empty() || !m_out.empty())
+    {
+        ev |= EPOLLOUT;
+    }
+    modfd(http_conn::m_epollfd, m_fd, ev);
+    m_lock.unlock();
+}
+
+// 处理m_in中所有完整的帧，剩下不完整的挪到开头
+bool h2_conn::parse()
+{
+    int pos = 0;
+    if (!m_preface)
+    {
+        if (m_in_len < PREFACE_LEN)
+        {
+            return memcmp(m_in, PREFACE, m_in_len) == 0;
+        }
+        if (memcmp(m_in, PREFACE, PREFACE_LEN) != 0)
+        {
+            return false;
+        }
+        m_preface = true;
+        pos = PREFACE_LEN;
+    }
+    while (m_in_len - pos >= FRAME_HEADER_LEN)
+    {
+        const unsigned char *h = (const unsigned char *)m_in + pos;
+        int len = (h[0] << 16) | (h[1] << 8) | h[2];
+        if (len > FRAME_MAX)
+        {
+            return conn_error(H2_FRAME_SIZE_ERROR);
+        }
+        if (m_in_len - pos < FRAME_HEADER_LEN + len)
+        {
+            break;
+        }
+        pos += FRAME_HEADER_LEN + len;
+        if (!on_frame(h[3], h[4], get32(h + 5) & 0x7fffffff, h + FRAME_HEADER_LEN, len))
+        {
+            return false;
+        }
+        // DATA和HEADERS受OUT_HIGH和并发流数限制，超过OUT_MAX的只能是对端触发的控制帧
+        if (m_out_bytes > OUT_MAX)
+        {
+            return conn_error(H2_ENHANCE_YOUR_CALM);
+        }
+    }
+    memmove(m_in, m_in + pos, m_in_len - pos);
+    m_in_len -= pos;
+    return true;
+}
+
+bool h2_conn::on_frame(int type, int flags, int id, const unsigned char *p, int len)
+{
+    // 头部块没收完时只能收同一个流的CONTINUATION
+    if (m_cont_id != 0 && (type != H2_CONTINUATION || id != m_cont_id))
+    {
+        return conn_error(H2_PROTOCOL_ERROR);
+    }
+    // 客户端的连接前言以SETTINGS结尾
+    if (!m_settings && type != H2_SETTINGS)
+    {
+        return conn_error(H2_PROTOCOL_ERROR);
+    }
+    switch (type)
+    {
+    case H2_DATA:
+        return on_data(flags, id, p, len);
+    case H2_HEADERS:
+        return on_headers(flags, id, p, len);
+    case H2_PRIORITY:
+        // 不按优先级调度，所有流轮流发
+        if (id == 0)
+        {
+            return conn_error(H2_PROTOCOL_ERROR);
+        }
+        return len == 5 || conn_error(H2_FRAME_SIZE_ERROR);
+    case H2_RST_STREAM:
+        return on_rst_stream(id, p, len);
+    case H2_SETTINGS:
+        return on_settings(flags, id, p, len);
+    case H2_PUSH_PROMISE:
+        return conn_error(H2_PROTOCOL_ERROR);
+    case H2_PING:
+        if (id != 0)
+        {
+            return conn_error(H2_PROTOCOL_ERROR);
+        }
+        if (len != 8)
+        {
+            return conn_error(H2_FRAME_SIZE_ERROR);
+        }
+        if (!(flags & FLAG_ACK))
+        {
+            queue_frame(H2_PING, FLAG_ACK, 0, (const char *)p, len);
+        }
+        return true;
+    case H2_GOAWAY:
+        if (id != 0)
+        {
+            return conn_error(H2_PROTOCOL_ERROR);
+        }
+        m_goaway_recv = true;
+        return true;
+    case H2_WINDOW_UPDATE:
+        return on_window_update(id, p, len);
+    case H2_CONTINUATION:
+        if (m_cont_id == 0)
+        {
+            return conn_error(H2_PROTOCOL_ERROR);
+        }
+        if (m_header_block.size() + len > MAX_HEADER_BLOCK)
+        {
+            return conn_error(H2_ENHANCE_YOUR_CALM);
+        }
+        m_header_block.append((const char *)p, len);
+        return (flags & FLAG_END_HEADERS) ? on_header_block() : true;
+    default:
+        // 不认识的帧忽略
+        return true;
+    }
+}
+
+bool h2_conn::on_headers(int flags, int id, const unsigned char *p, int len)
+{
+    if (id == 0 || (id & 1) == 0)
+    {
+        return conn_error(H2_PROTOCOL_ERROR);
+    }
+    if (!strip_padding(flags, p, len))
+    {
+        return conn_error(H2_PROTOCOL_ERROR);
+    }
+    if (flags & FLAG_PRIORITY)
+    {
+        if (len < 5)
+        {
+            return conn_error(H2_FRAME_SIZE_ERROR);
+        }
+        p += 5;
+        len -= 5;
+    }
+    m_header_block.assign((const char *)p, len);
+    m_cont_id = id;
+    m_cont_end_stream = flags & FLAG_END_STREAM;
+    return (flags & FLAG_END_HEADERS) ? on_header_block() : true;
+}
+
+// 一个完整的头部块：新流的请求头，或已有流上请求体后面的trailer
+bool h2_conn::on_header_block()
+{
+    int id = m_cont_id;
+    bool end_stream = m_cont_end_stream;
+    m_cont_id = 0;
+    vector<hpack_header> headers;
+    // 要拒绝的流的头部块也要解码，动态表才能和对端保持一致
+    bool ok = m_hpack.decode((const unsigned char *)m_header_block.data(), m_header_block.size(),
+                             headers, MAX_HEADER_LIST);
+    m_header_block.clear();
+    if (!ok)
+    {
+        return conn_error(H2_COMPRESSION_ERROR);
+    }
+
+    if (!idle_stream(id))
+    {
+        // trailer的内容不用；本端重置过的流是对端发出时还不知道，忽略；
+        // 其他已经关闭的流上再收到HEADERS是连接错误（RFC 9113 5.1）
+        map<int, h2_stream *>::iterator it = m_streams.find(id);
+        if (it == m_streams.end())
+        {
+            return m_reset_ids.count(id) ? true : conn_error(H2_STREAM_CLOSED);
+        }
+        h2_stream *s = it->second;
+        if (s->reset)
+        {
+            // 对端自己发过RST_STREAM的流也是已经关闭的流
+            return m_reset_ids.count(id) ? true : conn_error(H2_STREAM_CLOSED);
+        }
+        if (s->state != H2_RECV || !end_stream)
+        {
+            // 请求已经收完（half-closed remote）时是STREAM_CLOSED，trailer不带END_STREAM是PROTOCOL_ERROR
+            reset_stream(id, s->state != H2_RECV ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+            cancel(s);
+        }
+        else
+        {
+            dispatch(s);
+        }
+        return true;
+    }
+
+    m_last_id = id;
+    if (m_goaway_sent || (int)m_streams.size() >= m_max_streams)
+    {
+        reset_stream(id, H2_REFUSED_STREAM);
+        return true;
+    }
+    h2_stream *s = new h2_stream(this, id, m_initial_window);
+    s->start_ns = metrics::now_ns();
+    bool regular = false;
+    bool bad = false;
+    for (size_t i = 0; i < headers.size() && !bad; i++)
+    {
+        const string &name = headers[i].name;
+        if (!name.empty() && name[0] == ':')
+        {
+            // 伪头部必须在普通头部前面
+            if (regular)
+            {
+                bad = true;
+            }
+            else if (name == ":method")
+            {
+                s->method = headers[i].value;
+            }
+            else if (name == ":path")
+            {
+                s->path = headers[i].value;
+            }
+            else if (name != ":scheme" && name != ":authority")
+            {
+                bad = true;
+            }
+        }
+        else
+        {
+            regular = true;
+            bad = name.empty() || bad_header_name(name);
+        }
+    }
+    if (bad || s->method.empty() || s->path.empty())
+    {
+        delete s;
+        reset_stream(id, H2_PROTOCOL_ERROR);
+        return true;
+    }
+    m_streams[id] = s;
+    if (end_stream)
+    {
+        dispatch(s);
+    }
+    return true;
+}
+
+bool h2_conn::on_data(int flags, int id, const unsigned char *p, int len)
+{
+    if (id == 0)
+    {
+        return conn_error(H2_PROTOCOL_ERROR);
+    }
+    // 流量控制按整个帧算，填充也算
+    int frame_len = len;
+    if (!strip_padding(flags, p, len))
+    {
+        return conn_error(H2_PROTOCOL_ERROR);
+    }
+    if (frame_len > 0)
+    {
+        window_update(0, frame_len);
+    }
+    map<int, h2_stream *>::iterator it = m_streams.find(id);
+    if (it == m_streams.end())
+    {
+        // 已经关闭的流上迟到的数据丢掉
+        return idle_stream(id) ? conn_error(H2_PROTOCOL_ERROR) : true;
+    }
+    h2_stream *s = it->second;
+    if (s->state != H2_RECV)
+    {
+        reset_stream(id, H2_STREAM_CLOSED);
+        cancel(s);
+        return true;
+    }
+    // 请求体最多留读缓冲区那么大，再多也放不进http_conn，由init_stream()回400
+    size_t room = (size_t)http_conn::m_read_buffer_size - s->body.size();
+    s->body.append((const char *)p, std::min((size_t)len, room));
+    if (flags & FLAG_END_STREAM)
+    {
+        dispatch(s);
+    }
+    else if (frame_len > 0)
+    {
+        window_update(id, frame_len);
+    }
+    return true;
+}
+
+bool h2_conn::on_settings(int flags, int id, const unsigned char *p, int len)
+{
+    if (id != 0)
+    {
+        return conn_error(H2_PROTOCOL_ERROR);
+    }
+    if (flags & FLAG_ACK)
+    {
+        return len == 0 || conn_error(H2_FRAME_SIZE_ERROR);
+    }
+    if (len % 6 != 0)
+    {
+        return conn_error(H2_FRAME_SIZE_ERROR);
+    }
+    for (int i = 0; i < len; i += 6)
+    {
+        int key = (p[i] << 8) | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+        if (key == SETTINGS_ENABLE_PUSH && value > 1)
+        {
+            return conn_error(H2_PROTOCOL_ERROR);
+        }
+        if (key == SETTINGS_MAX_FRAME_SIZE && (value < 16384 || value > 16777215))
+        {
+            return conn_error(H2_PROTOCOL_ERROR);
+        }
+        if (key == SETTINGS_INITIAL_WINDOW_SIZE)
+        {
+            if (value > WINDOW_MAX)
+            {
+                return conn_error(H2_FLOW_CONTROL_ERROR);
+            }
+            // 已有的流的窗口按差值调整，可能变成负数
+            int64_t delta = (int64_t)value - m_initial_window;
+            m_initial_window = value;
+            for (map<int, h2_stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+            {
+                h2_stream *s = it->second;
+                s->send_window += delta;
+                if (s->send_window > WINDOW_MAX)
+                {
+                    return conn_error(H2_FLOW_CONTROL_ERROR);
+                }
+                if (s->blocked && s->send_window > 0)
+                {
+                    s->blocked = false;
+                    m_sending.push_back(s);
+                }
+            }
+        }
+        // 其余的项不影响本端：不推送，响应头不用动态表，DATA帧不超过16384字节
+    }
+    m_settings = true;
+    queue_frame(H2_SETTINGS, FLAG_ACK, 0, NULL, 0);
+    return true;
+}
+
+bool h2_conn::on_window_update(int id, const unsigned char *p, int len)
+{
+    if (len != 4)
+    {
+        return conn_error(H2_FRAME_SIZE_ERROR);
+    }
+    int64_t increment = get32(p) & 0x7fffffff;
+    if (id == 0)
+    {
+        if (increment == 0)
+        {
+            return conn_error(H2_PROTOCOL_ERROR);
+        }
+        m_send_window += increment;
+        return m_send_window <= WINDOW_MAX || conn_error(H2_FLOW_CONTROL_ERROR);
+    }
+    map<int, h2_stream *>::iterator it = m_streams.find(id);
+    if (it == m_streams.end())
+    {
+        return idle_stream(id) ? conn_error(H2_PROTOCOL_ERROR) : true;
+    }
+    h2_stream *s = it->second;
+    if (increment == 0 || s->send_window + increment > WINDOW_MAX)
+    {
+        reset_stream(id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        cancel(s);
+        return true;
+    }
+    s->send_window += increment;
+    if (s->blocked && s->send_window > 0)
+    {
+        s->blocked = false;
+        m_sending.push_back(s);
+    }
+    return true;
+}
+
+bool h2_conn::on_rst_stream(int id, const unsigned char *p, int len)
+{
+    if (len != 4)
+    {
+        return conn_error(H2_FRAME_SIZE_ERROR);
+    }
+    if (id == 0)
+    {
+        return conn_error(H2_PROTOCOL_ERROR);
+    }
+    map<int, h2_stream *>::iterator it = m_streams.find(id);
+    if (it == m_streams.end())
+    {
+        return idle_stream(id) ? conn_error(H2_PROTOCOL_ERROR) : true;
+    }
+    cancel(it->second);
+    return true;
+}
+
+// 请求收完：和HTTP/1.1一样过单IP限速和过载检查，超过时只拒绝这个流，连接上的其他请求照常
+void h2_conn::dispatch(h2_stream *s)
+{
+    s->state = H2_PROCESSING;
+    metrics *stats = metrics::GetInstance();
+    stats->add(COUNTER_H2_STREAMS);
+    int budget = s->method == "POST" ? RATE_BACKEND : RATE_STATIC;
+    if (!rate_limiter::GetInstance()->allow(m_conn->get_address()->sin_addr.s_addr, budget))
+    {
+        stats->add(COUNTER_LIMITED_REQUESTS);
+        s->reject = 429;
+        s->ok = true;
+        respond(s);
+        return;
+    }
+
+    if (m_spare.empty())
+    {
+        s->req = new http_conn();
+    }
+    else
+    {
+        s->req = m_spare.back();
+        m_spare.pop_back();
+    }
+    m_lock.lock();
+    m_in_flight++;
+    m_lock.unlock();
+    if (!s->req->init_stream(s))
+    {
+        // 不支持的方法、太长的路径或请求体，和HTTP/1.1一样回400
+        s->req->finish(http_conn::BAD_REQUEST);
+    }
+    else if (http_conn::m_threadpool->overloaded() || !http_conn::m_threadpool->append(s->req))
+    {
+        s->req->reject_busy();
+    }
+}
+
+// 响应已经生成：HEADERS帧马上放进发送队列（不受流量控制），消息体由produce()按窗口分成DATA帧
+void h2_conn::respond(h2_stream *s)
+{
+    if (s->reset)
+    {
+        release(s);
+        return;
+    }
+    if (!s->ok)
+    {
+        reset_stream(s->id, H2_INTERNAL_ERROR);
+        release(s);
+        return;
+    }
+
+    string block;
+    if (s->reject)
+    {
+        hpack_encode_status(block, s->reject);
+        hpack_encode_header(block, HPACK_RETRY_AFTER, "1", 1);
+        s->data = s->reject == 429 ? error_429_form : error_503_form;
+        s->data_len = strlen(s->data);
+    }
+    else
+    {
+        // 状态码和消息体直接取自HTTP/1.1的响应：文件在mmap里，错误页在写缓冲区的响应头后面
+        http_conn *r = s->req;
+        hpack_encode_status(block, r->m_status);
+        if (r->m_iv_count == 2)
+        {
+            s->data = r->m_file_address;
+            s->data_len = r->m_file_stat.st_size;
+        }
+        else
+        {
+            s->data = r->m_write_buf + r->m_body_idx;
+            s->data_len = r->m_write_idx - r->m_body_idx;
+        }
+    }
+    char length[16];
+    int n = snprintf(length, sizeof(length), "%d", s->data_len);
+    hpack_encode_header(block, HPACK_CONTENT_LENGTH, length, n);
+    char date[clock_cache::HTTP_DATE_LEN + 1];
+    clock_cache::GetInstance()->http_date(date);
+    hpack_encode_header(block, HPACK_DATE, date, clock_cache::HTTP_DATE_LEN);
+
+    s->state = H2_SENDING;
+    bool empty = s->data_len == 0;
+    queue_frame(H2_HEADERS, FLAG_END_HEADERS | (empty ? FLAG_END_STREAM : 0), s->id, block.data(), block.size());
+    if (empty)
+    {
+        s->queued_end = true;
+        queue_release(s);
+    }
+    else if (s->send_window > 0)
+    {
+        m_sending.push_back(s);
+    }
+    else
+    {
+        s->blocked = true;
+    }
+}
+
+// 轮流给每个流编一个DATA帧，每帧不超过流的窗口、连接的窗口和16384字节
+void h2_conn::produce()
+{
+    while (m_out_bytes < OUT_HIGH && m_send_window > 0 && !m_sending.empty())
+    {
+        h2_stream *s = m_sending.front();
+        m_sending.pop_front();
+        if (s->send_window <= 0)
+        {
+            s->blocked = true;
+            continue;
+        }
+        int64_t n = s->data_len - s->data_sent;
+        n = std::min(n, std::min(s->send_window, m_send_window));
+        n = std::min(n, (int64_t)FRAME_MAX);
+        bool last = s->data_sent + n == s->data_len;
+        queue_data(s, n, last);
+        s->data_sent += n;
+        s->send_window -= n;
+        m_send_window -= n;
+        if (last)
+        {
+            s->queued_end = true;
+        }
+        else
+        {
+            m_sending.push_back(s);
+        }
+    }
+}
+
+int h2_conn::flush()
+{
+    while (!m_out.empty())
+    {
+        struct iovec iov[IOV_NUM];
+        int cnt = 0;
+        size_t off = m_out_off;
+        for (deque<chunk>::iterator it = m_out.begin(); it != m_out.end() && cnt + 2 <= IOV_NUM; ++it)
+        {
+            if (off < it->frame.size())
+            {
+                iov[cnt].iov_base = (void *)(it->frame.data() + off);
+                iov[cnt++].iov_len = it->frame.size() - off;
+                off = 0;
+            }
+            else
+            {
+                off -= it->frame.size();
+            }
+            if ((size_t)it->data_len > off)
+            {
+                iov[cnt].iov_base = (void *)(it->data + off);
+                iov[cnt++].iov_len = it->data_len - off;
+            }
+            off = 0;
+        }
+        size_t sent = 0;
+        if (cnt > 0)
+        {
+            int n = m_conn->send_iov(iov, cnt);
+            if (n < 0)
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+            metrics::GetInstance()->add(COUNTER_BYTES_SENT, n);
+            sent = n;
+        }
+        // 发完的块出队，带着的流这时才能释放（DATA帧引用着它的mmap）
+        while (!m_out.empty())
+        {
+            chunk &c = m_out.front();
+            size_t size = c.frame.size() + c.data_len;
+            if (m_out_off + sent < size)
+            {
+                m_out_off += sent;
+                break;
+            }
+            sent -= size - m_out_off;
+            m_out_off = 0;
+            m_out_bytes -= size;
+            h2_stream *s = c.release;
+            m_out.pop_front();
+            if (s)
+            {
+                release(s);
+            }
+        }
+    }
+    return 1;
+}
+
+// 控制帧拼在队尾的控制帧后面，一次writev发出
+void h2_conn::queue_frame(int type, int flags, int id, const char *payload, int len)
+{
+    if (m_out.empty() || m_out.back().data != NULL || m_out.back().release != NULL)
+    {
+        m_out.push_back(chunk());
+    }
+    char h[FRAME_HEADER_LEN];
+    frame_header(h, len, type, flags, id);
+    string &frame = m_out.back().frame;
+    frame.append(h, FRAME_HEADER_LEN);
+    if (len > 0)
+    {
+        frame.append(payload, len);
+    }
+    m_out_bytes += FRAME_HEADER_LEN + len;
+}
+
+void h2_conn::queue_data(h2_stream *s, int len, bool last)
+{
+    m_out.push_back(chunk());
+    chunk &c = m_out.back();
+    char h[FRAME_HEADER_LEN];
+    frame_header(h, len, H2_DATA, last ? FLAG_END_STREAM : 0, s->id);
+    c.frame.assign(h, FRAME_HEADER_LEN);
+    c.data = s->data + s->data_sent;
+    c.data_len = len;
+    c.release = last ? s : NULL;
+    m_out_bytes += FRAME_HEADER_LEN + len;
+}
+
+// 空的一块，发送队列走到这里时释放流
+void h2_conn::queue_release(h2_stream *s)
+{
+    m_out.push_back(chunk());
+    m_out.back().release = s;
+}
+
+void h2_conn::window_update(int id, int increment)
+{
+    char payload[4];
+    put32(payload, increment);
+    queue_frame(H2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+void h2_conn::reset_stream(int id, uint32_t code)
+{
+    char payload[4];
+    put32(payload, code);
+    queue_frame(H2_RST_STREAM, 0, id, payload, sizeof(payload));
+    if (m_reset_ids.insert(id).second)
+    {
+        m_reset_order.push_back(id);
+        if (m_reset_order.size() > RESET_MEMORY)
+        {
+            m_reset_ids.erase(m_reset_order.front());
+            m_reset_order.pop_front();
+        }
+    }
+}
+
+// 流被取消：还在收请求的直接释放；在处理的等stream_done()之后在respond()中释放；
+// 在发送的不再编新的帧，等已经放进发送队列的部分发完再释放
+void h2_conn::cancel(h2_stream *s)
+{
+    if (s->reset)
+    {
+        return;
+    }
+    s->reset = true;
+    if (s->state == H2_RECV)
+    {
+        release(s);
+    }
+    else if (s->state == H2_SENDING && !s->queued_end)
+    {
+        m_sending.erase(std::remove(m_sending.begin(), m_sending.end(), s), m_sending.end());
+        s->queued_end = true;
+        queue_release(s);
+    }
+}
+
+void h2_conn::release(h2_stream *s)
+{
+    if (s->req)
+    {
+        s->req->unmap();
+        if (m_spare.size() < SPARE_MAX)
+        {
+            m_spare.push_back(s->req);
+        }
+        else
+        {
+            delete s->req;
+        }
+    }
+    if (s->state == H2_SENDING && !s->reset)
+    {
+        metrics::GetInstance()->observe(STAGE_TOTAL, metrics::now_ns() - s->start_ns);
+    }
+    m_streams.erase(s->id);
+    delete s;
+}
+
+// 连接错误：发GOAWAY，尽量发出去，调用者关闭连接
+bool h2_conn::conn_error(uint32_t code)
+{
+    LOG_DEBUG("h2: fd %d connection error %d\n", m_fd, (int)code);
+    char payload[8];
+    put32(payload, m_last_id);
+    put32(payload + 4, code);
+    queue_frame(H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    m_goaway_sent = true;
+    flush();
+    return false;
+}
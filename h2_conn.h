@@ -0,0 +1,165 @@
+#ifndef H2_CONN_H
+#define H2_CONN_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+
+#include "locker.h"
+#include "hpack.h"
+
+using namespace std;
+
+class http_conn;
+class h2_conn;
+
+/************************************************************
+*HTTP/2（RFC 9113）：一个TCP连接上同时处理多个请求（流），图片多的页面不用再开六个连接
+*明文端口上以连接前言（PRI * HTTP/2.0）开头的新连接（h2c prior knowledge）和HTTPS端口上ALPN选中h2的连接，
+*由http_conn交给h2_conn：收帧、HPACK解码、流量控制、发帧都在主线程中完成
+*
+*每个流的请求由一个不绑定socket的http_conn处理：照旧进线程池，走do_request()、缓存/Redis/MySQL和mmap的静态文件；
+*响应生成后（在工作线程或异步Redis的回调中）放进完成队列，并给连接注册EPOLLOUT，由主线程编成HEADERS和DATA帧
+*
+*发送：同时有响应的流轮流发，每个流每轮最多一帧，大文件不会挡住后面的小图片；
+*DATA帧的内容直接指向mmap的文件或写缓冲区，和帧头一起writev，不拷贝
+*接收：请求体只有登录/注册的表单，收到多少就用WINDOW_UPDATE补多少，不限制对端
+*
+*连接关闭时还有流在线程池里或在等Redis的，h2_conn由最后一个处理完的流释放
+************************************************************/
+
+enum H2_STREAM_STATE
+{
+    H2_RECV = 0,        // 在收请求头和请求体
+    H2_PROCESSING,      // 请求交给了http_conn，还没有响应
+    H2_SENDING          // 响应在发送
+};
+
+struct h2_stream
+{
+    h2_conn *conn;
+    int id;
+    int state;
+    string method;
+    string path;
+    string body;            // 请求体，超过读缓冲区的大小时回400
+    http_conn *req;         // 处理这个请求的http_conn，流结束时还给连接的备用列表
+    int reject;             // 主线程直接拒绝时的状态码（429、503），0表示响应由req生成
+    bool ok;                // req生成响应成功，否则回RST_STREAM
+    bool reset;             // 流已经被取消（对端RST_STREAM或本端出错），不再发送
+    bool blocked;           // 流的发送窗口用完，等对端的WINDOW_UPDATE
+    bool queued_end;        // 带END_STREAM的帧已经放进发送队列
+    int64_t send_window;
+    const char *data;       // 响应的消息体
+    int data_len;
+    int data_sent;          // 已经编成DATA帧的字节数
+    int64_t start_ns;       // 收到请求头的时间
+
+    h2_stream(h2_conn *c, int stream_id, int64_t window)
+        : conn(c), id(stream_id), state(H2_RECV), req(NULL), reject(0), ok(false), reset(false), blocked(false),
+          queued_end(false), send_window(window), data(NULL), data_len(0), data_sent(0), start_ns(0) {}
+};
+
+class h2_conn
+{
+public:
+    static bool m_enabled;          // 配置项http2，可热加载，对之后的新连接生效
+    static int m_max_streams;       // SETTINGS_MAX_CONCURRENT_STREAMS
+
+    // data是连接前言或它的开头（至少3个字节，HTTP/1.1没有以"PRI"开头的方法）
+    static bool preface(const char *data, int len);
+
+    explicit h2_conn(http_conn *conn);
+    ~h2_conn();
+
+    // 主线程：切换到HTTP/2时调用一次，data是已经读到的字节（prior knowledge时是连接前言的开头）
+    void start(const char *data, int len);
+    // 主线程：连接上有读写事件时调用，读完socket上的数据、处理帧、发出已完成的响应并重新注册事件
+    // 返回false时调用者关闭连接
+    bool handle();
+    // 停机排空：第一次调用时发GOAWAY，之后不再接受新的流；没有流也没有没发完的数据时返回true
+    bool idle();
+    // 连接关闭时由http_conn调用，之后不能再用这个对象；没有流在处理时立即释放
+    void detach();
+
+    // 工作线程或主线程：流的响应已经生成，ok为false表示生成失败
+    void stream_done(h2_stream *s, bool ok);
+
+private:
+    // 发送队列中的一块：帧头（或整个控制帧）加上直接引用的消息体
+    struct chunk
+    {
+        string frame;
+        const char *data;
+        int data_len;
+        h2_stream *release;     // 这一块发完之后释放的流
+
+        chunk() : data(NULL), data_len(0), release(NULL) {}
+    };
+
+    bool parse();
+    bool on_frame(int type, int flags, int id, const unsigned char *p, int len);
+    bool on_headers(int flags, int id, const unsigned char *p, int len);
+    bool on_header_block();
+    bool on_data(int flags, int id, const unsigned char *p, int len);
+    bool on_settings(int flags, int id, const unsigned char *p, int len);
+    bool on_window_update(int id, const unsigned char *p, int len);
+    bool on_rst_stream(int id, const unsigned char *p, int len);
+
+    void dispatch(h2_stream *s);    // 请求收完，交给http_conn
+    void respond(h2_stream *s);     // 响应已经生成，放HEADERS帧，消息体等produce()
+    void produce();                 // 按流量控制把DATA帧放进发送队列
+    int flush();                    // 返回1发完，0要等可写，-1出错
+    void rearm();
+
+    void queue_frame(int type, int flags, int id, const char *payload, int len);
+    void queue_data(h2_stream *s, int len, bool last);
+    void queue_release(h2_stream *s);
+    void window_update(int id, int increment);
+    void reset_stream(int id, uint32_t code);
+    void cancel(h2_stream *s);
+    void release(h2_stream *s);
+    bool conn_error(uint32_t code);
+    bool idle_stream(int id)
+    {
+        return id > m_last_id;
+    }
+
+private:
+    http_conn *m_conn;          // detach()之后为NULL
+    int m_fd;
+
+    locker m_lock;              // 保护以下三项，工作线程在stream_done中访问
+    vector<h2_stream *> m_done; // 响应已经生成、主线程还没处理的流
+    int m_in_flight;            // 交给http_conn还没有stream_done的流
+    bool m_detached;
+
+    char *m_in;                 // 收到还没处理的字节，至少放得下一个最大的帧
+    int m_in_len;
+    int m_in_cap;
+    bool m_preface;             // 已经收到连接前言
+    bool m_settings;            // 已经收到对端的第一个SETTINGS
+    hpack_decoder m_hpack;
+    string m_header_block;      // HEADERS加CONTINUATION的头部块
+    int m_cont_id;              // 头部块没收完的流，0表示没有
+    bool m_cont_end_stream;
+
+    map<int, h2_stream *> m_streams;    // 没有结束的流
+    set<int> m_reset_ids;       // 本端发过RST_STREAM的流，对端在途的帧可以忽略；只记最近的RESET_MEMORY个
+    deque<int> m_reset_order;
+    int m_last_id;              // 收到过的最大流编号
+    int64_t m_send_window;      // 连接的发送窗口
+    int64_t m_initial_window;   // 对端的SETTINGS_INITIAL_WINDOW_SIZE，新流的发送窗口
+    deque<h2_stream *> m_sending;       // 有数据可发、窗口没用完的流，轮流发
+    deque<chunk> m_out;         // 发送队列
+    size_t m_out_off;           // 第一块已经发出去的字节
+    size_t m_out_bytes;         // 发送队列中的字节数，超过一定量时先不编新的DATA帧
+    vector<http_conn *> m_spare;        // 用完的http_conn，下一个流接着用
+    bool m_goaway_sent;
+    bool m_goaway_recv;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "log.h"
+
+static const int HANDOFF_MAX_FDS = 4;
+
+static bool fill_addr(const char *path, struct sockaddr_un &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        LOG_ERROR("handoff: socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    if (!fill_addr(path, addr))
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    // 旧进程刚把监听fd交给我们，这个路径上的socket文件属于它，删掉重建
+    unlink(path);
+    mode_t old_mask = umask(0077);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (ret < 0 || listen(fd, 1) < 0)
+    {
+        LOG_ERROR("handoff: cannot listen on %s, errno %d\n", path, errno);
+        close(fd);
+        return -1;
+    }
+    LOG_INFO("handoff: waiting for upgrades on %s\n", path);
+    return fd;
+}
+
+bool handoff_send(int handoff_fd, const int *fds, const char *roles, int n)
+{
+    int conn = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0)
+    {
+        return false;
+    }
+    if (n > HANDOFF_MAX_FDS)
+    {
+        n = HANDOFF_MAX_FDS;
+    }
+
+    struct iovec iov;
+    iov.iov_base = (void *)roles;
+    iov.iov_len = n;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+    // 对方连上之后立刻在等这条消息，几个字节加控制信息不会发不出去
+    bool ok = sendmsg(conn, &msg, MSG_NOSIGNAL) == n;
+    if (!ok)
+    {
+        LOG_ERROR("handoff: sendmsg failed, errno %d\n", errno);
+    }
+    close(conn);
+    return ok;
+}
+
+int handoff_receive(const char *path, int *fds, char *roles, int max)
+{
+    struct sockaddr_un addr;
+    if (!fill_addr(path, addr))
+    {
+        return 0;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        // 没有旧进程（文件不存在或者是上次残留的），正常启动
+        close(fd);
+        return 0;
+    }
+    // 旧进程在主循环里处理升级请求，给它5秒
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char data[HANDOFF_MAX_FDS];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int n = 0;
+    int tagged = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (tagged > 0)
+    {
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *received = (int *)CMSG_DATA(cmsg);
+            for (int i = 0; i < count; i++)
+            {
+                if (n < max)
+                {
+                    // 旧版本只发一个'L'，后面的fd按固定顺序是管理端口
+                    roles[n] = n < tagged && tagged > 1 ? data[n] : (n == 0 ? HANDOFF_LISTEN : HANDOFF_ADMIN);
+                    fds[n++] = received[i];
+                }
+                else
+                {
+                    close(received[i]);
+                }
+            }
+        }
+    }
+    else
+    {
+        LOG_ERROR("handoff: no listening socket from %s, errno %d\n", path, errno);
+    }
+    close(fd);
+    return n;
+}
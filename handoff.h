@@ -0,0 +1,27 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+/************************************************************
+*热升级时在新旧进程之间传递监听socket
+*旧进程在一个UNIX域socket路径上等待；新进程启动、初始化完后端之后连上去，
+*旧进程用SCM_RIGHTS把服务端口（以及管理端口、HTTPS端口）的监听fd发过来，然后停止accept、排空已有连接后退出
+*消息正文是每个fd一个字节的用途标记（HANDOFF_LISTEN等），只发了一个'L'的旧版本按"服务端口、管理端口"的顺序理解
+*两个进程共用同一个内核监听队列，已经完成握手但还没accept的连接由新进程接着取，不会被重置
+*UNIX域socket文件的权限为0600，只有同一个用户的进程能要走监听fd
+************************************************************/
+
+// fd的用途
+const char HANDOFF_LISTEN = 'L';    // 服务端口
+const char HANDOFF_ADMIN = 'A';     // 管理端口
+const char HANDOFF_TLS = 'T';       // HTTPS端口
+
+// 在path上监听升级请求（先删除残留的socket文件），返回非阻塞的fd，失败返回-1
+int handoff_listen(const char *path);
+
+// 接受一个升级请求，把fds中的n个fd连同各自的用途roles发给对方，成功返回true
+bool handoff_send(int handoff_fd, const int *fds, const char *roles, int n);
+
+// 连上path上的旧进程并收下它的监听fd和用途，最多max个，返回收到的个数；没有旧进程时返回0
+int handoff_receive(const char *path, int *fds, char *roles, int max);
+
+#endif
@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "hpack.h"
+
+// RFC 7541附录A的静态表，下标从1开始
+static const char *STATIC_TABLE[][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static const uint32_t STATIC_TABLE_LEN = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+
+// RFC 7541附录B的Huffman编码，第256项是EOS
+static const uint32_t HUFFMAN_CODES[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+static const uint8_t HUFFMAN_BITS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// Huffman解码用的二叉树，第一次用到时按上表建好；叶子的sym为符号，内部节点为-1
+struct huffman_tree
+{
+    short next[2 * 257][2];
+    short sym[2 * 257];
+
+    huffman_tree()
+    {
+        memset(next, 0, sizeof(next));
+        sym[0] = -1;
+        int nodes = 1;
+        for (int s = 0; s < 257; s++)
+        {
+            int node = 0;
+            for (int b = HUFFMAN_BITS[s] - 1; b >= 0; b--)
+            {
+                int bit = (HUFFMAN_CODES[s] >> b) & 1;
+                if (next[node][bit] == 0)
+                {
+                    sym[nodes] = -1;
+                    next[node][bit] = nodes++;
+                }
+                node = next[node][bit];
+            }
+            sym[node] = s;
+        }
+    }
+
+    static const huffman_tree &get()
+    {
+        static const huffman_tree tree;
+        return tree;
+    }
+};
+
+// 末尾不足一个符号的位必须是EOS的前缀（全1）且少于8位，中间出现EOS算错误
+static bool huffman_decode(const unsigned char *p, uint32_t len, string &out)
+{
+    const huffman_tree &tree = huffman_tree::get();
+    int node = 0;
+    int pending = 0;        // 上一个符号之后读了几位
+    bool all_ones = true;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        for (int b = 7; b >= 0; b--)
+        {
+            int bit = (p[i] >> b) & 1;
+            node = tree.next[node][bit];
+            if (node == 0)
+            {
+                return false;
+            }
+            pending++;
+            all_ones = all_ones && bit;
+            if (tree.sym[node] >= 0)
+            {
+                if (tree.sym[node] == 256)
+                {
+                    return false;
+                }
+                out += (char)tree.sym[node];
+                node = 0;
+                pending = 0;
+                all_ones = true;
+            }
+        }
+    }
+    return pending < 8 && all_ones;
+}
+
+// prefix位前缀的整数，超过2^31的值当作错误
+static bool decode_int(const unsigned char *&p, const unsigned char *end, int prefix, uint32_t &value)
+{
+    if (p >= end)
+    {
+        return false;
+    }
+    uint32_t max = (1u << prefix) - 1;
+    uint64_t v = *p++ & max;
+    if (v < max)
+    {
+        value = v;
+        return true;
+    }
+    for (int shift = 0; p < end && shift <= 28; shift += 7)
+    {
+        unsigned char b = *p++;
+        v += (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+        {
+            value = v;
+            return v <= 0x7fffffff;
+        }
+    }
+    return false;
+}
+
+static bool decode_string(const unsigned char *&p, const unsigned char *end, string &out)
+{
+    if (p >= end)
+    {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    uint32_t len;
+    if (!decode_int(p, end, 7, len) || len > (uint32_t)(end - p))
+    {
+        return false;
+    }
+    if (huffman)
+    {
+        out.clear();
+        if (!huffman_decode(p, len, out))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        out.assign((const char *)p, len);
+    }
+    p += len;
+    return true;
+}
+
+bool hpack_decoder::decode(const unsigned char *p, int len, vector<hpack_header> &headers, size_t max_list)
+{
+    const unsigned char *end = p + len;
+    size_t list_size = 0;
+    while (p < end)
+    {
+        unsigned char c = *p;
+        uint32_t index;
+        hpack_header h;
+        if (c & 0x80)
+        {
+            // 索引：名字和值都在表里
+            if (!decode_int(p, end, 7, index) || !lookup(index, h))
+            {
+                return false;
+            }
+        }
+        else if ((c & 0xe0) == 0x20)
+        {
+            // 动态表大小更新
+            if (!decode_int(p, end, 5, index) || index > TABLE_SIZE)
+            {
+                return false;
+            }
+            m_max_size = index;
+            evict(m_max_size);
+            continue;
+        }
+        else
+        {
+            // 字面量：01加入动态表，0000不加入，0001不加入且中间节点也不能加入
+            bool indexing = (c & 0xc0) == 0x40;
+            if (!decode_int(p, end, indexing ? 6 : 4, index))
+            {
+                return false;
+            }
+            if (index == 0 ? !decode_string(p, end, h.name) : !lookup(index, h))
+            {
+                return false;
+            }
+            if (!decode_string(p, end, h.value))
+            {
+                return false;
+            }
+            if (indexing)
+            {
+                insert(h);
+            }
+        }
+        list_size += h.name.size() + h.value.size() + 32;
+        if (list_size > max_list)
+        {
+            return false;
+        }
+        headers.push_back(h);
+    }
+    return true;
+}
+
+bool hpack_decoder::lookup(uint32_t index, hpack_header &h)
+{
+    if (index == 0)
+    {
+        return false;
+    }
+    if (index <= STATIC_TABLE_LEN)
+    {
+        h.name = STATIC_TABLE[index - 1][0];
+        h.value = STATIC_TABLE[index - 1][1];
+        return true;
+    }
+    index -= STATIC_TABLE_LEN + 1;
+    if (index >= m_table.size())
+    {
+        return false;
+    }
+    h.name = m_table[index].name;
+    h.value = m_table[index].value;
+    return true;
+}
+
+// 比上限还大的项不加入，而且会清空整个表
+void hpack_decoder::insert(const hpack_header &h)
+{
+    size_t size = h.name.size() + h.value.size() + 32;
+    if (size > m_max_size)
+    {
+        evict(0);
+        return;
+    }
+    evict(m_max_size - size);
+    m_table.push_front(h);
+    m_size += size;
+}
+
+void hpack_decoder::evict(size_t limit)
+{
+    while (m_size > limit)
+    {
+        m_size -= m_table.back().name.size() + m_table.back().value.size() + 32;
+        m_table.pop_back();
+    }
+}
+
+static void encode_int(string &out, unsigned char flags, int prefix, uint32_t value)
+{
+    uint32_t max = (1u << prefix) - 1;
+    if (value < max)
+    {
+        out += (char)(flags | value);
+        return;
+    }
+    out += (char)(flags | max);
+    value -= max;
+    while (value >= 0x80)
+    {
+        out += (char)(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+void hpack_encode_status(string &out, int status)
+{
+    // 静态表第8到14项
+    static const int STATUS_CODES[] = {200, 204, 206, 304, 400, 404, 500};
+    for (int i = 0; i < (int)(sizeof(STATUS_CODES) / sizeof(STATUS_CODES[0])); i++)
+    {
+        if (STATUS_CODES[i] == status)
+        {
+            encode_int(out, 0x80, 7, HPACK_STATUS + i);
+            return;
+        }
+    }
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%d", status);
+    hpack_encode_header(out, HPACK_STATUS, buf, len);
+}
+
+void hpack_encode_header(string &out, int name_index, const char *value, int len)
+{
+    encode_int(out, 0x00, 4, name_index);
+    encode_int(out, 0x00, 7, len);
+    out.append(value, len);
+}
@@ -0,0 +1,62 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+using namespace std;
+
+/************************************************************
+*HPACK（RFC 7541）：HTTP/2的头部压缩
+*解码器维护对端编码器的动态表，每个HTTP/2连接一个，只在主线程中使用；字符串支持Huffman编码
+*动态表的上限是SETTINGS_HEADER_TABLE_SIZE的默认值4096，对端可以用Dynamic Table Size Update调小
+*
+*编码响应头时只用静态表和不加索引的字面量，不维护自己的动态表：
+*响应头只有:status、content-length、date几项，值大多每次不同，加索引省不了多少字节
+************************************************************/
+
+struct hpack_header
+{
+    string name;
+    string value;
+};
+
+// 编码响应头时用到的静态表下标
+enum HPACK_STATIC_INDEX
+{
+    HPACK_STATUS = 8,
+    HPACK_CONTENT_LENGTH = 28,
+    HPACK_DATE = 33,
+    HPACK_RETRY_AFTER = 53
+};
+
+class hpack_decoder
+{
+public:
+    static const size_t TABLE_SIZE = 4096;
+
+    hpack_decoder() : m_size(0), m_max_size(TABLE_SIZE) {}
+
+    // 解码一个完整的头部块，追加到headers；解码后的头部按RFC的算法（名字加值再加32）超过max_list时也失败
+    // 失败时动态表已经和对端不一致，调用者要以COMPRESSION_ERROR关闭连接
+    bool decode(const unsigned char *p, int len, vector<hpack_header> &headers, size_t max_list);
+
+private:
+    bool lookup(uint32_t index, hpack_header &h);
+    void insert(const hpack_header &h);
+    void evict(size_t limit);
+
+private:
+    deque<hpack_header> m_table;    // 动态表，新加的在前面
+    size_t m_size;                  // 动态表当前的大小
+    size_t m_max_size;              // 对端设置的上限，不超过TABLE_SIZE
+};
+
+// 响应状态码，常见的用静态表中的完整项，只占一个字节
+void hpack_encode_status(string &out, int status);
+// 名字取静态表第name_index项，值为不用Huffman编码的字面量，不加入动态表
+void hpack_encode_header(string &out, int name_index, const char *value, int len);
+
+#endif
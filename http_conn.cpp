@@ -2,6 +2,11 @@
 #include "threadpool.h"
 #include "log.h"
 #include "redis_pool.h"
+#include "user_cache.h"
+#include "redis_async.h"
+#include "capture.h"
+#include "rate_limit.h"
+#include "h2_conn.h"
 
 #include <mysql/mysql.h>
 #include <fstream>
@@ -17,11 +22,19 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_429_title = "Too Many Requests";
+const char* error_429_form = "You have sent too many requests, please slow down.\n";
+const char* error_503_title = "Service Unavailable";
+const char* error_503_form = "The server is busy, please try again later.\n";
 // 网站的根目录
-const char* doc_root = "/home/ltl/testLinux_code/myWebServer/4/root/";
+const char* doc_root = "./root/";
 
 int http_conn::m_user_count = 0;
+std::atomic<bool> http_conn::m_draining(false);
+int http_conn::m_read_buffer_size = 2048;
+int http_conn::m_write_buffer_size = 1024;
 int http_conn::m_epollfd = -1;
+threadpool<http_conn>* http_conn::m_threadpool = NULL;
 locker m_lock;
 // map<string, string> user;
 
@@ -105,19 +118,36 @@ void http_conn::init(int sockfd, const sockaddr_in &address)
 {
     m_sockfd = sockfd;
     m_address = address;
+    m_async_seq++;
     // 避免TIME_WAIT状态：调试时使用
     int reuse = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     addfd(m_epollfd, sockfd);
     m_user_count++;
+    if (traffic_capture::GetInstance()->enabled())
+    {
+        m_conn_id = traffic_capture::GetInstance()->next_conn_id();
+        m_capture_first = true;
+    }
+    m_new_conn = true;
+    m_ssl = NULL;
+    m_tls_ready = false;
+    m_ktls_send = false;
+    m_h2 = NULL;
+    m_served = false;
 
     init();
 }
 
 void http_conn::init()
 {
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
+    if (m_read_buf == NULL)
+    {
+        m_read_buf = new char[m_read_buffer_size];
+        m_write_buf = new char[m_write_buffer_size];
+    }
+    memset(m_read_buf, '\0', m_read_buffer_size);
+    memset(m_write_buf, '\0', m_write_buffer_size);
     memset(m_read_file, '\0', FILENAME_LEN);
 
     m_read_idx = 0;
@@ -140,6 +170,13 @@ void http_conn::init()
     bytes_have_send = 0;
     m_state = 0;
     improv = 0;
+    m_resume_sql = false;
+    m_resume_file = false;
+    m_start_ns = 0;
+    m_request_ns = 0;
+    m_captured = false;
+    m_capture_head.clear();
+    m_rate_checked = false;
 }
 
 // read---------------------
@@ -148,16 +185,23 @@ void http_conn::init()
 bool http_conn::read()
 {
     // 判断读缓冲区是否已满
-    if(m_read_idx >= READ_BUFFER_SIZE)
+    if(m_read_idx >= m_read_buffer_size)
     {
         return false;
     }
 
+    if (m_start_ns == 0)
+    {
+        m_start_ns = metrics::now_ns();
+        m_new_conn = false;
+    }
+
     int bytes_read = 0;
+    int read_from = m_read_idx;
     // 循环读取
     while (1)
     {
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        bytes_read = recv_raw(m_read_buf + m_read_idx, m_read_buffer_size - m_read_idx);
         //判断是否出错
         if (bytes_read == -1)
         {
@@ -180,12 +224,45 @@ bool http_conn::read()
         }
         // 都没问题则表示读取成功，m_read_idx记录最新的已经读入的客户端数据的最后一个字节的下一个位置
         m_read_idx += bytes_read;
+        // 缓冲区满了先交给调用者：一开始就发来一大串帧的HTTP/2连接在这里切换，剩下的由h2_conn接着读；
+        // HTTP/1.1的请求放不下时下一次read()返回false
+        if (m_read_idx == m_read_buffer_size)
+        {
+            break;
+        }
         // 循环读取
     }
     m_timer->rotation = 10;
+    if (!m_captured && traffic_capture::GetInstance()->enabled())
+    {
+        capture_request(read_from);
+    }
     return true;
 }
 
+// 请求头收完（读到空行）时录制一次，之后的消息体和同一请求的后续数据不再处理
+// 工作线程解析时会把m_read_buf中的\r\n改成\0，请求头分几次到达时先把新读到的原文拷出来
+void http_conn::capture_request(int from)
+{
+    size_t scan = m_capture_head.size() > 3 ? m_capture_head.size() - 3 : 0;     // 空行可能跨两次读取
+    m_capture_head.append(m_read_buf + from, m_read_idx - from);
+    size_t end = m_capture_head.find("\r\n\r\n", scan);
+    if (end == string::npos)
+    {
+        if (m_capture_head.size() >= (size_t)m_read_buffer_size)
+        {
+            m_captured = true;
+            m_capture_head.clear();
+        }
+        return;
+    }
+    traffic_capture::GetInstance()->record(m_conn_id, m_capture_first, m_start_ns, metrics::now_ns(),
+                                           m_capture_head.data(), end + 4);
+    m_capture_first = false;
+    m_captured = true;
+    m_capture_head.clear();
+}
+
 // 从状态机，用于分析出一行内容
 // 返回值为行的读取状态，有LINE_OK,LINE_BAD,LINE_OPEN
 http_conn::LINE_STATE http_conn::parse_line()
@@ -336,7 +413,7 @@ http_conn::HTTP_CODE http_conn::parse_header(char* text)
     }
     else 
     {
-        Log::get_instance()->write_log(3, "oop! unknow header %s\n", text);
+        LOG_ERROR("oop! unknow header %s\n", text);
     }
     return NO_REQUEST;
 }
@@ -378,7 +455,7 @@ http_conn::HTTP_CODE http_conn::do_request()
 
         // 将用户名和密码提取出来
         // user = 123&passwd=123
-        char name[100], password[100];
+        char *name = m_user_name, *password = m_user_passwd;
         int i;
         for (i = 5; m_string[i] != '&'; i++) {
             name[i - 5] = m_string[i];
@@ -393,135 +470,145 @@ http_conn::HTTP_CODE http_conn::do_request()
 
         if (*(p + 1) == '3') {
             // 从数据库连接池中取一个连接
-            MYSQL *mysql = NULL;
-            connectionRAII mysqlconn(&mysql, connection_pool::GetInstance());
+            sql_conn *sql = NULL;
+            connectionRAII mysqlconn(&sql, connection_pool::GetInstance());
 
             // 如果是注册，先检测数据库中是否有重名的
             // 没有重名的，进行增加数据
-            if (!mysql) {
-                Log::get_instance()->write_log(3, "mysql error: %s", mysql_error(mysql));
-            }
-            char *sql_insert = (char *)malloc(sizeof(char) * 200);
-            strcpy(sql_insert, "INSERT INTO user(username, passwd) VALUES(");
-            strcat(sql_insert, "'");
-            strcat(sql_insert, name);
-            strcat(sql_insert, "', '");
-            strcat(sql_insert, password);
-            strcat(sql_insert, "')");
-            Log::get_instance()->write_log(1, sql_insert);
-
-            // 在user表中检索username，passwd数据，浏览器端输入
-            if (mysql_query(mysql, "SELECT username,passwd FROM user"))
-            {
-                LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
-            }
-
-            // 从表中检索完整的结果集
-            MYSQL_RES *result = mysql_store_result(mysql);
-
-            // 返回结果集中的列数
-            int num_fields = mysql_num_fields(result);
-
-            // 返回所有字段结构的数组
-            MYSQL_FIELD *fields = mysql_fetch_fields(result);
-
-            // 从结果集中获取下一行，一一比对
-            bool password_is_true = false;
-            while (MYSQL_ROW row = mysql_fetch_row(result))
-            {
-                string temp1(row[0]);
-                string temp2(row[1]);
-                if (temp1 == name && temp2 == password) {
+            if (!sql) {
+                LOG_ERROR("mysql error: no connection\n");
+                strcpy(m_url, "/registerError.html");
+            } else {
+                // username上有唯一索引，一次点查即可判断是否重名；并发注册同名用户时由唯一索引兜底
+                char sql_passwd[100];
+                if (sql->find_user(name, sql_passwd, sizeof(sql_passwd)) == 0
+                    && sql->insert_user(name, password) == 0) {
+                    // 写穿：MySQL写成功后同步写入Redis和进程内缓存
                     RedisPool::GetInstance()->setString(name, password);
-                    password_is_true = true;
-                    strcpy(m_url, "/welcome.html");
-                    break;
-                }
-            }
-            if (!password_is_true) {
-                m_lock.lock();
-                
-                int res = mysql_query(mysql, sql_insert);
-                // user.insert(pair<string, string>(name, password));
-                m_lock.unlock();
-
-                if (!res) {
+                    user_cache::GetInstance()->put(name, password);
                     strcpy(m_url, "/log.html");
                 } else {
                     strcpy(m_url, "/registerError.html");
                 }
-            } else {
-                strcpy(m_url, "/registerError.html");
             }
-
-            // if (user.find(name) == user.end()) {
-            //     m_lock.lock();
-                
-            //     int res = mysql_query(mysql, sql_insert);
-            //     user.insert(pair<string, string>(name, password));
-            //     m_lock.unlock();
-
-            //     if (!res) {
-            //         strcpy(m_url, "/log.html");
-            //     } else {
-            //         strcpy(m_url, "/registerError.html");
-            //     }
-            // } else {
-            //     strcpy(m_url, "/registerError.html");
-            // }
-            
-            
         } 
         // 如果是登录，直接判断
         // 若浏览器端输入的用户名和密码在表中可以查找到，返回1，否则返回0
         else if (*(p + 1) == '2') {
-            string redis_password = RedisPool::GetInstance()->getString(name);
-            if (redis_password == password) {
-                strcpy(m_url, "/welcome.html");
-            } else if (redis_password == "error") {
-
-            } else if (redis_password == "") {
-                // 先从连接池中取一个连接
-                MYSQL *mysql = NULL;
-                connectionRAII mysqlconn(&mysql, connection_pool::GetInstance());
-
-                // 在user表中检索username，passwd数据，浏览器端输入
-                if (mysql_query(mysql, "SELECT username,passwd FROM user"))
-                {
-                    LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
-                }
+            if (!do_login()) {
+                return ASYNC_REQUEST;
+            }
+        }
+    }
 
-                // 从表中检索完整的结果集
-                MYSQL_RES *result = mysql_store_result(mysql);
+    return do_file();
+}
 
-                // 返回结果集中的列数
-                int num_fields = mysql_num_fields(result);
+http_conn::HTTP_CODE http_conn::timed_request()
+{
+    int64_t start = metrics::now_ns();
+    HTTP_CODE code = do_request();
+    m_request_ns = metrics::now_ns() - start;
+    metrics::GetInstance()->observe(STAGE_REQUEST, m_request_ns);
+    return code;
+}
 
-                // 返回所有字段结构的数组
-                MYSQL_FIELD *fields = mysql_fetch_fields(result);
+// 登录检测：依次查进程内缓存、Redis、MySQL，根据结果设置m_url
+// 开启了异步Redis时，缓存未命中会发出异步GET并返回false，由主线程收到回复后调用on_redis_reply继续
+bool http_conn::do_login()
+{
+    // 先查进程内缓存，热点用户的重复登录不再离开进程
+    char cached_passwd[user_cache::PASSWD_LEN];
+    if (user_cache::GetInstance()->get(m_user_name, cached_passwd, sizeof(cached_passwd))) {
+        if (strcmp(cached_passwd, m_user_passwd) == 0) {
+            strcpy(m_url, "/welcome.html");
+        } else {
+            strcpy(m_url, "/logError.html");
+        }
+        return true;
+    }
 
-                // 从结果集中获取下一行，一一比对
-                bool password_is_true = false;
-                while (MYSQL_ROW row = mysql_fetch_row(result))
-                {
-                    string temp1(row[0]);
-                    string temp2(row[1]);
-                    if (temp1 == name && temp2 == password) {
-                        RedisPool::GetInstance()->setString(name, password);
-                        password_is_true = true;
-                        strcpy(m_url, "/welcome.html");
-                        break;
-                    }
-                }
-                if (!password_is_true) {
-                    strcpy(m_url, "/logError.html");
-                }
-            } else {
-                strcpy(m_url, "/logError.html");
+    if (redis_async::GetInstance()->enabled()) {
+        // 近端缓存命中时不需要发请求
+        string redis_password;
+        if (RedisPool::GetInstance()->near_get(m_user_name, redis_password)) {
+            if (check_redis_password(redis_password)) {
+                do_login_sql();
             }
-            
+            return true;
         }
+        redis_async::GetInstance()->get(m_user_name, this, m_async_seq);
+        return false;
+    }
+
+    if (check_redis_password(RedisPool::GetInstance()->getString(m_user_name))) {
+        do_login_sql();
+    }
+    return true;
+}
+
+// 根据Redis中的密码设置m_url，Redis中没有该用户或Redis不可用时返回true，表示还需要查MySQL
+bool http_conn::check_redis_password(const string &redis_password)
+{
+    if (redis_password == "" || redis_password == "error") {
+        return true;
     }
+    user_cache::GetInstance()->put(m_user_name, redis_password.c_str());
+    if (redis_password == m_user_passwd) {
+        strcpy(m_url, "/welcome.html");
+    } else {
+        strcpy(m_url, "/logError.html");
+    }
+    return false;
+}
+
+// 在MySQL中按用户名点查密码，再与浏览器端输入比对
+void http_conn::do_login_sql()
+{
+    // 先从连接池中取一个连接
+    sql_conn *sql = NULL;
+    connectionRAII mysqlconn(&sql, connection_pool::GetInstance());
+
+    char sql_passwd[100];
+    if (sql && sql->find_user(m_user_name, sql_passwd, sizeof(sql_passwd)) == 1) {
+        RedisPool::GetInstance()->setString(m_user_name, sql_passwd);
+        user_cache::GetInstance()->put(m_user_name, sql_passwd);
+    } else {
+        sql_passwd[0] = '\0';
+    }
+    if (sql_passwd[0] != '\0' && strcmp(sql_passwd, m_user_passwd) == 0) {
+        strcpy(m_url, "/welcome.html");
+    } else {
+        strcpy(m_url, "/logError.html");
+    }
+}
+
+// 异步Redis的回复，在主线程中调用。seq用于丢弃连接已被复用之后才到达的回复
+// 之后的stat/open/mmap都交给工作线程，主线程不碰文件系统
+void http_conn::on_redis_reply(unsigned int seq, const string &redis_password)
+{
+    if (seq != m_async_seq || (m_sockfd == -1 && m_stream == NULL)) {
+        return;
+    }
+    // Redis里没有该用户（或Redis不可用）时，工作线程还要先查MySQL
+    if (check_redis_password(redis_password)) {
+        m_resume_sql = true;
+    } else {
+        m_resume_file = true;
+    }
+    if (!m_threadpool->append(this)) {
+        m_resume_sql = false;
+        m_resume_file = false;
+        reject_busy();
+    }
+}
+
+// 根据m_url定位目标文件，并将其映射到内存中
+http_conn::HTTP_CODE http_conn::do_file()
+{
+    strcpy(m_read_file, doc_root);
+    int len = strlen(doc_root);
+    const char *p = strrchr(m_url, '/');
 
     if (*(p + 1) == '0') {
         char *m_url_real = (char*)malloc(sizeof(char) * 200);
@@ -607,7 +694,7 @@ http_conn::HTTP_CODE http_conn::process_read()
         text = get_line();
         // 记录下一行的起始位置
         m_start_line = m_checked_idx;
-        Log::get_instance()->write_log(1, "got 1 http line: %s. Has %d bytes\n", text, m_start_line);
+        LOG_DEBUG("got 1 http line: %s. Has %d bytes\n", text, m_start_line);
         switch (m_check_state)
         {
             case CHECK_STATE_REQUESTLINE:
@@ -628,7 +715,7 @@ http_conn::HTTP_CODE http_conn::process_read()
                 }
                 else if (ret == GET_REQUEST)
                 {
-                    return do_request();
+                    return timed_request();
                 }
                 break;
             }
@@ -637,7 +724,7 @@ http_conn::HTTP_CODE http_conn::process_read()
                 ret = pares_content(text);
                 if (ret == GET_REQUEST)
                 {
-                    return do_request();
+                    return timed_request();
                 }
                 line_status = LINE_OPEN;
                 break;
@@ -668,7 +755,7 @@ bool http_conn::write()
 
     while (1)
     {
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        temp = send_iov();
 
         if (temp < 0)
         {
@@ -681,6 +768,7 @@ bool http_conn::write()
             return false;
         }
 
+        metrics::GetInstance()->add(COUNTER_BYTES_SENT, temp);
         bytes_have_send += temp;
         newadd = bytes_have_send - m_write_idx;
         bytes_to_send -= temp;  // meiyou
@@ -699,8 +787,10 @@ bool http_conn::write()
 
         if (bytes_to_send <= 0)
         {
+            metrics::GetInstance()->observe(STAGE_TOTAL, metrics::now_ns() - m_start_ns);
             unmap();
             modfd(m_epollfd, m_sockfd, EPOLLIN);
+            m_served = true;
 
             if (m_linger)
             {
@@ -718,16 +808,16 @@ bool http_conn::write()
 // 往写缓冲中写入待发送的数据
 bool http_conn::add_response(const char* format, ...)
 {
-    if (m_write_idx >= WRITE_BUFFER_SIZE)
+    if (m_write_idx >= m_write_buffer_size)
     {
         return false;
     }
     va_list arg_list;
     va_start(arg_list, format);
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - m_write_idx - 1,  // 因为有'\0'，所以要-1
+    int len = vsnprintf(m_write_buf + m_write_idx, m_write_buffer_size - m_write_idx - 1,  // 因为有'\0'，所以要-1
                             format, arg_list);
     va_end(arg_list);
-    if (len >= WRITE_BUFFER_SIZE - m_write_idx - 1)
+    if (len >= m_write_buffer_size - m_write_idx - 1)
     {
         return false;
     }
@@ -748,14 +838,32 @@ bool http_conn::add_response(const char* format, ...)
 
 bool http_conn::add_status_line(int status, const char* title)
 {
+    m_status = status;
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
 bool http_conn::add_header(int content_len)
 {
-    add_content_length(content_len);
-    add_linger();
-    add_bland_line();
+    return add_content_length(content_len) && add_date() && add_linger() && add_bland_line();
+}
+
+// Date头直接拷贝时钟缓存里格式化好的字节，不再每个响应调用gmtime+snprintf
+bool http_conn::add_date()
+{
+    static const char prefix[] = "Date: ";
+    int len = sizeof(prefix) - 1 + clock_cache::HTTP_DATE_LEN + 2;
+    if (m_write_idx + len >= m_write_buffer_size - 1)
+    {
+        return false;
+    }
+    char *p = m_write_buf + m_write_idx;
+    memcpy(p, prefix, sizeof(prefix) - 1);
+    p += sizeof(prefix) - 1;
+    clock_cache::GetInstance()->http_date(p);
+    p += clock_cache::HTTP_DATE_LEN;
+    memcpy(p, "\r\n", 2);
+    m_write_idx += len;
+    return true;
 }
 
 bool http_conn::add_content_length(int length)
@@ -770,12 +878,19 @@ bool http_conn::add_content_type()
 
 bool http_conn::add_linger()
 {
+    // 停机排空期间响应发完就关闭连接
+    if (m_draining)
+    {
+        m_linger = false;
+    }
     return add_response("Connection: %s\r\n", m_linger == true ? "keep-alive" : "close");
 }
 
 bool http_conn::add_bland_line()
 {
-    return add_response("\r\n");
+    bool ok = add_response("\r\n");
+    m_body_idx = m_write_idx;
+    return ok;
 }
 
 bool http_conn::add_content(const char* content)
@@ -791,6 +906,7 @@ bool http_conn::unmap()
         munmap(m_file_address, m_file_stat.st_size);
         m_file_address = NULL;
     }
+    return true;
 }
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
@@ -875,7 +991,31 @@ bool http_conn::process_write(HTTP_CODE code)
 // 工作线程调用的函数，处理用户请求。其中调用process_read();process_write();close_conn();
 void http_conn::process()
 {
-    HTTP_CODE code = process_read();
+    HTTP_CODE code;
+    if (m_resume_sql || m_resume_file)
+    {
+        // 异步Redis回复之后：未命中时接着查MySQL，再打开结果页面
+        if (m_resume_sql)
+        {
+            do_login_sql();
+        }
+        m_resume_sql = false;
+        m_resume_file = false;
+        code = do_file();
+    }
+    else if (m_stream)
+    {
+        // HTTP/2的请求在init_stream()中已经拆好，不用解析
+        code = timed_request();
+    }
+    else
+    {
+        // 解析耗时不含do_request()，后者单独统计
+        int64_t start = metrics::now_ns();
+        m_request_ns = 0;
+        code = process_read();
+        metrics::GetInstance()->observe(STAGE_PARSE, metrics::now_ns() - start - m_request_ns);
+    }
 
     // 请求不完整，需要继续获取数据，所以不能向客户端写数据，而是要将sockfd改为EPOLLIN，并return
     if (code == NO_REQUEST)
@@ -883,10 +1023,28 @@ void http_conn::process()
         modfd(m_epollfd, m_sockfd, EPOLLIN);
         return;
     }
+    // 正在等待异步Redis的回复，工作线程直接返回，由主线程中的回调继续处理
+    if (code == ASYNC_REQUEST)
+    {
+        return;
+    }
+    finish(code);
+}
 
+// 根据处理结果生成HTTP响应，并注册写事件
+void http_conn::finish(HTTP_CODE code)
+{
+    metrics::GetInstance()->add(COUNTER_REQUESTS);
     // 将HTTP请求分析完，根据响应码返回相应写HTTP响应
     // 如果写（组织）数据的时候出现了问题，则直接close_conn();否则将sockfd改为EPOLLOUT
-    if (!process_write(code))
+    bool ok = process_write(code);
+    if (m_stream)
+    {
+        // HTTP/2：响应交给连接编帧，之后这个对象可能已经被主线程复用，不能再访问
+        m_stream->conn->stream_done(m_stream, ok);
+        return;
+    }
+    if (!ok)
     {
         close_conn();
     }
@@ -897,6 +1055,8 @@ void http_conn::close_conn(bool real_close)
 {
     if (real_close && m_sockfd != -1)
     {
+        release_h2();
+        release_tls();
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
         m_user_count--;
@@ -905,10 +1065,274 @@ void http_conn::close_conn(bool real_close)
     
 }
 
+// 主线程直接拒绝时的响应是固定的，第一次用时拼好；非阻塞发送，发不完也不等
+static string canned_response(int status, const char *title, const char *form)
+{
+    return "HTTP/1.1 " + to_string(status) + " " + title + "\r\n"
+           + "Retry-After: 1\r\n"
+           + "Content-Length: " + to_string(strlen(form)) + "\r\n"
+           + "Connection: close\r\n\r\n"
+           + form;
+}
+
+static const string &busy_response()
+{
+    static const string resp = canned_response(503, error_503_title, error_503_form);
+    return resp;
+}
+
+static const string &limited_response()
+{
+    static const string resp = canned_response(429, error_429_title, error_429_form);
+    return resp;
+}
+
+void http_conn::reply_busy(int sockfd)
+{
+    send(sockfd, busy_response().data(), busy_response().size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    metrics::GetInstance()->add(COUNTER_REJECTED);
+}
+
+void http_conn::reply_limited(int sockfd)
+{
+    send(sockfd, limited_response().data(), limited_response().size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+void http_conn::send_now(const string &resp)
+{
+    if (m_ssl)
+    {
+        struct iovec iov;
+        iov.iov_base = (void *)resp.data();
+        iov.iov_len = resp.size();
+        tls_writev(m_ssl, &iov, 1);
+    }
+    else
+    {
+        send(m_sockfd, resp.data(), resp.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+}
+
+// 登录/注册（POST）要占用Redis和MySQL连接，和静态文件分开算；
+// 请求开头不到5个字节时判断不了方法，等下次读到更多数据再检查
+bool http_conn::rate_limited()
+{
+    if (m_rate_checked || m_read_idx < 5)
+    {
+        return false;
+    }
+    m_rate_checked = true;
+    int budget = strncasecmp(m_read_buf, "POST ", 5) == 0 ? RATE_BACKEND : RATE_STATIC;
+    if (rate_limiter::GetInstance()->allow(m_address.sin_addr.s_addr, budget))
+    {
+        return false;
+    }
+    metrics::GetInstance()->add(COUNTER_LIMITED_REQUESTS);
+    return true;
+}
+
+void http_conn::reject_limited()
+{
+    send_now(limited_response());
+    close_conn();
+}
+
+// 刚accept还没发请求的连接、请求已经到了但主线程还没读的连接都不算空闲，
+// 否则客户端会在发出请求之后被重置；对端已经关闭的算空闲
+bool http_conn::idle()
+{
+    if (m_h2)
+    {
+        return m_h2->idle();
+    }
+    if (m_start_ns != 0 || m_new_conn)
+    {
+        return false;
+    }
+    // TLS层已经解密出来、还没取走的数据也算
+    if (m_ssl && SSL_has_pending(m_ssl))
+    {
+        return false;
+    }
+    char c;
+    return recv(m_sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0;
+}
+
+void http_conn::reject_busy()
+{
+    if (m_stream)
+    {
+        // HTTP/2只拒绝这个流，连接上的其他请求照常
+        metrics::GetInstance()->add(COUNTER_REJECTED);
+        m_stream->reject = 503;
+        m_stream->conn->stream_done(m_stream, true);
+        return;
+    }
+    send_now(busy_response());
+    metrics::GetInstance()->add(COUNTER_REJECTED);
+    close_conn();
+}
+
+// tls---------------------
+
+void http_conn::start_tls(SSL *ssl)
+{
+    m_ssl = ssl;
+    m_accept_ns = metrics::now_ns();
+}
+
+int http_conn::handshake()
+{
+    bool want_write = false;
+    int ret = tls_handshake(m_ssl, want_write);
+    if (ret < 0)
+    {
+        metrics::GetInstance()->add(COUNTER_TLS_FAILED);
+        return -1;
+    }
+    if (ret == 0)
+    {
+        modfd(m_epollfd, m_sockfd, want_write ? EPOLLOUT : EPOLLIN);
+        return 0;
+    }
+
+    m_tls_ready = true;
+    // 握手完成以后按普通的长连接对待，排空时靠socket上有没有数据判断是否空闲
+    m_new_conn = false;
+    m_ktls_send = BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+    metrics *stats = metrics::GetInstance();
+    stats->add(COUNTER_TLS_HANDSHAKES);
+    stats->observe(STAGE_TLS_HANDSHAKE, metrics::now_ns() - m_accept_ns);
+    if (SSL_session_reused(m_ssl))
+    {
+        stats->add(COUNTER_TLS_RESUMED);
+    }
+    if (m_ktls_send)
+    {
+        stats->add(COUNTER_KTLS);
+    }
+    LOG_DEBUG("tls: fd %d %s %s, ktls send %d\n", m_sockfd, SSL_get_version(m_ssl),
+              SSL_get_cipher_name(m_ssl), (int)m_ktls_send);
+    const unsigned char *alpn = NULL;
+    unsigned int alpn_len = 0;
+    SSL_get0_alpn_selected(m_ssl, &alpn, &alpn_len);
+    if (alpn_len == 2 && memcmp(alpn, "h2", 2) == 0)
+    {
+        start_h2(NULL, 0);
+        return 1;
+    }
+    // 客户端紧跟着Finished发来的请求可能已经被OpenSSL读进来了，epoll不会再通知
+    if (SSL_has_pending(m_ssl))
+    {
+        return 1;
+    }
+    modfd(m_epollfd, m_sockfd, EPOLLIN);
+    return 0;
+}
+
+void http_conn::release_tls()
+{
+    if (m_ssl)
+    {
+        tls_close(m_ssl);
+        m_ssl = NULL;
+    }
+}
+
+// kTLS开启后内核负责加密，照旧writev，mmap的文件内容不经过用户态的拷贝
+int http_conn::send_iov()
+{
+    return send_iov(m_iv, m_iv_count);
+}
+
+int http_conn::send_iov(const struct iovec *iov, int count)
+{
+    if (m_ssl && !m_ktls_send)
+    {
+        return tls_writev(m_ssl, iov, count);
+    }
+    return writev(m_sockfd, iov, count);
+}
+
+int http_conn::recv_raw(char *buf, int len)
+{
+    if (m_ssl)
+    {
+        return tls_read(m_ssl, buf, len);
+    }
+    return recv(m_sockfd, buf, len, 0);
+}
+
+// http2---------------------
+
+// 连接前言以"PRI"开头，HTTP/1.1没有这个方法；读到的不到24个字节时按开头判断，剩下的由h2_conn接着读
+bool http_conn::detect_h2()
+{
+    if (!h2_conn::m_enabled || m_served || m_ssl || m_read_idx < 3 || !h2_conn::preface(m_read_buf, m_read_idx))
+    {
+        return false;
+    }
+    start_h2(m_read_buf, m_read_idx);
+    return true;
+}
+
+void http_conn::start_h2(const char *data, int len)
+{
+    m_h2 = new h2_conn(this);
+    m_h2->start(data, len);
+}
+
+bool http_conn::h2_handle()
+{
+    return m_h2->handle();
+}
+
+void http_conn::release_h2()
+{
+    if (m_h2)
+    {
+        m_h2->detach();
+        m_h2 = NULL;
+    }
+}
+
+bool http_conn::init_stream(h2_stream *s)
+{
+    m_stream = s;
+    m_async_seq++;
+    init();
+    m_start_ns = s->start_ns;
+    if (s->method == "GET")
+    {
+        m_method = GET;
+    }
+    else if (s->method == "POST")
+    {
+        m_method = POST;
+        cgi = 1;
+    }
+    else
+    {
+        return false;
+    }
+    // 请求行和消息体按HTTP/1.1解析后的样子放进读缓冲区，do_request()原样使用
+    if (s->path[0] != '/' || s->path.size() >= (size_t)FILENAME_LEN
+        || FILENAME_LEN + s->body.size() >= (size_t)m_read_buffer_size)
+    {
+        return false;
+    }
+    memcpy(m_read_buf, s->path.data(), s->path.size());
+    m_url = m_read_buf;
+    m_string = m_read_buf + FILENAME_LEN;
+    memcpy(m_string, s->body.data(), s->body.size());
+    m_content_length = s->body.size();
+    return true;
+}
+
 // 定时器回调函数，它删除非活动连接socket上的注册事件，并关闭
 void http_conn::timer_cb_func(http_conn* user_data) {
     epoll_ctl(m_epollfd, EPOLL_CTL_DEL, user_data->m_sockfd, 0);
     assert(user_data);
     close(user_data->m_sockfd);
-    Log::get_instance()->write_log(1, "close fd %d\n", user_data->m_sockfd);
+    LOG_DEBUG("close fd %d\n", user_data->m_sockfd);
 }
\ No newline at end of file
@@ -19,24 +19,38 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <map>
+#include <atomic>
 
 #include "locker.h"
 #include "timer_wheel.h"
 #include "timer_wheel.h"
 #include "sql_connection_pool.h"
+#include "clock_cache.h"
+#include "metrics.h"
+#include "tls.h"
 
 class tw_timer;
+template<typename T> class threadpool;
+class h2_conn;
+struct h2_stream;
+
+// 网站根目录，定义在http_conn.cpp，main启动时可以覆盖
+extern const char* doc_root;
 
 class http_conn
 {
+    friend class http_conn_bench;   // bench/microbench.cpp直接调用解析函数
+    friend class h2_conn;           // 取响应的状态码和消息体，生成响应后回调finish()
+
 public:
 
-    static const int READ_BUFFER_SIZE = 2048;
-    static const int WRITE_BUFFER_SIZE = 1024;
     static const int FILENAME_LEN = 200;
+    static int m_read_buffer_size;          // 读缓冲区大小，启动时按配置设置，之后不再改变
+    static int m_write_buffer_size;         // 写缓冲区大小
     static int m_epollfd;
     static int m_user_count;
     static timer_wheel m_twheel;
+    static std::atomic<bool> m_draining;    // 停机排空中：响应不再保持连接
     tw_timer* m_timer;
     int m_sockfd;
     MYSQL *mysql;
@@ -67,16 +81,23 @@ public:
         FORBDDEN_REQUEST:   客户对资源没有访问权限
         INTERNAL_ERROR:     服务器内部出错
         CLOSED_CONNECTION:  客户端已经关闭
+        ASYNC_REQUEST:      正在等待异步Redis的回复，由主线程中的回调继续处理
     */
     enum HTTP_CODE {NO_REQUEST, GET_REQUEST, 
                     BAD_REQUEST, NO_RESOURCE, 
                     FORBIDDEN_REQUEST, FLIE_REQUEST, 
-                    INTERNAL_ERROR, CLOSED_CONNECTION};
+                    INTERNAL_ERROR, CLOSED_CONNECTION,
+                    ASYNC_REQUEST};
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTION, CONNECT, PATCH};
 
 public:
-    http_conn(){}
-    ~http_conn(){}
+    http_conn() : m_sockfd(-1), m_read_buf(NULL), m_write_buf(NULL), m_async_seq(0), m_start_ns(0), m_new_conn(false),
+                  m_ssl(NULL), m_h2(NULL), m_stream(NULL) {}
+    ~http_conn()
+    {
+        delete [] m_read_buf;
+        delete [] m_write_buf;
+    }
 
     void process();     // 工作线程调用的函数，处理用户请求。其中调用process_read();process_write();close_conn();
 
@@ -86,6 +107,11 @@ public:
     void init(int sockfd, const sockaddr_in& address);        // 初始化
     void init(int sockfd, const sockaddr_in &addr, char *, int , int, string user, string passwd, string sqlname);
     void close_conn(bool real_close=true);  // 关闭连接
+    void reject_busy();                     // 过载时在主线程直接回503并关闭连接，不进线程池
+    static void reply_busy(int sockfd);     // 向sockfd发送503 + Retry-After，不关闭
+    bool rate_limited();                    // 按客户端IP限速，每个请求在主线程读到开头时检查一次
+    void reject_limited();                  // 超过限速时回429并关闭连接
+    static void reply_limited(int sockfd);  // 向sockfd发送429 + Retry-After，不关闭
 
     void timer_cb_func(http_conn* user_data);   // 定时器回调函数
 
@@ -96,8 +122,40 @@ public:
         return &m_address;
     }
 
+    // 停机排空时判断连接能否直接关闭：没有在处理的请求，也没有已经到达还没读的数据
+    bool idle();
+
+    // HTTPS连接：accept之后在init()之后调用，连接归还时释放ssl
+    void start_tls(SSL *ssl);
+    bool handshaking()
+    {
+        return m_ssl && !m_tls_ready;
+    }
+    // 主线程在握手期间的读写事件上调用：返回-1失败（调用者关闭连接），
+    // 0握手未完成或已完成在等请求（已重新注册事件），1已完成且SSL中已有请求数据，调用者接着read()；
+    // ALPN选中h2时也返回1，此时http2()为true，调用者接着h2_handle()
+    int handshake();
+    void release_tls();                     // 定时器直接关闭fd前调用
+
+    // HTTP/2：明文连接读到的开头是连接前言时切换，返回true后由h2_handle()接着处理；
+    // 已经在这个连接上回过HTTP/1.1响应的不切换
+    bool detect_h2();
+    bool http2()
+    {
+        return m_h2 != NULL;
+    }
+    bool h2_handle();                       // 主线程在HTTP/2连接的读写事件上调用，返回false时关闭连接
+    void release_h2();                      // 连接关闭时调用，还在处理的流由h2_conn自己收尾
+
+    // 处理HTTP/2的一个流：不绑定socket，请求行和消息体来自h2_stream，返回false时回400
+    bool init_stream(h2_stream *s);
+
+    // 异步Redis回复到达时由主线程调用，继续处理登录请求
+    void on_redis_reply(unsigned int seq, const string &redis_password);
+
     // void initmysql_result(connection_pool* connPool);
     int improv;
+    static threadpool<http_conn>* m_threadpool;   // 异步回调需要把请求重新交给工作线程
 
 private:
     // 初始化所需用到的辅助函数
@@ -110,9 +168,21 @@ private:
     HTTP_CODE parse_header(char* text);         // 分析请求头部
     HTTP_CODE pares_content(char* text);        // 分析请求正文
     HTTP_CODE do_request();                     // 处理请求，即读取目标文件，将文件内容映射到内存中
+    HTTP_CODE timed_request();                  // 调用do_request()并记下耗时
+    void capture_request(int from);             // 流量录制：请求头收完时交给traffic_capture
+    int send_iov();                             // 发送m_iv，HTTPS连接没有kTLS时经过SSL_write，返回值同writev
+    int send_iov(const struct iovec *iov, int count);
+    int recv_raw(char *buf, int len);           // 读socket，HTTPS连接经过SSL_read，返回值同recv
+    void start_h2(const char *data, int len);
+    void send_now(const string &resp);          // 主线程直接拒绝时的固定响应，非阻塞，发不完也不等
+    HTTP_CODE do_file();                        // 根据m_url定位目标文件，并映射到内存中
+    bool do_login();                            // 登录检测，返回false表示在等待异步Redis
+    bool check_redis_password(const string &redis_password);   // 比对Redis中的密码，返回true表示还需要查MySQL
+    void do_login_sql();                        // 在MySQL中比对密码
     char* get_line() { return m_read_buf + m_start_line; }
 
     // 这一组函数用来填充http应答，process_write()被process()调用；其余被process_write()调用
+    void finish(HTTP_CODE code);                            // 生成响应并注册写事件，调用process_write()
     bool process_write(HTTP_CODE ret);                      // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容。
                                                             // 调用add_status_line();add_header();add_content()
                                                             // 将各种函数调用add_response()所得到的写缓冲数据，放入内存块（以便在write()函数中，调用writev写入sockfd）
@@ -121,6 +191,7 @@ private:
     bool add_header(int content_length);                    // 写响应头，调用add_content_length();add_linger();add_bland_line()
     bool add_content(const char* content);                  // 调用add_reaponse();
     bool add_content_length(int content_length);            // 调用add_response();
+    bool add_date();                                        // 写Date头，使用clock_cache缓存的时间
     bool add_linger();                                      // 调用add_response();
     bool add_bland_line();                                  // 调用add_response();
     bool add_response(const char* format, ...);             // 往写缓冲中写入待发送的数据
@@ -133,8 +204,8 @@ private:
     
     sockaddr_in m_address;
 
-    char m_read_buf[READ_BUFFER_SIZE];      // 读缓冲区
-    char m_write_buf[WRITE_BUFFER_SIZE];    // 写缓冲区
+    char *m_read_buf;                       // 读缓冲区，第一次用到时分配，只有用过的fd占内存
+    char *m_write_buf;                      // 写缓冲区
     char m_read_file[FILENAME_LEN];         // 客户请求的目标文件的完整路径，为doc_root + m_url。doc_root为网站根目录
 
     int m_read_idx;         // 读缓冲区中，已经读入的客户端数据的最后一个字节的下一个位置；read()中用以检测读缓冲区是否已满
@@ -162,12 +233,39 @@ private:
     // int bytes_have_send;
     // char *doc_root;
 
-    map<string, string> m_users;
     // int m_TRIGMode;
     int m_close_log;
     int bytes_to_send;
     int bytes_have_send;
 
+    char m_user_name[100];      // 登录/注册时提交的用户名
+    char m_user_passwd[100];    // 登录/注册时提交的密码
+    unsigned int m_async_seq;   // 每个新连接加一，用来识别过期的异步回复
+    bool m_resume_sql;          // 异步Redis未命中，工作线程需要接着查MySQL
+    bool m_resume_file;         // 异步Redis命中，工作线程只需要打开结果页面
+
+    int64_t m_start_ns;         // 开始读这个请求的时间，用于统计请求总耗时
+    bool m_new_conn;            // 新连接还没有读到过数据
+    int64_t m_request_ns;       // 本次process_read()中do_request()的耗时
+
+    unsigned int m_conn_id;     // 流量录制中的连接编号
+    bool m_capture_first;       // 还没录制过这个连接上的请求
+    bool m_captured;            // 当前请求已经录制
+    string m_capture_head;      // 还没收完的请求头原文
+
+    bool m_rate_checked;        // 当前请求已经做过限速检查
+
+    SSL *m_ssl;                 // HTTPS连接的TLS状态，明文连接为NULL
+    bool m_tls_ready;           // 握手已完成
+    bool m_ktls_send;           // 发送由内核加密，writev可以直接写socket
+    int64_t m_accept_ns;        // accept的时间，统计握手耗时
+
+    h2_conn *m_h2;              // 切换到HTTP/2的连接，否则为NULL
+    h2_stream *m_stream;        // 处理HTTP/2流时指向该流，否则为NULL
+    bool m_served;              // 这个连接上已经发完过HTTP/1.1响应
+    int m_status;               // 响应的状态码，HTTP/2编码响应头时用
+    int m_body_idx;             // 写缓冲区中响应头之后、消息体开始的位置
+
     char sql_user[100];
     char sql_passwd[100];
     char sql_name[100];
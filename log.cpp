@@ -1,51 +1,179 @@
 #include <string.h>
+#include <stdlib.h>
+#include <new>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <pthread.h>
 
 #include "log.h"
+#include "clock_cache.h"
 
 using namespace std;
 
+static const size_t MIN_RING_SIZE = 64 * 1024;
+static const size_t MAX_RING_SIZE = 1024 * 1024;
+static const size_t OUT_BUF_SIZE = 1024 * 1024;     // 日志线程的输出缓冲，攒满或取空一轮后写一次
+
+thread_local Log::ring_holder Log::t_ring = {NULL};
+
 Log::Log()
 {
     m_count = 0;
     m_is_async = false;
+    m_binary = false;
+    m_fd = -1;
+    m_rings = NULL;
+    m_event_fd = -1;
+    m_sleeping = false;
+    m_stop = false;
+    m_ring_size = 0;
+    m_log_buf_size = 8192;
+    m_close_log = 0;
+    m_level = LOG_LEVEL_INFO;
+    m_nformats = 1;         // 0是LOG_FID_TEXT
+    memset(m_fmt_written, 0, sizeof(m_fmt_written));
+    m_out = NULL;
+    m_out_len = 0;
+    m_niov = 0;
+    m_pending_bytes = 0;
+    m_split_bytes = 0;
+    m_file_seq = 0;
+    m_file_bytes = 0;
+    m_flush_interval_ms = 0;
+    m_fsync_interval_ms = 0;
+    m_fsync_bytes = 0;
+    m_unsynced = 0;
+    m_last_sync_usec = 0;
+    m_last_sec = 0;
+    m_stamp[0] = '\0';
+    m_overflow = OVERFLOW_WRITE;
+    m_overflow_arg = 0;
+    m_overflow_seq = 0;
+    m_direct = 0;
+    m_dropped = 0;
+    m_spilled = 0;
+    m_blocked = 0;
+    m_block_usec = 0;
+    m_spill_fd = -1;
+    m_spill = NULL;
+    m_spill_size = 0;
+    m_spill_used = 0;
+    m_spill_end = 0;
+    m_spill_path[0] = '\0';
+    memset(&m_reported, 0, sizeof(m_reported));
+    m_last_report_usec = 0;
 }
 
 Log::~Log()
 {
-    if (m_fp != NULL)
+    if (m_is_async)
     {
-        fclose(m_fp);
+        // 让消费者写完剩下的日志再退出
+        m_stop = true;
+        uint64_t one = 1;
+        write(m_event_fd, &one, sizeof(one));
+        pthread_join(m_tid, NULL);
+        close(m_event_fd);
     }
+    close_spill();
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+    }
+    delete[] m_out;
 }
 
-// 异步需要设置阻塞队列的长度，同步不需要设置
-// int log_buf_size=8192, int split_lines=5000000, int max_queue_size=0
-bool Log::init(const char *file_name, int close_log, int log_buf_size, int split_lines, int max_queue_size)
+Log::ring_holder::~ring_holder()
 {
-    // 如果设置了max_queue_size，则设置为异步
-    if (max_queue_size >= 1)
+    if (ring == NULL)
     {
-        // 边界条件，用 != 0 不是特别好
-        m_is_async = true;
-        m_log_queue = new block_queue<string>(max_queue_size);
-        pthread_t tid;
-        // flush_log_pthread为回调函数，这里表示创建线程异步写日志
-        pthread_create(&tid, NULL, flush_log_thread, NULL);
+        return;
     }
+    if (ring->data)
+    {
+        ring->dead.store(true, memory_order_release);
+    }
+    else
+    {
+        delete[] ring->fmt;
+        log_ring::destroy(ring);
+    }
+}
 
+Log::log_ring *Log::log_ring::create()
+{
+    void *p = NULL;
+    if (posix_memalign(&p, alignof(log_ring), sizeof(log_ring)) != 0)
+    {
+        throw std::bad_alloc();
+    }
+    return new (p) log_ring;
+}
+
+void Log::log_ring::destroy(log_ring *r)
+{
+    r->~log_ring();
+    free(r);
+}
+
+// 记录不跨越缓冲区末尾：末尾剩下的连续空间不够时，用一条填充记录占掉它，从头开始写
+// 记录都按8字节对齐，末尾剩下的空间至少8字节，不一定放得下完整的log_rec_hdr（16字节）：
+// 填充记录只写len和fid（前6字节），日志线程也只读这两个字段，不能再往里加别的
+char *Log::log_ring::reserve(size_t len)
+{
+    size_t t = tail.load(memory_order_relaxed);
+    size_t h = head.load(memory_order_acquire);
+    size_t cap = mask + 1;
+    size_t pos = t & mask;
+    size_t contig = cap - pos;
+    size_t need = contig < len ? contig + len : len;
+    if (cap - (t - h) < need)
+    {
+        return NULL;
+    }
+    if (contig < len)
+    {
+        log_rec_hdr *pad = (log_rec_hdr *)(data + pos);
+        pad->len = contig;
+        pad->fid = LOG_FID_PAD;
+        t += contig;
+        pos = 0;
+    }
+    reserved = t;
+    return data + pos;
+}
+
+void Log::log_ring::commit(size_t len)
+{
+    tail.store(reserved + len, memory_order_release);
+}
+
+// 异步需要设置阻塞队列的长度，同步不需要设置
+// int log_buf_size=8192, int split_lines=5000000, int max_queue_size=0
+bool Log::init(const char *file_name, int close_log, int log_buf_size, int split_lines, int max_queue_size,
+               bool binary, int level)
+{
     m_close_log = close_log;
+    m_level = close_log ? LOG_LEVEL_OFF : level;
     m_log_buf_size = log_buf_size;          // 输出内容的长度
-    m_buf = new char[m_log_buf_size];
-    memset(m_buf, '\0', m_log_buf_size);
     m_split_lines = split_lines;            // 日志的最大行数
+    m_binary = binary && max_queue_size >= 1;
+    clock_cache::GetInstance()->start();
 
     time_t t = time(NULL);
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
+    struct tm my_tm;
+    localtime_r(&t, &my_tm);
 
     /*
         strrchr(const char* __s, int __c)
@@ -53,134 +181,806 @@ bool Log::init(const char *file_name, int close_log, int log_buf_size, int split
         最后转为 char
     */
     const char *p = strrchr(file_name, '/');
-    char log_full_name[256] = {0};
+    char log_full_name[512] = {0};      // 放得下dir_name、日期和log_name
 
     // 自定义日志名
     // 若输入的文件名没有 /, 则直接将时间 + 文件名作为日志名
     if (!p)
     {
-        snprintf(log_full_name, 255, "%d_%02d_%02d_%s", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, file_name);
+        strcpy(log_name, file_name);
+        dir_name[0] = '\0';
+        snprintf(log_full_name, sizeof(log_full_name), "%04u_%02u_%02u_%s", (unsigned)(my_tm.tm_year + 1900) % 10000,
+                 (unsigned)(my_tm.tm_mon + 1) % 100, (unsigned)my_tm.tm_mday % 100, file_name);
     }
-    else 
+    else
     {
         strcpy(log_name, p + 1);
-        // strcpy()
         // p - file_name + 1 --> p 和 file_name 之间的字符串长度 + 1
         strncpy(dir_name, file_name, p - file_name + 1);
-        snprintf(log_full_name, 255, "%s%d_%02d_%02d_%s", dir_name, my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, log_name);
+        dir_name[p - file_name + 1] = '\0';
+        snprintf(log_full_name, sizeof(log_full_name), "%s%04u_%02u_%02u_%s", dir_name, (unsigned)(my_tm.tm_year + 1900) % 10000,
+                 (unsigned)(my_tm.tm_mon + 1) % 100, (unsigned)my_tm.tm_mday % 100, log_name);
     }
 
     m_today = my_tm.tm_mday;
-    m_fp = fopen(log_full_name, "a");
-    if (m_fp == NULL)
+    if (!open_file(log_full_name))
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(m_fd, &st) == 0)
+    {
+        m_file_bytes = st.st_size;      // 追加到已有文件时，大小上限要算上原有内容
+    }
+
+    // 如果设置了max_queue_size，则设置为异步
+    if (max_queue_size >= 1)
+    {
+        // 缓冲区大小取2的幂，按每条日志占log_buf_size的1/8估算
+        size_t want = (size_t)max_queue_size * (log_buf_size / 8 + 1);
+        m_ring_size = MIN_RING_SIZE;
+        while (m_ring_size < want && m_ring_size < MAX_RING_SIZE)
+        {
+            m_ring_size <<= 1;
+        }
+        m_out = new char[OUT_BUF_SIZE];
+        if (m_overflow == OVERFLOW_SPILL && !open_spill(log_full_name))
+        {
+            m_overflow = OVERFLOW_DROP;     // 打不开溢出文件时同样不让请求线程碰磁盘
+        }
+        m_event_fd = eventfd(0, EFD_CLOEXEC);
+        if (m_event_fd < 0)
+        {
+            return false;
+        }
+        m_is_async = true;
+        // flush_log_pthread为回调函数，这里表示创建线程异步写日志
+        if (pthread_create(&m_tid, NULL, flush_log_thread, NULL) != 0)
+        {
+            m_is_async = false;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int Log::register_format(int level, const char *format, const char *file, int line)
+{
+    m_fmt_lock.lock();
+    int fid = m_nformats.load(memory_order_relaxed);
+    if (fid >= LOG_MAX_FORMATS)
+    {
+        m_fmt_lock.unlock();
+        return -1;
+    }
+    m_formats[fid].format = format;
+    m_formats[fid].file = file;
+    m_formats[fid].line = line;
+    m_formats[fid].level = level;
+    // 先填好再发布，日志线程看到编号时内容一定完整
+    m_nformats.store(fid + 1, memory_order_release);
+    m_fmt_lock.unlock();
+    return fid;
+}
+
+void Log::set_rotation(long split_bytes)
+{
+    m_split_bytes = split_bytes;
+}
+
+void Log::set_commit(int flush_interval_ms, int fsync_interval_ms, long fsync_bytes)
+{
+    m_flush_interval_ms = flush_interval_ms;
+    m_fsync_interval_ms = fsync_interval_ms;
+    m_fsync_bytes = fsync_bytes;
+}
+
+void Log::set_overflow(int policy, int arg)
+{
+    m_overflow = policy;
+    m_overflow_arg = arg;
+    if (policy == OVERFLOW_SAMPLE && m_overflow_arg < 1)
+    {
+        m_overflow_arg = 1;
+    }
+}
+
+void Log::overflow_stats(log_overflow_stats &stats)
+{
+    stats.direct = m_direct.load(memory_order_relaxed);
+    stats.dropped = m_dropped.load(memory_order_relaxed);
+    stats.spilled = m_spilled.load(memory_order_relaxed);
+    stats.blocked = m_blocked.load(memory_order_relaxed);
+    stats.block_usec = m_block_usec.load(memory_order_relaxed);
+}
+
+// 溢出文件预先扩展到arg MB并整个映射进来，写日志的线程用原子加法分配位置后直接memcpy
+// 二进制模式下和.bin文件格式相同（文件头加文本记录），可以用log_decode解码
+bool Log::open_spill(const char *path)
+{
+    char spill_path[288];
+    snprintf(spill_path, sizeof(spill_path), "%s.%d.spill%s", path, (int)getpid(), m_binary ? ".bin" : "");
+    m_spill_size = (size_t)(m_overflow_arg > 0 ? m_overflow_arg : 64) * 1024 * 1024;
+    int fd = open(spill_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
     {
         return false;
     }
+    if (ftruncate(fd, m_spill_size) != 0)
+    {
+        close(fd);
+        unlink(spill_path);
+        return false;
+    }
+    void *p = mmap(NULL, m_spill_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        close(fd);
+        unlink(spill_path);
+        return false;
+    }
+    m_spill_fd = fd;
+    m_spill = (char *)p;
+    size_t used = 0;
+    if (m_binary)
+    {
+        memcpy(m_spill, LOG_BIN_MAGIC, sizeof(LOG_BIN_MAGIC));
+        used = sizeof(LOG_BIN_MAGIC);
+    }
+    m_spill_used = used;
+    m_spill_end = m_spill_size;
+    strcpy(m_spill_path, spill_path);
+    return true;
+}
 
+// 截掉预分配但没用到的部分；一条也没溢出的话删掉文件
+void Log::close_spill()
+{
+    if (m_spill == NULL)
+    {
+        return;
+    }
+    size_t used = m_spill_used.load();
+    if (used > m_spill_end.load())
+    {
+        used = m_spill_end.load();
+    }
+    munmap(m_spill, m_spill_size);
+    m_spill = NULL;
+    if (m_spilled.load() == 0)
+    {
+        unlink(m_spill_path);
+    }
+    else
+    {
+        ftruncate(m_spill_fd, used);
+    }
+    close(m_spill_fd);
+    m_spill_fd = -1;
+}
+
+// 打开新的日志文件。第一次直接使用，之后用dup2换到原来的fd上，
+// 这样别的线程正在使用的m_fd不会失效，也不会被其他文件复用
+// 二进制日志文件名加.bin后缀，以LOG_BIN_MAGIC开头，格式定义在新文件中重新写一遍
+bool Log::open_file(const char *path)
+{
+    char bin_path[272];
+    if (m_binary)
+    {
+        snprintf(bin_path, sizeof(bin_path), "%s.bin", path);
+        path = bin_path;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (m_binary)
+    {
+        // 先写文件头再换上去，别的线程直接写入的记录不会出现在文件头之前
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == 0)
+        {
+            write(fd, LOG_BIN_MAGIC, sizeof(LOG_BIN_MAGIC));
+        }
+        memset(m_fmt_written, 0, sizeof(m_fmt_written));
+    }
+    if (m_fd < 0)
+    {
+        m_fd = fd;
+    }
+    else
+    {
+        dup2(fd, m_fd);
+        close(fd);
+    }
     return true;
 }
 
+// 日志不是今天、行数达到最大行的倍数、或者文件超过大小上限时切换文件
+// 如果是新的一天，创建今天的日志，重置行数；否则在当前日志名后加递增的序号
+void Log::rotate(const struct tm &my_tm)
+{
+    char new_log[512] = {0};
+    char tail[16] = {0};
+
+    // 格式化日志名中时间部分
+    snprintf(tail, sizeof(tail), "%04u_%02u_%02u_", (unsigned)(my_tm.tm_year + 1900) % 10000,
+             (unsigned)(my_tm.tm_mon + 1) % 100, (unsigned)my_tm.tm_mday % 100);
+
+    if (m_today != my_tm.tm_mday)
+    {
+        snprintf(new_log, sizeof(new_log), "%s%s%s", dir_name, tail, log_name);
+        m_today = my_tm.tm_mday;
+        m_count = 0;
+        m_file_seq = 0;
+    }
+    else
+    {
+        snprintf(new_log, sizeof(new_log), "%s%s%s.%d", dir_name, tail, log_name, ++m_file_seq);
+    }
+    if (open_file(new_log))
+    {
+        m_file_bytes = 0;
+    }
+}
+
+void Log::write_fd(const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(m_fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// 当前线程的缓冲区，第一次调用时创建并挂到链表上
+Log::log_ring *Log::local_ring()
+{
+    if (t_ring.ring)
+    {
+        return t_ring.ring;
+    }
+    log_ring *r = log_ring::create();
+    r->fmt = new char[m_log_buf_size];
+    r->data = NULL;
+    r->mask = 0;
+    r->reserved = 0;
+    r->head = 0;
+    r->tail = 0;
+    r->dead = false;
+    r->next = NULL;
+    if (m_is_async)
+    {
+        r->data = new char[m_ring_size];
+        r->mask = m_ring_size - 1;
+        m_ring_lock.lock();
+        r->next = m_rings;
+        m_rings = r;
+        m_ring_lock.unlock();
+    }
+    t_ring.ring = r;
+    return r;
+}
+
+// 日志线程在等待时才需要唤醒，忙的时候不进内核
+// 设置了攒批间隔时，日志线程按间隔自己醒来，只有缓冲区过半才提前唤醒它
+void Log::wake_writer(log_ring *r)
+{
+    if (m_flush_interval_ms > 0
+        && r->tail.load(memory_order_relaxed) - r->head.load(memory_order_relaxed) < (r->mask + 1) / 2)
+    {
+        return;
+    }
+    if (m_sleeping.load() && m_sleeping.exchange(false))
+    {
+        uint64_t one = 1;
+        write(m_event_fd, &one, sizeof(one));
+    }
+}
+
+// 在当前线程的缓冲区中预留一条记录的空间
+// OVERFLOW_BLOCK时缓冲区满了先唤醒日志线程，让出CPU等它写出，最多等m_overflow_arg毫秒
+char *Log::reserve_record(log_ring *r, size_t len)
+{
+    char *p = r->reserve(len);
+    if (p || m_overflow != OVERFLOW_BLOCK)
+    {
+        return p;
+    }
+    clock_cache *clock = clock_cache::GetInstance();
+    int64_t start = clock->now_usec();
+    int64_t waited = 0;
+    int spins = 0;
+    m_blocked.fetch_add(1, memory_order_relaxed);
+    while ((p = r->reserve(len)) == NULL)
+    {
+        wake_writer(r);
+        waited = clock->now_usec() - start;
+        if (waited >= (int64_t)m_overflow_arg * 1000)
+        {
+            break;
+        }
+        if (++spins < 64)
+        {
+            sched_yield();
+        }
+        else
+        {
+            usleep(100);
+        }
+    }
+    m_block_usec.fetch_add(waited, memory_order_relaxed);
+    return p;
+}
+
 void Log::write_log(int level, const char *format, ...)
 {
-    struct timeval now = {0, 0};
-    gettimeofday(&now, NULL);
-    time_t t = now.tv_sec;
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
-    char s[16] = {0};
-    switch (level)
+    va_list valst;
+    va_start(valst, format);
+    write_log_v(level, false, format, valst);
+    va_end(valst);
+}
+
+// write_fast预留不到空间时调用，不再重复预留和等待
+void Log::write_overflow(int level, const char *format, ...)
+{
+    va_list valst;
+    va_start(valst, format);
+    write_log_v(level, true, format, valst);
+    va_end(valst);
+}
+
+// 丢弃的日志不需要格式化，所以先决定要不要写
+bool Log::admit_overflow()
+{
+    switch (m_overflow)
     {
-    case 0:
-        strcpy(s, "[debug]:");
-        break;
-    case 1:
-        strcpy(s, "[info]:");
-        break;
-    case 2:
-        strcpy(s, "[warn]:");
-        break;
-    case 3:
-        strcpy(s, "[erro]:");
+    case OVERFLOW_WRITE:
+    case OVERFLOW_SPILL:
+        return true;
+    case OVERFLOW_SAMPLE:
+        if (m_overflow_seq.fetch_add(1, memory_order_relaxed) % m_overflow_arg == 0)
+        {
+            return true;
+        }
         break;
     default:
-    strcpy(s, "[info]");
         break;
     }
+    m_dropped.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+// 把缓冲区放不下的一条日志写到别处
+void Log::overflow_write(int level, int64_t usec, const char *buf, size_t len)
+{
+    log_rec_hdr h;
+    memset(&h, 0, sizeof(h));
+    h.len = sizeof(h) + len;
+    h.fid = LOG_FID_TEXT;
+    h.level = level;
+    h.usec = usec;
+
+    if (m_overflow == OVERFLOW_SPILL)
+    {
+        size_t need = m_binary ? log_rec_align(h.len) : len;
+        size_t off = m_spill_used.fetch_add(need, memory_order_relaxed);
+        if (off + need > m_spill_size)
+        {
+            // 只有跨过末尾的那一次分配满足off <= m_spill_size，记下有效内容的末尾
+            if (off <= m_spill_size)
+            {
+                m_spill_end.store(off);
+            }
+            m_dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        char *p = m_spill + off;
+        if (m_binary)
+        {
+            memset(p + h.len, 0, need - h.len);
+            memcpy(p, &h, sizeof(h));
+            p += sizeof(h);
+        }
+        memcpy(p, buf, len);
+        m_spilled.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    if (m_binary)
+    {
+        // 直接写一条文本记录。O_APPEND下一次writev写普通文件不会和其他写入交错
+        static const char pad[8] = {0};
+        struct iovec iov[3];
+        iov[0].iov_base = &h;
+        iov[0].iov_len = sizeof(h);
+        iov[1].iov_base = (void *)buf;
+        iov[1].iov_len = len;
+        iov[2].iov_base = (void *)pad;
+        iov[2].iov_len = log_rec_align(h.len) - h.len;
+        writev(m_fd, iov, 3);
+    }
+    else
+    {
+        // 直接写文件，这一行的顺序可能和缓冲区里的不一致
+        write_fd(buf, len);
+    }
+    m_direct.fetch_add(1, memory_order_relaxed);
+}
+
+// ring_full为true表示调用者已经预留失败（并按策略等待过）
+void Log::write_log_v(int level, bool ring_full, const char *format, va_list valst)
+{
+    if (ring_full && !admit_overflow())
+    {
+        return;
+    }
+
+    log_ring *r = local_ring();
+    char *buf = r->fmt;
+
+    // 时间戳直接拷贝时钟缓存里格式化好的字节
+    int mday;
+    clock_cache *clock = clock_cache::GetInstance();
+    int64_t usec = clock->now_usec();
+    clock->log_stamp(buf, &mday);
+    int n = clock_cache::LOG_STAMP_LEN;
+    buf[n++] = ' ';
+    const char *s = log_level_str(level);
+    size_t slen = strlen(s);
+    memcpy(buf + n, s, slen);
+    n += slen;
+
+    // 内容格式化，超出缓冲区的部分截断，留两个字节给换行和'\0'
+    int m = vsnprintf(buf + n, m_log_buf_size - n - 1, format, valst);
+    if (m < 0)
+    {
+        m = 0;
+    }
+    if (m > m_log_buf_size - n - 2)
+    {
+        m = m_log_buf_size - n - 2;
+    }
+    buf[n + m] = '\n';
+    buf[n + m + 1] = '\0';
+    size_t len = n + m + 1;
 
-    // 写入一个log，对m_count++, m_split_lines最大行数
+    if (m_is_async)
+    {
+        size_t rec_len = sizeof(log_rec_hdr) + len;
+        char *p = ring_full ? NULL : reserve_record(r, log_rec_align(rec_len));
+        if (p)
+        {
+            log_rec_hdr *h = (log_rec_hdr *)p;
+            h->len = rec_len;
+            h->fid = LOG_FID_TEXT;
+            h->level = level;
+            h->reserved = 0;
+            h->usec = usec;
+            memcpy(p + sizeof(log_rec_hdr), buf, len);
+            r->commit(log_rec_align(rec_len));
+            wake_writer(r);
+        }
+        else if (ring_full || admit_overflow())
+        {
+            overflow_write(level, usec, buf, len);
+        }
+        return;
+    }
+
+    // 同步模式：写入一个log，对m_count++, m_split_lines最大行数
     m_mutex.lock();
-    // 更新行数
     m_count++;
+    if (need_rotate(mday, len))
+    {
+        time_t t = usec / 1000000;
+        struct tm my_tm;
+        localtime_r(&t, &my_tm);
+        rotate(my_tm);
+    }
+    write_fd(buf, len);
+    m_file_bytes += len;
+    m_mutex.unlock();
+}
 
-    // 日志写入前判断当前 day 是否是创建日志的时间，行数是否超过最大行限制
-    // 如果是创建日志时间，写入日志，否则按照当前时间创建新的 log, 更新创建时间和行数
-    // 如果超过最大行限制，在当前日志的末尾加 count/max_lines 为后缀创建新 Log
-    // 日志不是今天或写入的日志行数是最大行的倍数
-    // m_split_lines 为最大行数
-    if (m_today != my_tm.tm_mday || m_count % m_split_lines == 0)
+// 在输出缓冲中预留len字节，用out_commit提交实际写入的长度
+char *Log::out_reserve(size_t len)
+{
+    // 同时保证还有一个iovec空位，out_commit时不会中途写出
+    if (m_out_len + len > OUT_BUF_SIZE || m_niov == LOG_IOV_MAX)
     {
-        char new_log[256] = {0};
-        fflush(m_fp);
-        fclose(m_fp);
-        char tail[16] = {0};
+        flush_out();
+    }
+    return m_out + m_out_len;
+}
 
-        // 格式化日志名中时间部分
-        snprintf(tail, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
+void Log::out_commit(size_t len)
+{
+    out_append(m_out + m_out_len, len);
+    m_out_len += len;
+}
+
+// 把一段数据加入待写的iovec，和上一段首尾相接时直接合并
+void Log::out_append(const char *buf, size_t len)
+{
+    if (m_niov > 0 && (const char *)m_iov[m_niov - 1].iov_base + m_iov[m_niov - 1].iov_len == buf)
+    {
+        m_iov[m_niov - 1].iov_len += len;
+    }
+    else
+    {
+        if (m_niov == LOG_IOV_MAX)
+        {
+            flush_out();
+        }
+        m_iov[m_niov].iov_base = (void *)buf;
+        m_iov[m_niov].iov_len = len;
+        m_niov++;
+    }
+    m_pending_bytes += len;
+}
 
-        // 如果时间不是今天，则创建今天的日志，更新 m_today 和 m_count
-        if (m_today != my_tm.tm_mday)
+// 一次writev写出攒下的所有数据，然后才归还环形缓冲区的空间
+void Log::flush_out()
+{
+    struct iovec *cur = m_iov;
+    int left = m_niov;
+    while (left > 0)
+    {
+        ssize_t n = writev(m_fd, cur, left);
+        if (n < 0)
         {
-            snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
-            m_today = my_tm.tm_mday;
-            m_count = 0;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
         }
-        else{
-            snprintf(new_log, 255, "%s%s%s.%lld", dir_name, tail, log_name, m_count / m_split_lines);
+        while (left > 0 && (size_t)n >= cur->iov_len)
+        {
+            n -= cur->iov_len;
+            cur++;
+            left--;
+        }
+        if (left > 0)
+        {
+            cur->iov_base = (char *)cur->iov_base + n;
+            cur->iov_len -= n;
         }
-        m_fp = fopen(new_log, "a");
     }
+    // O_APPEND下写完后的偏移就是文件大小，缓冲区满时其他线程直接写入的部分也算在内
+    off_t end = lseek(m_fd, 0, SEEK_CUR);
+    m_file_bytes = end >= 0 ? (size_t)end : m_file_bytes + m_pending_bytes;
+    m_unsynced += m_pending_bytes;
+    m_pending_bytes = 0;
+    m_niov = 0;
+    m_out_len = 0;
 
-    m_mutex.unlock();
+    for (size_t i = 0; i < m_release.size(); i++)
+    {
+        m_release[i].first->head.store(m_release[i].second, memory_order_release);
+    }
+    m_release.clear();
+}
 
-    va_list valst;
-    va_start(valst, format);
+// 组提交：距离上次fdatasync超过m_fsync_interval_ms，或者攒了m_fsync_bytes字节未落盘时同步一次
+void Log::maybe_sync(bool force)
+{
+    if (m_unsynced == 0 || (m_fsync_interval_ms <= 0 && m_fsync_bytes <= 0))
+    {
+        return;
+    }
+    int64_t now = clock_cache::GetInstance()->now_usec();
+    if (force
+        || (m_fsync_interval_ms > 0 && now - m_last_sync_usec >= m_fsync_interval_ms * 1000LL)
+        || (m_fsync_bytes > 0 && m_unsynced >= (size_t)m_fsync_bytes))
+    {
+        fdatasync(m_fd);
+        m_unsynced = 0;
+        m_last_sync_usec = now;
+    }
+}
 
-    string log_str;
-    m_mutex.lock();
+// 是否需要切换文件：换了一天、行数达到m_split_lines的倍数、或者文件超过m_split_bytes
+bool Log::need_rotate(int mday, size_t incoming)
+{
+    return m_today != mday
+        || (m_split_lines > 0 && m_count % m_split_lines == 0)
+        || (m_split_bytes > 0 && m_file_bytes + m_pending_bytes + incoming > (size_t)m_split_bytes
+            && m_file_bytes + m_pending_bytes > 0);
+}
 
-    // 写入的具体时间内容格式
-    int n = snprintf(m_buf, 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s",
-                     my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
-                     my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_usec, s);
+// 日志线程处理一条记录：二进制模式原样写出（必要时先写格式定义），否则格式化成文本
+// 原样写出的内容直接引用环形缓冲区，不再拷贝
+void Log::consume(const log_rec_hdr *h)
+{
+    // 切分只在这个线程做，写日志的线程不会阻塞在open上
+    time_t sec = h->usec / 1000000;
+    if (sec != m_last_sec)
+    {
+        localtime_r(&sec, &m_last_tm);
+        snprintf(m_stamp, sizeof(m_stamp), "%04u-%02u-%02u %02u:%02u:%02u",
+                 (unsigned)(m_last_tm.tm_year + 1900) % 10000, (unsigned)(m_last_tm.tm_mon + 1) % 100,
+                 (unsigned)m_last_tm.tm_mday % 100, (unsigned)m_last_tm.tm_hour % 100,
+                 (unsigned)m_last_tm.tm_min % 100, (unsigned)m_last_tm.tm_sec % 100);
+        m_last_sec = sec;
+    }
+    m_count++;
+    if (need_rotate(m_last_tm.tm_mday, h->len))
+    {
+        flush_out();
+        maybe_sync(true);
+        rotate(m_last_tm);
+    }
 
-    // 内容格式化，用于向字符串中打印数据、数据格式用户自定义
-    // 返回写入到字符数组 str 中的字符个数(不包含终止符)
-    int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, valst);
-    m_buf[n + m] = '\n';
-    m_buf[n + m + 1] = '\0';
-    log_str = m_buf;
+    const char *payload = (const char *)(h + 1);
+    size_t payload_len = h->len - sizeof(log_rec_hdr);
+    if (h->fid != LOG_FID_TEXT && h->fid >= m_nformats.load(memory_order_acquire))
+    {
+        return;     // 不会发生：编号都是登记过的
+    }
 
-    m_mutex.unlock();
-    
-    // 若 m_is_async 为 true 表示异步，默认同步
-    // 若异步，则将日志信息假如阻塞队列，同步则加锁向文件中写
-    if (m_is_async && !m_log_queue->full())
+    if (m_binary)
+    {
+        if (h->fid != LOG_FID_TEXT && !m_fmt_written[h->fid])
+        {
+            const log_format &f = m_formats[h->fid];
+            size_t flen = strlen(f.file) + 1;
+            size_t slen = strlen(f.format) + 1;
+            size_t def_len = sizeof(log_rec_hdr) + 2 + 4 + flen + slen;
+            char *p = out_reserve(log_rec_align(def_len));
+            memset(p, 0, log_rec_align(def_len));
+            log_rec_hdr *d = (log_rec_hdr *)p;
+            d->len = def_len;
+            d->fid = LOG_FID_FORMAT;
+            d->level = f.level;
+            d->usec = h->usec;
+            p += sizeof(log_rec_hdr);
+            uint16_t fid = h->fid;
+            uint32_t line = f.line;
+            memcpy(p, &fid, 2);
+            memcpy(p + 2, &line, 4);
+            memcpy(p + 6, f.file, flen);
+            memcpy(p + 6 + flen, f.format, slen);
+            out_commit(log_rec_align(def_len));
+            m_fmt_written[h->fid] = true;
+        }
+        out_append((const char *)h, log_rec_align(h->len));
+        return;
+    }
+
+    if (h->fid == LOG_FID_TEXT)
     {
-        m_log_queue->push(log_str);
+        out_append(payload, payload_len);
+        return;
     }
-    else 
+
+    // 和write_log同样的格式：时间 级别 内容，最后补一个换行
+    char *p = out_reserve(m_log_buf_size + 64);
+    int n = snprintf(p, 64, "%s.%06ld %s", m_stamp, (long)(h->usec % 1000000), log_level_str(h->level));
+    n += log_format_args(m_formats[h->fid].format, payload, payload_len, p + n, m_log_buf_size);
+    p[n++] = '\n';
+    out_commit(n);
+}
+
+// 从所有缓冲区中取出已写好的记录，合并成尽量少的writev写入文件
+size_t Log::drain()
+{
+    size_t bytes = 0;
+
+    m_ring_lock.lock();
+    log_ring **link = &m_rings;
+    while (*link)
     {
-        m_mutex.lock();
-        fputs(log_str.c_str(), m_fp);
-        m_mutex.unlock();
+        log_ring *r = *link;
+        // 先看dead再看tail：线程退出前写的日志一定能看到
+        bool dead = r->dead.load(memory_order_acquire);
+        size_t h = r->head.load(memory_order_relaxed);
+        size_t t = r->tail.load(memory_order_acquire);
+        if (t == h && dead)
+        {
+            *link = r->next;
+            delete[] r->data;
+            delete[] r->fmt;
+            log_ring::destroy(r);
+            continue;
+        }
+        if (t != h)
+        {
+            bytes += t - h;
+            while (h != t)
+            {
+                const log_rec_hdr *rec = (const log_rec_hdr *)(r->data + (h & r->mask));
+                if (rec->fid == LOG_FID_PAD)
+                {
+                    h += rec->len;
+                    continue;
+                }
+                consume(rec);
+                h += log_rec_align(rec->len);
+            }
+            // 这些记录可能还被m_iov引用着，写出之后才能归还
+            m_release.push_back(make_pair(r, t));
+        }
+        link = &r->next;
     }
-    va_end(valst);
+    flush_out();
+    m_ring_lock.unlock();
+
+    maybe_sync(false);
+    return bytes;
 }
 
+void Log::async_write_log()
+{
+    while (!m_stop)
+    {
+        // 没有设置攒批间隔时，有日志就立刻写
+        if (drain() > 0 && m_flush_interval_ms <= 0)
+        {
+            continue;
+        }
+        // 先声明要睡眠再检查一次，避免和生产者的唤醒错过
+        m_sleeping = true;
+        if (m_flush_interval_ms <= 0 && drain() > 0)
+        {
+            m_sleeping = false;
+            continue;
+        }
+        struct pollfd pfd;
+        pfd.fd = m_event_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, m_flush_interval_ms > 0 ? m_flush_interval_ms : 100) > 0)
+        {
+            uint64_t cnt;
+            read(m_event_fd, &cnt, sizeof(cnt));
+        }
+        m_sleeping = false;
+        report_overflow();
+    }
+    while (drain() > 0)
+    {
+    }
+    maybe_sync(true);
+}
+
+// 每秒最多一次，把这段时间内缓冲区满的情况记进日志本身
+void Log::report_overflow()
+{
+    int64_t now = clock_cache::GetInstance()->now_usec();
+    if (now - m_last_report_usec < 1000000)
+    {
+        return;
+    }
+    m_last_report_usec = now;
+    log_overflow_stats cur;
+    overflow_stats(cur);
+    if (memcmp(&cur, &m_reported, sizeof(cur)) == 0)
+    {
+        return;
+    }
+    LOG_WARN("log buffer overflow: dropped %llu, spilled %llu, direct %llu, blocked %llu (%llu us)",
+             (unsigned long long)(cur.dropped - m_reported.dropped),
+             (unsigned long long)(cur.spilled - m_reported.spilled),
+             (unsigned long long)(cur.direct - m_reported.direct),
+             (unsigned long long)(cur.blocked - m_reported.blocked),
+             (unsigned long long)(cur.block_usec - m_reported.block_usec));
+    m_reported = cur;
+}
+
+// 日志都直接交给write，用户态没有缓冲，这里不需要做什么
+// 以前的LOG_*宏每条日志之后都会调用它，现在已经不调用了
 void Log::flush(void)
 {
-    m_mutex.lock();
-    // 强制刷新写入流缓冲区
-    fflush(m_fp);
-    m_mutex.unlock();
 }
@@ -6,13 +6,49 @@
 #include <string>
 #include <stdarg.h>
 #include <pthread.h>
-#include "block_queue.h"
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <sys/uio.h>
+#include "locker.h"
+#include "log_record.h"
+#include "clock_cache.h"
 
 using namespace std;
 
+// 异步模式下缓冲区满时的处理情况，计数从进程启动开始累计
+struct log_overflow_stats
+{
+    uint64_t direct;        // 在调用线程直接写文件的条数
+    uint64_t dropped;       // 丢弃的条数（包括抽样丢掉、等待超时、溢出文件写满）
+    uint64_t spilled;       // 写进溢出文件的条数
+    uint64_t blocked;       // 等待缓冲区腾出空间的次数
+    uint64_t block_usec;    // 累计等待的微秒数
+};
+
+/************************************************************
+*日志。同步模式下调用线程直接write到日志文件
+*异步模式下每个线程把日志记录写进自己的环形缓冲区（单生产者单消费者），
+*后台线程批量取出所有缓冲区的内容，合并成一次writev写入文件，按配置定期fdatasync（组提交），
+*并负责按天/按行数/按大小切分日志
+*写日志的线程不加锁、不分配内存；缓冲区满时按set_overflow配置的策略处理
+*
+*LOG_*宏只记录调用点的格式编号和原始参数，格式化推迟到日志线程；
+*二进制模式下日志线程连格式化也不做，直接写二进制文件，用tools/log_decode解码
+************************************************************/
 class Log
 {
 public:
+    // 缓冲区满时的策略
+    enum OVERFLOW_POLICY
+    {
+        OVERFLOW_WRITE = 0,     // 在调用线程直接写文件，不丢日志，但磁盘慢时请求也跟着慢
+        OVERFLOW_DROP,          // 丢弃并计数
+        OVERFLOW_SAMPLE,        // 每arg条保留一条直接写文件，其余丢弃
+        OVERFLOW_BLOCK,         // 等待日志线程腾出空间，最多arg毫秒，超时丢弃
+        OVERFLOW_SPILL          // 追加到mmap的溢出文件（大小arg MB），不进内核，写满后丢弃
+    };
+
     // C++11以后，使用局部变量懒汉不用加锁
     static Log *get_instance()
     {
@@ -23,52 +59,232 @@ public:
     // 异步写日志公有方法，调用私有方法 async_write_log
     static void *flush_log_thread(void * args)
     {
-        // printf("flush_log_thread\n");
         // 静态成员函数调用非静态成员函数
         // 以及单例模式下的调用方法
         Log::get_instance()->async_write_log();
+        return NULL;
     }
 
     // 可选择的参数有日志文件、日志缓冲区大小、最大行数以及最长日志条队列
-    bool init(const char *file_name, int close_log, int log_buf_size=8192, int split_lines=5000000, int max_queue_size=0);
+    // max_queue_size >= 1 时为异步模式，每个线程的环形缓冲区按能容纳max_queue_size条日志估算大小
+    // binary为true时（仅异步模式有效）日志文件为二进制格式，文件名加.bin后缀
+    // level为初始的运行时级别
+    bool init(const char *file_name, int close_log, int log_buf_size=8192, int split_lines=5000000, int max_queue_size=0,
+              bool binary=false, int level=1);
 
+    // 按文件大小切分，split_bytes为0表示不限制（按天、按行数的切分始终有效）。需在init之前调用
+    void set_rotation(long split_bytes);
+    // 异步模式的写盘策略，需在init之前调用
+    // flush_interval_ms：日志线程攒批的间隔，0表示有日志就写；缓冲区过半时会提前写
+    // fsync_interval_ms / fsync_bytes：距上次fdatasync超过这么多毫秒或字节时同步一次，都为0表示不主动同步
+    void set_commit(int flush_interval_ms, int fsync_interval_ms, long fsync_bytes);
+    // 缓冲区满时的策略和参数，见OVERFLOW_POLICY。需在init之前调用，默认OVERFLOW_WRITE
+    // 溢出文件和日志放在同一目录，名为"日期_日志名.进程号.spill"，正常退出时截掉没用到的部分，没用到则删除
+    void set_overflow(int policy, int arg);
+    void overflow_stats(log_overflow_stats &stats);
+
+    // 直接写一条日志，不检查级别。一般使用下面的LOG_*宏
     void write_log(int level, const char *format, ...);
 
-    void flush(void);
+    // 运行时级别，低于它的日志不记录。close_log为1时为LOG_LEVEL_OFF
+    bool enabled(int level) { return level >= m_level.load(memory_order_relaxed); }
+    void set_level(int level) { m_level.store(level, memory_order_relaxed); }
+    int get_level() { return m_level.load(memory_order_relaxed); }
 
-private:
-    Log();
-    virtual ~Log();     // 为什么要虚？
-    void *async_write_log()
+    // 登记一个LOG_*调用点，返回格式编号，登记满了返回-1
+    int register_format(int level, const char *format, const char *file, int line);
+
+    // 记录格式编号和原始参数。参数只能是整数、浮点数、字符串和指针
+    template <typename... Args>
+    void write_fast(int fid, int level, const char *format, Args... args)
     {
-        string single_log;
-        // 从阻塞队列中取出一个日志string，写入文件
-        while (m_log_queue->pop(single_log))
+        size_t len = sizeof(log_rec_hdr) + log_args_size(args...);
+        if (!m_is_async || fid < 0 || len > MAX_RECORD)
+        {
+            write_log(level, format, args...);
+            return;
+        }
+        log_ring *r = local_ring();
+        char *p = reserve_record(r, log_rec_align(len));
+        if (p == NULL)
         {
-            m_mutex.lock();
-            fputs(single_log.c_str(), m_fp);
-            m_mutex.unlock();
+            write_overflow(level, format, args...);
+            return;
         }
+        log_rec_hdr *h = (log_rec_hdr *)p;
+        h->len = len;
+        h->fid = fid;
+        h->level = level;
+        h->reserved = 0;
+        h->usec = clock_cache::GetInstance()->now_usec();
+        log_args_put(p + sizeof(log_rec_hdr), args...);
+        r->commit(log_rec_align(len));
+        wake_writer(r);
     }
 
+    void flush(void);
+
+private:
+    static const size_t MAX_RECORD = 16 * 1024;     // 单条记录的上限，超过的直接格式化成文本
+
+    // 一个线程的日志缓冲区，生产者只改tail，消费者只改head
+    // 缓冲区中是一条条log_rec_hdr开头的记录，记录不会跨越缓冲区末尾
+    struct log_ring
+    {
+        char *data;                 // 环形缓冲区，同步模式下为NULL
+        size_t mask;                // 容量-1，容量为2的幂
+        char *fmt;                  // 本线程格式化日志用的缓冲区
+        size_t reserved;            // reserve()得到的位置，commit()时发布
+        alignas(64) atomic<size_t> head;
+        alignas(64) atomic<size_t> tail;
+        atomic<bool> dead;          // 线程已退出，取空后由消费者释放
+        log_ring *next;
+
+        char *reserve(size_t len);  // 预留len字节（已对齐）的连续空间，空间不够返回NULL
+        void commit(size_t len);
+
+        // C++11的new不保证64字节对齐，用posix_memalign分配，head和tail才真正各占一个缓存行
+        static log_ring *create();
+        static void destroy(log_ring *r);
+    };
+
+    // 一个LOG_*调用点
+    struct log_format
+    {
+        const char *format;
+        const char *file;
+        int line;
+        int level;
+    };
+
+    // 线程退出时标记它的缓冲区
+    struct ring_holder
+    {
+        log_ring *ring;
+        ~ring_holder();
+    };
+
+    Log();
+    virtual ~Log();     // 为什么要虚？
+
+    log_ring *local_ring();
+    void wake_writer(log_ring *r);
+    char *reserve_record(log_ring *r, size_t len);  // 在缓冲区中预留空间，OVERFLOW_BLOCK时等待
+    void write_log_v(int level, bool ring_full, const char *format, va_list valst);
+    void write_overflow(int level, const char *format, ...);
+    bool admit_overflow();                          // 缓冲区满的这条是否还要写（DROP/SAMPLE/BLOCK在格式化前决定）
+    void overflow_write(int level, int64_t usec, const char *buf, size_t len);
+    bool open_spill(const char *path);
+    void close_spill();
+    void report_overflow();
+    void async_write_log();
+    size_t drain();                                 // 写出所有缓冲区中的日志，返回字节数
+    void consume(const log_rec_hdr *h);             // 日志线程处理一条记录
+    char *out_reserve(size_t len);                  // 在输出缓冲中预留空间，不够时先写出
+    void out_commit(size_t len);
+    void out_append(const char *buf, size_t len);   // 把一段数据加入下一次writev
+    void flush_out();
+    void maybe_sync(bool force);
+    bool need_rotate(int mday, size_t incoming);
+    void rotate(const struct tm &my_tm);            // 按天或按行数切换日志文件
+    bool open_file(const char *path);               // 打开日志文件，并替换到m_fd上
+    void write_fd(const char *buf, size_t len);
+
 private:
     char dir_name[128];     // 路径名
     char log_name[128];     // log文件名
     int m_split_lines;      // 日志最大行数
     int m_log_buf_size;     // 日志缓冲区大小
+    size_t m_ring_size;     // 每个线程环形缓冲区的字节数
+    long m_split_bytes;     // 单个文件的大小上限，0表示不限制
     long long m_count;      // 日志行数记录
+    int m_file_seq;         // 当天切分出的文件序号
+    size_t m_file_bytes;    // 当前文件已写入的字节数
     int m_today;            // 因为按天分类，记录当前时间是那一天
-    FILE *m_fp;             // 打开log的文件指针
-    char *m_buf;            
-    block_queue<string> *m_log_queue;   // 阻塞队列
+    int m_fd;               // 日志文件，切分时用dup2原地替换，其他线程持有的fd始终有效
     bool m_is_async;        // 是否同步标志位
-    locker m_mutex;
+    bool m_binary;          // 是否写二进制日志
+    locker m_mutex;         // 同步模式下保护切分
     int m_close_log;        // 关闭日志
+    atomic<int> m_level;    // 运行时级别
+
+    locker m_ring_lock;             // 保护缓冲区链表（只在线程注册和消费者遍历时使用）
+    log_ring *m_rings;
+    int m_event_fd;                 // 消费者空闲时在这里等待
+    atomic<bool> m_sleeping;        // 消费者是否在等待，生产者只在它等待时才写eventfd
+    atomic<bool> m_stop;
+    pthread_t m_tid;
+
+    locker m_fmt_lock;
+    log_format m_formats[LOG_MAX_FORMATS];
+    atomic<int> m_nformats;
+    bool m_fmt_written[LOG_MAX_FORMATS];    // 二进制模式下当前文件是否已写过该格式的定义
+
+    int m_flush_interval_ms;
+    int m_fsync_interval_ms;
+    long m_fsync_bytes;
+
+    int m_overflow;                 // OVERFLOW_POLICY
+    int m_overflow_arg;
+    atomic<uint64_t> m_overflow_seq;    // OVERFLOW_SAMPLE的抽样序号
+    atomic<uint64_t> m_direct;
+    atomic<uint64_t> m_dropped;
+    atomic<uint64_t> m_spilled;
+    atomic<uint64_t> m_blocked;
+    atomic<uint64_t> m_block_usec;
+    int m_spill_fd;
+    char *m_spill;                  // 溢出文件的映射
+    size_t m_spill_size;
+    atomic<size_t> m_spill_used;    // 已分配出去的字节数，可能超过m_spill_size
+    atomic<size_t> m_spill_end;     // 第一次分配失败时的位置，即有效内容的末尾
+    char m_spill_path[288];
+
+    // 以下只由日志线程使用
+    static const int LOG_IOV_MAX = 1024;
+    char *m_out;                // 格式化结果的输出缓冲
+    size_t m_out_len;
+    struct iovec m_iov[LOG_IOV_MAX];    // 下一次writev的内容，大部分直接指向环形缓冲区
+    int m_niov;
+    size_t m_pending_bytes;
+    vector<pair<log_ring *, size_t> > m_release;   // writev之后要归还的缓冲区及新的head
+    size_t m_unsynced;          // 上次fdatasync之后写入的字节数
+    int64_t m_last_sync_usec;
+    time_t m_last_sec;          // m_stamp对应的秒
+    char m_stamp[32];           // 格式化好的"年-月-日 时:分:秒"
+    struct tm m_last_tm;
+    log_overflow_stats m_reported;  // 上次报告时的计数
+    int64_t m_last_report_usec;
+
+    static thread_local ring_holder t_ring;
 };
 
-#define LOG_DEBUG(format, ...) if (0 == m_close_log) {Log::get_instance()->write_log(0, format, ##__VA_ARGS__); Log::get_instance()->flush();}
-#define LOG_INFO(format, ...) if (0 == m_close_log) {Log::get_instance()->write_log(1, format, ##__VA_ARGS__); Log::get_instance()->flush();}
-#define LOG_WARN(format, ...) if (0 == m_close_log) {Log::get_instance()->write_log(2, format, ##__VA_ARGS__); Log::get_instance()->flush();}
-#define LOG_ERROR(format, ...) if (0 == m_close_log) {Log::get_instance()->write_log(3, format, ##__VA_ARGS__); Log::get_instance()->flush();}
+/************************************************************
+*分级日志宏。低于LOG_MIN_LEVEL的调用点在编译期被整个去掉，
+*其余的先和运行时级别比较（一次relaxed原子读），不需要记录时参数都不会求值
+*记录时只保存格式编号和原始参数，格式化推迟到日志线程（同步模式下当场格式化）
+*参数只能是整数、浮点数、字符串和指针
+************************************************************/
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+// 编译期最低级别，例如 -DLOG_MIN_LEVEL=1 去掉所有LOG_DEBUG
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_AT(level, format, ...) do { \
+        if ((level) >= LOG_MIN_LEVEL && Log::get_instance()->enabled(level)) { \
+            static const int log_fid_ = Log::get_instance()->register_format(level, format, __FILE__, __LINE__); \
+            Log::get_instance()->write_fast(log_fid_, level, format, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_DEBUG(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) LOG_AT(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOG_ERROR(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,359 @@
+#ifndef LOG_RECORD_H
+#define LOG_RECORD_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <type_traits>
+
+/************************************************************
+*日志缓冲区和二进制日志文件中的记录格式，日志线程和离线解码工具tools/log_decode共用
+*一条记录 = log_rec_hdr + 内容，整体按8字节对齐
+*  fid为LOG_FID_TEXT：内容是格式化好的一行文本
+*  fid为格式编号：内容是调用点的原始参数，由日志线程或解码工具按格式串格式化
+*参数依次编码为 1字节类型 + 值：
+*  'i' int64   'u' uint64   'f' double   'p' 指针(uint64)
+*  'n' int（4字节及以下的整数经过整型提升后的类型，值按符号扩展成8字节）   'v' unsigned int（值为8字节）
+*  's' uint16长度(含'\0') + 字符串
+*整数记下原来的宽度，%x、%u输出32位的-1时和printf一样是ffffffff、4294967295
+*二进制日志文件以LOG_BIN_MAGIC开头，格式编号第一次出现之前先写一条LOG_FID_FORMAT记录，
+*内容为 uint16编号 + uint32行号 + 文件名'\0' + 格式串'\0'，每个文件都可以单独解码
+************************************************************/
+
+static const uint16_t LOG_FID_TEXT = 0;
+static const uint16_t LOG_FID_FORMAT = 0xFFFE;
+static const uint16_t LOG_FID_PAD = 0xFFFF;     // 环形缓冲区末尾的填充，不会出现在文件中
+static const int LOG_MAX_FORMATS = 4096;
+static const size_t LOG_MAX_STRING = 1024;      // 单个字符串参数最多记录的字节数
+
+static const char LOG_BIN_MAGIC[8] = {'W', 'S', 'L', 'O', 'G', 'B', '1', '\n'};
+
+struct log_rec_hdr
+{
+    uint32_t len;       // 头部 + 内容的字节数，不含对齐填充
+    uint16_t fid;
+    uint8_t level;
+    uint8_t reserved;
+    int64_t usec;       // 写日志时的时间，微秒
+};
+
+inline size_t log_rec_align(size_t len)
+{
+    return (len + 7) & ~(size_t)7;
+}
+
+inline const char *log_level_str(int level)
+{
+    switch (level)
+    {
+    case 0:
+        return "[debug]:";
+    case 1:
+        return "[info]:";
+    case 2:
+        return "[warn]:";
+    case 3:
+        return "[erro]:";
+    default:
+        return "[info]";
+    }
+}
+
+/*******************
+*   参数编码
+*******************/
+
+inline size_t log_str_len(const char *s)
+{
+    size_t n = s ? strlen(s) : 6;      // NULL记为"(null)"
+    return n > LOG_MAX_STRING ? LOG_MAX_STRING : n;
+}
+
+template <class T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_floating_point<T>::value || std::is_enum<T>::value, size_t>::type
+log_arg_size(T)
+{
+    return 9;
+}
+
+inline size_t log_arg_size(const char *s) { return 3 + log_str_len(s) + 1; }
+inline size_t log_arg_size(char *s) { return log_arg_size((const char *)s); }
+inline size_t log_arg_size(const void *) { return 9; }
+
+inline size_t log_args_size() { return 0; }
+
+template <class T, class... Rest>
+inline size_t log_args_size(T v, Rest... rest)
+{
+    return log_arg_size(v) + log_args_size(rest...);
+}
+
+inline char *log_put_tag(char *p, char tag, const void *v, size_t n)
+{
+    *p++ = tag;
+    memcpy(p, v, n);
+    return p + n;
+}
+
+// 比int窄的整数按可变参数的规则提升为int
+template <class T>
+inline typename std::enable_if<(std::is_integral<T>::value || std::is_enum<T>::value) && std::is_signed<T>::value, char *>::type
+log_arg_put(char *p, T v)
+{
+    int64_t x = v;
+    return log_put_tag(p, sizeof(T) <= 4 ? 'n' : 'i', &x, 8);
+}
+
+template <class T>
+inline typename std::enable_if<(std::is_integral<T>::value || std::is_enum<T>::value) && !std::is_signed<T>::value, char *>::type
+log_arg_put(char *p, T v)
+{
+    uint64_t x = v;
+    return log_put_tag(p, sizeof(T) < 4 ? 'n' : (sizeof(T) == 4 ? 'v' : 'u'), &x, 8);
+}
+
+template <class T>
+inline typename std::enable_if<std::is_floating_point<T>::value, char *>::type
+log_arg_put(char *p, T v)
+{
+    double x = v;
+    return log_put_tag(p, 'f', &x, 8);
+}
+
+inline char *log_arg_put(char *p, const char *s)
+{
+    uint16_t n = (uint16_t)log_str_len(s);
+    *p++ = 's';
+    uint16_t total = n + 1;
+    memcpy(p, &total, 2);
+    p += 2;
+    memcpy(p, s ? s : "(null)", n);
+    p += n;
+    *p++ = '\0';
+    return p;
+}
+
+inline char *log_arg_put(char *p, char *s) { return log_arg_put(p, (const char *)s); }
+
+inline char *log_arg_put(char *p, const void *v)
+{
+    uint64_t x = (uint64_t)(uintptr_t)v;
+    return log_put_tag(p, 'p', &x, 8);
+}
+
+inline char *log_args_put(char *p) { return p; }
+
+template <class T, class... Rest>
+inline char *log_args_put(char *p, T v, Rest... rest)
+{
+    return log_args_put(log_arg_put(p, v), rest...);
+}
+
+/*******************
+*   解码
+*******************/
+
+inline bool log_int_tag(char tag)
+{
+    return tag == 'i' || tag == 'u' || tag == 'n' || tag == 'v';
+}
+
+// 按参数原来的宽度截断：'n'、'v'是32位
+inline long long log_int_signed(char tag, int64_t v)
+{
+    return (tag == 'n' || tag == 'v') ? (long long)(int32_t)v : (long long)v;
+}
+
+inline unsigned long long log_int_unsigned(char tag, int64_t v)
+{
+    return (tag == 'n' || tag == 'v') ? (unsigned long long)(uint32_t)v : (unsigned long long)v;
+}
+
+// 依次取出编码后的参数
+struct log_arg_reader
+{
+    const char *p;
+    const char *end;
+
+    // 取下一个参数，返回类型字符，参数不足或数据损坏返回0
+    char next(int64_t &i, double &f, const char *&s)
+    {
+        if (p >= end)
+        {
+            return 0;
+        }
+        char tag = *p++;
+        if (tag == 's')
+        {
+            uint16_t n;
+            if (end - p < 2)
+            {
+                return 0;
+            }
+            memcpy(&n, p, 2);
+            p += 2;
+            if (n == 0 || end - p < n)
+            {
+                return 0;
+            }
+            s = p;
+            p += n;
+            return tag;
+        }
+        if (end - p < 8)
+        {
+            return 0;
+        }
+        if (tag == 'f')
+        {
+            memcpy(&f, p, 8);
+        }
+        else
+        {
+            memcpy(&i, p, 8);
+        }
+        p += 8;
+        return tag;
+    }
+};
+
+// 按printf格式串把编码后的参数格式化到out，返回写入的字节数（不含'\0'）
+// 长度修饰符(h/l/ll/z...)被忽略，整数按参数原来的宽度（int或64位）输出；类型对不上的参数输出"<?>"
+inline int log_format_args(const char *fmt, const char *args, size_t args_len, char *out, int out_len)
+{
+    log_arg_reader rd = {args, args + args_len};
+    int n = 0;
+    const char *f = fmt;
+    if (out_len <= 0)
+    {
+        return 0;
+    }
+    while (*f && n < out_len - 1)
+    {
+        if (*f != '%')
+        {
+            out[n++] = *f++;
+            continue;
+        }
+        if (f[1] == '%')
+        {
+            out[n++] = '%';
+            f += 2;
+            continue;
+        }
+        // 复制标志、宽度、精度，去掉长度修饰符；spec最多SPEC_MAX字节，后面留给"ll"、转换字符和'\0'。
+        // 格式串可能来自要解码的日志文件，放不下的整个转换输出"<?>"，对应的参数照常跳过
+        const int SPEC_MAX = 24;
+        char spec[SPEC_MAX + 4];
+        int k = 0;
+        bool fits = true;
+        spec[k++] = *f++;
+        while (*f && strchr("-+ #0123456789.*", *f))
+        {
+            if (*f == '*')
+            {
+                // 宽度/精度来自参数：直接替换为数字
+                int64_t iv = 0;
+                double fv;
+                const char *sv;
+                char tag = rd.next(iv, fv, sv);
+                char num[16];
+                int len = snprintf(num, sizeof(num), "%d", log_int_tag(tag) ? (int)iv : 0);
+                if (k + len <= SPEC_MAX)
+                {
+                    memcpy(spec + k, num, len);
+                    k += len;
+                }
+                else
+                {
+                    fits = false;
+                }
+                f++;
+                continue;
+            }
+            if (k < SPEC_MAX)
+            {
+                spec[k++] = *f;
+            }
+            else
+            {
+                fits = false;
+            }
+            f++;
+        }
+        while (*f && strchr("hlLqjzt", *f))
+        {
+            f++;
+        }
+        char conv = *f;
+        if (conv == '\0')
+        {
+            break;
+        }
+        f++;
+
+        int64_t iv = 0;
+        double fv = 0;
+        const char *sv = NULL;
+        char tag = rd.next(iv, fv, sv);
+        int room = out_len - n;
+        int w = 0;
+        if (!fits)
+        {
+            w = snprintf(out + n, room, "<?>");
+        }
+        else if (strchr("diouxXc", conv) && (log_int_tag(tag) || tag == 'p'))
+        {
+            if (conv == 'c')
+            {
+                spec[k++] = 'c';
+                spec[k] = '\0';
+                w = snprintf(out + n, room, spec, (int)iv);
+            }
+            else
+            {
+                spec[k++] = 'l';
+                spec[k++] = 'l';
+                spec[k++] = conv;
+                spec[k] = '\0';
+                if (conv == 'd' || conv == 'i')
+                {
+                    w = snprintf(out + n, room, spec, log_int_signed(tag, iv));
+                }
+                else
+                {
+                    w = snprintf(out + n, room, spec, log_int_unsigned(tag, iv));
+                }
+            }
+        }
+        else if (strchr("fFeEgGaA", conv) && tag == 'f')
+        {
+            spec[k++] = conv;
+            spec[k] = '\0';
+            w = snprintf(out + n, room, spec, fv);
+        }
+        else if (conv == 's' && tag == 's')
+        {
+            spec[k++] = 's';
+            spec[k] = '\0';
+            w = snprintf(out + n, room, spec, sv);
+        }
+        else if (conv == 'p' && (tag == 'p' || log_int_tag(tag)))
+        {
+            w = snprintf(out + n, room, "%p", (void *)(uintptr_t)iv);
+        }
+        else
+        {
+            w = snprintf(out + n, room, "<?>");
+        }
+        if (w < 0)
+        {
+            w = 0;
+        }
+        n += (w < room) ? w : room - 1;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+#endif
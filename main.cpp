@@ -19,12 +19,17 @@
 #include "log.h"
 #include "sql_connection_pool.h"
 #include "redis_pool.h"
+#include "user_cache.h"
+#include "redis_async.h"
+#include "metrics.h"
+#include "capture.h"
+#include "rate_limit.h"
+#include "handoff.h"
+#include "config.h"
+#include "tls.h"
+#include "h2_conn.h"
 
-#define MAXFD               65535
-#define MAX_EVENT_NUMBER    10000
 #define TIMESLOT            1
-#define TIMEOUT             100
-#define BACKLOG             5
 
 extern int addfd(int epollfd, int fd, bool one_shot);
 extern int removefd(int epollfd, int fd);
@@ -58,7 +63,7 @@ void addsig(int sig, void(handler)(int), bool restart=true)
 
 void show_error(int connfd, const char* info)
 {
-    Log::get_instance()->write_log(1, "%s", info);
+    LOG_INFO("%s", info);
     send(connfd, info, strlen(info), 0);
     close(connfd);
 }
@@ -67,38 +72,392 @@ void show_error(int connfd, const char* info)
 void cb_func(http_conn* user_data) {
     epoll_ctl(user_data->m_epollfd, EPOLL_CTL_DEL, user_data->m_sockfd, 0);
     assert(user_data);
+    user_data->release_h2();
+    user_data->release_tls();
     close(user_data->m_sockfd);
-    Log::get_instance()->write_log(1, "close fd %d\n", user_data->m_sockfd);
+    http_conn::m_user_count--;
+    metrics::GetInstance()->add(COUNTER_TIMER_EXPIRED);
+    LOG_DEBUG("close fd %d\n", user_data->m_sockfd);
+    // 标记为已关闭，排空时的扫描和迟到的异步回复不会再碰这个fd
+    user_data->m_sockfd = -1;
+}
+
+// /metrics中的瞬时值，抓取时在管理线程中调用
+static long gauge_active_conns()
+{
+    return http_conn::m_user_count;
+}
+
+static long gauge_queue_depth()
+{
+    return http_conn::m_threadpool ? http_conn::m_threadpool->queue_size() : 0;
+}
+
+static long gauge_overloaded()
+{
+    return http_conn::m_threadpool && http_conn::m_threadpool->overloaded() ? 1 : 0;
+}
+
+static long gauge_rate_clients()
+{
+    return rate_limiter::GetInstance()->size();
+}
+
+// 限速预算，格式为"每秒次数:突发次数"，每秒次数为0表示不限
+static void rate_from_config(const char* key, int budget)
+{
+    const char* v = config::GetInstance()->get(key);
+    double rate = atof(v);
+    const char* colon = strchr(v, ':');
+    int burst = colon ? atoi(colon + 1) : (int)(rate * 2);
+    rate_limiter::GetInstance()->set_budget(budget, rate, burst);
+}
+
+static void set_rate_limits()
+{
+    config* cfg = config::GetInstance();
+    rate_from_config("rate_conn", RATE_CONN);
+    rate_from_config("rate_static", RATE_STATIC);
+    rate_from_config("rate_backend", RATE_BACKEND);
+    rate_limiter::GetInstance()->set_exempt_loopback(cfg->get_int("rate_loopback") == 0);
+}
+
+// HTTP/2的开关和每个连接的并发流数，只影响之后切换的连接
+static void set_http2()
+{
+    config* cfg = config::GetInstance();
+    h2_conn::m_enabled = cfg->get_int("http2") != 0;
+    h2_conn::m_max_streams = cfg->get_int("h2_max_streams");
+}
+
+static long gauge_sql_idle()
+{
+    return connection_pool::GetInstance()->GetFreeConn();
+}
+
+static long gauge_redis_idle()
+{
+    return RedisPool::GetInstance()->GetFreeConn();
+}
+
+// 过载保护：线程池持续积压（CoDel判定）或连接数到上限时暂停accept，新连接留在内核的监听队列里，
+// 队列满了客户端自己重试SYN，已经在排队的请求不会被新连接拖得越来越慢
+static bool accept_paused = false;
+static int64_t accept_retry_ns = 0;     // 文件描述符用完之后，到这个时刻再accept
+static int max_connfd = -1;             // 用过的最大连接fd，排空时只扫描到这里
+static int max_fd = 65535;              // users数组的大小，启动时按配置设置
+static int conn_timeout = 100;          // 新连接的空闲超时（秒），可热加载
+
+static bool saturated(threadpool<http_conn>* pool)
+{
+    return pool->overloaded() || http_conn::m_user_count >= max_fd || metrics::now_ns() < accept_retry_ns;
+}
+
+// listenfd是ET模式，一次通知要把监听队列里的连接全部取出来；饱和时先停下，恢复后由主循环再调用
+// tls为true时是HTTPS端口，新连接先握手
+static void accept_conns(int listenfd, bool tls, http_conn* users, threadpool<http_conn>* pool)
+{
+    while (true)
+    {
+        if (saturated(pool))
+        {
+            if (!accept_paused)
+            {
+                accept_paused = true;
+                metrics::GetInstance()->add(COUNTER_ACCEPT_PAUSES);
+                LOG_WARN("overloaded, pause accepting: %d connections, %d queued\n",
+                         http_conn::m_user_count, pool->queue_size());
+            }
+            return;
+        }
+        if (accept_paused)
+        {
+            accept_paused = false;
+            LOG_INFO("resume accepting: %d connections, %d queued\n", http_conn::m_user_count, pool->queue_size());
+        }
+
+        struct sockaddr_in client_address;
+        socklen_t client_addresslen = sizeof(client_address);
+        int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addresslen);
+        if (connfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                // 连接留在监听队列里，100ms后再试，期间也算饱和
+                LOG_WARN("accept: out of file descriptors, errno %d\n", errno);
+                accept_retry_ns = metrics::now_ns() + 100000000LL;
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                LOG_ERROR("accept: errno is %d\n", errno);
+            }
+            return;
+        }
+        // users按fd下标存放，超出范围的连接只能拒绝；HTTPS连接握手之前没法回明文，直接关闭
+        if (connfd >= max_fd)
+        {
+            if (!tls)
+            {
+                http_conn::reply_busy(connfd);
+            }
+            close(connfd);
+            continue;
+        }
+        if (!rate_limiter::GetInstance()->allow(client_address.sin_addr.s_addr, RATE_CONN))
+        {
+            if (!tls)
+            {
+                http_conn::reply_limited(connfd);
+            }
+            close(connfd);
+            metrics::GetInstance()->add(COUNTER_LIMITED_CONNS);
+            continue;
+        }
+        metrics::GetInstance()->add(COUNTER_ACCEPTS);
+        if (connfd > max_connfd)
+        {
+            max_connfd = connfd;
+        }
+        SSL* ssl = NULL;
+        if (tls && (ssl = tls_context::GetInstance()->create(connfd)) == NULL)
+        {
+            LOG_ERROR("tls: cannot create a session for fd %d\n", connfd);
+            close(connfd);
+            continue;
+        }
+        users[connfd].init(connfd, client_address);
+        if (ssl)
+        {
+            users[connfd].start_tls(ssl);
+        }
+        tw_timer* timer = http_conn::m_twheel.add_timer(conn_timeout);
+        timer->user_data = &users[connfd];
+        timer->cb_func = cb_func;
+        users[connfd].m_timer = timer;
+    }
+}
+
+// 监听服务端口；热升级时不调用，直接用旧进程交过来的fd
+static int open_listenfd(const char* ip, int port, int backlog)
+{
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &address.sin_addr);
+    address.sin_port = htons(port);
+
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    assert(listenfd >= 0);
+    // 第一个值：0表示关闭，1表示开启；第二个值：如果开启，套接口关闭时内核将拖延一段时间（这里是拖延0秒，就是立即关闭）
+    // 
+    // struct linger lin = {1, 0};     
+    // setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    // 重启时端口上还有TIME_WAIT的连接也能绑定
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    int ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+    assert(ret != -1);
+
+    ret = listen(listenfd, backlog);
+    assert(ret >= 0);
+    return listenfd;
+}
+
+// 停机排空：关掉空闲的长连接，返回还在处理请求的连接数
+static int close_idle_conns(http_conn* users)
+{
+    int busy = 0;
+    for (int fd = 0; fd <= max_connfd; fd++)
+    {
+        if (users[fd].m_sockfd == -1)
+        {
+            continue;
+        }
+        if (users[fd].idle())
+        {
+            users[fd].close_conn();
+        }
+        else
+        {
+            busy++;
+        }
+    }
+    return busy;
+}
+
+// 主线程读请求，完整的请求交给线程池；超过限速或过载时直接拒绝
+static void read_request(http_conn* users, int sockfd, threadpool<http_conn>* pool)
+{
+    // ALPN选中h2的HTTPS连接在握手完成后直接到这里
+    if (users[sockfd].http2())
+    {
+        if (!users[sockfd].h2_handle())
+        {
+            users[sockfd].close_conn();
+        }
+        return;
+    }
+    metrics* stats = metrics::GetInstance();
+    int64_t start = metrics::now_ns();
+    bool ok = users[sockfd].read();
+    stats->observe(STAGE_READ, metrics::now_ns() - start);
+    if (!ok)
+    {
+        users[sockfd].close_conn();
+    }
+    // 以HTTP/2连接前言开头的明文连接（h2c prior knowledge），之后的帧由h2_conn处理
+    else if (users[sockfd].detect_h2())
+    {
+        if (!users[sockfd].h2_handle())
+        {
+            users[sockfd].close_conn();
+        }
+    }
+    else if (users[sockfd].rate_limited())
+    {
+        users[sockfd].reject_limited();
+    }
+    // 线程池持续积压或队列已满时直接回503，不再排队
+    else if (pool->overloaded() || !pool->append(users + sockfd))
+    {
+        users[sockfd].reject_busy();
+    }
+}
+
+// HTTPS的证书、私钥和票据密钥
+static bool load_tls(string& err)
+{
+    config* cfg = config::GetInstance();
+    return tls_context::GetInstance()->init(cfg->get("tls_cert"), cfg->get("tls_key"), cfg->get("tls_ticket_key"),
+                                            cfg->get_int("http2") != 0, err);
 }
 
 void timer_handler() {
     // 定时处理任务，实际上就是调用tick函数
     http_conn::m_twheel.tick();
+    // 限速表里去掉已经安静下来的IP
+    rate_limiter::GetInstance()->compact();
+    // 录制的请求每秒至少落盘一次
+    traffic_capture::GetInstance()->flush();
     // 因为一次alarm调用只会引起一次SIGALRM信号，所以我们要重新定时，以不断触发SIGALRM信号
     alarm(TIMESLOT);
 }
 
+// 收到SIGHUP时重读配置文件，重新应用可以热加载的项；文件有错时整个放弃，保持原来的配置
+static void reload_config(threadpool<http_conn>* pool)
+{
+    config* cfg = config::GetInstance();
+    string err;
+    if (!cfg->reload(err))
+    {
+        LOG_ERROR("config: reload failed, keeping the current settings: %s\n", err.c_str());
+        return;
+    }
+    Log::get_instance()->set_level(cfg->get_level("log_level"));
+    conn_timeout = cfg->get_int("conn_timeout");
+    if (cfg->changed("max_queue") || cfg->changed("queue_target_ms") || cfg->changed("queue_interval_ms"))
+    {
+        pool->set_limits(cfg->get_int("max_queue"), cfg->get_int("queue_target_ms"), cfg->get_int("queue_interval_ms"));
+    }
+    connection_pool::GetInstance()->set_size(cfg->get_int("sql_max_conn"), cfg->get_int("sql_min_conn"));
+    connection_pool::GetInstance()->set_timeouts(cfg->get_int("sql_checkout_ms"),
+                                                 cfg->get_int("pool_idle_timeout"), cfg->get_int("pool_health_interval"));
+    RedisPool::GetInstance()->set_size(cfg->get_int("redis_max_conn"), cfg->get_int("redis_min_conn"));
+    RedisPool::GetInstance()->set_timeouts(cfg->get_int("redis_checkout_ms"),
+                                           cfg->get_int("pool_idle_timeout"), cfg->get_int("pool_health_interval"));
+    set_rate_limits();
+    set_http2();
+    if (cfg->changed("rate_max_clients"))
+    {
+        rate_limiter::GetInstance()->set_max_clients(cfg->get_int("rate_max_clients"));
+    }
+    if (cfg->changed("user_cache_mb") || cfg->changed("user_cache_ttl"))
+    {
+        user_cache::GetInstance()->resize(cfg->get_int("user_cache_mb") * 1024L * 1024, cfg->get_int("user_cache_ttl"));
+    }
+    // 证书续期通常原地覆盖文件，路径不变时按修改时间判断；都没变时保留原来的CTX和会话缓存
+    if (tls_context::GetInstance()->enabled() && !load_tls(err))
+    {
+        LOG_ERROR("tls: keeping the old certificate: %s\n", err.c_str());
+    }
+    LOG_INFO("config: reloaded %s\n", cfg->path().c_str());
+}
+
 int main(int argc, char* argv[])
 {
-    if (argc <= 2)
+    // 配置：-f指定配置文件，-o key=value覆盖单项（优先于配置文件和环境变量）
+    config* cfg = config::GetInstance();
+    const char* config_path = NULL;
+    string err;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:o:")) != -1)
+    {
+        if (opt == 'f')
+        {
+            config_path = optarg;
+        }
+        else if (opt == 'o' && cfg->set_override(optarg, err))
+        {
+            continue;
+        }
+        else
+        {
+            fprintf(stderr, "%s\n", err.empty() ? "bad option" : err.c_str());
+            return 1;
+        }
+    }
+    if (argc - optind < 2)
+    {
+        fprintf(stderr, "usage: %s [-f config_file] [-o key=value]... ip port_number [admin_port]\n", basename(argv[0]));
+        return 1;
+    }
+    if (!cfg->load(config_path, err))
     {
-        Log::get_instance()->write_log(1, "usage: %s ip port_number\n", basename(argv[0]));
+        fprintf(stderr, "config: %s\n", err.c_str());
         return 1;
     }
-    char* ip = argv[1];
-    int port = atoi(argv[2]);
+    char* ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+    // 管理端口只监听本机，默认为服务端口+1
+    int admin_port = argc - optind > 2 ? atoi(argv[optind + 2]) : port + 1;
     int ret = 0;
 
     // 开启异步写日志 
-    int LOGWrite = 1;
+    int LOGWrite = cfg->get_int("log_async");
     // 默认日志不关闭
     int m_close_log = 0;
+    // 运行时日志级别，收到SIGHUP时按配置文件重新设置
+    int m_log_level = cfg->get_level("log_level");
+
+    // 日志时间戳和响应的Date头都从这里取，每毫秒刷新一次
+    clock_cache::GetInstance()->start(1000);
+
+    // 单个日志文件最大100MB；异步日志按log_flush_ms攒一批写出，按log_fsync_ms/log_fsync_kb做fdatasync
+    Log::get_instance()->set_rotation(100L * 1024 * 1024);
+    Log::get_instance()->set_commit(cfg->get_int("log_flush_ms"), cfg->get_int("log_fsync_ms"), cfg->get_int("log_fsync_kb") * 1024L);
+    // 缓冲区满时在延迟和完整性之间取舍：默认写进溢出文件，日志盘卡住时不拖慢请求，写满再丢弃
+    int log_overflow = cfg->get_overflow("log_overflow");
+    int log_overflow_arg = 0;
+    if (log_overflow == Log::OVERFLOW_SPILL)
+        log_overflow_arg = cfg->get_int("log_spill_mb");
+    else if (log_overflow == Log::OVERFLOW_SAMPLE)
+        log_overflow_arg = cfg->get_int("log_sample");
+    else if (log_overflow == Log::OVERFLOW_BLOCK)
+        log_overflow_arg = cfg->get_int("log_block_ms");
+    Log::get_instance()->set_overflow(log_overflow, log_overflow_arg);
 
     //初始化日志
     if (1 == LOGWrite)
-        Log::get_instance()->init("./ServerLog/Log", m_close_log, 2000, 800000, 800);
+        Log::get_instance()->init("./ServerLog/Log", m_close_log, 2000, 800000, cfg->get_int("log_queue"),
+                                  cfg->get_int("log_binary") != 0, m_log_level);
     else
-        Log::get_instance()->init("./ServerLog/Log", m_close_log, 2000, 800000, 0);
+        Log::get_instance()->init("./ServerLog/Log", m_close_log, 2000, 800000, 0, false, m_log_level);
 
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
@@ -107,42 +466,41 @@ int main(int argc, char* argv[])
     sigfillset(&sa.sa_mask);
     assert(sigaction(SIGPIPE, &sa, NULL) != -1);
 
+    // HTTPS：配置了tls_port时另开一个端口，证书加载不了就不启动
+    int tls_port = cfg->get_int("tls_port");
+    if (tls_port > 0 && !load_tls(err))
+    {
+        LOG_ERROR("tls: %s\n", err.c_str());
+        fprintf(stderr, "tls: %s\n", err.c_str());
+        return 1;
+    }
+
+    // 线程池最多积压max_queue个请求；排队时间连续queue_interval毫秒高于queue_target毫秒时判定过载，新请求回503
+    int max_queue = cfg->get_int("max_queue");
+    int queue_target_ms = cfg->get_int("queue_target_ms");
+    int queue_interval_ms = cfg->get_int("queue_interval_ms");
     threadpool<http_conn>* pool = NULL;
     try
     {
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(cfg->get_int("threads"), max_queue, queue_target_ms, queue_interval_ms);
     }
     catch(...)
     {
         return 1;
     }
     
-    http_conn* users = new http_conn[MAXFD];
+    // 每个连接的读写缓冲区在第一次用到时分配
+    max_fd = cfg->get_int("max_fd");
+    conn_timeout = cfg->get_int("conn_timeout");
+    http_conn::m_read_buffer_size = cfg->get_int("read_buffer");
+    http_conn::m_write_buffer_size = cfg->get_int("write_buffer");
+    http_conn* users = new http_conn[max_fd];
     assert(users);
 
-    struct sockaddr_in address;
-    bzero(&address, sizeof(address));
-    address.sin_family = AF_INET;
-    inet_pton(AF_INET, ip, &address.sin_addr);
-    address.sin_port = htons(port);
-
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(listenfd >= 0);
-    // 第一个值：0表示关闭，1表示开启；第二个值：如果开启，套接口关闭时内核将拖延一段时间（这里是拖延0秒，就是立即关闭）
-    // 
-    // struct linger lin = {1, 0};     
-    // setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
-
-    ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
-    assert(ret != -1);
-
-    ret = listen(listenfd, BACKLOG);
-    assert(ret >= 0);
-
-    epoll_event events[MAX_EVENT_NUMBER];
+    int max_events = cfg->get_int("max_events");
+    epoll_event* events = new epoll_event[max_events];
     int epollfd = epoll_create(1);
     assert(epollfd != -1);
-    addfd(epollfd, listenfd, false);
     http_conn::m_epollfd = epollfd;
 
     ret = socketpair(PF_UNIX, SOCK_STREAM, 0, timer_sig_pipefd);  // 创建管道
@@ -153,73 +511,194 @@ int main(int argc, char* argv[])
     //设置信号处理函数
     addsig(SIGALRM, sig_handler);
     addsig(SIGTERM, sig_handler);
+    addsig(SIGHUP, sig_handler);
     bool stop_server = false;
+    bool reload = false;
 
     bool timeout = false;
     alarm(TIMESLOT);        // 设置定时周期，即TIMESLOT为一个周期。一个周期触发一次tick()函数
 
+    // 网站根目录，末尾需要带'/'；配置重新加载后原来的字符串会释放，这里留一份
+    string root_dir = cfg->get("root");
+    doc_root = root_dir.c_str();
+
     /* 启动数据库池 */
     connection_pool* connPool;
-    string user = "root";           // 登陆数据库用户名
-    string passWord = "123456";     // 登陆数据库密码
-    string databaseName = "web";    // 使用数据库名
-    int sql_num = 8;                // 数据库连接池大小
+    string sql_url = cfg->get("mysql_host");
+    int sql_port = cfg->get_int("mysql_port");
+    string user = cfg->get("mysql_user");               // 登陆数据库用户名
+    string passWord = cfg->get("mysql_password");       // 登陆数据库密码
+    string databaseName = cfg->get("mysql_db");         // 使用数据库名
+    int sql_num = cfg->get_int("sql_max_conn");         // 数据库连接池最大连接数
+    int sql_min_num = cfg->get_int("sql_min_conn");     // 数据库连接池最小连接数，空闲时收缩到这个数
 
     // 初始化数据库连接池
     connPool = connection_pool::GetInstance();
-    connPool->init("localhost", user, passWord, databaseName, port, sql_num);
+    connPool->set_timeouts(cfg->get_int("sql_checkout_ms"), cfg->get_int("pool_idle_timeout"), cfg->get_int("pool_health_interval"));
+    connPool->init(sql_url, user, passWord, databaseName, sql_port, sql_num, sql_min_num);
     // connPool->init("192.168.136.123:858", user, passWord, databaseName, port, sql_num);
 
-    // // 初始化数据库读取表
-    // users->initmysql_result(connPool);
+    // 初始化进程内用户缓存：默认64MB内存上限，记录存活10分钟
+    user_cache::GetInstance()->init(cfg->get_int("user_cache_mb") * 1024L * 1024, cfg->get_int("user_cache_ttl"));
 
     /*启动redis池*/
     RedisPool* redisPool;
-    const char* redis_url = "127.0.0.1";
-    const char* redis_port = "6379";
-    int redis_num = 8;
+    string redis_url = cfg->get("redis_host");
+    string redis_port = cfg->get("redis_port");
+    int redis_num = cfg->get_int("redis_max_conn");
+    int redis_min_num = cfg->get_int("redis_min_conn");
+    int redis_batch_num = cfg->get_int("redis_batch");     // 管道线程数，并发的GET/SET合并成pipeline发送
 
     // 初始化redis连接池
     redisPool = RedisPool::GetInstance();
-    redisPool->init(redis_url, redis_port, redis_num);
+    redisPool->set_timeouts(cfg->get_int("redis_checkout_ms"), cfg->get_int("pool_idle_timeout"), cfg->get_int("pool_health_interval"));
+    redisPool->init(redis_url.c_str(), redis_port.c_str(), redis_num, redis_batch_num, redis_min_num);
+    // 近端缓存：默认最多10万个key，命中记录存活5分钟，不存在的用户记录存活30秒
+    redisPool->init_near_cache(cfg->get_int("near_cache_size"), cfg->get_int("near_cache_ttl"), cfg->get_int("near_cache_negative_ttl"));
+
+    // 登录时的缓存查询走挂在主线程epoll上的异步Redis连接，回调中再让对应连接继续处理
+    http_conn::m_threadpool = pool;
+    bool redis_async_mode = cfg->get_int("redis_async") != 0;
+    if (redis_async_mode)
+    {
+        redis_async::GetInstance()->init(epollfd, redis_url.c_str(), atoi(redis_port.c_str()));
+    }
+
+    // 运行指标：GET http://127.0.0.1:admin_port/metrics
+    metrics* stats = metrics::GetInstance();
+    stats->register_gauge("webserver_active_connections", "Open client connections.", gauge_active_conns);
+    stats->register_gauge("webserver_queue_depth", "Requests waiting in the thread pool queue.", gauge_queue_depth);
+    stats->register_gauge("webserver_overloaded", "1 while the thread pool queue is judged overloaded.", gauge_overloaded);
+    stats->register_gauge("webserver_mysql_idle_connections", "Idle connections in the MySQL pool.", gauge_sql_idle);
+    stats->register_gauge("webserver_redis_idle_connections", "Idle connections in the Redis pool.", gauge_redis_idle);
+    stats->register_gauge("webserver_rate_limited_clients", "Client IPs currently tracked by the rate limiter.", gauge_rate_clients);
+
+    // 热升级：设置了WEBSERVER_UPGRADE_SOCK时，先向该路径上的旧进程要服务端口、管理端口和HTTPS端口的监听fd，
+    // 后端都初始化好了才要，旧进程交出之后停止accept并排空，监听队列里的连接由本进程接着accept
+    string upgrade_sock = cfg->get("upgrade_sock");
+    const char* upgrade_path = upgrade_sock.empty() ? NULL : upgrade_sock.c_str();
+    int inherited[3];
+    char roles[3];
+    int inherited_num = upgrade_path ? handoff_receive(upgrade_path, inherited, roles, 3) : 0;
+    int listenfd = -1;
+    int admin_listenfd = -1;
+    int tls_listenfd = -1;
+    for (int i = 0; i < inherited_num; i++)
+    {
+        if (roles[i] == HANDOFF_LISTEN)
+        {
+            listenfd = inherited[i];
+        }
+        else if (roles[i] == HANDOFF_ADMIN)
+        {
+            admin_listenfd = inherited[i];
+        }
+        else if (roles[i] == HANDOFF_TLS)
+        {
+            tls_listenfd = inherited[i];
+        }
+        else
+        {
+            close(inherited[i]);
+        }
+    }
+    if (listenfd >= 0)
+    {
+        LOG_INFO("took over listening socket from the previous process\n");
+    }
+    else
+    {
+        listenfd = open_listenfd(ip, port, cfg->get_int("backlog"));
+    }
+    addfd(epollfd, listenfd, false);
+    // 升级前后HTTPS端口开关不同时，以本进程的配置为准
+    if (tls_listenfd >= 0 && tls_port <= 0)
+    {
+        close(tls_listenfd);
+        tls_listenfd = -1;
+    }
+    else if (tls_listenfd < 0 && tls_port > 0)
+    {
+        tls_listenfd = open_listenfd(ip, tls_port, cfg->get_int("backlog"));
+    }
+    if (tls_listenfd >= 0)
+    {
+        addfd(epollfd, tls_listenfd, false);
+    }
+    if (admin_listenfd >= 0)
+    {
+        stats->start_admin_fd(admin_listenfd);
+    }
+    else
+    {
+        stats->start_admin("127.0.0.1", admin_port);
+    }
+    // 等待下一次升级
+    int upgrade_fd = upgrade_path ? handoff_listen(upgrade_path) : -1;
+    if (upgrade_fd >= 0)
+    {
+        addfd(epollfd, upgrade_fd, false);
+    }
+    bool handed_over = false;
+
+    // 停机排空：收到SIGTERM或交出监听socket之后不再accept，空闲连接直接关闭，
+    // 正在处理的请求最多再等drain_ms毫秒
+    bool draining = false;
+    int64_t drain_deadline = 0;
+
+    // 单IP限速：新建连接、静态文件请求、登录/注册请求各自一个令牌桶；本机地址默认不限，便于压测
+    rate_limiter::GetInstance()->init(cfg->get_int("rate_max_clients"));
+    set_rate_limits();
+    set_http2();
+
+    // 流量录制：配置了capture时把请求头和到达时间录到该文件，用bench/replay回放
+    const char* capture_path = cfg->get("capture");
+    if (*capture_path)
+    {
+        traffic_capture::GetInstance()->init(capture_path, cfg->get_int("capture_mb"));
+    }
 
     while (1)
     {
-        int count = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        // 暂停accept或排空期间每10ms看一次
+        int count = epoll_wait(epollfd, events, max_events, accept_paused || draining ? 10 : -1);
         if (count < 0 && errno != EINTR)
         {
-            Log::get_instance()->write_log(3, "epoll failure\n");
+            LOG_ERROR("epoll failure\n");
             break;      // 不能return，因为还有很多东西没有close，还有很多内存没有释放
         }
         for (int i = 0; i < count; i++)
         {
             int sockfd = events[i].data.fd;         // 有事件的sockfd
             // 如果这个sockfd是listenfd的话，则表示有新的连接进来
-            // 我们需要创建一个新的fd，名为connfd，作为与新连接沟通的fd
-            // 如果此时epoll管理的fd数量小于最大值，则需要将其init，并加入epoll（在init中做了）
-            // 否则传递给客户端信息，表示网络正忙
-            if (events[i].data.fd == listenfd)
+            // 我们需要创建一个新的fd，名为connfd，作为与新连接沟通的fd，init时加入epoll
+            // 过载时暂停accept，见accept_conns()
+            if (sockfd == listenfd || sockfd == tls_listenfd)
+            {
+                accept_conns(sockfd, sockfd == tls_listenfd, users, pool);
+            }
+            // 新版本的进程来要监听socket，交出去之后本进程开始排空
+            else if (sockfd == upgrade_fd)
             {
-                struct sockaddr_in client_address;
-                socklen_t client_addresslen = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addresslen);
-                if (connfd < 0)
+                int fds[3] = {listenfd};
+                char fd_roles[3] = {HANDOFF_LISTEN};
+                int fd_num = 1;
+                if (stats->admin_fd() >= 0)
                 {
-                    Log::get_instance()->write_log(3, "errno is %d", errno);
-                    return 1;
+                    fds[fd_num] = stats->admin_fd();
+                    fd_roles[fd_num++] = HANDOFF_ADMIN;
                 }
-                if (http_conn::m_user_count >= MAXFD)
+                if (tls_listenfd >= 0)
                 {
-                    const char* info = "Internet busy\n";
-                    Log::get_instance()->write_log(1, "%s\n", info);
-                    send(connfd, info, sizeof(info), 0);
-                    continue;
+                    fds[fd_num] = tls_listenfd;
+                    fd_roles[fd_num++] = HANDOFF_TLS;
+                }
+                if (handoff_send(upgrade_fd, fds, fd_roles, fd_num))
+                {
+                    LOG_INFO("handed listening socket over to the new process, draining\n");
+                    handed_over = true;
+                    stop_server = true;
                 }
-                users[connfd].init(connfd, client_address);
-                tw_timer* timer = http_conn::m_twheel.add_timer(TIMEOUT);
-                timer->user_data = &users[connfd];
-                timer->cb_func = cb_func;
-                users[connfd].m_timer = timer;
             }
             // 处理信号
             else if ((sockfd == timer_sig_pipefd[0]) && (events[i].events & EPOLLIN)) 
@@ -248,31 +727,59 @@ int main(int argc, char* argv[])
                             case SIGTERM:
                             {
                                 stop_server = true;
+                                break;
+                            }
+                            case SIGHUP:
+                            {
+                                reload = true;
+                                break;
                             }
                         }
                     }
                 }
             }
+            // 异步Redis的连接和唤醒用的eventfd
+            else if (redis_async::GetInstance()->owns(sockfd))
+            {
+                redis_async::GetInstance()->handle_event(sockfd, events[i].events);
+            }
             // 如果是error，则直接关闭（remove、close、用户数量减1）
             else if (events[i].events & EPOLLERR)
             {
                 users[sockfd].close_conn();
             }
-            // 如果是有数据要读，则根据read的结果（看看数据是否完整）判断是否要将其加入任务队列
-            else if (events[i].events & EPOLLIN){
-                if (users[sockfd].read())
+            // HTTPS连接握手期间的读写事件都用来推进握手，握手完成时请求已经到了就接着读
+            else if (users[sockfd].handshaking())
+            {
+                int ret = users[sockfd].handshake();
+                if (ret < 0)
                 {
-                    pool->append(users + sockfd);
+                    users[sockfd].close_conn();
                 }
-                else 
+                else if (ret > 0)
+                {
+                    read_request(users, sockfd, pool);
+                }
+            }
+            // HTTP/2连接的读写事件都交给h2_conn：读帧、发出已经生成的响应
+            else if (users[sockfd].http2())
+            {
+                if (!users[sockfd].h2_handle())
                 {
                     users[sockfd].close_conn();
                 }
             }
+            // 如果是有数据要读，则根据read的结果（看看数据是否完整）判断是否要将其加入任务队列
+            else if (events[i].events & EPOLLIN){
+                read_request(users, sockfd, pool);
+            }
             // 如果是有数据要写，则根据写的结果判断是否要关闭
             else if (events[i].events & EPOLLOUT)
             {
-                if (users[sockfd].write())
+                int64_t start = metrics::now_ns();
+                bool ok = users[sockfd].write();
+                stats->observe(STAGE_WRITE, metrics::now_ns() - start);
+                if (ok)
                 {
                     
                 }
@@ -292,11 +799,69 @@ int main(int argc, char* argv[])
                 timeout = false;
             }
         }
+        if (reload)
+        {
+            reload = false;
+            reload_config(pool);
+        }
+        if (stop_server && !draining)
+        {
+            draining = true;
+            drain_deadline = metrics::now_ns() + cfg->get_int("drain_ms") * 1000000LL;
+            http_conn::m_draining = true;
+            // 交出去的监听socket在新进程里还开着，这里只是关掉本进程的fd
+            removefd(epollfd, listenfd);
+            if (tls_listenfd >= 0)
+            {
+                removefd(epollfd, tls_listenfd);
+            }
+            if (upgrade_fd >= 0)
+            {
+                removefd(epollfd, upgrade_fd);
+                if (!handed_over)
+                {
+                    unlink(upgrade_path);
+                }
+            }
+            LOG_INFO("stop accepting, draining %d connections\n", http_conn::m_user_count);
+        }
+        if (draining)
+        {
+            int busy = close_idle_conns(users);
+            if (busy == 0 && pool->queue_size() == 0)
+            {
+                LOG_INFO("drained, exiting\n");
+                break;
+            }
+            if (metrics::now_ns() >= drain_deadline)
+            {
+                LOG_WARN("drain deadline reached, %d requests still in progress\n", busy);
+                break;
+            }
+        }
+        // 负载降下来之后，把暂停期间积压在监听队列里的连接取出来
+        else if (accept_paused)
+        {
+            accept_conns(listenfd, false, users, pool);
+            if (tls_listenfd >= 0)
+            {
+                accept_conns(tls_listenfd, true, users, pool);
+            }
+        }
+    }
+    // 先等工作线程做完手上的请求并退出，再关闭所有fd，释放所有内存
+    delete pool;
+    traffic_capture::GetInstance()->stop();
+    if (!draining)
+    {
+        close(listenfd);
+        if (tls_listenfd >= 0)
+        {
+            close(tls_listenfd);
+        }
     }
-    // 关闭所有fd，释放所有内存
-    close(listenfd);
     close(epollfd);
     delete [] users;
-    delete pool;
+    delete [] events;
     return 0;
 }
\ No newline at end of file
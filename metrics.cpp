@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "log.h"
+
+static const char *STAGE_NAMES[STAGE_NUM] = {
+    "read", "queue", "parse", "request", "write", "total", "sql_checkout", "redis_checkout", "tls_handshake"
+};
+
+struct counter_def
+{
+    const char *name;
+    const char *help;
+};
+
+static const counter_def COUNTER_DEFS[COUNTER_NUM] = {
+    {"webserver_accepts_total", "Accepted client connections."},
+    {"webserver_requests_total", "HTTP requests processed by worker threads."},
+    {"webserver_sent_bytes_total", "Bytes written to client sockets."},
+    {"webserver_timer_expired_total", "Connections closed by the idle timer."},
+    {"webserver_rejected_total", "Requests rejected with 503 while overloaded."},
+    {"webserver_accept_pauses_total", "Times accepting new connections was paused while overloaded."},
+    {"webserver_rate_limited_connections_total", "Connections rejected by the per-IP rate limit."},
+    {"webserver_rate_limited_requests_total", "Requests rejected with 429 by the per-IP rate limit."},
+    {"webserver_tls_handshakes_total", "Completed TLS handshakes."},
+    {"webserver_tls_resumed_total", "TLS handshakes that resumed a session."},
+    {"webserver_tls_failed_total", "Failed TLS handshakes."},
+    {"webserver_ktls_connections_total", "TLS connections whose sends are encrypted by the kernel (kTLS)."},
+    {"webserver_http2_connections_total", "Connections that switched to HTTP/2."},
+    {"webserver_http2_streams_total", "Requests received on HTTP/2 connections."},
+};
+
+// 输出的le边界：2^10ns(约1us)到2^35ns(约34s)，正好落在分桶边界上，累计值是精确的
+static const int LE_MIN_EXP = 10;
+static const int LE_MAX_EXP = 35;
+
+thread_local metrics::shard *metrics::t_shard = NULL;
+
+metrics::metrics()
+{
+    m_shards = NULL;
+    m_admin_fd = -1;
+}
+
+metrics *metrics::GetInstance()
+{
+    static metrics instance;
+    return &instance;
+}
+
+// 小于16的值每个值一格；之后每个2的幂区间[2^e, 2^(e+1))按次高4位再分16格
+int metrics::bucket_of(uint64_t v)
+{
+    if (v < (uint64_t)SUB)
+    {
+        return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    if (e > MAX_EXP - 1)
+    {
+        return HIST_BUCKETS - 1;
+    }
+    return (e - SUB_BITS + 1) * SUB + (int)((v >> (e - SUB_BITS)) & (SUB - 1));
+}
+
+uint64_t metrics::bucket_upper(int idx)
+{
+    if (idx < SUB)
+    {
+        return idx + 1;
+    }
+    int e = idx / SUB + SUB_BITS - 1;
+    uint64_t m = idx % SUB;
+    return (SUB + m + 1) << (e - SUB_BITS);
+}
+
+// 当前线程的分片，第一次调用时创建并挂到链表上
+metrics::shard *metrics::local_shard()
+{
+    if (t_shard)
+    {
+        return t_shard;
+    }
+    shard *s = new shard;
+    for (int i = 0; i < STAGE_NUM; i++)
+    {
+        for (int j = 0; j < HIST_BUCKETS; j++)
+        {
+            s->buckets[i][j].store(0, memory_order_relaxed);
+        }
+        s->sum[i].store(0, memory_order_relaxed);
+    }
+    for (int i = 0; i < COUNTER_NUM; i++)
+    {
+        s->counters[i].store(0, memory_order_relaxed);
+    }
+    m_lock.lock();
+    s->next = m_shards;
+    m_shards = s;
+    m_lock.unlock();
+    t_shard = s;
+    return s;
+}
+
+// 只有本线程写自己的分片，读-加-写不需要原子加法
+void metrics::observe(int stage, int64_t ns)
+{
+    if (ns < 0)
+    {
+        ns = 0;
+    }
+    shard *s = local_shard();
+    atomic<uint64_t> &b = s->buckets[stage][bucket_of(ns)];
+    b.store(b.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    s->sum[stage].store(s->sum[stage].load(memory_order_relaxed) + ns, memory_order_relaxed);
+}
+
+void metrics::add(int counter, uint64_t v)
+{
+    shard *s = local_shard();
+    atomic<uint64_t> &c = s->counters[counter];
+    c.store(c.load(memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+void metrics::register_gauge(const char *name, const char *help, long (*fn)())
+{
+    gauge g;
+    g.name = name;
+    g.help = help;
+    g.fn = fn;
+    m_lock.lock();
+    m_gauges.push_back(g);
+    m_lock.unlock();
+}
+
+string metrics::render()
+{
+    // 先把所有分片加起来
+    vector<uint64_t> buckets((size_t)STAGE_NUM * HIST_BUCKETS, 0);
+    uint64_t sum[STAGE_NUM] = {0};
+    uint64_t counters[COUNTER_NUM] = {0};
+    m_lock.lock();
+    for (shard *s = m_shards; s; s = s->next)
+    {
+        for (int i = 0; i < STAGE_NUM; i++)
+        {
+            for (int j = 0; j < HIST_BUCKETS; j++)
+            {
+                buckets[i * HIST_BUCKETS + j] += s->buckets[i][j].load(memory_order_relaxed);
+            }
+            sum[i] += s->sum[i].load(memory_order_relaxed);
+        }
+        for (int i = 0; i < COUNTER_NUM; i++)
+        {
+            counters[i] += s->counters[i].load(memory_order_relaxed);
+        }
+    }
+    vector<gauge> gauges = m_gauges;
+    m_lock.unlock();
+
+    string out;
+    char line[256];
+    out += "# HELP webserver_stage_seconds Time spent in each request stage.\n";
+    out += "# TYPE webserver_stage_seconds histogram\n";
+    for (int i = 0; i < STAGE_NUM; i++)
+    {
+        const uint64_t *b = &buckets[i * HIST_BUCKETS];
+        uint64_t cum = 0;
+        int j = 0;
+        for (int e = LE_MIN_EXP; e <= LE_MAX_EXP; e++)
+        {
+            uint64_t le = 1ULL << e;
+            while (j < HIST_BUCKETS && bucket_upper(j) <= le)
+            {
+                cum += b[j++];
+            }
+            snprintf(line, sizeof(line), "webserver_stage_seconds_bucket{stage=\"%s\",le=\"%.12g\"} %llu\n",
+                     STAGE_NAMES[i], le / 1e9, (unsigned long long)cum);
+            out += line;
+        }
+        while (j < HIST_BUCKETS)
+        {
+            cum += b[j++];
+        }
+        snprintf(line, sizeof(line), "webserver_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                 "webserver_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+                 "webserver_stage_seconds_count{stage=\"%s\"} %llu\n",
+                 STAGE_NAMES[i], (unsigned long long)cum, STAGE_NAMES[i], sum[i] / 1e9,
+                 STAGE_NAMES[i], (unsigned long long)cum);
+        out += line;
+    }
+
+    // 直方图的le边界较粗，另外按细分桶给出分位数（取所在格的中点）
+    static const double QUANTILES[] = {0.5, 0.99, 0.999};
+    out += "# HELP webserver_stage_quantile_seconds Estimated latency quantiles of each request stage.\n";
+    out += "# TYPE webserver_stage_quantile_seconds gauge\n";
+    for (int i = 0; i < STAGE_NUM; i++)
+    {
+        const uint64_t *b = &buckets[i * HIST_BUCKETS];
+        uint64_t total = 0;
+        for (int j = 0; j < HIST_BUCKETS; j++)
+        {
+            total += b[j];
+        }
+        for (size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++)
+        {
+            double v = 0;
+            if (total > 0)
+            {
+                uint64_t rank = (uint64_t)(QUANTILES[q] * total);
+                if (rank >= total)
+                {
+                    rank = total - 1;
+                }
+                uint64_t cum = 0;
+                for (int j = 0; j < HIST_BUCKETS; j++)
+                {
+                    cum += b[j];
+                    if (cum > rank)
+                    {
+                        uint64_t lower = j == 0 ? 0 : bucket_upper(j - 1);
+                        v = (lower + bucket_upper(j)) / 2.0 / 1e9;
+                        break;
+                    }
+                }
+            }
+            snprintf(line, sizeof(line), "webserver_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                     STAGE_NAMES[i], QUANTILES[q], v);
+            out += line;
+        }
+    }
+
+    for (int i = 0; i < COUNTER_NUM; i++)
+    {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                 COUNTER_DEFS[i].name, COUNTER_DEFS[i].help, COUNTER_DEFS[i].name,
+                 COUNTER_DEFS[i].name, (unsigned long long)counters[i]);
+        out += line;
+    }
+    for (size_t i = 0; i < gauges.size(); i++)
+    {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n",
+                 gauges[i].name, gauges[i].help, gauges[i].name, gauges[i].name, gauges[i].fn());
+        out += line;
+    }
+    return out;
+}
+
+bool metrics::start_admin(const char *ip, int port)
+{
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &address.sin_addr);
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 16) < 0)
+    {
+        LOG_ERROR("metrics: cannot listen on %s:%d, errno %d\n", ip, port, errno);
+        close(fd);
+        return false;
+    }
+    if (!start_admin_fd(fd))
+    {
+        return false;
+    }
+    LOG_INFO("metrics: serving /metrics on %s:%d\n", ip, port);
+    return true;
+}
+
+bool metrics::start_admin_fd(int fd)
+{
+    m_admin_fd = fd;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, admin_worker, this) != 0)
+    {
+        close(fd);
+        m_admin_fd = -1;
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+void *metrics::admin_worker(void *arg)
+{
+    metrics *m = (metrics *)arg;
+    m->admin_loop();
+    return m;
+}
+
+// 抓取很少，一次处理一个连接；读超时1秒，慢客户端不会卡住管理端口太久
+void metrics::admin_loop()
+{
+    while (true)
+    {
+        int connfd = accept(m_admin_fd, NULL, NULL);
+        if (connfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            LOG_ERROR("metrics: accept failed, errno %d\n", errno);
+            return;
+        }
+        struct timeval tv = {1, 0};
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        // 只看请求行，请求头不关心
+        char req[1024];
+        int len = 0;
+        while (len < (int)sizeof(req) - 1)
+        {
+            int n = recv(connfd, req + len, sizeof(req) - 1 - len, 0);
+            if (n <= 0)
+            {
+                break;
+            }
+            len += n;
+            req[len] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            {
+                break;
+            }
+        }
+        req[len] = '\0';
+
+        string body;
+        const char *status;
+        if (strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET /metrics?", 13) == 0)
+        {
+            status = "200 OK";
+            body = render();
+        }
+        else
+        {
+            status = "404 Not Found";
+            body = "not found\n";
+        }
+        char head[256];
+        int head_len = snprintf(head, sizeof(head),
+                                "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %d\r\nConnection: close\r\n\r\n",
+                                status, (int)body.size());
+        string resp(head, head_len);
+        resp += body;
+        size_t sent = 0;
+        while (sent < resp.size())
+        {
+            ssize_t n = send(connfd, resp.data() + sent, resp.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                break;
+            }
+            sent += n;
+        }
+        close(connfd);
+    }
+}
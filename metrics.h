@@ -0,0 +1,126 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "locker.h"
+
+using namespace std;
+
+/************************************************************
+*运行指标：各处理阶段的延迟直方图和计数器，在管理端口上以Prometheus文本格式输出
+*每个线程写自己的分片（只有本线程写，relaxed读改写，不加锁、不用原子加法），
+*抓取时遍历所有分片求和；线程退出后分片保留，计数器保持单调
+*直方图是HDR风格的对数-线性分桶：每个2的幂区间再分16格，相对误差约6%，范围1ns到约68s
+*队列长度、活跃连接数这类瞬时值在抓取时调用登记的函数读取
+************************************************************/
+
+// 直方图：请求经过的各个阶段，单位纳秒
+enum METRIC_STAGE
+{
+    STAGE_READ = 0,     // 主线程read()读取请求
+    STAGE_QUEUE,        // 在线程池队列中等待
+    STAGE_PARSE,        // process_read()解析请求（不含do_request）
+    STAGE_REQUEST,      // do_request()，包括查缓存、Redis、MySQL和打开文件
+    STAGE_WRITE,        // 一次write()发送响应
+    STAGE_TOTAL,        // 从读到请求到响应发送完
+    STAGE_SQL_WAIT,     // 从MySQL连接池取连接
+    STAGE_REDIS_WAIT,   // 从Redis连接池取连接
+    STAGE_TLS_HANDSHAKE,    // 从accept到TLS握手完成，包含网络往返
+    STAGE_NUM
+};
+
+// 计数器，只增不减
+enum METRIC_COUNTER
+{
+    COUNTER_ACCEPTS = 0,    // 接受的连接
+    COUNTER_REQUESTS,       // 处理完的请求
+    COUNTER_BYTES_SENT,     // 发送的字节数
+    COUNTER_TIMER_EXPIRED,  // 超时被定时器关闭的连接
+    COUNTER_REJECTED,       // 过载时回503拒绝的请求
+    COUNTER_ACCEPT_PAUSES,  // 过载时暂停accept的次数
+    COUNTER_LIMITED_CONNS,  // 超过单IP限速被拒绝的连接
+    COUNTER_LIMITED_REQUESTS,   // 超过单IP限速被拒绝的请求
+    COUNTER_TLS_HANDSHAKES, // 完成的TLS握手
+    COUNTER_TLS_RESUMED,    // 其中恢复了会话的
+    COUNTER_TLS_FAILED,     // 失败的TLS握手
+    COUNTER_KTLS,           // 握手后由内核加密发送（kTLS）的连接
+    COUNTER_H2_CONNS,       // 切换到HTTP/2的连接
+    COUNTER_H2_STREAMS,     // HTTP/2连接上收到的请求（流）
+    COUNTER_NUM
+};
+
+class metrics
+{
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB = 1 << SUB_BITS;           // 每个2的幂区间的格数
+    static const int MAX_EXP = 36;                  // 2^36ns约68s，更大的值记在最后一格
+    static const int HIST_BUCKETS = (MAX_EXP - SUB_BITS + 1) * SUB;
+
+    static metrics *GetInstance();
+
+    // 单调时钟，纳秒
+    static int64_t now_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    void observe(int stage, int64_t ns);
+    void add(int counter, uint64_t v = 1);
+
+    // 登记一个瞬时值，抓取时调用fn读取；需在start_admin之前登记
+    void register_gauge(const char *name, const char *help, long (*fn)());
+
+    // 生成Prometheus文本格式的全部指标
+    string render();
+
+    // 在ip:port上启动管理端口，GET /metrics返回指标；单独一个阻塞线程，不经过主线程的epoll
+    bool start_admin(const char *ip, int port);
+    // 用已经在监听的fd启动管理端口（热升级时从旧进程接过来的）
+    bool start_admin_fd(int fd);
+    int admin_fd()
+    {
+        return m_admin_fd;
+    }
+
+private:
+    // 一个线程的分片，只有所属线程写
+    struct shard
+    {
+        atomic<uint64_t> buckets[STAGE_NUM][HIST_BUCKETS];
+        atomic<uint64_t> sum[STAGE_NUM];
+        atomic<uint64_t> counters[COUNTER_NUM];
+        shard *next;
+    };
+
+    struct gauge
+    {
+        const char *name;
+        const char *help;
+        long (*fn)();
+    };
+
+    metrics();
+
+    shard *local_shard();
+    static int bucket_of(uint64_t v);
+    static uint64_t bucket_upper(int idx);     // 该格的上界（不含）
+    static void *admin_worker(void *arg);
+    void admin_loop();
+
+private:
+    locker m_lock;                  // 保护分片链表和gauge列表
+    shard *m_shards;
+    vector<gauge> m_gauges;
+    int m_admin_fd;
+
+    static thread_local shard *t_shard;
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "rate_limit.h"
+#include "metrics.h"
+#include "log.h"
+
+rate_limiter::rate_limiter()
+    : m_mask(0), m_size(0), m_max_size(0), m_full_logged(false), m_exempt_loopback(true)
+{
+    for (int i = 0; i < RATE_BUDGET_NUM; i++)
+    {
+        m_enabled[i] = false;
+        m_interval_ns[i] = 0;
+        m_burst_ns[i] = 0;
+    }
+}
+
+rate_limiter *rate_limiter::GetInstance()
+{
+    static rate_limiter instance;
+    return &instance;
+}
+
+// 装载率不超过1/2，线性探测的探查长度很短
+size_t rate_limiter::capacity_for(int max_clients)
+{
+    size_t cap = 16;
+    while (cap < (size_t)max_clients * 2)
+    {
+        cap <<= 1;
+    }
+    return cap;
+}
+
+void rate_limiter::init(int max_clients)
+{
+    size_t cap = capacity_for(max_clients);
+    entry empty;
+    memset(&empty, 0, sizeof(empty));
+    m_table.assign(cap, empty);
+    m_mask = cap - 1;
+    m_size = 0;
+    m_max_size = max_clients;
+}
+
+void rate_limiter::set_max_clients(int max_clients)
+{
+    if (m_table.empty())
+    {
+        init(max_clients);
+        return;
+    }
+    m_max_size = max_clients;
+    rebuild(metrics::now_ns(), capacity_for(max_clients));
+}
+
+void rate_limiter::set_budget(int budget, double rate, int burst)
+{
+    if (rate <= 0)
+    {
+        m_enabled[budget] = false;
+        return;
+    }
+    if (burst < 1)
+    {
+        burst = 1;
+    }
+    m_enabled[budget] = true;
+    m_interval_ns[budget] = (int64_t)(1e9 / rate);
+    m_burst_ns[budget] = m_interval_ns[budget] * burst;
+}
+
+void rate_limiter::set_exempt_loopback(bool exempt)
+{
+    m_exempt_loopback = exempt;
+}
+
+// 找到ip对应的槽位，不存在时插入一个空桶；表满时返回NULL
+rate_limiter::entry *rate_limiter::lookup(uint32_t ip)
+{
+    size_t i = (size_t)((ip * 0x9E3779B97F4A7C15ULL) >> 32) & m_mask;
+    while (m_table[i].ip != 0)
+    {
+        if (m_table[i].ip == ip)
+        {
+            return &m_table[i];
+        }
+        i = (i + 1) & m_mask;
+    }
+    // 表满时不在这里压缩：大量不同IP连进来时每次accept都扫一遍整张表，代价会被对端放大。
+    // 满了就直接放行新IP，等定时器每秒一次的compact()腾出位置
+    if (m_size >= m_max_size)
+    {
+        if (!m_full_logged)
+        {
+            LOG_WARN("rate limit: tracking %d clients, new clients are not limited\n", m_size);
+            m_full_logged = true;
+        }
+        return NULL;
+    }
+    m_table[i].ip = ip;
+    m_size++;
+    return &m_table[i];
+}
+
+bool rate_limiter::allow(uint32_t ip, int budget)
+{
+    if (!m_enabled[budget] || m_table.empty())
+    {
+        return true;
+    }
+    if (m_exempt_loopback && (ntohl(ip) >> 24) == 127)
+    {
+        return true;
+    }
+    entry *e = lookup(ip);
+    if (e == NULL)
+    {
+        return true;
+    }
+    int64_t now = metrics::now_ns();
+    int64_t tat = (e->tat[budget] > now ? e->tat[budget] : now) + m_interval_ns[budget];
+    if (tat - now > m_burst_ns[budget])
+    {
+        return false;
+    }
+    e->tat[budget] = tat;
+    return true;
+}
+
+void rate_limiter::compact()
+{
+    if (m_size > 0)
+    {
+        rebuild(metrics::now_ns(), m_table.size());
+    }
+}
+
+// 只保留还有桶没满的IP，重新插入到cap个槽位的表里，顺带消除线性探测留下的长探查链
+void rate_limiter::rebuild(int64_t now, size_t cap)
+{
+    vector<entry> old;
+    old.swap(m_table);
+    entry empty;
+    memset(&empty, 0, sizeof(empty));
+    m_table.assign(cap, empty);
+    m_mask = cap - 1;
+    m_size = 0;
+    for (size_t j = 0; j < old.size(); j++)
+    {
+        const entry &e = old[j];
+        if (e.ip == 0)
+        {
+            continue;
+        }
+        bool active = false;
+        for (int b = 0; b < RATE_BUDGET_NUM; b++)
+        {
+            active = active || e.tat[b] > now;
+        }
+        // 调小之后放不下的IP不再限速，和表满时一样
+        if (!active || m_size >= m_max_size)
+        {
+            continue;
+        }
+        size_t i = (size_t)((e.ip * 0x9E3779B97F4A7C15ULL) >> 32) & m_mask;
+        while (m_table[i].ip != 0)
+        {
+            i = (i + 1) & m_mask;
+        }
+        m_table[i] = e;
+        m_size++;
+    }
+    if (m_size < m_max_size)
+    {
+        m_full_logged = false;
+    }
+}
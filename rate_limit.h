@@ -0,0 +1,78 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+/************************************************************
+*按客户端IP限速：每个IP三个令牌桶，分别限制新建连接、静态文件请求和要查Redis/MySQL的请求（登录/注册）
+*令牌桶用GCRA实现，每个桶只存一个"理论到达时间"tat：每次放行tat前进1/rate秒，
+*tat超前当前时间burst/rate秒以上时拒绝。桶满（tat不晚于当前时间）的IP和不存在的IP等价
+*
+*accept和读到请求都在主线程，表只由主线程访问，不加锁
+*开放定址（线性探测）的哈希表，init时一次分配；定时器每秒压缩一次，把桶已经满了的IP删掉，
+*表中只剩最近一两秒内活跃的IP。表满时在下一次压缩之前不再记录新IP，直接放行
+************************************************************/
+
+enum RATE_BUDGET
+{
+    RATE_CONN = 0,      // 新建连接
+    RATE_STATIC,        // 静态文件请求
+    RATE_BACKEND,       // 登录/注册等要访问后端的请求
+    RATE_BUDGET_NUM
+};
+
+class rate_limiter
+{
+public:
+    static rate_limiter *GetInstance();
+
+    // max_clients：最多同时跟踪的IP数
+    void init(int max_clients);
+    // 运行中调整最多跟踪的IP数，已有的桶保留
+    void set_max_clients(int max_clients);
+    // 每秒允许rate次，最多攒burst次；rate为0表示不限
+    void set_budget(int budget, double rate, int burst);
+    // 本机（127.0.0.0/8）发来的连接和请求是否豁免，默认豁免，便于本机压测
+    void set_exempt_loopback(bool exempt);
+
+    // ip为网络字节序的IPv4地址，返回false表示超过了预算
+    bool allow(uint32_t ip, int budget);
+
+    // 删掉桶已经满了的IP，由定时器每秒调用
+    void compact();
+
+    int size()
+    {
+        return m_size;
+    }
+
+private:
+    rate_limiter();
+
+    struct entry
+    {
+        uint32_t ip;                        // 0表示空槽
+        int64_t tat[RATE_BUDGET_NUM];       // 各个桶的理论到达时间
+    };
+
+    entry *lookup(uint32_t ip);
+    void rebuild(int64_t now, size_t cap);
+    static size_t capacity_for(int max_clients);
+
+private:
+    vector<entry> m_table;
+    size_t m_mask;
+    int m_size;
+    int m_max_size;                         // 超过后不再记录新IP
+    bool m_full_logged;
+
+    bool m_enabled[RATE_BUDGET_NUM];
+    int64_t m_interval_ns[RATE_BUDGET_NUM]; // 1/rate
+    int64_t m_burst_ns[RATE_BUDGET_NUM];    // burst/rate
+    bool m_exempt_loopback;
+};
+
+#endif
@@ -0,0 +1,264 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "redis_async.h"
+#include "redis_pool.h"
+#include "http_conn.h"
+#include "log.h"
+
+redis_async::redis_async()
+    : m_enabled(false), m_epollfd(-1), m_notify_fd(-1), m_ctx(NULL), m_ctx_fd(-1), m_ctx_epoch(-1), m_events(0), m_pending(NULL), m_port(0)
+{
+}
+
+redis_async::~redis_async()
+{
+    if (m_ctx)
+    {
+        redisAsyncFree(m_ctx);
+    }
+    if (m_notify_fd != -1)
+    {
+        close(m_notify_fd);
+    }
+}
+
+redis_async *redis_async::GetInstance()
+{
+    static redis_async instance;
+    return &instance;
+}
+
+bool redis_async::init(int epollfd, const char *url, int port)
+{
+    m_epollfd = epollfd;
+    m_url = url;
+    m_port = port;
+
+    m_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_notify_fd < 0)
+    {
+        LOG_ERROR("redis async: eventfd failed, errno is %d\n", errno);
+        return false;
+    }
+    epoll_event event;
+    event.data.fd = m_notify_fd;
+    event.events = EPOLLIN;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_notify_fd, &event);
+
+    connect();
+    m_enabled = true;
+    return true;
+}
+
+bool redis_async::owns(int fd)
+{
+    return fd == m_notify_fd || (m_ctx_fd != -1 && fd == m_ctx_fd);
+}
+
+void redis_async::connect()
+{
+    m_ctx = redisAsyncConnect(m_url.c_str(), m_port);
+    if (m_ctx == NULL || m_ctx->err)
+    {
+        LOG_ERROR("redis async: connect error: %s\n", m_ctx ? m_ctx->errstr : "alloc failed");
+        if (m_ctx)
+        {
+            redisAsyncFree(m_ctx);
+        }
+        m_ctx = NULL;
+        return;
+    }
+    m_ctx->data = this;
+    m_ctx->ev.data = this;
+    m_ctx->ev.addRead = add_read;
+    m_ctx->ev.delRead = del_read;
+    m_ctx->ev.addWrite = add_write;
+    m_ctx->ev.delWrite = del_write;
+    m_ctx->ev.cleanup = cleanup;
+    m_ctx_fd = m_ctx->c.fd;
+    m_ctx_epoch = -1;
+    m_events = 0;
+    redisAsyncSetConnectCallback(m_ctx, on_connect);
+    redisAsyncSetDisconnectCallback(m_ctx, on_disconnect);
+}
+
+void redis_async::get(const char *key, http_conn *conn, unsigned int seq)
+{
+    request *req = new request;
+    req->conn = conn;
+    req->seq = seq;
+    req->near_seq = RedisPool::GetInstance()->near_seq();
+    strncpy(req->key, key, sizeof(req->key) - 1);
+    req->key[sizeof(req->key) - 1] = '\0';
+
+    // 压入无锁栈；栈原来为空时才需要唤醒主线程，否则主线程一定还会再来取
+    request *head = m_pending.load(memory_order_relaxed);
+    do
+    {
+        req->next = head;
+    } while (!m_pending.compare_exchange_weak(head, req, memory_order_release, memory_order_relaxed));
+    if (head == NULL)
+    {
+        uint64_t one = 1;
+        ::write(m_notify_fd, &one, sizeof(one));
+    }
+}
+
+// 取走所有待发送请求，按提交顺序发给Redis
+void redis_async::flush_pending()
+{
+    request *head = m_pending.exchange(NULL, memory_order_acquire);
+    request *fifo = NULL;
+    while (head)
+    {
+        request *next = head->next;
+        head->next = fifo;
+        fifo = head;
+        head = next;
+    }
+
+    if (fifo && m_ctx == NULL)
+    {
+        connect();
+    }
+    // 和同步连接一样，把这条连接上的失效消息重定向到RedisPool的订阅连接
+    RedisPool *pool = RedisPool::GetInstance();
+    long long track_id = pool->tracking_id();
+    if (fifo && m_ctx && track_id >= 0 && m_ctx_epoch != pool->tracking_epoch())
+    {
+        if (redisAsyncCommand(m_ctx, NULL, NULL, "CLIENT TRACKING on REDIRECT %lld", track_id) == REDIS_OK)
+        {
+            m_ctx_epoch = pool->tracking_epoch();
+        }
+    }
+    bool tracked = track_id >= 0 && m_ctx_epoch == pool->tracking_epoch();
+    while (fifo)
+    {
+        request *next = fifo->next;
+        fifo->tracked = tracked;
+        if (m_ctx == NULL || redisAsyncCommand(m_ctx, on_reply, fifo, "GET %s", fifo->key) != REDIS_OK)
+        {
+            // Redis不可用，按出错处理，登录会退回到MySQL
+            fifo->conn->on_redis_reply(fifo->seq, "error");
+            delete fifo;
+        }
+        fifo = next;
+    }
+}
+
+void redis_async::handle_event(int fd, uint32_t events)
+{
+    if (fd == m_notify_fd)
+    {
+        uint64_t count;
+        while (::read(m_notify_fd, &count, sizeof(count)) > 0)
+        {
+        }
+        flush_pending();
+        return;
+    }
+    if (m_ctx == NULL)
+    {
+        return;
+    }
+    // 回调中可能断开并释放m_ctx，每一步之后都要重新检查
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    {
+        redisAsyncHandleRead(m_ctx);
+    }
+    if (m_ctx && (events & EPOLLOUT))
+    {
+        redisAsyncHandleWrite(m_ctx);
+    }
+}
+
+void redis_async::on_reply(redisAsyncContext *ac, void *reply, void *privdata)
+{
+    request *req = (request *)privdata;
+    string value = RedisPool::parse_get_reply((redisReply *)reply);
+    if (req->tracked)
+    {
+        RedisPool::GetInstance()->near_put(req->key, value, req->near_seq);
+    }
+    req->conn->on_redis_reply(req->seq, value);
+    delete req;
+}
+
+void redis_async::on_connect(const redisAsyncContext *ac, int status)
+{
+    if (status != REDIS_OK)
+    {
+        // 连接失败后hiredis会释放上下文，下次提交时重连
+        LOG_ERROR("redis async: connect failed: %s\n", ac->errstr);
+        redis_async *self = (redis_async *)ac->data;
+        self->m_ctx = NULL;
+    }
+}
+
+void redis_async::on_disconnect(const redisAsyncContext *ac, int status)
+{
+    if (status != REDIS_OK)
+    {
+        LOG_ERROR("redis async: disconnected: %s\n", ac->errstr);
+    }
+    redis_async *self = (redis_async *)ac->data;
+    self->m_ctx = NULL;
+}
+
+void redis_async::update_events(uint32_t events)
+{
+    if (events == m_events || m_ctx_fd == -1)
+    {
+        return;
+    }
+    epoll_event event;
+    event.data.fd = m_ctx_fd;
+    event.events = events;
+    if (m_events == 0)
+    {
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_ctx_fd, &event);
+    }
+    else if (events == 0)
+    {
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_ctx_fd, NULL);
+    }
+    else
+    {
+        epoll_ctl(m_epollfd, EPOLL_CTL_MOD, m_ctx_fd, &event);
+    }
+    m_events = events;
+}
+
+void redis_async::add_read(void *privdata)
+{
+    redis_async *self = (redis_async *)privdata;
+    self->update_events(self->m_events | EPOLLIN);
+}
+
+void redis_async::del_read(void *privdata)
+{
+    redis_async *self = (redis_async *)privdata;
+    self->update_events(self->m_events & ~EPOLLIN);
+}
+
+void redis_async::add_write(void *privdata)
+{
+    redis_async *self = (redis_async *)privdata;
+    self->update_events(self->m_events | EPOLLOUT);
+}
+
+void redis_async::del_write(void *privdata)
+{
+    redis_async *self = (redis_async *)privdata;
+    self->update_events(self->m_events & ~EPOLLOUT);
+}
+
+void redis_async::cleanup(void *privdata)
+{
+    redis_async *self = (redis_async *)privdata;
+    self->update_events(0);
+    self->m_ctx_fd = -1;
+}
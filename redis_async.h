@@ -0,0 +1,80 @@
+#ifndef _REDIS_ASYNC_
+#define _REDIS_ASYNC_
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+using namespace std;
+
+class http_conn;
+
+/************************************************************
+*挂在主线程epoll上的异步Redis客户端，用于登录时的缓存查询
+*工作线程通过无锁栈提交GET请求，再用eventfd唤醒主线程；
+*主线程发出命令、处理回复，并在回调中让对应的http_conn继续处理，
+*整个过程中没有工作线程阻塞等待，也不需要从连接池取连接
+************************************************************/
+
+class redis_async
+{
+public:
+    static redis_async *GetInstance();
+
+    // 连接Redis，并把连接和eventfd注册到主线程的epoll上
+    bool init(int epollfd, const char *url, int port);
+    bool enabled() { return m_enabled; }
+
+    // fd是否属于异步Redis（Redis连接或eventfd），只在主线程调用
+    bool owns(int fd);
+    // 处理epoll事件，只在主线程调用
+    void handle_event(int fd, uint32_t events);
+
+    // 提交一次GET，结果通过conn->on_redis_reply(seq, value)返回。工作线程调用，无锁
+    void get(const char *key, http_conn *conn, unsigned int seq);
+
+private:
+    redis_async();
+    ~redis_async();
+
+    struct request
+    {
+        http_conn *conn;
+        unsigned int seq;
+        unsigned long near_seq;         // 提交时近端缓存的失效序号
+        bool tracked;                   // 发送时连接已开启失效跟踪，结果可以进近端缓存
+        char key[100];
+        request *next;
+    };
+
+    void connect();
+    void flush_pending();
+    void update_events(uint32_t events);
+
+    static void on_reply(redisAsyncContext *ac, void *reply, void *privdata);
+    static void on_connect(const redisAsyncContext *ac, int status);
+    static void on_disconnect(const redisAsyncContext *ac, int status);
+
+    // hiredis事件适配器：hiredis通过这些回调告诉我们需要关注哪些事件
+    static void add_read(void *privdata);
+    static void del_read(void *privdata);
+    static void add_write(void *privdata);
+    static void del_write(void *privdata);
+    static void cleanup(void *privdata);
+
+private:
+    bool m_enabled;
+    int m_epollfd;
+    int m_notify_fd;                    // 工作线程提交请求后用来唤醒主线程
+    redisAsyncContext *m_ctx;           // 断开后为NULL，下次提交时重连
+    int m_ctx_fd;                       // 当前注册在epoll上的Redis连接fd
+    long m_ctx_epoch;                   // 连接上开启失效跟踪时订阅连接的epoch，-1表示未开启
+    uint32_t m_events;                  // 当前注册的事件
+    atomic<request *> m_pending;        // 待发送的请求（无锁栈，后进先出）
+    string m_url;
+    int m_port;
+};
+
+#endif
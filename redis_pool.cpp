@@ -2,11 +2,141 @@
 #include <string.h>
 #include <iostream>
 
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+
 #include "redis_pool.h"
+#include "metrics.h"
+
+/*******************
+*   near_cache
+*******************/
+
+near_cache::near_cache() : m_hand(0), m_capacity(0), m_ttl(0), m_negative_ttl(0), m_seq(0) {
+}
+
+void near_cache::init(int capacity, int ttl, int negative_ttl) {
+    m_lock.lock();
+    m_slots.assign(capacity, slot());
+    for (int i = 0; i < capacity; ++i) {
+        m_slots[i].used = false;
+        m_slots[i].referenced = false;
+        m_slots[i].expire = 0;
+    }
+    m_index.clear();
+    m_index.reserve(capacity);
+    m_hand = 0;
+    m_ttl = ttl;
+    m_negative_ttl = negative_ttl;
+    m_capacity = capacity;
+    m_lock.unlock();
+}
+
+bool near_cache::get(const string& key, string& value) {
+    bool hit = false;
+    m_lock.lock();
+    unordered_map<string, int>::iterator it = m_index.find(key);
+    if (it != m_index.end()) {
+        slot& s = m_slots[it->second];
+        if (s.expire > time(NULL)) {
+            s.referenced = true;
+            value = s.value;
+            hit = true;
+        } else {
+            s.used = false;
+            m_index.erase(it);
+        }
+    }
+    m_lock.unlock();
+    return hit;
+}
+
+void near_cache::put(const string& key, const string& value, unsigned long seq) {
+    m_lock.lock();
+    // 发出GET之后有过失效，读到的可能是旧值
+    if (seq != m_seq.load(memory_order_relaxed)) {
+        m_lock.unlock();
+        return;
+    }
+    int idx;
+    unordered_map<string, int>::iterator it = m_index.find(key);
+    if (it != m_index.end()) {
+        idx = it->second;
+    } else {
+        // CLOCK：跳过最近被访问过的槽位，同时清掉它们的访问位
+        while (m_slots[m_hand].used && m_slots[m_hand].referenced) {
+            m_slots[m_hand].referenced = false;
+            m_hand = (m_hand + 1) % m_capacity;
+        }
+        idx = m_hand;
+        m_hand = (m_hand + 1) % m_capacity;
+        if (m_slots[idx].used) {
+            m_index.erase(m_slots[idx].key);
+        }
+        m_slots[idx].key = key;
+        m_slots[idx].used = true;
+        m_index[key] = idx;
+    }
+    slot& s = m_slots[idx];
+    s.value = value;
+    s.referenced = false;
+    s.expire = time(NULL) + (value.empty() ? m_negative_ttl : m_ttl);
+    m_lock.unlock();
+}
+
+void near_cache::erase(const string& key) {
+    m_lock.lock();
+    m_seq.fetch_add(1, memory_order_release);
+    unordered_map<string, int>::iterator it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_slots[it->second].used = false;
+        m_index.erase(it);
+    }
+    m_lock.unlock();
+}
+
+void near_cache::clear() {
+    m_lock.lock();
+    m_seq.fetch_add(1, memory_order_release);
+    for (int i = 0; i < m_capacity; ++i) {
+        m_slots[i].used = false;
+    }
+    m_index.clear();
+    m_lock.unlock();
+}
+
+/*******************
+*   RedisPool
+*******************/
+
+// 从现在起ms毫秒后的绝对时间，给pthread_cond_timedwait用
+static struct timespec deadline_after(int ms) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec t;
+    long long nsec = now.tv_usec * 1000LL + (ms % 1000) * 1000000LL;
+    t.tv_sec = now.tv_sec + ms / 1000 + nsec / 1000000000LL;
+    t.tv_nsec = nsec % 1000000000LL;
+    return t;
+}
 
 RedisPool::RedisPool() {
-    m_CurConn = 0;
-    m_FreeConn = 0;
+    m_MinConn = 0;
+    m_MaxConn = 0;
+    m_TotalConn = 0;
+    m_checkout_ms = 200;
+    m_idle_timeout = 60;
+    m_health_interval = 5;
+    m_health_stop = false;
+    m_health_started = false;
+    m_batchConn = 0;
+    m_batch_head = NULL;
+    m_batch_tail = NULL;
+    m_batch_stop = false;
+    m_tracking = false;
+    m_track_id = -1;
+    m_track_epoch = 0;
 }
 
 RedisPool* RedisPool::GetInstance() {
@@ -14,143 +144,628 @@ RedisPool* RedisPool::GetInstance() {
     return &redisPool;
 }
 
+void RedisPool::set_timeouts(int checkout_ms, int idle_timeout, int health_interval) {
+    // 健康检查线程按m_health_interval等待，为0时会空转
+    m_checkout_ms = checkout_ms < 0 ? 0 : checkout_ms;
+    m_idle_timeout = idle_timeout < 1 ? 1 : idle_timeout;
+    m_health_interval = health_interval < 1 ? 1 : health_interval;
+    // 唤醒健康检查线程按新的间隔重新计时，不用等完上一个间隔
+    m_health_lock.lock();
+    m_health_cond.signal();
+    m_health_lock.unlock();
+}
+
+void RedisPool::set_size(int maxConn, int minConn) {
+    m_MinConn = (minConn < 0 || minConn > maxConn) ? maxConn : minConn;
+    m_MaxConn = maxConn;
+}
+
 // 构造初始化
-void RedisPool::init(const char* url, const char* port, int maxConn) {
+void RedisPool::init(const char* url, const char* port, int maxConn, int batchConn, int minConn) {
     m_url = url;
     m_port = port;
+    m_MaxConn = maxConn;
+    m_MinConn = (minConn < 0 || minConn > maxConn) ? maxConn : minConn;
 
-    for (int i = 0; i < maxConn; ++i) {
-        redisContext* conn = NULL;
-        conn = redisConnect(url, atoi(port));
+    // Redis暂时不可用也不退出，由健康检查线程稍后补足
+    for (int i = 0; i < m_MinConn; ++i) {
+        ++m_TotalConn;
+        pooled_conn* pc = create_conn();
+        if (pc == NULL) {
+            --m_TotalConn;
+            LOG_ERROR("Redis Error: only %d of %d connections established\n", i, m_MinConn.load());
+            break;
+        }
+        m_idle.put_shared(pc);
+    }
+
+    // 不detach，析构时join：进程退出时健康检查线程不能再访问已经销毁的连接池
+    m_health_started = pthread_create(&m_health_tid, NULL, health_worker, this) == 0;
 
-        if (conn == NULL) {
-            Log::get_instance()->write_log(3, "Redis Error: connect error\n");
-            exit(1);
+    pthread_t tid;
+
+    // 启动管道线程，每个线程独占一个连接
+    for (int i = 0; i < batchConn; ++i) {
+        if (pthread_create(&tid, NULL, batch_worker, this) != 0) {
+            LOG_ERROR("Redis Error: create batch thread failed\n");
+            break;
         }
+        // 不detach，析构时join：管道线程还等在m_batch_cond上时销毁条件变量会一直阻塞
+        m_batch_threads.push_back(tid);
+        ++m_batchConn;
+    }
+}
 
-        connList.push_back(conn);
-        ++m_FreeConn;
+// 建立一个连接。with_timeout为true时设置命令超时，Redis卡住时命令最多阻塞1秒
+redisContext* RedisPool::connect_one(bool with_timeout) {
+    struct timeval tv = {1, 0};
+    redisContext* conn = redisConnectWithTimeout(m_url.c_str(), atoi(m_port.c_str()), tv);
+    if (conn == NULL || conn->err) {
+        LOG_ERROR("Redis Error: connect error: %s\n", conn ? conn->errstr : "alloc failed");
+        if (conn) {
+            redisFree(conn);
+        }
+        return NULL;
+    }
+    if (with_timeout) {
+        redisSetTimeout(conn, tv);
     }
-    reserve = sem(m_FreeConn);
-    m_MaxConn = m_FreeConn;
+    redisEnableKeepAlive(conn);
+    return conn;
 }
 
-// 当有请求时，从数据库连接池中返回一个可用连接，更新使用和空闲连接数
-redisContext* RedisPool::GetConnection() {
-    redisContext* conn = NULL;
-    if (0 == connList.size()) return NULL;
+// 包装一个新建的连接，优先复用spare栈中的对象，调用前需已占好名额
+RedisPool::pooled_conn* RedisPool::create_conn() {
+    redisContext* conn = connect_one(true);
+    if (conn == NULL) {
+        return NULL;
+    }
+    pooled_conn* pc = m_idle.take_spare();
+    if (pc == NULL) {
+        pc = new pooled_conn;
+    }
+    pc->conn = conn;
+    pc->last_used = time(NULL);
+    pc->track_epoch = -1;
+    pc->next = NULL;
+    conn->privdata = pc;
+    return pc;
+}
 
-    
-    reserve.wait();
+bool RedisPool::reserve() {
+    int total = m_TotalConn.load();
+    while (total < m_MaxConn) {
+        if (m_TotalConn.compare_exchange_weak(total, total + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    lock.lock();
+void RedisPool::discard(pooled_conn* pc) {
+    redisFree(pc->conn);
+    pc->conn = NULL;
+    m_idle.put_spare(pc);
+    --m_TotalConn;
+    m_idle.notify();
+}
 
-    conn = connList.front();
-    connList.pop_back();
+// 当有请求时，从连接池中返回一个可用连接
+// 常见情况是取回本线程上次归还的连接，不加锁；没有空闲连接时未达上限就新建一个，否则最多等待m_checkout_ms毫秒
+redisContext* RedisPool::GetConnection() {
+    int64_t start = metrics::now_ns();
+    redisContext* conn = checkout();
+    metrics::GetInstance()->observe(STAGE_REDIS_WAIT, metrics::now_ns() - start);
+    return conn;
+}
 
-    --m_FreeConn;
-    ++m_CurConn;
+redisContext* RedisPool::checkout() {
+    // 没有初始化过的池直接返回
+    if (0 == m_MaxConn) return NULL;
 
-    lock.unlock();
-    return conn;
+    pooled_conn* pc = m_idle.get();
+    if (pc) {
+        return pc->conn;
+    }
+
+    struct timespec deadline = deadline_after(m_checkout_ms);
+    while (true) {
+        if (reserve()) {
+            pc = create_conn();
+            if (pc) {
+                return pc->conn;
+            }
+            // 建连失败说明Redis不可用，直接失败，不让请求排队等待
+            --m_TotalConn;
+            m_idle.notify();
+            return NULL;
+        }
+        bool timed_out = false;
+        pc = m_idle.wait(deadline, m_TotalConn, m_MaxConn, timed_out);
+        if (pc) {
+            return pc->conn;
+        }
+        if (timed_out) {
+            LOG_WARN("Redis pool: checkout timed out after %d ms\n", m_checkout_ms.load());
+            return NULL;
+        }
+    }
 }
 
-// 释放当前使用的连接
+// 释放当前使用的连接，出过错的连接直接关闭，腾出名额给等待者新建
 bool RedisPool::ReleaseConnection(redisContext* conn) {
     if (NULL == conn) return false;
-    lock.lock();
 
-    connList.push_back(conn);
-    ++m_FreeConn;
-    --m_CurConn;
+    pooled_conn* pc = (pooled_conn*)conn->privdata;
+    // 上限调小之后，多出的连接用完就关闭
+    if (conn->err || m_TotalConn > m_MaxConn) {
+        discard(pc);
+        return true;
+    }
 
-    lock.unlock();
-    reserve.post();
+    pc->last_used = time(NULL);
+    m_idle.put(pc);
     return true;
 }
 
+void* RedisPool::health_worker(void* arg) {
+    RedisPool* pool = (RedisPool*)arg;
+    pool->m_health_lock.lock();
+    while (!pool->m_health_stop) {
+        struct timespec deadline = deadline_after(pool->m_health_interval * 1000);
+        if (pool->m_health_cond.timewait(pool->m_health_lock.get(), deadline)) {
+            // 间隔改了或者要退出
+            continue;
+        }
+        pool->m_health_lock.unlock();
+        pool->health_check();
+        pool->m_health_lock.lock();
+    }
+    pool->m_health_lock.unlock();
+    return pool;
+}
+
+void RedisPool::stop_health() {
+    if (!m_health_started) {
+        return;
+    }
+    m_health_lock.lock();
+    m_health_stop = true;
+    m_health_cond.signal();
+    m_health_lock.unlock();
+    pthread_join(m_health_tid, NULL);
+    m_health_started = false;
+}
+
+// 健康检查：回收空闲太久的连接，PING其余空闲了一个周期以上的连接，最后补足MinConn
+// 一次只取出一个连接，检查完马上放回，其余空闲连接照常可用；各线程槽位里的连接不动
+void RedisPool::health_check() {
+    time_t now = time(NULL);
+    // 检查期间归还的连接也会进全局栈，最多检查开始时的空闲连接数那么多次
+    int n = m_idle.idle_count();
+    for (int i = 0; i < n; i++) {
+        pooled_conn* pc = m_idle.take_unchecked();
+        if (!pc) {
+            break;
+        }
+        if (m_TotalConn > m_MaxConn) {
+            discard(pc);
+            continue;
+        }
+        if (now - pc->last_used < m_health_interval) {
+            m_idle.put_checked(pc);
+            continue;
+        }
+        if (now - pc->last_used >= m_idle_timeout && m_TotalConn > m_MinConn) {
+            discard(pc);
+            continue;
+        }
+        redisReply* reply = (redisReply*)redisCommand(pc->conn, "PING");
+        if (reply == NULL) {
+            // 连接已断开：换一个新连接，建不上就关闭它
+            LOG_WARN("Redis connection lost, reconnecting\n");
+            redisContext* fresh = connect_one(true);
+            if (fresh == NULL) {
+                discard(pc);
+                continue;
+            }
+            redisFree(pc->conn);
+            pc->conn = fresh;
+            pc->track_epoch = -1;
+            fresh->privdata = pc;
+        } else {
+            freeReplyObject(reply);
+        }
+        m_idle.put_checked(pc);
+    }
+    m_idle.end_check();
+
+    while (reserve()) {
+        if (m_TotalConn > m_MinConn) {
+            --m_TotalConn;
+            break;
+        }
+        pooled_conn* pc = create_conn();
+        if (!pc) {
+            --m_TotalConn;
+            break;
+        }
+        m_idle.put_shared(pc);
+    }
+}
+
 // 销毁Redis连接池
 void RedisPool::DestroyPool() {
-    lock.lock();
-    if (connList.size() > 0) {
-        list<redisContext*>::iterator it;
-        for (it = connList.begin(); it != connList.end(); ++it) {
-            redisContext* conn = *it;
-            redisFree(conn);
-        }
-        m_CurConn = 0;
-        m_FreeConn = 0;
-        connList.clear();
+    list<pooled_conn*> idle;
+    m_idle.drain(idle);
+    for (list<pooled_conn*>::iterator it = idle.begin(); it != idle.end(); ++it) {
+        redisFree((*it)->conn);
+        (*it)->conn = NULL;
+        m_idle.put_spare(*it);
+        --m_TotalConn;
     }
-    lock.unlock();
 }
 
 // 当前空闲的连接数
 int RedisPool::GetFreeConn() {
-    return this->m_FreeConn;
+    return m_idle.idle_count();
 }
 
 RedisPool::~RedisPool() {
+    stop_health();
+    stop_batch();
     DestroyPool();
+    pooled_conn* pc;
+    while ((pc = m_idle.take_spare()) != NULL) {
+        delete pc;
+    }
+}
+
+int RedisPool::parse_set_reply(redisReply* reply) {
+    if (reply == NULL) {
+        LOG_ERROR("set string fail : reply = NULL\n");
+        return -1;
+    }
+    LOG_DEBUG("set string type = %d\n", reply->type); //获取响应的枚举类型
+    if (reply->type == REDIS_REPLY_STATUS && strcmp(reply->str, "OK") == 0) {  //根据不同的响应类型进行判断获取成功与否
+        return 1;
+    }
+    LOG_ERROR("set string fail: %s\n", reply->str ? reply->str : "");
+    return -1;
+}
+
+string RedisPool::parse_get_reply(redisReply* reply) {
+    if (reply == NULL) {
+        LOG_ERROR("ERROR getString: reply = NULL! maybe redis server is down\n");
+        return "error";
+    }
+    LOG_DEBUG("get string type = %d\n", reply->type);
+    if (reply->type == REDIS_REPLY_NIL || (reply->type == REDIS_REPLY_STRING && reply->len <= 0)) {
+        return "";
+    }
+    if (reply->type != REDIS_REPLY_STRING) {
+        LOG_ERROR("ERROR getString: %s\n", reply->str ? reply->str : "");
+        return "error";
+    }
+    return string(reply->str, reply->len);
 }
 
 int RedisPool::setString(string key, string value) {
-    redisContext* redis =  RedisPool::GetInstance()->GetConnection();
-    redisRAII raii(&redis, RedisPool::GetInstance());
+    // 自己的写入同样会收到失效消息，这里先删掉本地旧值，下次读时再从Redis取
+    if (m_near.enabled()) {
+        m_near.erase(key);
+    }
+    if (m_batchConn > 0) {
+        batch_request req;
+        req.is_set = true;
+        req.key = &key;
+        req.value = &value;
+        submit(&req);
+        req.done.wait();
+        return req.set_result;
+    }
+
+    redisContext* redis = NULL;
+    redisRAII raii(&redis, this);
     if(redis == NULL || redis->err)     // Error flags, 错误标识，0表示无错误
     {
-        Log::get_instance()->write_log(3, "Redis init Error !!!\n");
+        LOG_ERROR("Redis init Error !!!\n");
         return -1;
     }
-    redisReply *reply;
-    reply = (redisReply *)redisCommand(redis, "SET %s %s",  key.c_str(), value.c_str());    //执行写入命令
-    Log::get_instance()->write_log(1, "set string type = \n", reply->type); //获取响应的枚举类型
-    int result = 0;
-    if(reply == NULL) {
-        result = -1;
-        Log::get_instance()->write_log(3, "set string fail : reply->str = NULL\n");
-        return -1;
-    } else if(strcmp(reply->str, "OK") == 0) {  //根据不同的响应类型进行判断获取成功与否
-        result = 1;
-    } else {
-        result = -1;
-        Log::get_instance()->write_log(3, "set string fail: %s\n", reply->str);
+    redisReply *reply = (redisReply *)redisCommand(redis, "SET %s %s",  key.c_str(), value.c_str());    //执行写入命令
+    int result = parse_set_reply(reply);
+    if (reply) {
+        freeReplyObject(reply);     //释放响应信息
     }
-    freeReplyObject(reply);     //释放响应信息
     return result;
 }
 
 string RedisPool::getString(string key) {
-    redisContext* redis =  RedisPool::GetInstance()->GetConnection();
-    redisRAII raii(&redis, RedisPool::GetInstance());
-    if(redis == NULL || redis->err)
-	{
-        Log::get_instance()->write_log(3, "Redis init Error!\n");
-        return "error";
-	}
-	redisReply *reply;
-    reply = (redisReply *)redisCommand(redis,"GET %s", key.c_str());
-    Log::get_instance()->write_log(1, "get string type = %d\n", reply->type);
- 
-	if(reply == NULL)
-	{
-        Log::get_instance()->write_log(3, "ERROR getString: reply = NULL! maybe redis server is down\n");
-        return "error";
-	}
-    else if(reply->len <= 0)
-	{		
-        freeReplyObject(reply);
-        return "";
-	}
-	else
-	{
-        // stringstream ss;
-        // ss << reply->str;
-        // freeReplyObject(reply);
-        // return ss.str();
-        string s = reply->str;
+    string result;
+    if (near_get(key, result)) {
+        return result;
+    }
+    unsigned long seq = m_near.seq();
+    bool tracked = false;
+
+    if (m_batchConn > 0) {
+        batch_request req;
+        req.is_set = false;
+        req.key = &key;
+        req.value = NULL;
+        submit(&req);
+        req.done.wait();
+        result = req.get_result;
+        tracked = req.tracked;
+    } else {
+        redisContext* redis = NULL;
+        redisRAII raii(&redis, this);
+        if(redis == NULL || redis->err)
+        {
+            LOG_ERROR("Redis init Error!\n");
+            return "error";
+        }
+        tracked = ensure_tracking(redis, ((pooled_conn*)redis->privdata)->track_epoch);
+        redisReply *reply = (redisReply *)redisCommand(redis,"GET %s", key.c_str());
+        result = parse_get_reply(reply);
+        if (reply) {
+            freeReplyObject(reply);
+        }
+    }
+
+    if (tracked) {
+        near_put(key, result, seq);
+    }
+    return result;
+}
+
+/*******************
+*   近端缓存
+*******************/
+
+void RedisPool::init_near_cache(int capacity, int ttl, int negative_ttl) {
+    if (capacity <= 0) {
+        return;
+    }
+    m_near.init(capacity, ttl, negative_ttl);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, tracking_worker, this) != 0) {
+        LOG_ERROR("Redis Error: create tracking thread failed\n");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
+
+bool RedisPool::near_get(const string& key, string& value) {
+    // 失效通道断开时不能信任本地数据
+    return m_near.enabled() && m_tracking && m_near.get(key, value);
+}
+
+void RedisPool::near_put(const string& key, const string& value, unsigned long seq) {
+    if (m_near.enabled() && value != "error") {
+        m_near.put(key, value, seq);
+    }
+}
+
+bool RedisPool::ensure_tracking(redisContext* conn, long& conn_epoch) {
+    if (!m_near.enabled() || !m_tracking) {
+        return false;
+    }
+    // 连接上记录着开启跟踪时的epoch，订阅连接重连过之后需要重新开启
+    long epoch = m_track_epoch;
+    if (conn_epoch == epoch) {
+        return true;
+    }
+    redisReply* reply = (redisReply*)redisCommand(conn, "CLIENT TRACKING on REDIRECT %lld", (long long)m_track_id);
+    bool ok = reply && reply->type == REDIS_REPLY_STATUS;
+    if (!ok) {
+        LOG_ERROR("Redis Error: CLIENT TRACKING failed: %s\n", reply && reply->str ? reply->str : "");
+    }
+    if (reply) {
         freeReplyObject(reply);
-        return s;
+    }
+    if (ok) {
+        conn_epoch = epoch;
+    }
+    return ok;
+}
+
+void* RedisPool::tracking_worker(void* arg) {
+    RedisPool* pool = (RedisPool*)arg;
+    pool->tracking_loop();
+    return pool;
+}
+
+// 订阅连接：取得自己的CLIENT ID，订阅__redis__:invalidate，
+// 之后数据连接都把失效消息重定向到这里。断开后清空近端缓存并重连
+void RedisPool::tracking_loop() {
+    while (true) {
+        // 订阅连接上长时间没有消息是正常的，不设命令超时，靠TCP keepalive发现断线
+        redisContext* conn = connect_one(false);
+        redisReply* reply = NULL;
+        long long id = -1;
+        if (conn) {
+            reply = (redisReply*)redisCommand(conn, "CLIENT ID");
+            if (reply && reply->type == REDIS_REPLY_INTEGER) {
+                id = reply->integer;
+            }
+            if (reply) {
+                freeReplyObject(reply);
+            }
+        }
+        if (id >= 0) {
+            reply = (redisReply*)redisCommand(conn, "SUBSCRIBE __redis__:invalidate");
+            if (reply == NULL) {
+                id = -1;
+            } else {
+                freeReplyObject(reply);
+            }
+        }
+        if (id < 0) {
+            LOG_ERROR("Redis Error: tracking connection failed\n");
+            if (conn) {
+                redisFree(conn);
+            }
+            sleep(1);
+            continue;
+        }
+
+        m_near.clear();
+        m_track_id = id;
+        m_track_epoch++;
+        m_tracking = true;
+
+        while (redisGetReply(conn, (void**)&reply) == REDIS_OK) {
+            handle_invalidate(reply);
+            freeReplyObject(reply);
+        }
+
+        // 收不到失效消息了，本地数据都不可信
+        m_tracking = false;
+        m_near.clear();
+        LOG_ERROR("Redis Error: tracking connection lost\n");
+        redisFree(conn);
+        sleep(1);
+    }
+}
+
+// 失效消息：["message", "__redis__:invalidate", [key...]]，key列表为nil表示FLUSHALL
+void RedisPool::handle_invalidate(redisReply* reply) {
+    if (reply->type != REDIS_REPLY_ARRAY && reply->type != REDIS_REPLY_PUSH) {
+        return;
+    }
+    if (reply->elements < 3 || reply->element[0]->type != REDIS_REPLY_STRING
+        || strcmp(reply->element[0]->str, "message") != 0) {
+        return;
+    }
+    redisReply* keys = reply->element[2];
+    if (keys->type == REDIS_REPLY_ARRAY) {
+        for (size_t i = 0; i < keys->elements; ++i) {
+            m_near.erase(string(keys->element[i]->str, keys->element[i]->len));
+        }
+    } else {
+        m_near.clear();
+    }
+}
+
+/*******************
+*   批处理
+*******************/
+
+void* RedisPool::batch_worker(void* arg) {
+    RedisPool* pool = (RedisPool*)arg;
+    pool->batch_loop();
+    return pool;
+}
+
+// 把请求挂到队尾，唤醒一个管道线程
+// 管道线程忙于上一批时，后来的请求会在队列里攒成下一批
+void RedisPool::submit(batch_request* req) {
+    req->next = NULL;
+    m_batch_lock.lock();
+    if (m_batch_tail) {
+        m_batch_tail->next = req;
+    } else {
+        m_batch_head = req;
+    }
+    m_batch_tail = req;
+    m_batch_cond.signal();
+    m_batch_lock.unlock();
+}
+
+// 连接不可用时，整批请求都以出错返回
+void RedisPool::fail_batch(batch_request* head) {
+    while (head) {
+        batch_request* next = head->next;   // post之后head可能已被调用者释放
+        head->set_result = -1;
+        head->get_result = "error";
+        head->tracked = false;
+        head->done.post();
+        head = next;
+    }
+}
+
+// 等管道线程把已提交的请求做完后退出
+void RedisPool::stop_batch() {
+    m_batch_lock.lock();
+    m_batch_stop = true;
+    m_batch_cond.broadcast();
+    m_batch_lock.unlock();
+    for (size_t i = 0; i < m_batch_threads.size(); ++i) {
+        pthread_join(m_batch_threads[i], NULL);
+    }
+    m_batch_threads.clear();
+}
+
+void RedisPool::batch_loop() {
+    redisContext* conn = connect_one(true);
+    long conn_epoch = -1;
+    while (true) {
+        // 一次取走队列中至多MAX_BATCH个请求
+        m_batch_lock.lock();
+        while (m_batch_head == NULL && !m_batch_stop) {
+            m_batch_cond.wait(m_batch_lock.get());
+        }
+        if (m_batch_head == NULL) {
+            m_batch_lock.unlock();
+            break;
+        }
+        batch_request* head = m_batch_head;
+        batch_request* tail = head;
+        for (int n = 1; tail->next && n < MAX_BATCH; ++n) {
+            tail = tail->next;
+        }
+        m_batch_head = tail->next;
+        if (m_batch_head == NULL) {
+            m_batch_tail = NULL;
+        }
+        tail->next = NULL;
+        m_batch_lock.unlock();
+
+        if (conn == NULL || conn->err) {
+            if (conn) {
+                redisFree(conn);
+            }
+            conn = connect_one(true);
+            conn_epoch = -1;
+            if (conn == NULL) {
+                LOG_ERROR("Redis Error: batch connection lost\n");
+                fail_batch(head);
+                continue;
+            }
+        }
+
+        bool tracked = ensure_tracking(conn, conn_epoch);
+
+        // 先把整批命令写入输出缓冲，再逐个读回复：一次往返完成整批
+        for (batch_request* req = head; req; req = req->next) {
+            req->tracked = tracked;
+            if (req->is_set) {
+                redisAppendCommand(conn, "SET %s %s", req->key->c_str(), req->value->c_str());
+            } else {
+                redisAppendCommand(conn, "GET %s", req->key->c_str());
+            }
+        }
+        for (batch_request* req = head; req; ) {
+            batch_request* next = req->next;
+            redisReply* reply = NULL;
+            if (redisGetReply(conn, (void**)&reply) != REDIS_OK) {
+                reply = NULL;
+            }
+            if (req->is_set) {
+                req->set_result = parse_set_reply(reply);
+            } else {
+                req->get_result = parse_get_reply(reply);
+            }
+            if (reply) {
+                freeReplyObject(reply);
+            }
+            req->done.post();
+            req = next;
+        }
+    }
+    if (conn) {
+        redisFree(conn);
     }
 }
 
@@ -8,13 +8,62 @@
 #include <string.h>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <time.h>
 #include <hiredis/hiredis.h>
 
 #include "locker.h"
 #include "log.h"
+#include "conn_cache.h"
 
 using namespace std;
 
+/************************************************************
+*RedisPool内部的近端缓存，缓存GET的结果（包括不存在的key）
+*容量固定，按key设置过期时间，满了以后用CLOCK淘汰
+*一致性依靠Redis 6的客户端缓存：数据连接开启CLIENT TRACKING并重定向到
+*专门的订阅连接，其他客户端修改了我们读过的key时，Redis推送失效消息
+************************************************************/
+class near_cache
+{
+public:
+    near_cache();
+
+    // capacity：最多缓存的key数；ttl/negative_ttl：命中/不存在的记录存活秒数
+    void init(int capacity, int ttl, int negative_ttl);
+    bool enabled() { return m_capacity > 0; }
+
+    // 命中返回true；value为""表示该key在Redis中不存在（负缓存）
+    bool get(const string& key, string& value);
+    // 写入GET的结果。seq为发出GET之前的失效序号，期间有过失效则放弃写入，避免写回旧值
+    void put(const string& key, const string& value, unsigned long seq);
+    void erase(const string& key);
+    void clear();
+    // 失效序号，每次erase/clear加一
+    unsigned long seq() { return m_seq.load(memory_order_acquire); }
+
+private:
+    struct slot
+    {
+        string key;
+        string value;
+        time_t expire;
+        bool referenced;    // CLOCK的访问位
+        bool used;
+    };
+
+    locker m_lock;
+    vector<slot> m_slots;
+    unordered_map<string, int> m_index;     // key -> 槽位下标
+    int m_hand;             // CLOCK指针
+    int m_capacity;
+    int m_ttl;
+    int m_negative_ttl;
+    atomic<unsigned long> m_seq;
+};
+
 class RedisPool
 {
 // public:
@@ -28,27 +77,119 @@ class RedisPool
 public:
     // 单例模式
     static RedisPool *GetInstance();
-    void init(const char* url, const char* port, int maxConn);
+    // batchConn > 0 时开启批处理：GET/SET不再各自占用一个连接，
+    // 而是交给batchConn个管道线程合并成pipeline发送
+    // 连接数在[minConn, maxConn]之间自动伸缩，minConn < 0 表示固定为maxConn
+    void init(const char* url, const char* port, int maxConn, int batchConn = 0, int minConn = -1);
+    // checkout_ms：取连接最长等待毫秒数；idle_timeout：空闲多少秒后回收；health_interval：健康检查间隔秒数
+    void set_timeouts(int checkout_ms, int idle_timeout, int health_interval);
+    // 运行中调整连接数范围：对之后的取连接生效，调小时多出的连接在归还或健康检查时关闭
+    void set_size(int maxConn, int minConn);
 
-    redisContext* GetConnection();                  // 获取redis连接
+    redisContext* GetConnection();                  // 获取redis连接，超时或建连失败返回NULL
     bool ReleaseConnection(redisContext *conn);     // 释放连接
-    int GetFreeConn();                              // 获取连接
+    int GetFreeConn();                              // 当前空闲连接数（近似值）
     void DestroyPool();                             // 销毁所有连接
 
     int setString(string key, string value);
     string getString(string key);
 
+    // 把GET的回复转换成getString的返回值：值本身，不存在为""，出错为"error"
+    static string parse_get_reply(redisReply* reply);
+
+    // 开启近端缓存，并启动接收失效消息的订阅线程
+    void init_near_cache(int capacity, int ttl, int negative_ttl);
+    // 只查近端缓存，不访问Redis
+    bool near_get(const string& key, string& value);
+    // 把GET结果写入近端缓存，seq为发GET之前near_seq()的值
+    void near_put(const string& key, const string& value, unsigned long seq);
+    unsigned long near_seq() { return m_near.seq(); }
+    // 保证连接开启了重定向到当前订阅连接的CLIENT TRACKING，
+    // conn_epoch记录该连接开启跟踪时的epoch（新连接为-1）
+    // 返回false表示失效通道不可用，这次读到的结果不能进近端缓存
+    bool ensure_tracking(redisContext* conn, long& conn_epoch);
+    // 给异步连接用：当前订阅连接的id（没有可用的订阅连接时为-1）和epoch
+    long long tracking_id() { return m_near.enabled() && m_tracking ? m_track_id.load() : -1; }
+    long tracking_epoch() { return m_track_epoch; }
+
     RedisPool();
     ~RedisPool();
+
+private:
+    // 一次排队等待批处理的GET/SET请求，结果由管道线程填好后post唤醒调用者
+    struct batch_request
+    {
+        bool is_set;
+        const string* key;
+        const string* value;
+        int set_result;         // SET的结果，同setString
+        string get_result;      // GET的结果，同getString
+        bool tracked;           // 执行命令的连接开启了失效跟踪
+        sem done;
+        batch_request* next;
+    };
+
+    static void* batch_worker(void* arg);
+    void batch_loop();
+    void submit(batch_request* req);
+    void fail_batch(batch_request* head);
+    void stop_batch();
+
+    static int parse_set_reply(redisReply* reply);
+
+    struct pooled_conn;
+    redisContext* connect_one(bool with_timeout);
+    redisContext* checkout();           // GetConnection的实际实现，外面包一层统计等待时间
+    pooled_conn* create_conn();
+    bool reserve();                     // 未达上限时占一个名额
+    void discard(pooled_conn* pc);      // 关闭连接并让出名额
+    static void* health_worker(void* arg);
+    void health_check();
+    void stop_health();                 // 通知健康检查线程退出并等它结束
+
+    static void* tracking_worker(void* arg);
+    void tracking_loop();
+    void handle_invalidate(redisReply* reply);
+
 private:
+    // 池中的一个连接，redisContext的privdata指向它
+    // 对象本身不释放（conn_cache的要求），连接关闭后放回spare栈复用
+    struct pooled_conn
+    {
+        redisContext* conn;
+        time_t last_used;       // 最近一次归还的时间
+        long track_epoch;       // 开启CLIENT TRACKING时的epoch
+        pooled_conn* next;
+    };
+
     string m_url;           // 主机地址
     string m_port;          // 数据库端口号
-    int m_MaxConn;          // 最大连接数
-    int m_CurConn;          // 当前已使用的连接数
-    int m_FreeConn;         // 当前空闲的连接数
-    locker lock;
-    list<redisContext*> connList;  // 连接池
-    sem reserve;
+    atomic<int> m_MinConn;      // 最小连接数
+    atomic<int> m_MaxConn;      // 最大连接数
+    atomic<int> m_TotalConn;    // 已建立的连接数（空闲 + 使用中 + 正在建立）
+    atomic<int> m_checkout_ms;      // 以下三项SIGHUP时由主线程修改，工作线程和健康检查线程读
+    atomic<int> m_idle_timeout;
+    atomic<int> m_health_interval;
+    locker m_health_lock;
+    cond m_health_cond;                 // set_timeouts和析构时唤醒健康检查线程
+    bool m_health_stop;                 // 由m_health_lock保护
+    bool m_health_started;
+    pthread_t m_health_tid;
+    conn_cache<pooled_conn> m_idle;     // 空闲连接，常见路径取回本线程上次归还的连接
+
+    int m_batchConn;                        // 管道线程数，0表示不批处理
+    static const int MAX_BATCH = 256;       // 一次pipeline最多合并的命令数
+    locker m_batch_lock;
+    cond m_batch_cond;
+    batch_request* m_batch_head;            // 等待发送的请求（FIFO）
+    batch_request* m_batch_tail;
+    bool m_batch_stop;                      // 析构时通知管道线程退出，由m_batch_lock保护
+    vector<pthread_t> m_batch_threads;
+
+    near_cache m_near;
+    atomic<bool> m_tracking;                // 订阅连接正常，失效消息可达
+    atomic<long long> m_track_id;           // 订阅连接的CLIENT ID
+    atomic<long> m_track_epoch;             // 订阅连接每重连一次加一，数据连接据此重新开启跟踪
     
     // redisContext* _connect;
     // redisReply* _reply;
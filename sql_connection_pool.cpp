@@ -6,15 +6,208 @@
 #include <list>
 #include <pthread.h>
 #include <iostream>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "sql_connection_pool.h"
 #include "log.h"
+#include "metrics.h"
 
 using namespace std;
 
+static const char *SELECT_USER_SQL = "SELECT passwd FROM user WHERE username=?";
+static const char *INSERT_USER_SQL = "INSERT INTO user(username, passwd) VALUES(?, ?)";
+static const unsigned int ER_DUP_ENTRY_CODE = 1062;    // 违反唯一索引
+
+static const unsigned int CR_SERVER_GONE_ERROR_CODE = 2006;   // 连接已断开
+static const unsigned int CR_SERVER_LOST_CODE = 2013;         // 执行过程中连接断开
+
+// 从现在起ms毫秒后的绝对时间，给pthread_cond_timedwait用
+static struct timespec deadline_after(int ms) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec t;
+    long long nsec = now.tv_usec * 1000LL + (ms % 1000) * 1000000LL;
+    t.tv_sec = now.tv_sec + ms / 1000 + nsec / 1000000000LL;
+    t.tv_nsec = nsec % 1000000000LL;
+    return t;
+}
+
+/*******************
+*   sql_conn
+*******************/
+
+sql_conn::sql_conn(const sql_conn_params *params)
+    : mysql(NULL), last_used(0), broken(false), next(NULL), m_params(params), m_select_user(NULL), m_insert_user(NULL) {
+}
+
+sql_conn::~sql_conn() {
+    close();
+}
+
+void sql_conn::close() {
+    if (m_select_user) mysql_stmt_close(m_select_user);
+    if (m_insert_user) mysql_stmt_close(m_insert_user);
+    if (mysql) mysql_close(mysql);
+    m_select_user = NULL;
+    m_insert_user = NULL;
+    mysql = NULL;
+}
+
+bool sql_conn::connect() {
+    close();
+    mysql = mysql_init(NULL);
+    if (mysql == NULL) {
+        LOG_ERROR("MySQL Error: mysql_init failed\n");
+        broken = true;
+        return false;
+    }
+    // 连接和读写都设置超时，后端卡住时不至于让工作线程无限期阻塞
+    unsigned int timeout = 3;
+    mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &timeout);
+    mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+    if (!mysql_real_connect(mysql, m_params->url.c_str(), m_params->user.c_str(), m_params->passwd.c_str(),
+                            m_params->db.c_str(), m_params->port, NULL, 0)) {
+        LOG_ERROR("MySQL Error: connect failed: %s\n", mysql_error(mysql));
+        close();
+        broken = true;
+        return false;
+    }
+    broken = !prepare();
+    return !broken;
+}
+
+bool sql_conn::ping() {
+    if (mysql && mysql_ping(mysql) == 0) {
+        return true;
+    }
+    LOG_WARN("MySQL connection lost, reconnecting\n");
+    return connect();
+}
+
+bool sql_conn::prepare() {
+    m_select_user = mysql_stmt_init(mysql);
+    m_insert_user = mysql_stmt_init(mysql);
+    if (!m_select_user || !m_insert_user) {
+        LOG_ERROR("mysql_stmt_init error: %s\n", mysql_error(mysql));
+        return false;
+    }
+    if (mysql_stmt_prepare(m_select_user, SELECT_USER_SQL, strlen(SELECT_USER_SQL))) {
+        LOG_ERROR("prepare select error: %s\n", mysql_stmt_error(m_select_user));
+        return false;
+    }
+    if (mysql_stmt_prepare(m_insert_user, INSERT_USER_SQL, strlen(INSERT_USER_SQL))) {
+        LOG_ERROR("prepare insert error: %s\n", mysql_stmt_error(m_insert_user));
+        return false;
+    }
+    return true;
+}
+
+bool sql_conn::lost(MYSQL_STMT *stmt) {
+    unsigned int err = mysql_stmt_errno(stmt);
+    return err == CR_SERVER_GONE_ERROR_CODE || err == CR_SERVER_LOST_CODE;
+}
+
+int sql_conn::find_user(const char *name, char *passwd, int passwd_len) {
+    if (mysql == NULL && !connect()) {
+        return -1;
+    }
+    int ret = do_find_user(name, passwd, passwd_len);
+    if (ret == -1 && lost(m_select_user) && connect()) {
+        ret = do_find_user(name, passwd, passwd_len);
+    }
+    return ret;
+}
+
+int sql_conn::insert_user(const char *name, const char *passwd) {
+    if (mysql == NULL && !connect()) {
+        return -1;
+    }
+    int ret = do_insert_user(name, passwd);
+    if (ret == -1 && lost(m_insert_user) && connect()) {
+        ret = do_insert_user(name, passwd);
+    }
+    return ret;
+}
+
+int sql_conn::do_find_user(const char *name, char *passwd, int passwd_len) {
+    unsigned long name_len = strlen(name);
+    MYSQL_BIND param[1];
+    memset(param, 0, sizeof(param));
+    param[0].buffer_type = MYSQL_TYPE_STRING;
+    param[0].buffer = (void *)name;
+    param[0].buffer_length = name_len;
+    param[0].length = &name_len;
+
+    unsigned long out_len = 0;
+    MYSQL_BIND result[1];
+    memset(result, 0, sizeof(result));
+    result[0].buffer_type = MYSQL_TYPE_STRING;
+    result[0].buffer = passwd;
+    result[0].buffer_length = passwd_len - 1;   // 留一个字节给'\0'
+    result[0].length = &out_len;
+
+    if (mysql_stmt_bind_param(m_select_user, param)
+        || mysql_stmt_execute(m_select_user)
+        || mysql_stmt_bind_result(m_select_user, result)) {
+        LOG_ERROR("SELECT error: %s\n", mysql_stmt_error(m_select_user));
+        mysql_stmt_reset(m_select_user);
+        return -1;
+    }
+
+    int ret = 0;
+    int fetch = mysql_stmt_fetch(m_select_user);
+    if (fetch == 0 || fetch == MYSQL_DATA_TRUNCATED) {
+        // 被截断的密码不可能和输入相等，置空即可
+        if (fetch == MYSQL_DATA_TRUNCATED) out_len = 0;
+        passwd[out_len] = '\0';
+        ret = 1;
+    } else if (fetch != MYSQL_NO_DATA) {
+        LOG_ERROR("SELECT fetch error: %s\n", mysql_stmt_error(m_select_user));
+        ret = -1;
+    }
+    mysql_stmt_free_result(m_select_user);
+    return ret;
+}
+
+int sql_conn::do_insert_user(const char *name, const char *passwd) {
+    unsigned long name_len = strlen(name);
+    unsigned long passwd_len = strlen(passwd);
+    MYSQL_BIND param[2];
+    memset(param, 0, sizeof(param));
+    param[0].buffer_type = MYSQL_TYPE_STRING;
+    param[0].buffer = (void *)name;
+    param[0].buffer_length = name_len;
+    param[0].length = &name_len;
+    param[1].buffer_type = MYSQL_TYPE_STRING;
+    param[1].buffer = (void *)passwd;
+    param[1].buffer_length = passwd_len;
+    param[1].length = &passwd_len;
+
+    if (mysql_stmt_bind_param(m_insert_user, param) || mysql_stmt_execute(m_insert_user)) {
+        if (mysql_stmt_errno(m_insert_user) == ER_DUP_ENTRY_CODE) {
+            return 1;
+        }
+        LOG_ERROR("INSERT error: %s\n", mysql_stmt_error(m_insert_user));
+        return -1;
+    }
+    return 0;
+}
+
+/*******************
+*   connection_pool
+*******************/
+
 connection_pool::connection_pool() {
-    m_CurConn = 0;
-    m_FreeConn = 0;
+    m_MinConn = 0;
+    m_MaxConn = 0;
+    m_TotalConn = 0;
+    m_checkout_ms = 500;
+    m_idle_timeout = 60;
+    m_health_interval = 5;
+    m_health_stop = false;
+    m_health_started = false;
 }
 
 connection_pool* connection_pool::GetInstance() {
@@ -22,96 +215,236 @@ connection_pool* connection_pool::GetInstance() {
     return &connPool;
 }
 
+void connection_pool::set_timeouts(int checkout_ms, int idle_timeout, int health_interval) {
+    // 健康检查线程按m_health_interval等待，为0时会空转
+    m_checkout_ms = checkout_ms < 0 ? 0 : checkout_ms;
+    m_idle_timeout = idle_timeout < 1 ? 1 : idle_timeout;
+    m_health_interval = health_interval < 1 ? 1 : health_interval;
+    // 唤醒健康检查线程按新的间隔重新计时，不用等完上一个间隔
+    m_health_lock.lock();
+    m_health_cond.signal();
+    m_health_lock.unlock();
+}
+
+void connection_pool::set_size(int MaxConn, int MinConn) {
+    m_MinConn = (MinConn < 0 || MinConn > MaxConn) ? MaxConn : MinConn;
+    m_MaxConn = MaxConn;
+}
+
 // 构造初始化
-void connection_pool::init(string url, string User, string PassWord, string DBName, int port, int MaxConn) {
+void connection_pool::init(string url, string User, string PassWord, string DBName, int port, int MaxConn, int MinConn) {
     m_url = url;
-    m_Port = port;
+    m_Port = to_string(port);
     m_User = User;
     m_Password = PassWord;
     m_DatabaseName = DBName;
 
-    for (int i = 0; i < MaxConn; i++) {
-        MYSQL *conn = NULL;
-        conn = mysql_init(conn);
+    m_params.url = url;
+    m_params.user = User;
+    m_params.passwd = PassWord;
+    m_params.db = DBName;
+    m_params.port = port;
 
-        if (conn == NULL) {
-            Log::get_instance()->write_log(3, "MySQL Error: %s\n", mysql_error(conn));
-            exit(1);
-        }
+    m_MaxConn = MaxConn;
+    m_MinConn = (MinConn < 0 || MinConn > MaxConn) ? MaxConn : MinConn;
 
-        conn = mysql_real_connect(conn, "localhost", "root", "123456", "web", port, NULL, 0);
-        if (!conn) {
-            Log::get_instance()->write_log(3, ("error occurs: %s", mysql_error(conn)));
-            exit(1);
+    // 先建立MinConn个连接；后端暂时不可用也不退出，由健康检查线程稍后补足
+    for (int i = 0; i < m_MinConn; i++) {
+        ++m_TotalConn;
+        sql_conn *sql = create_conn();
+        if (!sql) {
+            --m_TotalConn;
+            break;
         }
+        sql->last_used = time(NULL);
+        m_idle.put_shared(sql);
+    }
+    if (m_TotalConn < m_MinConn) {
+        LOG_ERROR("MySQL Error: only %d of %d connections established\n", m_TotalConn.load(), m_MinConn.load());
+    }
 
-        connList.push_back(conn);
-        ++m_FreeConn;
+    // 不detach，析构时join：进程退出时健康检查线程不能再访问已经销毁的连接池
+    m_health_started = pthread_create(&m_health_tid, NULL, health_worker, this) == 0;
+}
 
+// 优先复用之前关闭的sql_conn对象，调用前需已占好名额
+sql_conn* connection_pool::create_conn() {
+    sql_conn *sql = m_idle.take_spare();
+    if (!sql) {
+        sql = new sql_conn(&m_params);
     }
-    reserve = sem(m_FreeConn);
-
-    m_MaxConn = m_FreeConn;
+    sql->broken = false;
+    if (!sql->connect()) {
+        m_idle.put_spare(sql);
+        return NULL;
+    }
+    return sql;
 }
 
-// 当有请求时，从数据库连接池中返回一个可用练级额，更新使用和空闲连接数
-MYSQL* connection_pool::GetConnection() {
-    MYSQL *conn = NULL;
-    if (0 == connList.size()) return NULL;
+bool connection_pool::reserve() {
+    int total = m_TotalConn.load();
+    while (total < m_MaxConn) {
+        if (m_TotalConn.compare_exchange_weak(total, total + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    reserve.wait();
+void connection_pool::discard(sql_conn *conn) {
+    conn->close();
+    m_idle.put_spare(conn);
+    --m_TotalConn;
+    m_idle.notify();
+}
 
-    lock.lock();
+// 当有请求时，从数据库连接池中返回一个可用连接
+// 常见情况是取回本线程上次归还的连接，不加锁；没有空闲连接时未达上限就新建一个，否则最多等待m_checkout_ms毫秒
+sql_conn* connection_pool::GetConnection() {
+    int64_t start = metrics::now_ns();
+    sql_conn *conn = checkout();
+    metrics::GetInstance()->observe(STAGE_SQL_WAIT, metrics::now_ns() - start);
+    return conn;
+}
 
-    conn = connList.front();
-    connList.pop_front();
+sql_conn* connection_pool::checkout() {
+    if (0 == m_MaxConn) return NULL;
 
-    --m_FreeConn;
-    ++m_CurConn;
+    sql_conn *conn = m_idle.get();
+    if (conn) {
+        return conn;
+    }
 
-    lock.unlock();
-    return conn;
+    struct timespec deadline = deadline_after(m_checkout_ms);
+    while (true) {
+        if (reserve()) {
+            conn = create_conn();
+            if (!conn) {
+                // 建连失败说明后端不可用，直接失败，不让请求排队等待
+                --m_TotalConn;
+                m_idle.notify();
+            }
+            return conn;
+        }
+        bool timed_out = false;
+        conn = m_idle.wait(deadline, m_TotalConn, m_MaxConn, timed_out);
+        if (conn) {
+            return conn;
+        }
+        if (timed_out) {
+            LOG_WARN("MySQL pool: checkout timed out after %d ms\n", m_checkout_ms.load());
+            return NULL;
+        }
+    }
 }
 
-// 释放当前使用的连接
-bool connection_pool::ReleaseConnection(MYSQL *conn) {
+// 释放当前使用的连接，已失效的连接直接关闭，腾出名额给等待者新建
+bool connection_pool::ReleaseConnection(sql_conn *conn) {
     if (NULL == conn) return false;
-    lock.lock();
 
-    connList.push_back(conn);
+    // 上限调小之后，多出的连接用完就关闭
+    if (conn->broken || m_TotalConn > m_MaxConn) {
+        discard(conn);
+        return true;
+    }
 
-    ++m_FreeConn;
-    --m_CurConn;
+    conn->last_used = time(NULL);
+    m_idle.put(conn);
+    return true;
+}
 
-    lock.unlock();
+void* connection_pool::health_worker(void *arg) {
+    connection_pool *pool = (connection_pool*)arg;
+    pool->m_health_lock.lock();
+    while (!pool->m_health_stop) {
+        struct timespec deadline = deadline_after(pool->m_health_interval * 1000);
+        if (pool->m_health_cond.timewait(pool->m_health_lock.get(), deadline)) {
+            // 间隔改了或者要退出
+            continue;
+        }
+        pool->m_health_lock.unlock();
+        pool->health_check();
+        pool->m_health_lock.lock();
+    }
+    pool->m_health_lock.unlock();
+    return pool;
+}
 
-    reserve.post();
-    return true;
+void connection_pool::stop_health() {
+    if (!m_health_started) {
+        return;
+    }
+    m_health_lock.lock();
+    m_health_stop = true;
+    m_health_cond.signal();
+    m_health_lock.unlock();
+    pthread_join(m_health_tid, NULL);
+    m_health_started = false;
+}
+
+// 健康检查：回收空闲太久的连接，ping其余空闲了一个周期以上的连接，最后补足MinConn
+// 一次只取出一个连接，检查完马上放回，其余空闲连接照常可用；各线程槽位里的连接不动
+void connection_pool::health_check() {
+    time_t now = time(NULL);
+    // 检查期间归还的连接也会进全局栈，最多检查开始时的空闲连接数那么多次
+    int n = m_idle.idle_count();
+    for (int i = 0; i < n; i++) {
+        sql_conn *conn = m_idle.take_unchecked();
+        if (!conn) {
+            break;
+        }
+        if (m_TotalConn > m_MaxConn) {
+            discard(conn);
+        } else if (now - conn->last_used < m_health_interval) {
+            m_idle.put_checked(conn);
+        } else if (now - conn->last_used >= m_idle_timeout && m_TotalConn > m_MinConn) {
+            discard(conn);
+        } else if (!conn->ping()) {
+            discard(conn);
+        } else {
+            m_idle.put_checked(conn);
+        }
+    }
+    m_idle.end_check();
+
+    while (reserve()) {
+        if (m_TotalConn > m_MinConn) {
+            --m_TotalConn;
+            break;
+        }
+        sql_conn *conn = create_conn();
+        if (!conn) {
+            --m_TotalConn;
+            break;
+        }
+        conn->last_used = time(NULL);
+        m_idle.put_shared(conn);
+    }
 }
 
 // 销毁数据库连接池
 void connection_pool::DestroyPool() {
-    lock.lock();
-    if (connList.size() > 0) {
-        list<MYSQL*>::iterator it;
-        for (it = connList.begin(); it != connList.end(); ++it) {
-            MYSQL* conn = *it;
-            mysql_close(conn);
-        }
-        m_CurConn = 0;
-        m_FreeConn = 0;
-        connList.clear();
+    list<sql_conn*> idle;
+    m_idle.drain(idle);
+    for (list<sql_conn*>::iterator it = idle.begin(); it != idle.end(); ++it) {
+        (*it)->close();
+        m_idle.put_spare(*it);
+        --m_TotalConn;
     }
-    lock.unlock();
 }
 
 // 当前空闲的连接数
 int connection_pool::GetFreeConn() {
-    return this->m_FreeConn;
+    return m_idle.idle_count();
 }
 
 connection_pool::~connection_pool() {
+    stop_health();
     DestroyPool();
+    sql_conn *conn;
+    while ((conn = m_idle.take_spare()) != NULL) {
+        delete conn;
+    }
 }
 
 
@@ -119,7 +452,7 @@ connection_pool::~connection_pool() {
 *   connectionRAII
 *******************/
 
-connectionRAII::connectionRAII(MYSQL **SQL, connection_pool *connPool) {
+connectionRAII::connectionRAII(sql_conn **SQL, connection_pool *connPool) {
     *SQL = connPool->GetConnection();
 
     connRAII = *SQL;
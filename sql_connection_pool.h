@@ -8,23 +8,79 @@
 #include <string.h>
 #include <iostream>
 #include <string>
+#include <atomic>
 
 #include "locker.h"
 #include "log.h"
+#include "conn_cache.h"
 
 using namespace std;
 
+// 建立数据库连接所需的参数，由连接池持有，连接断开重连时使用
+struct sql_conn_params {
+    string url;
+    string user;
+    string passwd;
+    string db;
+    int port;
+};
+
+// 一个数据库连接，以及在它上面预编译好的语句
+// 语句在连接池创建连接时prepare一次，之后登录/注册都以二进制协议执行，不再重复解析SQL
+// 要求user表的username列上有唯一索引，这样每次查询都是一次索引点查
+class sql_conn {
+public:
+    sql_conn(const sql_conn_params *params);
+    ~sql_conn();
+
+    bool connect();         // 建立连接并预编译语句
+    bool ping();            // 检查连接是否可用，不可用时重连一次
+    void close();           // 断开连接，对象本身留着以后重连复用
+
+    // 按用户名查询密码：找到返回1并写入passwd，用户不存在返回0，出错返回-1
+    // 执行时发现连接已断开会透明地重连并重试一次
+    int find_user(const char *name, char *passwd, int passwd_len);
+    // 插入新用户：成功返回0，用户名已存在返回1，出错返回-1
+    int insert_user(const char *name, const char *passwd);
+
+    MYSQL *mysql;           // 底层连接
+    time_t last_used;       // 最近一次归还到池中的时间，用于回收空闲连接
+    bool broken;            // 重连也失败了，归还时直接关闭
+    sql_conn *next;         // 空闲栈中的下一个，由conn_cache使用
+
+private:
+    bool prepare();
+    bool lost(MYSQL_STMT *stmt);    // 语句执行失败是否因为连接断开
+    int do_find_user(const char *name, char *passwd, int passwd_len);
+    int do_insert_user(const char *name, const char *passwd);
+
+    const sql_conn_params *m_params;
+    MYSQL_STMT *m_select_user;  // SELECT passwd FROM user WHERE username=?
+    MYSQL_STMT *m_insert_user;  // INSERT INTO user(username, passwd) VALUES(?, ?)
+};
+
+/************************************************************
+*数据库连接池，连接数在[MinConn, MaxConn]之间自动伸缩
+*空闲连接放在conn_cache中：每个工作线程优先取回自己上次归还的连接，常见路径不加锁
+*取连接时没有空闲连接且未达上限就新建，达到上限则限时等待，超时返回NULL
+*后台线程定期ping空闲连接（失效则重连）、回收长时间空闲的连接、补足MinConn
+************************************************************/
 class connection_pool {
 public:
-    MYSQL *GetConnection();                 // 获取数据库连接
-    bool ReleaseConnection(MYSQL *conn);    // 释放连接
-    int GetFreeConn();                      // 获取连接
+    sql_conn *GetConnection();                  // 获取数据库连接，超时或建连失败返回NULL
+    bool ReleaseConnection(sql_conn *conn);     // 释放连接
+    int GetFreeConn();                      // 当前空闲连接数（近似值）
     void DestroyPool();                     // 销毁所有连接
 
     // 单例模式
     static connection_pool *GetInstance();
 
-    void init(string url, string User, string PassWord, string DataBaseName, int port, int MaxConn);
+    // MinConn < 0 表示和MaxConn相同，即固定大小
+    void init(string url, string User, string PassWord, string DataBaseName, int port, int MaxConn, int MinConn = -1);
+    // checkout_ms：取连接最长等待毫秒数；idle_timeout：空闲多少秒后回收；health_interval：健康检查间隔秒数
+    void set_timeouts(int checkout_ms, int idle_timeout, int health_interval);
+    // 运行中调整连接数范围：对之后的取连接生效，调小时多出的连接在归还或健康检查时关闭
+    void set_size(int MaxConn, int MinConn);
 
 public:
     string m_url;           // 主机地址
@@ -38,21 +94,36 @@ private:
     connection_pool();
     ~connection_pool();
 
+    sql_conn *checkout();   // GetConnection的实际实现，外面包一层统计等待时间
+    sql_conn *create_conn();
+    bool reserve();         // 未达上限时占一个名额
+    void discard(sql_conn *conn);   // 关闭连接并让出名额
+    static void *health_worker(void *arg);
+    void health_check();
+    void stop_health();     // 通知健康检查线程退出并等它结束
+
 private:
-    int m_MaxConn;          // 最大连接数
-    int m_CurConn;          // 当前已使用的连接数
-    int m_FreeConn;         // 当前空闲的连接数
-    locker lock;
-    list<MYSQL*> connList;  // 连接处
-    sem reserve;
+    atomic<int> m_MinConn;      // 最小连接数
+    atomic<int> m_MaxConn;      // 最大连接数
+    atomic<int> m_TotalConn;    // 已建立的连接数（空闲 + 使用中 + 正在建立）
+    atomic<int> m_checkout_ms;      // 以下三项SIGHUP时由主线程修改，工作线程和健康检查线程读
+    atomic<int> m_idle_timeout;
+    atomic<int> m_health_interval;
+    locker m_health_lock;
+    cond m_health_cond;         // set_timeouts和析构时唤醒健康检查线程
+    bool m_health_stop;         // 由m_health_lock保护
+    bool m_health_started;
+    pthread_t m_health_tid;
+    sql_conn_params m_params;
+    conn_cache<sql_conn> m_idle;    // 空闲连接
 };
 
 class connectionRAII{
 public:
-    connectionRAII(MYSQL **conn, connection_pool *connPool);
+    connectionRAII(sql_conn **conn, connection_pool *connPool);
     ~connectionRAII();
 private:
-    MYSQL *connRAII;
+    sql_conn *connRAII;
     connection_pool *poolRAII;
 };
 
@@ -2,34 +2,54 @@
 #define THREADPOOLH
 
 #include <queue>
+#include <atomic>
 #include "locker.h"
 #include "log.h"
+#include "metrics.h"
 
 
 template<typename T>
 class threadpool
 {
 public:
-    threadpool(int thread_number = 8, int max_request = 100000);
-    ~threadpool();
-    bool append(T* request);
+    threadpool(int thread_number = 8, int max_request = 100000, int target_ms = 5, int interval_ms = 100);
+    ~threadpool();                  // 通知工作线程退出并等它们结束，调用前应先排空队列
+    bool append(T* request);        // 队列已满时返回false，调用者应拒绝该请求
+    int queue_size();               // 当前排队的请求数
+    bool overloaded();              // 排队时间持续高于目标值，新请求应当拒绝
+    void set_limits(int max_request, int target_ms, int interval_ms);  // 运行中调整队列上限和CoDel参数
 
 private:
     static void* work(void* arg);
 
+    // 队列中的一项，记下入队时间以统计排队等待
+    struct task
+    {
+        T* request;
+        int64_t enqueue_ns;
+    };
+
 private:
     int m_thread_number;            // 线程池中最大线程数量
     pthread_t* m_thread;            // 描述线程池的数组
-    int m_max_request;              // 最大请求数，即工作队列中可滞留的最大任务数
-    std::queue<T*> m_workqueue;     // 请求队列
+    int m_max_request;              // 最大请求数，即工作队列中可滞留的最大任务数，由m_queuelocker保护
+    std::queue<task> m_workqueue;   // 请求队列
     locker m_queuelocker;           // 保护请求队列的互斥锁
     sem m_quetestat;                // 是否有任务需要处理
-    bool m_stop;                    // 是否结束线程
+    std::atomic<bool> m_stop;       // 是否结束线程
+
+    // CoDel：出队时看请求排了多久队，连续interval都高于target说明是持续积压而不是突发
+    // 以下三项由m_queuelocker保护
+    int64_t m_target_ns;
+    int64_t m_interval_ns;
+    int64_t m_first_above_ns;       // 排队时间高于target时，到这个时刻还没降下来就判定过载；0表示低于target
+    std::atomic<bool> m_overloaded;
 };
 
 template<typename T>
-threadpool<T>::threadpool(int thread_num, int max_request): 
-    m_thread_number(thread_num), m_max_request(max_request), m_thread(NULL), m_stop(false)
+threadpool<T>::threadpool(int thread_num, int max_request, int target_ms, int interval_ms):
+    m_thread_number(thread_num), m_max_request(max_request), m_thread(NULL), m_stop(false),
+    m_target_ns(target_ms * 1000000LL), m_interval_ns(interval_ms * 1000000LL), m_first_above_ns(0), m_overloaded(false)
 {
     if (m_thread_number <= 0 || m_max_request <= 0)
     {
@@ -42,28 +62,31 @@ threadpool<T>::threadpool(int thread_num, int max_request):
     }
     for (int i = 0; i < m_thread_number; i++)
     {
-        Log::get_instance()->write_log(1, "create the %dth thread\n", i);
+        LOG_INFO("create the %dth thread\n", i);
         // 线程地址，属性，线程要运行的函数，此函数的参数
+        // 线程保持joinable，析构时逐个pthread_join，确保停机时正在处理的请求做完
         if (pthread_create(&m_thread[i], NULL, work, this) != 0) 
         {   
             delete [] m_thread;
             throw std::exception();
         }
-        // 线程默认的状态是joinable，意思是pthread_exit()之后不会释放线程所占用的堆栈和线程描述符
-        // 调用pthread_detach则将其状态改为unjoinable，确保资源的释放
-        if (pthread_detach(m_thread[i]))
-        {
-            delete [] m_thread;
-            throw std::exception();
-        }
     }
 }
 
 template<typename T>
 threadpool<T>::~threadpool()
 {
-    delete [] m_thread;
+    // 每个线程post一次，把阻塞在信号量上的线程都叫醒，看到m_stop后退出
     m_stop = true;
+    for (int i = 0; i < m_thread_number; i++)
+    {
+        m_quetestat.post();
+    }
+    for (int i = 0; i < m_thread_number; i++)
+    {
+        pthread_join(m_thread[i], NULL);
+    }
+    delete [] m_thread;
 }
 
 template<typename T>
@@ -81,14 +104,31 @@ void* threadpool<T>::work(void* arg)
             pool->m_queuelocker.unlock();
             continue;
         }
-        T* request = pool->m_workqueue.front();
+        task t = pool->m_workqueue.front();
         pool->m_workqueue.pop();
+        int64_t now = metrics::now_ns();
+        int64_t sojourn = now - t.enqueue_ns;
+        if (sojourn < pool->m_target_ns || pool->m_workqueue.empty())
+        {
+            // 排队时间降下来了，或者队列已经排空
+            pool->m_first_above_ns = 0;
+            pool->m_overloaded = false;
+        }
+        else if (pool->m_first_above_ns == 0)
+        {
+            pool->m_first_above_ns = now + pool->m_interval_ns;
+        }
+        else if (now >= pool->m_first_above_ns)
+        {
+            pool->m_overloaded = true;
+        }
         pool->m_queuelocker.unlock();
-        if (!request)
+        if (!t.request)
         {
             continue;
         }
-        request->process();
+        metrics::GetInstance()->observe(STAGE_QUEUE, sojourn);
+        t.request->process();
     }
 
     return pool;
@@ -103,9 +143,44 @@ bool threadpool<T>::append(T* request)
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push(request);
+    task t;
+    t.request = request;
+    t.enqueue_ns = metrics::now_ns();
+    // 工作线程全卡住（例如都在等MySQL）时没有出队，入队时也看一下队头已经等了多久
+    if (!m_workqueue.empty() && t.enqueue_ns - m_workqueue.front().enqueue_ns >= m_target_ns + m_interval_ns)
+    {
+        m_overloaded = true;
+    }
+    m_workqueue.push(t);
     m_queuelocker.unlock();
     m_quetestat.post();
     return true;
 }
+
+template<typename T>
+void threadpool<T>::set_limits(int max_request, int target_ms, int interval_ms)
+{
+    m_queuelocker.lock();
+    // 调小上限时已经在队列里的请求照常处理，只是新请求会被拒绝
+    m_max_request = max_request > 0 ? max_request : 1;
+    m_target_ns = target_ms * 1000000LL;
+    m_interval_ns = interval_ms * 1000000LL;
+    m_first_above_ns = 0;
+    m_queuelocker.unlock();
+}
+
+template<typename T>
+int threadpool<T>::queue_size()
+{
+    m_queuelocker.lock();
+    int size = m_workqueue.size();
+    m_queuelocker.unlock();
+    return size;
+}
+
+template<typename T>
+bool threadpool<T>::overloaded()
+{
+    return m_overloaded.load(std::memory_order_relaxed);
+}
 #endif
\ No newline at end of file
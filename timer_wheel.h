@@ -71,7 +71,7 @@ public:
         tw_timer* timer = new tw_timer(rotation, ts);
         // 如果第ts个槽中尚无任何定时器，则把新建的定时器插入其中，并将该定时器设置为该槽的头结点
         if (!slots[ts]) {
-            Log::get_instance()->write_log(1, "add timer, rotation is %d, ts is %d, cur_slot is %d\n", 
+            LOG_DEBUG("add timer, rotation is %d, ts is %d, cur_slot is %d\n", 
                     rotation, ts, cur_slot);
             slots[ts] = timer;
         }
@@ -115,9 +115,9 @@ public:
     void tick(){
         // 取得时间轮上当前槽的头结点
         tw_timer* tmp = slots[cur_slot];
-        Log::get_instance()->write_log(1, "current slot is %d\n", cur_slot);
+        LOG_DEBUG("current slot is %d\n", cur_slot);
         while (tmp) {
-            Log::get_instance()->write_log(1, "tick the timer once\n");
+            LOG_DEBUG("tick the timer once\n");
 
             // 如果定时器的rotation值大于0， 则他在这一轮不起作用
             if (tmp->rotation > 0) {
@@ -129,7 +129,7 @@ public:
                 tmp->cb_func(tmp->user_data);
                 if (tmp == slots[cur_slot]) 
                 {
-                    Log::get_instance()->write_log(1, "delete header in cur_slot: %d\n", cur_slot);
+                    LOG_DEBUG("delete header in cur_slot: %d\n", cur_slot);
                     slots[cur_slot] = tmp->next;
                     delete tmp;
                     if (slots[cur_slot]) 
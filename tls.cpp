@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <openssl/err.h>
+
+#include "tls.h"
+#include "log.h"
+
+static const int TICKET_KEY_LEN = 80;       // 16字节名字 + 32字节HMAC密钥 + 32字节AES密钥，和nginx的格式相同
+static const int RECORD_LEN = 16384;        // 一个TLS记录最多的明文
+
+static const unsigned char ALPN_H2[] = "\x02h2\x08http/1.1";
+static const unsigned char ALPN_HTTP1[] = "\x08http/1.1";
+
+// 取出OpenSSL错误队列中最早的一条
+static string ssl_error()
+{
+    char buf[256];
+    unsigned long e = ERR_get_error();
+    ERR_clear_error();
+    if (e == 0)
+    {
+        return "unknown error";
+    }
+    ERR_error_string_n(e, buf, sizeof(buf));
+    return buf;
+}
+
+tls_context *tls_context::GetInstance()
+{
+    static tls_context instance;
+    return &instance;
+}
+
+tls_context::~tls_context()
+{
+    SSL_CTX_free(m_ctx);
+}
+
+// 按服务端的顺序选协议，arg非NULL时优先h2；客户端一个都不支持时不带ALPN继续握手，按HTTP/1.1处理
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *arg)
+{
+    const unsigned char *protos = arg ? ALPN_H2 : ALPN_HTTP1;
+    unsigned int len = arg ? sizeof(ALPN_H2) - 1 : sizeof(ALPN_HTTP1) - 1;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos, len, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// 文件不存在时为0，加载时会报错
+static time_t file_mtime(const char *path)
+{
+    struct stat st;
+    if (*path == '\0' || stat(path, &st) != 0)
+    {
+        return 0;
+    }
+    return st.st_mtime;
+}
+
+bool tls_context::init(const char *cert, const char *key, const char *ticket_key, bool http2, string &err)
+{
+    // 先取修改时间再加载：加载过程中文件又被改写时，下一次还会重新加载
+    time_t cert_mtime = file_mtime(cert);
+    time_t key_mtime = file_mtime(key);
+    time_t ticket_mtime = file_mtime(ticket_key);
+    if (m_ctx && m_cert == cert && m_key == key && m_ticket_key == ticket_key &&
+        m_cert_mtime == cert_mtime && m_key_mtime == key_mtime && m_ticket_mtime == ticket_mtime)
+    {
+        // 只有http2可能变了，ALPN回调在握手时从CTX取，新连接立即生效
+        SSL_CTX_set_alpn_select_cb(m_ctx, select_alpn, http2 ? (void *)ALPN_H2 : NULL);
+        return true;
+    }
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL)
+    {
+        err = ssl_error();
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // 客户端不发close_notify直接断开时按正常关闭处理，否则SSL_read报错
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                             SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // 非阻塞写：一次写出一部分就返回，重试时缓冲区可以换地址（内容相同）；空闲连接释放读写缓冲区
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"webserver", 9);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, 20480);
+    SSL_CTX_set_timeout(ctx, 3600);
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, http2 ? (void *)ALPN_H2 : NULL);
+
+    bool ok = SSL_CTX_use_certificate_chain_file(ctx, cert) == 1 &&
+              SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) == 1 &&
+              SSL_CTX_check_private_key(ctx) == 1;
+    if (!ok)
+    {
+        err = string(cert) + ": " + ssl_error();
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    if (*ticket_key)
+    {
+        unsigned char keys[TICKET_KEY_LEN];
+        FILE *fp = fopen(ticket_key, "rb");
+        size_t n = fp ? fread(keys, 1, sizeof(keys), fp) : 0;
+        if (fp)
+        {
+            fclose(fp);
+        }
+        if (n != sizeof(keys) || SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys)) != 1)
+        {
+            err = string(ticket_key) + ": expected " + to_string(TICKET_KEY_LEN) + " bytes of key material";
+            SSL_CTX_free(ctx);
+            return false;
+        }
+        memset(keys, 0, sizeof(keys));
+    }
+    else if (m_ctx && m_ticket_key.empty())
+    {
+        // 随机生成的票据密钥换成新的会让所有客户端的票据失效，沿用旧CTX的
+        unsigned char keys[TICKET_KEY_LEN];
+        if (SSL_CTX_get_tlsext_ticket_keys(m_ctx, keys, sizeof(keys)) == 1)
+        {
+            SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys));
+        }
+        memset(keys, 0, sizeof(keys));
+    }
+
+    SSL_CTX_free(m_ctx);
+    m_ctx = ctx;
+    m_cert = cert;
+    m_key = key;
+    m_ticket_key = ticket_key;
+    m_cert_mtime = cert_mtime;
+    m_key_mtime = key_mtime;
+    m_ticket_mtime = ticket_mtime;
+    LOG_INFO("tls: loaded %s\n", cert);
+    return true;
+}
+
+SSL *tls_context::create(int fd)
+{
+    SSL *ssl = SSL_new(m_ctx);
+    if (ssl == NULL)
+    {
+        return NULL;
+    }
+    if (SSL_set_fd(ssl, fd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+int tls_handshake(SSL *ssl, bool &want_write)
+{
+    ERR_clear_error();
+    int r = SSL_do_handshake(ssl);
+    if (r == 1)
+    {
+        return 1;
+    }
+    int e = SSL_get_error(ssl, r);
+    if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE)
+    {
+        want_write = e == SSL_ERROR_WANT_WRITE;
+        return 0;
+    }
+    // 扫描器、证书不受信任的客户端都会走到这里，只记debug
+    LOG_DEBUG("tls: handshake failed: %s\n", ssl_error().c_str());
+    return -1;
+}
+
+int tls_read(SSL *ssl, char *buf, int len)
+{
+    if (len <= 0)
+    {
+        return 0;
+    }
+    ERR_clear_error();
+    int n = SSL_read(ssl, buf, len);
+    if (n > 0)
+    {
+        return n;
+    }
+    int e = SSL_get_error(ssl, n);
+    if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (e == SSL_ERROR_ZERO_RETURN)
+    {
+        return 0;
+    }
+    ERR_clear_error();
+    errno = ECONNRESET;
+    return -1;
+}
+
+// 小块（响应头、HTTP/2的帧头和控制帧）先拼成一个记录再写，不单独成为一个TLS记录；
+// 不小于一个记录的块直接写，不拷贝
+int tls_writev(SSL *ssl, const struct iovec *iov, int iovcnt)
+{
+    char gather[RECORD_LEN];
+    int total = 0;
+    int i = 0;
+    size_t off = 0;         // iov[i]中已经写出或拼进gather的字节
+    while (i < iovcnt)
+    {
+        if (off == iov[i].iov_len)
+        {
+            i++;
+            off = 0;
+            continue;
+        }
+        const char *buf = (const char *)iov[i].iov_base + off;
+        int len = 0;
+        if (iov[i].iov_len - off >= (size_t)RECORD_LEN)
+        {
+            len = iov[i].iov_len - off;
+        }
+        else
+        {
+            // 从iov[i]开始拼，拼满一个记录或iov用完为止，后面的大块也可以只拼进开头一部分
+            buf = gather;
+            for (int j = i; j < iovcnt && len < RECORD_LEN; j++)
+            {
+                size_t from = j == i ? off : 0;
+                size_t n = iov[j].iov_len - from;
+                if (n > (size_t)(RECORD_LEN - len))
+                {
+                    n = RECORD_LEN - len;
+                }
+                memcpy(gather + len, (const char *)iov[j].iov_base + from, n);
+                len += n;
+            }
+        }
+        ERR_clear_error();
+        int n = SSL_write(ssl, buf, len);
+        if (n > 0)
+        {
+            total += n;
+            // 按写出的字节数前进
+            size_t left = n;
+            while (left > 0)
+            {
+                size_t step = iov[i].iov_len - off < left ? iov[i].iov_len - off : left;
+                off += step;
+                left -= step;
+                if (off == iov[i].iov_len && left > 0)
+                {
+                    i++;
+                    off = 0;
+                }
+            }
+            if (n < len)
+            {
+                break;
+            }
+            continue;
+        }
+        // 已经写出一部分时先返回，下次从断点重试会再遇到同样的情况
+        if (total > 0)
+        {
+            break;
+        }
+        int e = SSL_get_error(ssl, n);
+        if (e == SSL_ERROR_WANT_WRITE || e == SSL_ERROR_WANT_READ)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        ERR_clear_error();
+        errno = EPIPE;
+        return -1;
+    }
+    return total;
+}
+
+void tls_close(SSL *ssl)
+{
+    // 非阻塞socket上只发一次close_notify，不等对方回应
+    if (SSL_is_init_finished(ssl))
+    {
+        ERR_clear_error();
+        SSL_shutdown(ssl);
+        ERR_clear_error();
+    }
+    SSL_free(ssl);
+}
@@ -0,0 +1,66 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <string>
+#include <time.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+using namespace std;
+
+/************************************************************
+*HTTPS终止：OpenSSL，握手由主线程在epoll循环里以非阻塞方式推进，不额外占用线程
+*握手完成后，内核支持kTLS（tls模块已加载）时OpenSSL把会话密钥交给内核（SSL_OP_ENABLE_KTLS），
+*响应照旧用writev直接写socket，由内核加密，静态文件的mmap+writev路径不变；
+*不支持时退回SSL_write在用户态加密，多一次拷贝。读取总是经过SSL_read，开了kTLS接收时OpenSSL直接读内核解密好的数据
+*
+*会话恢复：TLS1.3和1.2都发session ticket，TLS1.2的session id由服务端缓存恢复。
+*票据密钥默认每个进程随机生成；配置了票据密钥文件（80字节随机数）时多个进程、热升级前后共用，旧票据仍然有效
+*
+*ALPN：开启HTTP/2时优先选h2，其次http/1.1；客户端不带ALPN时按HTTP/1.1处理
+*
+*SSL_CTX只在主线程创建和替换（SIGHUP换证书），已有连接的SSL对象持有旧CTX的引用，不受影响。
+*证书、私钥、票据密钥的路径和文件修改时间都没变时不重建，保留服务端的会话缓存；
+*重建时没有配置票据密钥文件的沿用旧CTX的随机密钥，已经发出的票据仍然有效
+************************************************************/
+
+class tls_context
+{
+public:
+    static tls_context *GetInstance();
+
+    // 加载证书链和私钥，ticket_key为""时随机生成票据密钥；http2决定ALPN是否提供h2
+    // 再次调用时文件都没变只更新ALPN；失败时保留原来的CTX，err中为原因
+    bool init(const char *cert, const char *key, const char *ticket_key, bool http2, string &err);
+    bool enabled()
+    {
+        return m_ctx != NULL;
+    }
+    // 为新连接创建服务端的SSL对象，失败返回NULL
+    SSL *create(int fd);
+
+private:
+    tls_context() : m_ctx(NULL), m_cert_mtime(0), m_key_mtime(0), m_ticket_mtime(0) {}
+    ~tls_context();
+
+private:
+    SSL_CTX *m_ctx;
+    // m_ctx是按这些文件建的
+    string m_cert;
+    string m_key;
+    string m_ticket_key;
+    time_t m_cert_mtime;
+    time_t m_key_mtime;
+    time_t m_ticket_mtime;
+};
+
+// 推进握手：返回1完成，0未完成（want_write为true时等可写，否则等可读），-1失败
+int tls_handshake(SSL *ssl, bool &want_write);
+// 返回值同recv：读到的字节数，0表示对端关闭，-1出错（errno为EAGAIN时等下一次可读）
+int tls_read(SSL *ssl, char *buf, int len);
+// 返回值同writev，errno为EAGAIN时等下一次可写；没写完的部分下次要用同样的内容重试（后面可以多出新的内容）
+int tls_writev(SSL *ssl, const struct iovec *iov, int iovcnt);
+// 尽量发出close_notify并释放
+void tls_close(SSL *ssl);
+
+#endif
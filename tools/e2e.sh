@@ -0,0 +1,189 @@
+#!/bin/bash
+############################################################
+# 端到端压测登录/注册路径：在临时目录里起后端和服务器，预置N个用户，用loadgen跑登录/注册混合负载
+#
+# 后端(-b)：
+#   fake    链接tools/fake_backends.cpp，MySQL/Redis都在服务器进程内，延迟由-M/-L注入（默认）
+#   real    起临时的mysqld和redis-server（需要已安装），数据目录在临时目录里，结束后删除
+#
+# 用法：tools/e2e.sh [-b fake|real] [-n 用户数] [-R 注册百分比] [-d 秒数] [-c 连接数] [-t 线程数]
+#                    [-M MySQL延迟us] [-L Redis延迟us] [-o 结果文件] [-B 基线结果文件] [-x 阈值百分比]
+# 例如：tools/e2e.sh -n 10000 -R 10 -M 500 -L 100 -o base.txt
+#       （改动之后）tools/e2e.sh -n 10000 -R 10 -M 500 -L 100 -B base.txt
+# 给了-B时比较吞吐和p99：吞吐下降或p99上升超过阈值（默认10%）时退出码为2
+#
+# 结果文件是loadgen的输出，后面附上结束时/metrics的分阶段延迟
+############################################################
+
+set -e
+
+REPO=$(cd "$(dirname "$0")/.." && pwd)
+BACKEND=fake
+USERS=10000
+REGISTER_PCT=10
+DURATION=10
+CONNS=64
+THREADS=4
+MYSQL_LATENCY=0
+REDIS_LATENCY=0
+OUT=
+BASELINE=
+THRESHOLD=10
+
+HTTP_PORT=${HTTP_PORT:-19006}
+ADMIN_PORT=$((HTTP_PORT + 1))
+MYSQL_PORT=${MYSQL_PORT:-13306}
+REDIS_PORT=${REDIS_PORT:-16379}
+
+usage()
+{
+    sed -n '2,17p' "$0" | sed 's/^# \{0,1\}//'
+    exit 1
+}
+
+while getopts "b:n:R:d:c:t:M:L:o:B:x:" ch; do
+    case $ch in
+    b) BACKEND=$OPTARG ;;
+    n) USERS=$OPTARG ;;
+    R) REGISTER_PCT=$OPTARG ;;
+    d) DURATION=$OPTARG ;;
+    c) CONNS=$OPTARG ;;
+    t) THREADS=$OPTARG ;;
+    M) MYSQL_LATENCY=$OPTARG ;;
+    L) REDIS_LATENCY=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    B) BASELINE=$OPTARG ;;
+    x) THRESHOLD=$OPTARG ;;
+    *) usage ;;
+    esac
+done
+[ "$BACKEND" = fake ] || [ "$BACKEND" = real ] || usage
+
+WORK=$(mktemp -d /tmp/webserver_e2e.XXXXXX)
+PIDS=()
+
+# 服务器和后端收到TERM后排空再退出，给2秒，之后强制结束
+cleanup()
+{
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    for _ in $(seq 20); do
+        alive=0
+        for pid in "${PIDS[@]}"; do
+            kill -0 "$pid" 2>/dev/null && alive=1
+        done
+        [ $alive = 0 ] && break
+        sleep 0.1
+    done
+    for pid in "${PIDS[@]}"; do
+        kill -9 "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# 等端口可以连接，最多等30秒
+wait_port()
+{
+    for _ in $(seq 300); do
+        if (exec 3<>/dev/tcp/127.0.0.1/"$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "port $1 did not come up" >&2
+    exit 1
+}
+
+SRCS="main.cpp http_conn.cpp log.cpp clock_cache.cpp metrics.cpp sql_connection_pool.cpp redis_pool.cpp redis_async.cpp user_cache.cpp capture.cpp rate_limit.cpp handoff.cpp config.cpp tls.cpp h2_conn.cpp hpack.cpp"
+
+echo "building in $WORK"
+(cd "$REPO" && g++ -O2 -std=c++11 bench/loadgen.cpp -lpthread -o "$WORK/loadgen")
+if [ "$BACKEND" = fake ]; then
+    (cd "$REPO" && g++ -O2 -std=c++11 -I. $CXXFLAGS $SRCS tools/fake_backends.cpp -lssl -lcrypto -lpthread -o "$WORK/server")
+else
+    (cd "$REPO" && g++ -O2 -std=c++11 $CXXFLAGS $SRCS -lmysqlclient -lhiredis -lssl -lcrypto -lpthread -o "$WORK/server")
+fi
+
+if [ "$BACKEND" = real ]; then
+    # 临时MySQL：空root密码初始化，只监听本机，建web库、user表和服务器用的账号
+    mkdir -p "$WORK/mysql"
+    mysqld --no-defaults --initialize-insecure --user="$(id -un)" --datadir="$WORK/mysql/data" \
+        > "$WORK/mysql/init.log" 2>&1
+    mysqld --no-defaults --user="$(id -un)" --datadir="$WORK/mysql/data" --socket="$WORK/mysql/sock" \
+        --port="$MYSQL_PORT" --bind-address=127.0.0.1 --mysqlx=OFF --pid-file="$WORK/mysql/pid" \
+        --log-error="$WORK/mysql/error.log" &
+    PIDS+=($!)
+    redis-server --port "$REDIS_PORT" --bind 127.0.0.1 --save "" --appendonly no --dir "$WORK" \
+        > "$WORK/redis.log" 2>&1 &
+    PIDS+=($!)
+    wait_port "$MYSQL_PORT"
+    wait_port "$REDIS_PORT"
+
+    SQL="mysql --no-defaults -uroot -S $WORK/mysql/sock"
+    $SQL <<EOF
+CREATE DATABASE web;
+CREATE TABLE web.user(
+    username VARCHAR(50) NOT NULL,
+    passwd VARCHAR(50) NOT NULL,
+    UNIQUE KEY idx_username(username)
+) ENGINE=InnoDB;
+CREATE USER 'web'@'127.0.0.1' IDENTIFIED BY 'web';
+GRANT ALL ON web.* TO 'web'@'127.0.0.1';
+EOF
+    # 预置用户，和loadgen的mix模式约定一致：user<i>/pass<i>
+    awk -v n="$USERS" 'BEGIN {
+        for (i = 0; i < n; i += 1000) {
+            printf "INSERT INTO user(username, passwd) VALUES";
+            for (j = i; j < i + 1000 && j < n; j++) printf "%s(\"user%d\",\"pass%d\")", (j > i ? "," : ""), j, j;
+            print ";";
+        }
+    }' | $SQL web
+
+    export WEBSERVER_MYSQL_HOST=127.0.0.1 WEBSERVER_MYSQL_PORT=$MYSQL_PORT
+    export WEBSERVER_MYSQL_USER=web WEBSERVER_MYSQL_PASSWORD=web WEBSERVER_MYSQL_DB=web
+    export WEBSERVER_REDIS_HOST=127.0.0.1 WEBSERVER_REDIS_PORT=$REDIS_PORT
+else
+    export FAKE_USERS=$USERS FAKE_MYSQL_LATENCY_US=$MYSQL_LATENCY FAKE_REDIS_LATENCY_US=$REDIS_LATENCY
+fi
+
+export WEBSERVER_ROOT=$REPO/root/
+mkdir -p "$WORK/ServerLog"
+(cd "$WORK" && exec ./server 127.0.0.1 "$HTTP_PORT" "$ADMIN_PORT" > server.out 2>&1) &
+PIDS+=($!)
+wait_port "$HTTP_PORT"
+wait_port "$ADMIN_PORT"
+
+RESULT=$WORK/result.txt
+echo "backend=$BACKEND mysql_latency=${MYSQL_LATENCY}us redis_latency=${REDIS_LATENCY}us" > "$RESULT"
+"$WORK/loadgen" -p "$HTTP_PORT" -t "$THREADS" -c "$CONNS" -d "$DURATION" -m mix -N "$USERS" -R "$REGISTER_PCT" \
+    | tee -a "$RESULT"
+
+# 服务器端各阶段的分位数
+exec 3<>/dev/tcp/127.0.0.1/"$ADMIN_PORT"
+printf 'GET /metrics HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n' >&3
+grep -E '^webserver_stage_quantile_seconds' <&3 | tee -a "$RESULT" || true
+exec 3<&-
+
+if [ -n "$OUT" ]; then
+    cp "$RESULT" "$OUT"
+fi
+
+if [ -n "$BASELINE" ]; then
+    # 取"throughput N req/s"和"latency us ... p99 N"
+    read_result()
+    {
+        awk '/^throughput/ {rps = $2} /^latency us/ {for (i = 1; i < NF; i++) if ($i == "p99") p99 = $(i + 1)}
+             END {print rps, p99}' "$1"
+    }
+    read -r base_rps base_p99 <<< "$(read_result "$BASELINE")"
+    read -r cur_rps cur_p99 <<< "$(read_result "$RESULT")"
+    awk -v br="$base_rps" -v bp="$base_p99" -v cr="$cur_rps" -v cp="$cur_p99" -v x="$THRESHOLD" 'BEGIN {
+        drps = br > 0 ? (cr - br) / br * 100 : 0;
+        dp99 = bp > 0 ? (cp - bp) / bp * 100 : 0;
+        printf "vs baseline: throughput %.0f -> %.0f req/s (%+.1f%%), p99 %.0f -> %.0f us (%+.1f%%)\n", br, cr, drps, bp, cp, dp99;
+        if (drps < -x || dp99 > x) { print "REGRESSION"; exit 2 }
+    }' || exit 2
+fi
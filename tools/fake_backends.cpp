@@ -0,0 +1,749 @@
+/************************************************************
+*MySQL和Redis的进程内替身：实现服务器用到的libmysqlclient和hiredis接口，数据放在进程内的表里，
+*每次往返按环境变量注入固定延迟。链接服务器时用它代替-lmysqlclient -lhiredis，
+*不需要数据库就能端到端地压测登录/注册路径，结果只受注入的延迟影响，可以离线重复
+*
+*编译：g++ -O2 -std=c++11 -I.. ../main.cpp ../http_conn.cpp ../log.cpp ../clock_cache.cpp ../metrics.cpp
+*      ../sql_connection_pool.cpp ../redis_pool.cpp ../redis_async.cpp ../user_cache.cpp ../capture.cpp ../rate_limit.cpp ../handoff.cpp ../config.cpp ../tls.cpp
+*      ../h2_conn.cpp ../hpack.cpp fake_backends.cpp -lssl -lcrypto -lpthread -o server_fake
+*环境变量：
+*   FAKE_MYSQL_LATENCY_US   每次连接、执行语句的延迟（微秒），默认0
+*   FAKE_REDIS_LATENCY_US   每次命令往返的延迟，管道中的一批命令只算一次，默认0
+*   FAKE_USERS              预置的用户数N，用户名user0..user(N-1)，密码pass0..pass(N-1)，默认0
+*
+*支持的Redis命令：PING、GET、SET、CLIENT ID、CLIENT TRACKING、SUBSCRIBE；
+*SET之后向订阅者推送失效消息，近端缓存的行为和真实Redis一致（失效范围更大，不影响正确性）
+*异步连接的fd是一个timerfd，延迟到期时可读，回调在主线程的redisAsyncHandleRead中执行
+************************************************************/
+
+#include <mysql/mysql.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+#include "locker.h"
+
+using namespace std;
+
+static const unsigned int FAKE_ER_DUP_ENTRY = 1062;
+
+/************************************************************
+*配置和共享数据
+************************************************************/
+
+struct fake_state
+{
+    long mysql_latency_us;
+    long redis_latency_us;
+
+    locker user_lock;
+    unordered_map<string, string> users;    // user表：username -> passwd
+
+    locker kv_lock;
+    unordered_map<string, string> kv;       // Redis的字符串键
+
+    // 订阅了__redis__:invalidate的连接收到的失效消息，按key推送
+    locker sub_lock;
+    cond sub_cond;
+    int subscribers;
+    deque<string> invalidated;
+};
+
+static long env_long(const char *name)
+{
+    const char *v = getenv(name);
+    return v ? atol(v) : 0;
+}
+
+static fake_state *state()
+{
+    static fake_state *s = NULL;
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    struct init
+    {
+        static void run()
+        {
+            s = new fake_state;
+            s->mysql_latency_us = env_long("FAKE_MYSQL_LATENCY_US");
+            s->redis_latency_us = env_long("FAKE_REDIS_LATENCY_US");
+            s->subscribers = 0;
+            long n = env_long("FAKE_USERS");
+            char name[32], passwd[32];
+            for (long i = 0; i < n; i++)
+            {
+                snprintf(name, sizeof(name), "user%ld", i);
+                snprintf(passwd, sizeof(passwd), "pass%ld", i);
+                s->users[name] = passwd;
+            }
+            fprintf(stderr, "fake backends: mysql %ldus, redis %ldus, %ld users\n",
+                    s->mysql_latency_us, s->redis_latency_us, n);
+        }
+    };
+    pthread_once(&once, init::run);
+    return s;
+}
+
+static void fake_delay(long usec)
+{
+    if (usec <= 0)
+    {
+        return;
+    }
+    struct timespec ts = {usec / 1000000, (usec % 1000000) * 1000};
+    while (nanosleep(&ts, &ts) != 0)
+    {
+    }
+}
+
+static long long mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/************************************************************
+*MySQL：只认识连接池prepare的两条语句
+************************************************************/
+
+struct fake_mysql
+{
+    char error[128];
+};
+
+struct fake_stmt
+{
+    bool is_select;
+    int param_count;
+    MYSQL_BIND *params;         // bind_param传入的数组，execute时读取
+    MYSQL_BIND *result;
+    bool has_row;
+    string row;
+    unsigned int err;
+    char error[128];
+};
+
+static string bind_string(const MYSQL_BIND &b)
+{
+    unsigned long len = b.length ? *b.length : b.buffer_length;
+    return string((const char *)b.buffer, len);
+}
+
+MYSQL *mysql_init(MYSQL *mysql)
+{
+    if (mysql != NULL)
+    {
+        return NULL;
+    }
+    fake_mysql *m = new fake_mysql;
+    m->error[0] = '\0';
+    return (MYSQL *)m;
+}
+
+int mysql_options(MYSQL *mysql, enum mysql_option option, const void *arg)
+{
+    return 0;
+}
+
+MYSQL *mysql_real_connect(MYSQL *mysql, const char *host, const char *user, const char *passwd,
+                          const char *db, unsigned int port, const char *unix_socket, unsigned long clientflag)
+{
+    fake_delay(state()->mysql_latency_us);
+    return mysql;
+}
+
+const char *mysql_error(MYSQL *mysql)
+{
+    return ((fake_mysql *)mysql)->error;
+}
+
+int mysql_ping(MYSQL *mysql)
+{
+    fake_delay(state()->mysql_latency_us);
+    return 0;
+}
+
+void mysql_close(MYSQL *mysql)
+{
+    delete (fake_mysql *)mysql;
+}
+
+MYSQL_STMT *mysql_stmt_init(MYSQL *mysql)
+{
+    fake_stmt *s = new fake_stmt;
+    s->is_select = false;
+    s->param_count = 0;
+    s->params = NULL;
+    s->result = NULL;
+    s->has_row = false;
+    s->err = 0;
+    s->error[0] = '\0';
+    return (MYSQL_STMT *)s;
+}
+
+int mysql_stmt_prepare(MYSQL_STMT *stmt, const char *query, unsigned long length)
+{
+    fake_stmt *s = (fake_stmt *)stmt;
+    string sql(query, length);
+    s->param_count = 0;
+    for (size_t i = 0; i < sql.size(); i++)
+    {
+        if (sql[i] == '?')
+        {
+            s->param_count++;
+        }
+    }
+    if (sql.compare(0, 6, "SELECT") == 0 && s->param_count == 1)
+    {
+        s->is_select = true;
+        return 0;
+    }
+    if (sql.compare(0, 6, "INSERT") == 0 && s->param_count == 2)
+    {
+        s->is_select = false;
+        return 0;
+    }
+    s->err = 1064;
+    snprintf(s->error, sizeof(s->error), "fake mysql: unsupported statement");
+    return 1;
+}
+
+bool mysql_stmt_bind_param(MYSQL_STMT *stmt, MYSQL_BIND *bnd)
+{
+    ((fake_stmt *)stmt)->params = bnd;
+    return false;
+}
+
+bool mysql_stmt_bind_result(MYSQL_STMT *stmt, MYSQL_BIND *bnd)
+{
+    ((fake_stmt *)stmt)->result = bnd;
+    return false;
+}
+
+int mysql_stmt_execute(MYSQL_STMT *stmt)
+{
+    fake_stmt *s = (fake_stmt *)stmt;
+    fake_state *st = state();
+    fake_delay(st->mysql_latency_us);
+    s->err = 0;
+    s->error[0] = '\0';
+    s->has_row = false;
+
+    string name = bind_string(s->params[0]);
+    st->user_lock.lock();
+    unordered_map<string, string>::iterator it = st->users.find(name);
+    if (s->is_select)
+    {
+        if (it != st->users.end())
+        {
+            s->has_row = true;
+            s->row = it->second;
+        }
+    }
+    else if (it != st->users.end())
+    {
+        s->err = FAKE_ER_DUP_ENTRY;
+        snprintf(s->error, sizeof(s->error), "Duplicate entry '%.64s' for key 'idx_username'", name.c_str());
+    }
+    else
+    {
+        st->users[name] = bind_string(s->params[1]);
+    }
+    st->user_lock.unlock();
+    return s->err ? 1 : 0;
+}
+
+int mysql_stmt_fetch(MYSQL_STMT *stmt)
+{
+    fake_stmt *s = (fake_stmt *)stmt;
+    if (!s->has_row)
+    {
+        return MYSQL_NO_DATA;
+    }
+    s->has_row = false;
+    MYSQL_BIND &b = s->result[0];
+    if (b.length)
+    {
+        *b.length = s->row.size();
+    }
+    size_t n = s->row.size() < b.buffer_length ? s->row.size() : b.buffer_length;
+    memcpy(b.buffer, s->row.data(), n);
+    return n < s->row.size() ? MYSQL_DATA_TRUNCATED : 0;
+}
+
+bool mysql_stmt_free_result(MYSQL_STMT *stmt)
+{
+    ((fake_stmt *)stmt)->has_row = false;
+    return false;
+}
+
+bool mysql_stmt_reset(MYSQL_STMT *stmt)
+{
+    ((fake_stmt *)stmt)->has_row = false;
+    return false;
+}
+
+bool mysql_stmt_close(MYSQL_STMT *stmt)
+{
+    delete (fake_stmt *)stmt;
+    return false;
+}
+
+unsigned int mysql_stmt_errno(MYSQL_STMT *stmt)
+{
+    return ((fake_stmt *)stmt)->err;
+}
+
+const char *mysql_stmt_error(MYSQL_STMT *stmt)
+{
+    return ((fake_stmt *)stmt)->error;
+}
+
+/************************************************************
+*Redis：命令按hiredis的格式串规则拆成参数，在进程内执行
+************************************************************/
+
+static redisReply *new_reply(int type)
+{
+    redisReply *r = (redisReply *)calloc(1, sizeof(redisReply));
+    r->type = type;
+    return r;
+}
+
+static redisReply *str_reply(int type, const string &s)
+{
+    redisReply *r = new_reply(type);
+    r->str = (char *)malloc(s.size() + 1);
+    memcpy(r->str, s.data(), s.size());
+    r->str[s.size()] = '\0';
+    r->len = s.size();
+    return r;
+}
+
+static redisReply *array_reply(const vector<redisReply *> &elems)
+{
+    redisReply *r = new_reply(REDIS_REPLY_ARRAY);
+    r->elements = elems.size();
+    r->element = (redisReply **)calloc(elems.size() ? elems.size() : 1, sizeof(redisReply *));
+    for (size_t i = 0; i < elems.size(); i++)
+    {
+        r->element[i] = elems[i];
+    }
+    return r;
+}
+
+void freeReplyObject(void *reply)
+{
+    redisReply *r = (redisReply *)reply;
+    if (r == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < r->elements; i++)
+    {
+        freeReplyObject(r->element[i]);
+    }
+    free(r->element);
+    free(r->str);
+    free(r);
+}
+
+// 空格分隔参数，%s、%b整体作为参数的一部分，不再按空格拆分
+static vector<string> format_argv(const char *fmt, va_list ap)
+{
+    vector<string> argv;
+    string cur;
+    bool touched = false;
+    char num[32];
+    for (const char *p = fmt; *p; p++)
+    {
+        if (*p == ' ')
+        {
+            if (touched)
+            {
+                argv.push_back(cur);
+            }
+            cur.clear();
+            touched = false;
+            continue;
+        }
+        touched = true;
+        if (*p != '%' || p[1] == '\0')
+        {
+            cur += *p;
+            continue;
+        }
+        p++;
+        if (*p == 's')
+        {
+            cur += va_arg(ap, const char *);
+        }
+        else if (*p == 'b')
+        {
+            const char *b = va_arg(ap, const char *);
+            size_t len = va_arg(ap, size_t);
+            cur.append(b, len);
+        }
+        else if (*p == 'd')
+        {
+            snprintf(num, sizeof(num), "%d", va_arg(ap, int));
+            cur += num;
+        }
+        else if (strncmp(p, "lld", 3) == 0)
+        {
+            snprintf(num, sizeof(num), "%lld", va_arg(ap, long long));
+            cur += num;
+            p += 2;
+        }
+        else if (*p == '%')
+        {
+            cur += '%';
+        }
+    }
+    if (touched)
+    {
+        argv.push_back(cur);
+    }
+    return argv;
+}
+
+static long long next_client_id()
+{
+    static atomic<long long> id(1);
+    return id++;
+}
+
+static redisReply *execute(const vector<string> &argv, bool *subscribed)
+{
+    fake_state *st = state();
+    if (argv.empty())
+    {
+        return str_reply(REDIS_REPLY_ERROR, "ERR empty command");
+    }
+    string cmd = argv[0];
+    for (size_t i = 0; i < cmd.size(); i++)
+    {
+        cmd[i] = toupper(cmd[i]);
+    }
+    if (cmd == "PING")
+    {
+        return str_reply(REDIS_REPLY_STATUS, "PONG");
+    }
+    if (cmd == "GET" && argv.size() == 2)
+    {
+        st->kv_lock.lock();
+        unordered_map<string, string>::iterator it = st->kv.find(argv[1]);
+        redisReply *r = it == st->kv.end() ? new_reply(REDIS_REPLY_NIL) : str_reply(REDIS_REPLY_STRING, it->second);
+        st->kv_lock.unlock();
+        return r;
+    }
+    if (cmd == "SET" && argv.size() == 3)
+    {
+        st->kv_lock.lock();
+        st->kv[argv[1]] = argv[2];
+        st->kv_lock.unlock();
+        st->sub_lock.lock();
+        if (st->subscribers > 0)
+        {
+            st->invalidated.push_back(argv[1]);
+            st->sub_cond.broadcast();
+        }
+        st->sub_lock.unlock();
+        return str_reply(REDIS_REPLY_STATUS, "OK");
+    }
+    if (cmd == "CLIENT" && argv.size() >= 2)
+    {
+        if (strcasecmp(argv[1].c_str(), "ID") == 0)
+        {
+            redisReply *r = new_reply(REDIS_REPLY_INTEGER);
+            r->integer = next_client_id();
+            return r;
+        }
+        if (strcasecmp(argv[1].c_str(), "TRACKING") == 0)
+        {
+            return str_reply(REDIS_REPLY_STATUS, "OK");
+        }
+    }
+    if (cmd == "SUBSCRIBE" && argv.size() == 2 && subscribed)
+    {
+        st->sub_lock.lock();
+        st->subscribers++;
+        st->sub_lock.unlock();
+        *subscribed = true;
+        vector<redisReply *> elems;
+        elems.push_back(str_reply(REDIS_REPLY_STRING, "subscribe"));
+        elems.push_back(str_reply(REDIS_REPLY_STRING, argv[1]));
+        redisReply *n = new_reply(REDIS_REPLY_INTEGER);
+        n->integer = 1;
+        elems.push_back(n);
+        return array_reply(elems);
+    }
+    return str_reply(REDIS_REPLY_ERROR, "ERR unsupported command in fake redis");
+}
+
+// 同步连接：管道中待读的回复，和是否已经付过这一批的往返延迟
+struct fake_redis
+{
+    redisContext c;
+    deque<redisReply *> pending;
+    bool waited;
+    bool subscribed;
+};
+
+redisContext *redisConnectWithTimeout(const char *ip, int port, const struct timeval tv)
+{
+    fake_redis *r = new fake_redis;
+    memset(&r->c, 0, sizeof(r->c));
+    r->c.fd = -1;
+    r->waited = false;
+    r->subscribed = false;
+    fake_delay(state()->redis_latency_us);
+    return &r->c;
+}
+
+int redisSetTimeout(redisContext *c, const struct timeval tv)
+{
+    return REDIS_OK;
+}
+
+int redisEnableKeepAlive(redisContext *c)
+{
+    return REDIS_OK;
+}
+
+void redisFree(redisContext *c)
+{
+    if (c == NULL)
+    {
+        return;
+    }
+    fake_redis *r = (fake_redis *)c;
+    for (size_t i = 0; i < r->pending.size(); i++)
+    {
+        freeReplyObject(r->pending[i]);
+    }
+    if (r->subscribed)
+    {
+        fake_state *st = state();
+        st->sub_lock.lock();
+        st->subscribers--;
+        st->sub_lock.unlock();
+    }
+    delete r;
+}
+
+int redisAppendCommand(redisContext *c, const char *format, ...)
+{
+    fake_redis *r = (fake_redis *)c;
+    va_list ap;
+    va_start(ap, format);
+    vector<string> argv = format_argv(format, ap);
+    va_end(ap);
+    if (r->pending.empty())
+    {
+        r->waited = false;
+    }
+    r->pending.push_back(execute(argv, &r->subscribed));
+    return REDIS_OK;
+}
+
+int redisGetReply(redisContext *c, void **reply)
+{
+    fake_redis *r = (fake_redis *)c;
+    if (!r->pending.empty())
+    {
+        if (!r->waited)
+        {
+            fake_delay(state()->redis_latency_us);
+            r->waited = true;
+        }
+        *reply = r->pending.front();
+        r->pending.pop_front();
+        return REDIS_OK;
+    }
+    if (!r->subscribed)
+    {
+        *reply = NULL;
+        c->err = 1;
+        snprintf(c->errstr, sizeof(c->errstr), "fake redis: no pending reply");
+        return REDIS_ERR;
+    }
+    // 订阅连接：等到有失效消息为止
+    fake_state *st = state();
+    st->sub_lock.lock();
+    while (st->invalidated.empty())
+    {
+        st->sub_cond.wait(st->sub_lock.get());
+    }
+    string key = st->invalidated.front();
+    st->invalidated.pop_front();
+    st->sub_lock.unlock();
+    vector<redisReply *> keys;
+    keys.push_back(str_reply(REDIS_REPLY_STRING, key));
+    vector<redisReply *> elems;
+    elems.push_back(str_reply(REDIS_REPLY_STRING, "message"));
+    elems.push_back(str_reply(REDIS_REPLY_STRING, "__redis__:invalidate"));
+    elems.push_back(array_reply(keys));
+    *reply = array_reply(elems);
+    return REDIS_OK;
+}
+
+void *redisCommand(redisContext *c, const char *format, ...)
+{
+    fake_redis *r = (fake_redis *)c;
+    va_list ap;
+    va_start(ap, format);
+    vector<string> argv = format_argv(format, ap);
+    va_end(ap);
+    fake_delay(state()->redis_latency_us);
+    return execute(argv, &r->subscribed);
+}
+
+/************************************************************
+*异步Redis：回复按到期时间排队，timerfd在最早的到期时间可读
+************************************************************/
+
+struct fake_async_reply
+{
+    long long due_ns;
+    redisCallbackFn *fn;
+    void *privdata;
+    redisReply *reply;
+};
+
+struct fake_async
+{
+    redisAsyncContext ac;
+    deque<fake_async_reply> queue;      // 延迟固定，按提交顺序就是按到期顺序
+    bool reading;
+};
+
+static void arm_timer(fake_async *a)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (!a->queue.empty())
+    {
+        long long wait = a->queue.front().due_ns - mono_ns();
+        if (wait < 1)
+        {
+            wait = 1;   // 全零会关闭定时器
+        }
+        its.it_value.tv_sec = wait / 1000000000LL;
+        its.it_value.tv_nsec = wait % 1000000000LL;
+    }
+    timerfd_settime(a->ac.c.fd, 0, &its, NULL);
+}
+
+redisAsyncContext *redisAsyncConnect(const char *ip, int port)
+{
+    fake_async *a = new fake_async;
+    memset(&a->ac, 0, sizeof(a->ac));
+    a->reading = false;
+    a->ac.c.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (a->ac.c.fd < 0)
+    {
+        a->ac.err = 1;
+        a->ac.errstr = (char *)"fake redis: timerfd_create failed";
+    }
+    return &a->ac;
+}
+
+int redisAsyncSetConnectCallback(redisAsyncContext *ac, redisConnectCallback *fn)
+{
+    return REDIS_OK;
+}
+
+int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallback *fn)
+{
+    return REDIS_OK;
+}
+
+int redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, ...)
+{
+    fake_async *a = (fake_async *)ac;
+    va_list ap;
+    va_start(ap, format);
+    vector<string> argv = format_argv(format, ap);
+    va_end(ap);
+
+    fake_async_reply r;
+    r.due_ns = mono_ns() + state()->redis_latency_us * 1000LL;
+    r.fn = fn;
+    r.privdata = privdata;
+    r.reply = execute(argv, NULL);
+    a->queue.push_back(r);
+    if (a->queue.size() == 1)
+    {
+        arm_timer(a);
+    }
+    if (!a->reading && ac->ev.addRead)
+    {
+        a->reading = true;
+        ac->ev.addRead(ac->ev.data);
+    }
+    return REDIS_OK;
+}
+
+void redisAsyncHandleRead(redisAsyncContext *ac)
+{
+    fake_async *a = (fake_async *)ac;
+    uint64_t expirations;
+    while (read(ac->c.fd, &expirations, sizeof(expirations)) > 0)
+    {
+    }
+    long long now = mono_ns();
+    while (!a->queue.empty() && a->queue.front().due_ns <= now)
+    {
+        fake_async_reply r = a->queue.front();
+        a->queue.pop_front();
+        if (r.fn)
+        {
+            r.fn(ac, r.reply, r.privdata);
+        }
+        freeReplyObject(r.reply);
+    }
+    arm_timer(a);
+}
+
+void redisAsyncHandleWrite(redisAsyncContext *ac)
+{
+}
+
+// 和hiredis一样，未完成的回调以NULL回复调用
+void redisAsyncFree(redisAsyncContext *ac)
+{
+    fake_async *a = (fake_async *)ac;
+    while (!a->queue.empty())
+    {
+        fake_async_reply r = a->queue.front();
+        a->queue.pop_front();
+        if (r.fn)
+        {
+            r.fn(ac, NULL, r.privdata);
+        }
+        freeReplyObject(r.reply);
+    }
+    if (ac->ev.cleanup)
+    {
+        ac->ev.cleanup(ac->ev.data);
+    }
+    if (ac->c.fd >= 0)
+    {
+        close(ac->c.fd);
+    }
+    delete a;
+}
@@ -0,0 +1,167 @@
+/************************************************************
+*二进制日志解码工具：把Log二进制模式写出的.bin文件还原成文本日志，输出到标准输出
+*格式和文本模式的日志相同；加 -v 在每行末尾注明调用位置(文件:行号)
+*
+*编译：g++ -O2 -std=c++11 -I.. log_decode.cpp -o log_decode
+*用法：./log_decode [-v] ../ServerLog/2024_01_01_Log.bin [...]
+************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "log_record.h"
+
+using namespace std;
+
+struct format_def
+{
+    bool known;
+    string file;
+    unsigned int line;
+    string format;
+};
+
+static bool verbose = false;
+
+static bool decode_file(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    char magic[sizeof(LOG_BIN_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, LOG_BIN_MAGIC, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a binary log file\n", path);
+        fclose(fp);
+        return false;
+    }
+
+    vector<format_def> formats(LOG_MAX_FORMATS);
+    vector<char> rec;
+    char out[65536];
+    time_t last_sec = -1;
+    char stamp[32] = {0};
+    long long count = 0;
+
+    while (true)
+    {
+        log_rec_hdr h;
+        size_t got = fread(&h, 1, sizeof(h), fp);
+        if (got == 0)
+        {
+            break;
+        }
+        if (got != sizeof(h) || h.len < sizeof(h))
+        {
+            fprintf(stderr, "%s: truncated record after %lld records\n", path, count);
+            break;
+        }
+        size_t body = log_rec_align(h.len) - sizeof(h);
+        rec.resize(body + 1);
+        if (fread(&rec[0], 1, body, fp) != body)
+        {
+            fprintf(stderr, "%s: truncated record after %lld records\n", path, count);
+            break;
+        }
+        const char *payload = &rec[0];
+        size_t payload_len = h.len - sizeof(h);
+        count++;
+
+        if (h.fid == LOG_FID_FORMAT)
+        {
+            uint16_t fid;
+            uint32_t line;
+            if (payload_len < 8)
+            {
+                continue;
+            }
+            memcpy(&fid, payload, 2);
+            memcpy(&line, payload + 2, 4);
+            if (fid >= LOG_MAX_FORMATS)
+            {
+                continue;
+            }
+            const char *file = payload + 6;
+            size_t flen = strnlen(file, payload_len - 6);
+            if (6 + flen + 1 >= payload_len)
+            {
+                continue;
+            }
+            const char *format = file + flen + 1;
+            size_t slen = strnlen(format, payload_len - 6 - flen - 1);
+            formats[fid].known = true;
+            formats[fid].file.assign(file, flen);
+            formats[fid].line = line;
+            formats[fid].format.assign(format, slen);
+            continue;
+        }
+        if (h.fid == LOG_FID_TEXT)
+        {
+            fwrite(payload, 1, payload_len, stdout);
+            continue;
+        }
+
+        time_t sec = h.usec / 1000000;
+        if (sec != last_sec)
+        {
+            struct tm my_tm;
+            localtime_r(&sec, &my_tm);
+            snprintf(stamp, sizeof(stamp), "%04u-%02u-%02u %02u:%02u:%02u",
+                     (unsigned)(my_tm.tm_year + 1900) % 10000, (unsigned)(my_tm.tm_mon + 1) % 100,
+                     (unsigned)my_tm.tm_mday % 100, (unsigned)my_tm.tm_hour % 100,
+                     (unsigned)my_tm.tm_min % 100, (unsigned)my_tm.tm_sec % 100);
+            last_sec = sec;
+        }
+        printf("%s.%06ld %s", stamp, (long)(h.usec % 1000000), log_level_str(h.level));
+        if (h.fid >= LOG_MAX_FORMATS || !formats[h.fid].known)
+        {
+            printf("<unknown format %u>\n", h.fid);
+            continue;
+        }
+        const format_def &f = formats[h.fid];
+        log_format_args(f.format.c_str(), payload, payload_len, out, sizeof(out));
+        if (verbose)
+        {
+            // 格式串通常自带换行，注明位置时先去掉
+            size_t n = strlen(out);
+            while (n > 0 && out[n - 1] == '\n')
+            {
+                out[--n] = '\0';
+            }
+            printf("%s  (%s:%u)\n", out, f.file.c_str(), f.line);
+        }
+        else
+        {
+            printf("%s\n", out);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int i = 1;
+    if (i < argc && strcmp(argv[i], "-v") == 0)
+    {
+        verbose = true;
+        i++;
+    }
+    if (i >= argc)
+    {
+        fprintf(stderr, "usage: %s [-v] log.bin [...]\n", argv[0]);
+        return 1;
+    }
+    bool ok = true;
+    for (; i < argc; i++)
+    {
+        ok = decode_file(argv[i]) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,38 @@
+#ifndef TRACE_RECORD_H
+#define TRACE_RECORD_H
+
+#include <stdint.h>
+
+/************************************************************
+*流量录制文件的格式，服务器的traffic_capture和回放工具bench/replay共用
+*文件以TRACE_MAGIC开头，后面是trace_file_hdr，然后是一条条记录：trace_rec_hdr + 请求头原文
+*每条记录对应一个请求：
+*  offset_ns   第一个字节到达的时间，相对于开始录制的时刻
+*  send_us     从第一个字节到请求头收完用了多久，慢客户端在回放时按这个时间分几次发送
+*  conn_id     服务器上的连接编号，同一个长连接上的请求编号相同
+*  body_len    Content-Length，消息体不录制，回放时用同样长度的占位内容
+*请求头原文中Cookie、Authorization等头的值和URL的查询串已经替换成REDACTED
+************************************************************/
+
+static const char TRACE_MAGIC[8] = {'W', 'S', 'T', 'R', 'A', 'C', 'E', '1'};
+
+struct trace_file_hdr
+{
+    int64_t start_realtime_ns;  // 开始录制时的墙上时间，只用于显示
+    uint32_t version;
+    uint32_t reserved;
+};
+
+static const uint16_t TRACE_NEW_CONN = 1;       // 该连接上的第一个请求
+
+struct trace_rec_hdr
+{
+    uint64_t offset_ns;
+    uint32_t conn_id;
+    uint32_t send_us;
+    uint32_t body_len;
+    uint16_t head_len;          // 后面紧跟的请求头字节数
+    uint16_t flags;
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include <string.h>
+
+#include "user_cache.h"
+#include "log.h"
+
+user_cache::user_cache() : m_buckets(0), m_resized(0), m_ttl(0)
+{
+    for (int i = 0; i < SHARD_NUM; i++)
+    {
+        m_shards[i].entries = NULL;
+        m_shards[i].buckets = 0;
+    }
+}
+
+user_cache::~user_cache()
+{
+    for (int i = 0; i < SHARD_NUM; i++)
+    {
+        delete [] m_shards[i].entries;
+    }
+}
+
+user_cache *user_cache::GetInstance()
+{
+    static user_cache cache;
+    return &cache;
+}
+
+int user_cache::buckets_for(long budget_bytes)
+{
+    long buckets = budget_bytes / (long)(sizeof(entry) * WAYS * SHARD_NUM);
+    return buckets < 1 ? 1 : (int)buckets;
+}
+
+void user_cache::init(long budget_bytes, int ttl)
+{
+    m_ttl = ttl;
+    m_buckets = buckets_for(budget_bytes);
+    m_resized = m_buckets;
+    for (int i = 0; i < SHARD_NUM; i++)
+    {
+        m_shards[i].entries = new entry[m_buckets * WAYS];
+        memset(m_shards[i].entries, 0, sizeof(entry) * m_buckets * WAYS);
+        m_shards[i].buckets = m_buckets;
+    }
+    LOG_INFO("user cache: %d shards, %d entries per shard\n", SHARD_NUM, m_buckets * WAYS);
+}
+
+// 一次只锁一个分片，其他分片照常读写；已有记录的过期时间不变，新的ttl对之后写入的记录生效
+void user_cache::resize(long budget_bytes, int ttl)
+{
+    m_ttl = ttl;
+    int buckets = buckets_for(budget_bytes);
+    // 分片的buckets可能正被工作线程读，和上一次resize的结果比较
+    if (!m_buckets || buckets == m_resized)
+    {
+        return;
+    }
+    m_resized = buckets;
+    time_t now = time(NULL);
+    int kept = 0;
+    for (int i = 0; i < SHARD_NUM; i++)
+    {
+        shard &s = m_shards[i];
+        entry *fresh = new entry[buckets * WAYS];
+        memset(fresh, 0, sizeof(entry) * buckets * WAYS);
+
+        s.lock.lock();
+        entry *old = s.entries;
+        int old_slots = s.buckets * WAYS;
+        s.entries = fresh;
+        s.buckets = buckets;
+        for (int j = 0; j < old_slots; j++)
+        {
+            if (old[j].hash == 0 || old[j].expire <= now)
+            {
+                continue;
+            }
+            // 缩小时新桶放不下的记录直接丢掉
+            entry *bucket = bucket_of(s, old[j].hash);
+            for (int w = 0; w < WAYS; w++)
+            {
+                if (bucket[w].hash == 0)
+                {
+                    bucket[w] = old[j];
+                    kept++;
+                    break;
+                }
+            }
+        }
+        s.lock.unlock();
+        delete [] old;
+    }
+    LOG_INFO("user cache: resized to %d entries per shard, kept %d records\n", buckets * WAYS, kept);
+}
+
+// FNV-1a，结果保证非0（0表示空槽）
+uint64_t user_cache::hash_name(const char *name)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+// 低位选分片，高位选桶，避免两者相关
+user_cache::entry *user_cache::bucket_of(shard &s, uint64_t h)
+{
+    return s.entries + ((h >> 32) % s.buckets) * WAYS;
+}
+
+bool user_cache::get(const char *name, char *passwd, int len)
+{
+    if (!m_buckets || strlen(name) >= NAME_LEN)
+    {
+        return false;
+    }
+    uint64_t h = hash_name(name);
+    shard &s = m_shards[h % SHARD_NUM];
+    time_t now = time(NULL);
+    bool hit = false;
+
+    s.lock.lock();
+    entry *bucket = bucket_of(s, h);
+    for (int i = 0; i < WAYS; i++)
+    {
+        entry &e = bucket[i];
+        if (e.hash == h && strcmp(e.name, name) == 0)
+        {
+            if (e.expire <= now)
+            {
+                e.hash = 0;
+                break;
+            }
+            e.referenced = true;
+            strncpy(passwd, e.passwd, len - 1);
+            passwd[len - 1] = '\0';
+            hit = true;
+            break;
+        }
+    }
+    s.lock.unlock();
+    return hit;
+}
+
+void user_cache::put(const char *name, const char *passwd)
+{
+    if (!m_buckets || strlen(name) >= NAME_LEN || strlen(passwd) >= PASSWD_LEN)
+    {
+        return;
+    }
+    uint64_t h = hash_name(name);
+    shard &s = m_shards[h % SHARD_NUM];
+    time_t now = time(NULL);
+
+    s.lock.lock();
+    entry *bucket = bucket_of(s, h);
+    entry *victim = NULL;
+    // 优先覆盖同名记录，其次是空槽或过期槽
+    for (int i = 0; i < WAYS; i++)
+    {
+        entry &e = bucket[i];
+        if (e.hash == h && strcmp(e.name, name) == 0)
+        {
+            victim = &e;
+            break;
+        }
+        if (!victim && (e.hash == 0 || e.expire <= now))
+        {
+            victim = &e;
+        }
+    }
+    // 桶满了，按CLOCK淘汰：清掉访问位，直到找到一个没被访问过的槽
+    for (int i = 0; !victim; i = (i + 1) % WAYS)
+    {
+        if (bucket[i].referenced)
+        {
+            bucket[i].referenced = false;
+        }
+        else
+        {
+            victim = &bucket[i];
+        }
+    }
+    victim->hash = h;
+    victim->expire = now + m_ttl;
+    victim->referenced = false;
+    strcpy(victim->name, name);
+    strcpy(victim->passwd, passwd);
+    s.lock.unlock();
+}
+
+void user_cache::erase(const char *name)
+{
+    if (!m_buckets || strlen(name) >= NAME_LEN)
+    {
+        return;
+    }
+    uint64_t h = hash_name(name);
+    shard &s = m_shards[h % SHARD_NUM];
+
+    s.lock.lock();
+    entry *bucket = bucket_of(s, h);
+    for (int i = 0; i < WAYS; i++)
+    {
+        if (bucket[i].hash == h && strcmp(bucket[i].name, name) == 0)
+        {
+            bucket[i].hash = 0;
+            break;
+        }
+    }
+    s.lock.unlock();
+}
@@ -0,0 +1,70 @@
+#ifndef USER_CACHE_H
+#define USER_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+#include "locker.h"
+
+/************************************************************
+*进程内的用户信息缓存，挡在Redis和MySQL前面
+*按用户名哈希分成SHARD_NUM个分片，每个分片一把锁（锁分段）
+*分片内是组相联结构：哈希定位到桶，每个桶WAYS个槽位，桶内用CLOCK淘汰
+*所有槽位在init时一次分配，查找和写入都不再分配内存
+************************************************************/
+
+class user_cache
+{
+public:
+    static const int NAME_LEN = 64;     // 超过长度的用户名不缓存
+    static const int PASSWD_LEN = 64;
+
+    static user_cache *GetInstance();
+
+    // budget_bytes：缓存可用的内存上限；ttl：每条记录的存活秒数
+    void init(long budget_bytes, int ttl);
+    // 运行中调整内存上限和存活时间：逐个分片换成新的槽位数组，旧记录能放下的搬过去
+    void resize(long budget_bytes, int ttl);
+
+    // 命中返回true，并把密码拷贝到passwd中
+    bool get(const char *name, char *passwd, int len);
+    // 写入或更新一条记录
+    void put(const char *name, const char *passwd);
+    // 删除一条记录
+    void erase(const char *name);
+
+private:
+    user_cache();
+    ~user_cache();
+
+    struct entry
+    {
+        uint64_t hash;          // 0表示空槽
+        time_t expire;          // 过期时间
+        bool referenced;        // CLOCK的访问位
+        char name[NAME_LEN];
+        char passwd[PASSWD_LEN];
+    };
+
+    struct shard
+    {
+        locker lock;
+        entry *entries;         // buckets * WAYS 个槽位
+        int buckets;            // 桶数，resize时在锁内修改
+    };
+
+    static const int SHARD_NUM = 64;
+    static const int WAYS = 8;
+
+    static uint64_t hash_name(const char *name);
+    static int buckets_for(long budget_bytes);
+    entry *bucket_of(shard &s, uint64_t h);
+
+    shard m_shards[SHARD_NUM];
+    int m_buckets;              // init时每个分片的桶数，0表示未开启
+    int m_resized;              // 最近一次init/resize的桶数，只在主线程中读写，不用锁分片
+    std::atomic<int> m_ttl;
+};
+
+#endif